@@ -0,0 +1,34 @@
+// Copyright (c) 2026 The Byron developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addressindex.h"
+
+#include "hash.h"
+#include "script/standard.h"
+
+bool GetAddressIndexKey(const CScript& scriptPubKey, unsigned int& type, uint160& hashBytes)
+{
+    std::vector<std::vector<unsigned char> > vSolutions;
+    txnouttype whichType;
+    if (!Solver(scriptPubKey, whichType, vSolutions))
+        return false;
+
+    switch (whichType) {
+    case TX_PUBKEYHASH:
+        type = ADDRESS_INDEX_PUBKEYHASH;
+        hashBytes = uint160(vSolutions[0]);
+        return true;
+    case TX_PUBKEY:
+        // Coinstakes pay to the bare key; file them under the key's address
+        type = ADDRESS_INDEX_PUBKEYHASH;
+        hashBytes = Hash160(vSolutions[0]);
+        return true;
+    case TX_SCRIPTHASH:
+        type = ADDRESS_INDEX_SCRIPTHASH;
+        hashBytes = uint160(vSolutions[0]);
+        return true;
+    default:
+        return false;
+    }
+}
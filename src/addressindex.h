@@ -0,0 +1,236 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2026 The Byron developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_ADDRESSINDEX_H
+#define BITCOIN_ADDRESSINDEX_H
+
+#include "amount.h"
+#include "script/script.h"
+#include "serialize.h"
+#include "uint256.h"
+
+/** Address types of the address index, matching the base58 prefixes they are shown with */
+enum AddressIndexType {
+    ADDRESS_INDEX_NONE = 0,
+    ADDRESS_INDEX_PUBKEYHASH = 1, //! pay to pubkey hash, and pay to pubkey under the key's hash
+    ADDRESS_INDEX_SCRIPTHASH = 2, //! pay to script hash
+};
+
+/** Get the address index type and hash a scriptPubKey is filed under */
+bool GetAddressIndexKey(const CScript& scriptPubKey, unsigned int& type, uint160& hashBytes);
+
+/** Unspent output of an address, key of the 'u' records */
+struct CAddressUnspentKey {
+    unsigned int type;
+    uint160 hashBytes;
+    uint256 txhash;
+    unsigned int index;
+
+    CAddressUnspentKey(unsigned int addressType, uint160 addressHash, uint256 txid, unsigned int indexValue)
+    {
+        type = addressType;
+        hashBytes = addressHash;
+        txhash = txid;
+        index = indexValue;
+    }
+
+    CAddressUnspentKey()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        type = 0;
+        hashBytes = 0;
+        txhash = 0;
+        index = 0;
+    }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 57;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        unsigned char chType = type;
+        WRITEDATA(s, chType);
+        hashBytes.Serialize(s, nType, nVersion);
+        txhash.Serialize(s, nType, nVersion);
+        ::Serialize(s, index, nType, nVersion);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        unsigned char chType;
+        READDATA(s, chType);
+        type = chType;
+        hashBytes.Unserialize(s, nType, nVersion);
+        txhash.Unserialize(s, nType, nVersion);
+        ::Unserialize(s, index, nType, nVersion);
+    }
+};
+
+/** Value of the 'u' records; a null value erases the record */
+struct CAddressUnspentValue {
+    CAmount satoshis;
+    CScript script;
+    int blockHeight;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(satoshis);
+        READWRITE(script);
+        READWRITE(blockHeight);
+    }
+
+    CAddressUnspentValue(CAmount sats, CScript scriptPubKey, int height)
+    {
+        satoshis = sats;
+        script = scriptPubKey;
+        blockHeight = height;
+    }
+
+    CAddressUnspentValue()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        satoshis = -1;
+        script.clear();
+        blockHeight = 0;
+    }
+
+    bool IsNull() const
+    {
+        return (satoshis == -1);
+    }
+};
+
+/**
+ * Credit or debit of an address, key of the 'a' records. Heights and
+ * transaction positions are big endian so the history iterates in chain order.
+ */
+struct CAddressIndexKey {
+    unsigned int type;
+    uint160 hashBytes;
+    int blockHeight;
+    unsigned int txindex;
+    uint256 txhash;
+    unsigned int index;
+    bool spending;
+
+    CAddressIndexKey(unsigned int addressType, uint160 addressHash, int height, int blockindex,
+        uint256 txid, unsigned int indexValue, bool isSpending)
+    {
+        type = addressType;
+        hashBytes = addressHash;
+        blockHeight = height;
+        txindex = blockindex;
+        txhash = txid;
+        index = indexValue;
+        spending = isSpending;
+    }
+
+    CAddressIndexKey()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        type = 0;
+        hashBytes = 0;
+        blockHeight = 0;
+        txindex = 0;
+        txhash = 0;
+        index = 0;
+        spending = false;
+    }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 66;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        unsigned char chType = type;
+        WRITEDATA(s, chType);
+        hashBytes.Serialize(s, nType, nVersion);
+        ser_writedata32be(s, blockHeight);
+        ser_writedata32be(s, txindex);
+        txhash.Serialize(s, nType, nVersion);
+        ::Serialize(s, index, nType, nVersion);
+        unsigned char chSpending = spending;
+        WRITEDATA(s, chSpending);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        unsigned char chType;
+        READDATA(s, chType);
+        type = chType;
+        hashBytes.Unserialize(s, nType, nVersion);
+        blockHeight = ser_readdata32be(s);
+        txindex = ser_readdata32be(s);
+        txhash.Unserialize(s, nType, nVersion);
+        ::Unserialize(s, index, nType, nVersion);
+        unsigned char chSpending;
+        READDATA(s, chSpending);
+        spending = chSpending != 0;
+    }
+};
+
+/** Prefix of CAddressIndexKey and CAddressUnspentKey selecting one address, optionally from a height on */
+struct CAddressIndexIteratorKey {
+    unsigned int type;
+    uint160 hashBytes;
+    bool fHeight;
+    int blockHeight;
+
+    CAddressIndexIteratorKey(unsigned int addressType, uint160 addressHash)
+    {
+        type = addressType;
+        hashBytes = addressHash;
+        fHeight = false;
+        blockHeight = 0;
+    }
+
+    CAddressIndexIteratorKey(unsigned int addressType, uint160 addressHash, int height)
+    {
+        type = addressType;
+        hashBytes = addressHash;
+        fHeight = true;
+        blockHeight = height;
+    }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return fHeight ? 25 : 21;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        unsigned char chType = type;
+        WRITEDATA(s, chType);
+        hashBytes.Serialize(s, nType, nVersion);
+        if (fHeight)
+            ser_writedata32be(s, blockHeight);
+    }
+};
+
+#endif // BITCOIN_ADDRESSINDEX_H
@@ -124,6 +124,8 @@ public:
 
     CTxDestination Get() const;
     bool GetKeyID(CKeyID& keyID) const;
+    //! Type and hash the address is filed under in the address index
+    bool GetIndexKey(uint160& hashBytes, unsigned int& type) const;
     bool IsScript() const;
 };
 
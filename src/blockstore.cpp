@@ -0,0 +1,107 @@
+// Copyright (c) 2019 The Byron developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockstore.h"
+
+#include "crypto/common.h"
+#include "main.h"
+#include "util.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CMappedBlockFile::~CMappedBlockFile()
+{
+#ifndef WIN32
+    munmap((void*)pbegin, nSize);
+#endif
+}
+
+/** Map the whole of a block or undo file; NULL if it can't be (always, on Windows) */
+static CMappedBlockFileRef MapBlockFile(const CDiskBlockPos& pos, const char* prefix)
+{
+#ifdef WIN32
+    return CMappedBlockFileRef();
+#else
+    boost::filesystem::path path = GetBlockPosFilename(pos, prefix);
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return CMappedBlockFileRef();
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return CMappedBlockFileRef();
+    }
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        LogPrintf("Unable to map %s\n", path.string());
+        return CMappedBlockFileRef();
+    }
+    return std::make_shared<const CMappedBlockFile>(prefix, pos.nFile, (const char*)p, (size_t)st.st_size);
+#endif
+}
+
+CMappedBlockFileRef CBlockFileMapper::GetFile(const CDiskBlockPos& pos, const char* prefix, size_t nMinSize)
+{
+    LOCK(cs);
+    for (std::list<CMappedBlockFileRef>::iterator it = listMapped.begin(); it != listMapped.end(); ++it) {
+        if ((*it)->nFile != pos.nFile || (*it)->strPrefix != prefix)
+            continue;
+        if ((*it)->nSize >= nMinSize) {
+            listMapped.splice(listMapped.begin(), listMapped, it);
+            return listMapped.front();
+        }
+        // The file grew since it was mapped; views still using the old mapping keep it alive
+        listMapped.erase(it);
+        break;
+    }
+
+    CMappedBlockFileRef file = MapBlockFile(pos, prefix);
+    if (!file)
+        return file;
+    listMapped.push_front(file);
+    while (listMapped.size() > nMaxFiles)
+        listMapped.pop_back();
+    if (file->nSize < nMinSize)
+        return CMappedBlockFileRef();
+    return file;
+}
+
+bool CBlockFileMapper::GetRecord(const CDiskBlockPos& pos, const char* prefix, unsigned int nTrailer, CDiskBlockView& view)
+{
+    if (pos.IsNull() || pos.nPos < sizeof(uint32_t) || nMaxFiles == 0)
+        return false;
+
+    CMappedBlockFileRef file = GetFile(pos, prefix, pos.nPos);
+    if (!file)
+        return false;
+    uint32_t nRecord = ReadLE32((const unsigned char*)file->pbegin + pos.nPos - sizeof(uint32_t));
+    uint64_t nEnd = (uint64_t)pos.nPos + nRecord + nTrailer;
+    if (nEnd > file->nSize) {
+        // Written after the file was mapped, or not a record at all
+        file = GetFile(pos, prefix, nEnd);
+        if (!file || nEnd > file->nSize)
+            return false;
+    }
+
+    view = CDiskBlockView(file, file->pbegin + pos.nPos, (size_t)nRecord + nTrailer);
+    return true;
+}
+
+void CBlockFileMapper::Forget(int nFile)
+{
+    LOCK(cs);
+    std::list<CMappedBlockFileRef>::iterator it = listMapped.begin();
+    while (it != listMapped.end()) {
+        if ((*it)->nFile == nFile)
+            it = listMapped.erase(it);
+        else
+            ++it;
+    }
+}
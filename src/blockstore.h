@@ -0,0 +1,100 @@
+// Copyright (c) 2019 The Byron developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BYRON_BLOCKSTORE_H
+#define BYRON_BLOCKSTORE_H
+
+#include "chain.h"
+#include "clientversion.h"
+#include "serialize.h"
+#include "streams.h"
+#include "sync.h"
+
+#include <list>
+#include <memory>
+#include <stddef.h>
+#include <string>
+
+/** Number of block and undo files kept mapped at once; block files grow to 128MiB */
+static const unsigned int MAX_MAPPED_BLOCK_FILES = sizeof(void*) >= 8 ? 16 : 2;
+
+/** A block or undo file mapped read-only into memory, unmapped when the last reference goes */
+class CMappedBlockFile
+{
+private:
+    // Disallow copies
+    CMappedBlockFile(const CMappedBlockFile&);
+    CMappedBlockFile& operator=(const CMappedBlockFile&);
+
+public:
+    const std::string strPrefix;
+    const int nFile;
+    const char* const pbegin;
+    const size_t nSize;
+
+    CMappedBlockFile(const std::string& strPrefixIn, int nFileIn, const char* pbeginIn, size_t nSizeIn) : strPrefix(strPrefixIn),
+                                                                                                     nFile(nFileIn),
+                                                                                                     pbegin(pbeginIn),
+                                                                                                     nSize(nSizeIn) {}
+    ~CMappedBlockFile();
+};
+
+typedef std::shared_ptr<const CMappedBlockFile> CMappedBlockFileRef;
+
+/**
+ * The serialized bytes of one record in a block or undo file, read straight
+ * from the mapping. The view keeps the file mapped for as long as it lives.
+ */
+class CDiskBlockView
+{
+private:
+    CMappedBlockFileRef file;
+    const char* pbegin;
+    size_t nSize;
+
+public:
+    CDiskBlockView() : pbegin(NULL), nSize(0) {}
+    CDiskBlockView(const CMappedBlockFileRef& fileIn, const char* pbeginIn, size_t nSizeIn) : file(fileIn),
+                                                                                             pbegin(pbeginIn),
+                                                                                             nSize(nSizeIn) {}
+
+    bool IsNull() const { return !file; }
+    const char* begin() const { return pbegin; }
+    const char* end() const { return pbegin + nSize; }
+    size_t size() const { return nSize; }
+
+    //! Deserialize from the start of the record
+    CMemoryReader GetReader() const { return CMemoryReader(begin(), end(), SER_DISK, CLIENT_VERSION); }
+};
+
+/**
+ * Maps block and undo files on demand and keeps the most recently used ones
+ * mapped, so reading a block is a copy out of the page cache instead of an
+ * open, seek and a series of freads.
+ */
+class CBlockFileMapper
+{
+private:
+    mutable CCriticalSection cs;
+    //! Most recently used first
+    std::list<CMappedBlockFileRef> listMapped;
+    const size_t nMaxFiles;
+
+    CMappedBlockFileRef GetFile(const CDiskBlockPos& pos, const char* prefix, size_t nMinSize);
+
+public:
+    CBlockFileMapper(size_t nMaxFilesIn) : nMaxFiles(nMaxFilesIn) {}
+
+    /**
+     * Get the record stored at pos, whose size is written just before it, plus
+     * nTrailer bytes following it. Returns false if the file can't be mapped
+     * (or mapping isn't supported), in which case callers read it with fread.
+     */
+    bool GetRecord(const CDiskBlockPos& pos, const char* prefix, unsigned int nTrailer, CDiskBlockView& view);
+
+    //! Drop the mappings of a block file and its undo file, e.g. when they are deleted
+    void Forget(int nFile);
+};
+
+#endif // BYRON_BLOCKSTORE_H
@@ -13,6 +13,7 @@ using namespace std;
  */
 void CChain::SetTip(CBlockIndex* pindex)
 {
+    pindexAtomicTip.store(pindex);
     if (pindex == NULL) {
         vChain.clear();
         return;
@@ -13,6 +13,7 @@
 #include "uint256.h"
 #include "util.h"
 
+#include <atomic>
 #include <vector>
 
 #include <boost/foreach.hpp>
@@ -96,6 +97,47 @@ enum BlockStatus {
     BLOCK_FAILED_VALID = 32, //! stage after last reached validness failed
     BLOCK_FAILED_CHILD = 64, //! descends from failed block
     BLOCK_FAILED_MASK = BLOCK_FAILED_VALID | BLOCK_FAILED_CHILD,
+
+    BLOCK_HAVE_STATS = 128, //! CBlockIndex::stats recorded when the block was connected
+    BLOCK_HAVE_STAKE_HASH = 256,     //! hashProofOfStake known from the block's coinstake
+    BLOCK_HAVE_STAKE_CHECKSUM = 512, //! nStakeModifierChecksum final, chained from the genesis block
+};
+
+/** Value and fee totals of a block's transactions, kept in the block index */
+class CBlockStats
+{
+public:
+    int64_t nValueIn;      //! sum of the outputs spent by the block
+    int64_t nValueOut;     //! sum of the outputs created by the block
+    int64_t nFees;         //! fees paid by transactions other than coinbase and coinstake
+    unsigned int nFeeTxs;  //! number of transactions other than coinbase and coinstake
+    uint64_t nFeeTxBytes;  //! serialized size of those transactions
+
+    CBlockStats()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        nValueIn = 0;
+        nValueOut = 0;
+        nFees = 0;
+        nFeeTxs = 0;
+        nFeeTxBytes = 0;
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(nValueIn);
+        READWRITE(nValueOut);
+        READWRITE(nFees);
+        READWRITE(VARINT(nFeeTxs));
+        READWRITE(VARINT(nFeeTxBytes));
+    }
 };
 
 /** The block chain is a tree shaped structure starting with the
@@ -158,13 +200,16 @@ public:
     // proof-of-stake specific fields
     uint256 GetBlockTrust() const;
     uint64_t nStakeModifier;             // hash modifier for proof-of-stake
-    unsigned int nStakeModifierChecksum; // checksum of index; in-memeory only
+    unsigned int nStakeModifierChecksum; // checksum of index; stored once final (BLOCK_HAVE_STAKE_CHECKSUM)
     COutPoint prevoutStake;
     unsigned int nStakeTime;
     uint256 hashProofOfStake;
     int64_t nMint;
     int64_t nMoneySupply;
 
+    //! Transaction totals, valid if nStatus & BLOCK_HAVE_STATS
+    CBlockStats stats;
+
     //! block header
     int nVersion;
     uint256 hashMerkleRoot;
@@ -193,6 +238,7 @@ public:
 
         nMint = 0;
         nMoneySupply = 0;
+        stats.SetNull();
         nFlags = 0;
         nStakeModifier = 0;
         nStakeModifierChecksum = 0;
@@ -452,9 +498,25 @@ public:
         READWRITE(nTime);
         READWRITE(nBits);
         READWRITE(nNonce);
+
+        // Only present for blocks connected since the statistics were introduced
+        if (nStatus & BLOCK_HAVE_STATS)
+            READWRITE(stats);
+        // Likewise for what the stake modifier checksum needs, kept after the rest so older
+        // versions can still read the entry
+        if (nStatus & BLOCK_HAVE_STAKE_HASH)
+            READWRITE(hashProofOfStake);
+        if (nStatus & BLOCK_HAVE_STAKE_CHECKSUM)
+            READWRITE(nStakeModifierChecksum);
     }
 
     uint256 GetBlockHash() const
+    {
+        return GetDiskBlockHeader().GetHash();
+    }
+
+    //! The header this entry was stored for, rebuilt from the serialized fields
+    CBlockHeader GetDiskBlockHeader() const
     {
         CBlockHeader block;
         block.nVersion = nVersion;
@@ -464,7 +526,7 @@ public:
         block.nBits = nBits;
         block.nNonce = nNonce;
         block.nAccumulatorCheckpoint = nAccumulatorCheckpoint;
-        return block.GetHash();
+        return block;
     }
 
 
@@ -484,8 +546,12 @@ class CChain
 {
 private:
     std::vector<CBlockIndex*> vChain;
+    /** Copy of the tip published by SetTip, for readers that do not hold cs_main. */
+    std::atomic<CBlockIndex*> pindexAtomicTip;
 
 public:
+    CChain() : pindexAtomicTip(NULL) {}
+
     /** Returns the index entry for the genesis block of this chain, or NULL if none. */
     CBlockIndex* Genesis() const
     {
@@ -543,6 +609,15 @@ public:
         return vChain.size() - 1;
     }
 
+    /**
+     * Returns the tip as last set, without touching vChain. Safe to call without cs_main, since
+     * block index entries are never freed while running; walk back from it with GetAncestor.
+     */
+    CBlockIndex* AtomicTip() const
+    {
+        return pindexAtomicTip.load();
+    }
+
     /** Set/initialize a chain with a given tip. */
     void SetTip(CBlockIndex* pindex);
 
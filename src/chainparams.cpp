@@ -184,7 +184,10 @@ public:
         fMineBlocksOnDemand = false; // Default false
         fSkipProofOfWorkCheck = false;
         fTestnetToBeDeprecatedFieldRPC = false;
-        fHeadersFirstSyncingActive = false;
+        fHeadersFirstSyncingActive = true;
+
+        // The last checkpoint; its ancestors' signatures have been checked by every node since
+        hashDefaultAssumeValid = uint256("0x5960e609c9b010c8f7dee5fbc4c32e279ee2e3ff96c2ce2f58d748a63675a915"); // 359823
 
         nPoolMaxTransactions = 3;
         strSporkKey = "045a106cf3aea6d708df936467360a0d8e77dfa08b8e08233d3852de4752ec6a352296b80e7df6949a70ba34efcd5ab0b4ebea9a9b47649c2d32f3eda2010d9564";
@@ -228,6 +231,9 @@ public:
         nBlockRecalculateAccumulators = 9908000; //Trigger a recalculation of accumulators
         nEnforceNewSporkKey = 1521604800; //!> Sporks signed after Wednesday, March 21, 2018 4:00:00 AM GMT must use the new spork key
         nRejectOldSporkKey = 1522454400; //!> Reject old spork key after Saturday, March 31, 2018 12:00:00 AM GMT
+        // Don't inherit the mainnet block. Testnet's only checkpoint is genesis, so every script was
+        // already verified here and no default keeps it that way; regtest inherits this.
+        hashDefaultAssumeValid = uint256(0);
 
         //! Modify the testnet genesis block so the timestamp is valid for a later start.
         genesis.nTime = 1570470324;
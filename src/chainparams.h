@@ -100,6 +100,8 @@ public:
     /** Height or Time Based Activations **/
     int ModifierUpgradeBlock() const { return nModifierUpdateBlock; }
     int LAST_POW_BLOCK() const { return nLastPOWBlock; }
+    /** Block whose ancestors' scripts are assumed valid unless -assumevalid says otherwise */
+    const uint256& DefaultAssumeValid() const { return hashDefaultAssumeValid; }
 
 protected:
     CChainParams() {}
@@ -145,6 +147,7 @@ protected:
     int nBlockEnforceSerialRange;
     int nBlockRecalculateAccumulators;
     int nBlockLastGoodCheckpoint;
+    uint256 hashDefaultAssumeValid;
 };
 
 /**
@@ -5,150 +5,407 @@
 
 #include "coins.h"
 
+#include "memusage.h"
+#include "primitives/block.h"
 #include "random.h"
+#include "util.h"
+#include "utiltime.h"
+#include "version.h"
 
 #include <assert.h>
+#include <stdexcept>
 
-/**
- * calculate number of bytes for the bitmask, and its number of non-zero bytes
- * each bit in the bitmask represents the availability of one output, but the
- * availabilities of the first two outputs are encoded separately
- */
-void CCoins::CalcMaskSize(unsigned int& nBytes, unsigned int& nNonzeroBytes) const
-{
-    unsigned int nLastUsedByte = 0;
-    for (unsigned int b = 0; 2 + b * 8 < vout.size(); b++) {
-        bool fZero = true;
-        for (unsigned int i = 0; i < 8 && 2 + b * 8 + i < vout.size(); i++) {
-            if (!vout[2 + b * 8 + i].IsNull()) {
-                fZero = false;
-                continue;
-            }
-        }
-        if (!fZero) {
-            nLastUsedByte = b + 1;
-            nNonzeroBytes++;
+#include <boost/bind.hpp>
+
+size_t Coin::DynamicMemoryUsage() const
+{
+    return memusage::MallocUsage(out.scriptPubKey.capacity());
+}
+
+bool CCoinsView::GetCoin(const COutPoint& outpoint, Coin& coin) const { return false; }
+bool CCoinsView::HaveCoin(const COutPoint& outpoint) const
+{
+    Coin coin;
+    return GetCoin(outpoint, coin);
+}
+uint256 CCoinsView::GetBestBlock() const { return uint256(0); }
+bool CCoinsView::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) { return false; }
+bool CCoinsView::GetStats(CCoinsStats& stats) const { return false; }
+CCoinsViewCursor* CCoinsView::Cursor() const { return NULL; }
+
+CCoinsViewBacked::CCoinsViewBacked(CCoinsView* viewIn) : base(viewIn) {}
+bool CCoinsViewBacked::GetCoin(const COutPoint& outpoint, Coin& coin) const { return base->GetCoin(outpoint, coin); }
+bool CCoinsViewBacked::HaveCoin(const COutPoint& outpoint) const { return base->HaveCoin(outpoint); }
+uint256 CCoinsViewBacked::GetBestBlock() const { return base->GetBestBlock(); }
+void CCoinsViewBacked::SetBackend(CCoinsView& viewIn) { base = &viewIn; }
+bool CCoinsViewBacked::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) { return base->BatchWrite(mapCoins, hashBlock); }
+bool CCoinsViewBacked::GetStats(CCoinsStats& stats) const { return base->GetStats(stats); }
+CCoinsViewCursor* CCoinsViewBacked::Cursor() const { return base->Cursor(); }
+
+SaltedOutpointHasher::SaltedOutpointHasher() : salt(GetRandHash()) {}
+
+CCoinsViewPrefetch::CCoinsViewPrefetch(CCoinsView* viewIn, size_t nMaxEntriesIn) : CCoinsViewBacked(viewIn), nGeneration(0), nMaxEntries(nMaxEntriesIn), nHits(0), nMisses(0) {}
+
+bool CCoinsViewPrefetch::GetCoin(const COutPoint& outpoint, Coin& coin) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        CCoinsPrefetchMap::iterator it = mapPrefetched.find(outpoint);
+        if (it != mapPrefetched.end()) {
+            // The caller caches what it gets, so the entry is not needed anymore.
+            coin = std::move(it->second);
+            mapPrefetched.erase(it);
+            nHits++;
+            return true;
         }
+        nMisses++;
     }
-    nBytes += nLastUsedByte;
+    return base->GetCoin(outpoint, coin);
+}
+
+bool CCoinsViewPrefetch::HaveCoin(const COutPoint& outpoint) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (mapPrefetched.count(outpoint))
+            return true;
+    }
+    return base->HaveCoin(outpoint);
+}
+
+bool CCoinsViewPrefetch::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        nGeneration++;
+        mapPrefetched.clear();
+    }
+    bool fOk = base->BatchWrite(mapCoins, hashBlock);
+    {
+        // Reads that were in flight during the write may have seen either state.
+        boost::unique_lock<boost::mutex> lock(cs);
+        nGeneration++;
+        mapPrefetched.clear();
+    }
+    return fOk;
 }
 
-bool CCoins::Spend(const COutPoint& out, CTxInUndo& undo)
+bool CCoinsViewPrefetch::Prefetch(const COutPoint& outpoint)
 {
-    if (out.n >= vout.size())
+    uint64_t nGenerationStart;
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (mapPrefetched.size() >= nMaxEntries || mapPrefetched.count(outpoint))
+            return false;
+        nGenerationStart = nGeneration;
+    }
+    Coin coin;
+    if (!base->GetCoin(outpoint, coin) || coin.IsSpent())
         return false;
-    if (vout[out.n].IsNull())
+    boost::unique_lock<boost::mutex> lock(cs);
+    if (nGeneration != nGenerationStart)
         return false;
+    mapPrefetched[outpoint] = std::move(coin);
+    return true;
+}
+
+void CCoinsViewPrefetch::Clear()
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    mapPrefetched.clear();
+}
+
+void CCoinsViewPrefetch::GetPrefetchStats(size_t& nEntries, uint64_t& nHitsOut, uint64_t& nMissesOut) const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    nEntries = mapPrefetched.size();
+    nHitsOut = nHits;
+    nMissesOut = nMisses;
+}
+
+CCoinsViewWriteBehind::CCoinsViewWriteBehind(CCoinsView* viewIn) : CCoinsViewBacked(viewIn),
+    mapQueued(0, SaltedOutpointHasher(), std::equal_to<COutPoint>(), CCoinsMapAllocator(&resource)), hashQueued(0), fQueued(false),
+    mapWriting(0, SaltedOutpointHasher(), std::equal_to<COutPoint>(), CCoinsMapAllocator(&resource)), hashWriting(0), fWriting(false),
+    fFailed(false), fStop(false), nLastWriteEntries(0), nLastWriteMicros(0)
+{
+    threadWriter = boost::thread(boost::bind(&CCoinsViewWriteBehind::ThreadWrite, this));
+}
+
+CCoinsViewWriteBehind::~CCoinsViewWriteBehind()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fStop = true;
+        condWriter.notify_all();
+    }
+    threadWriter.join();
+}
 
-    undo = CTxInUndo(vout[out.n]);
-    vout[out.n].SetNull();
-    Cleanup();
+void CCoinsViewWriteBehind::ThreadWrite()
+{
+    RenameThread("byron-coinswrite");
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (!fFailed) {
+        while (!fQueued && !fStop)
+            condWriter.wait(lock);
+        // Whatever is queued when stopping still goes to the base.
+        if (!fQueued)
+            break;
+        WriteQueued(lock);
+    }
+}
 
-    if (vout.size() == 0) {
-        undo.nHeight = nHeight;
-        undo.fCoinBase = fCoinBase;
-        undo.fCoinStake = fCoinStake;
-        undo.nVersion = this->nVersion;
+void CCoinsViewWriteBehind::WriteQueued(boost::unique_lock<boost::mutex>& lock)
+{
+    assert(fQueued && !fWriting && mapWriting.empty());
+    mapWriting.swap(mapQueued);
+    hashWriting = hashQueued;
+    fQueued = false;
+    fWriting = true;
+    lock.unlock();
+
+    // The base consumes the map it is given, while readers keep using
+    // mapWriting until the write is done, so it gets a copy.
+    int64_t nStart = GetTimeMicros();
+    size_t nEntries = mapWriting.size();
+    bool fOk = false;
+    try {
+        CCoinsMapResource resourceCopy;
+        CCoinsMap mapCopy(mapWriting.begin(), mapWriting.end(), nEntries, SaltedOutpointHasher(), std::equal_to<COutPoint>(), CCoinsMapAllocator(&resourceCopy));
+        fOk = base->BatchWrite(mapCopy, hashWriting);
+    } catch (const std::exception& e) {
+        LogPrintf("%s : %s\n", __func__, e.what());
     }
+    int64_t nTime = GetTimeMicros() - nStart;
 
+    lock.lock();
+    if (fOk) {
+        CCoinsMap mapEmpty(0, SaltedOutpointHasher(), std::equal_to<COutPoint>(), CCoinsMapAllocator(&resource));
+        mapWriting.swap(mapEmpty);
+    } else {
+        // Keep serving the snapshot; the base no longer matches it.
+        LogPrintf("%s : failed to write %u coins to the base view\n", __func__, (unsigned int)nEntries);
+        fFailed = true;
+    }
+    if (mapWriting.empty() && mapQueued.empty() && resource.IsUnused())
+        resource.Release();
+    fWriting = false;
+    nLastWriteEntries = nEntries;
+    nLastWriteMicros = nTime;
+    condDone.notify_all();
+    LogPrint("coindb", "Wrote %u coins behind the tip in %.2fms\n", (unsigned int)nEntries, nTime * 0.001);
+}
+
+bool CCoinsViewWriteBehind::FindPending(const COutPoint& outpoint, Coin& coin, bool& fFound) const
+{
+    CCoinsMap::const_iterator it = mapQueued.find(outpoint);
+    if (it == mapQueued.end()) {
+        it = mapWriting.find(outpoint);
+        if (it == mapWriting.end())
+            return false;
+    }
+    // A spent entry means the base still has the coin, but it is gone.
+    fFound = !it->second.coin.IsSpent();
+    if (fFound)
+        coin = it->second.coin;
     return true;
 }
 
-bool CCoins::Spend(int nPos)
+bool CCoinsViewWriteBehind::GetCoin(const COutPoint& outpoint, Coin& coin) const
 {
-    CTxInUndo undo;
-    COutPoint out(0, nPos);
-    return Spend(out, undo);
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        bool fFound;
+        if (FindPending(outpoint, coin, fFound))
+            return fFound;
+    }
+    return base->GetCoin(outpoint, coin);
 }
 
-bool CCoinsView::GetCoins(const uint256& txid, CCoins& coins) const { return false; }
-bool CCoinsView::HaveCoins(const uint256& txid) const { return false; }
-uint256 CCoinsView::GetBestBlock() const { return uint256(0); }
-bool CCoinsView::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) { return false; }
-bool CCoinsView::GetStats(CCoinsStats& stats) const { return false; }
+bool CCoinsViewWriteBehind::HaveCoin(const COutPoint& outpoint) const
+{
+    Coin coin;
+    return GetCoin(outpoint, coin);
+}
 
-CCoinsViewBacked::CCoinsViewBacked(CCoinsView* viewIn) : base(viewIn) {}
-bool CCoinsViewBacked::GetCoins(const uint256& txid, CCoins& coins) const { return base->GetCoins(txid, coins); }
-bool CCoinsViewBacked::HaveCoins(const uint256& txid) const { return base->HaveCoins(txid); }
-uint256 CCoinsViewBacked::GetBestBlock() const { return base->GetBestBlock(); }
-void CCoinsViewBacked::SetBackend(CCoinsView& viewIn) { base = &viewIn; }
-bool CCoinsViewBacked::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) { return base->BatchWrite(mapCoins, hashBlock); }
-bool CCoinsViewBacked::GetStats(CCoinsStats& stats) const { return base->GetStats(stats); }
+uint256 CCoinsViewWriteBehind::GetBestBlock() const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (fQueued)
+            return hashQueued;
+        if (fWriting || fFailed)
+            return hashWriting;
+    }
+    return base->GetBestBlock();
+}
+
+bool CCoinsViewWriteBehind::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    // Keep at most one snapshot queued behind the one being written.
+    while (fQueued && fWriting)
+        condDone.wait(lock);
+    if (fFailed)
+        return false;
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); it = mapCoins.erase(it)) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+            continue;
+        // Created and spent again above us; neither we nor the base know it.
+        if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coin.IsSpent())
+            continue;
+        CCoinsCacheEntry& entry = mapQueued[it->first];
+        entry.coin = std::move(it->second.coin);
+        entry.flags = CCoinsCacheEntry::DIRTY;
+    }
+    hashQueued = hashBlock;
+    fQueued = true;
+    condWriter.notify_one();
+    return true;
+}
 
-CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) {}
+bool CCoinsViewWriteBehind::GetStats(CCoinsStats& stats) const
+{
+    if (!Sync())
+        return false;
+    return base->GetStats(stats);
+}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView* baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), hashBlock(0) {}
+CCoinsViewCursor* CCoinsViewWriteBehind::Cursor() const
+{
+    if (!Sync())
+        return NULL;
+    return base->Cursor();
+}
+
+bool CCoinsViewWriteBehind::Sync() const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    while ((fQueued || fWriting) && !fFailed)
+        condDone.wait(lock);
+    return !fFailed;
+}
+
+void CCoinsViewWriteBehind::GetWriteStats(size_t& nPending, size_t& nLastEntries, int64_t& nLastMicros) const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    nPending = mapQueued.size() + mapWriting.size();
+    nLastEntries = nLastWriteEntries;
+    nLastMicros = nLastWriteMicros;
+}
+
+CCoinsViewCache::CCoinsViewCache(CCoinsView* baseIn) : CCoinsViewBacked(baseIn), hashBlock(0),
+    cacheCoins(0, SaltedOutpointHasher(), std::equal_to<COutPoint>(), CCoinsMapAllocator(&cacheCoinsResource)), cachedCoinsUsage(0) {}
 
 CCoinsViewCache::~CCoinsViewCache()
 {
-    assert(!hasModifier);
 }
 
-CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256& txid) const
+size_t CCoinsViewCache::DynamicMemoryUsage() const
+{
+    return cacheCoinsResource.ChunkBytes() + memusage::MallocUsage(cacheCoins.bucket_count() * sizeof(void*)) + cachedCoinsUsage;
+}
+
+CCoinsMap::iterator CCoinsViewCache::FetchCoin(const COutPoint& outpoint) const
 {
-    CCoinsMap::iterator it = cacheCoins.find(txid);
+    CCoinsMap::iterator it = cacheCoins.find(outpoint);
     if (it != cacheCoins.end())
         return it;
-    CCoins tmp;
-    if (!base->GetCoins(txid, tmp))
+    Coin tmp;
+    if (!base->GetCoin(outpoint, tmp))
         return cacheCoins.end();
-    CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
-    tmp.swap(ret->second.coins);
-    if (ret->second.coins.IsPruned()) {
-        // The parent only has an empty entry for this txid; we can consider our
+    CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(outpoint, CCoinsCacheEntry(std::move(tmp)))).first;
+    if (ret->second.coin.IsSpent()) {
+        // The parent only has an empty entry for this outpoint; we can consider our
         // version as fresh.
         ret->second.flags = CCoinsCacheEntry::FRESH;
     }
+    cachedCoinsUsage += ret->second.coin.DynamicMemoryUsage();
     return ret;
 }
 
-bool CCoinsViewCache::GetCoins(const uint256& txid, CCoins& coins) const
+bool CCoinsViewCache::GetCoin(const COutPoint& outpoint, Coin& coin) const
 {
-    CCoinsMap::const_iterator it = FetchCoins(txid);
+    CCoinsMap::const_iterator it = FetchCoin(outpoint);
     if (it != cacheCoins.end()) {
-        coins = it->second.coins;
-        return true;
+        coin = it->second.coin;
+        return !coin.IsSpent();
     }
     return false;
 }
 
-CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256& txid)
+void CCoinsViewCache::AddCoin(const COutPoint& outpoint, Coin&& coin, bool possible_overwrite)
 {
-    assert(!hasModifier);
-    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
-    if (ret.second) {
-        if (!base->GetCoins(txid, ret.first->second.coins)) {
-            // The parent view does not have this entry; mark it as fresh.
-            ret.first->second.coins.Clear();
-            ret.first->second.flags = CCoinsCacheEntry::FRESH;
-        } else if (ret.first->second.coins.IsPruned()) {
-            // The parent view only has a pruned entry for this; mark it as fresh.
-            ret.first->second.flags = CCoinsCacheEntry::FRESH;
-        }
+    assert(!coin.IsSpent());
+    if (coin.out.scriptPubKey.IsUnspendable())
+        return;
+    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(outpoint, CCoinsCacheEntry()));
+    CCoinsMap::iterator it = ret.first;
+    bool fresh = false;
+    if (!ret.second)
+        cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
+    if (!possible_overwrite) {
+        if (!it->second.coin.IsSpent())
+            throw std::logic_error("Adding new coin that replaces non-pruned entry");
+        // A spent entry that was never modified here may still exist in the
+        // parent, so only a brand new or clean entry can be marked fresh.
+        fresh = !(it->second.flags & CCoinsCacheEntry::DIRTY);
     }
-    // Assume that whenever ModifyCoins is called, the entry will be modified.
-    ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
-    return CCoinsModifier(*this, ret.first);
+    it->second.coin = std::move(coin);
+    it->second.flags |= CCoinsCacheEntry::DIRTY | (fresh ? CCoinsCacheEntry::FRESH : 0);
+    cachedCoinsUsage += it->second.coin.DynamicMemoryUsage();
 }
 
-const CCoins* CCoinsViewCache::AccessCoins(const uint256& txid) const
+void AddCoins(CCoinsViewCache& cache, const CTransaction& tx, int nHeight, bool check)
 {
-    CCoinsMap::const_iterator it = FetchCoins(txid);
-    if (it == cacheCoins.end()) {
-        return NULL;
+    bool fCoinbase = tx.IsCoinBase();
+    bool fCoinstake = tx.IsCoinStake();
+    const uint256& txid = tx.GetHash();
+    for (size_t i = 0; i < tx.vout.size(); ++i) {
+        COutPoint outpoint(txid, i);
+        // Coinbases may repeat an earlier txid (pre-BIP30), so they are always allowed to overwrite
+        bool overwrite = check ? cache.HaveCoin(outpoint) : fCoinbase;
+        cache.AddCoin(outpoint, Coin(tx.vout[i], nHeight, fCoinbase, fCoinstake), overwrite);
+    }
+}
+
+bool CCoinsViewCache::SpendCoin(const COutPoint& outpoint, Coin* moveout)
+{
+    CCoinsMap::iterator it = FetchCoin(outpoint);
+    if (it == cacheCoins.end() || it->second.coin.IsSpent())
+        return false;
+    cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
+    if (moveout)
+        *moveout = std::move(it->second.coin);
+    if (it->second.flags & CCoinsCacheEntry::FRESH) {
+        cacheCoins.erase(it);
     } else {
-        return &it->second.coins;
+        it->second.flags |= CCoinsCacheEntry::DIRTY;
+        it->second.coin.Clear();
     }
+    return true;
+}
+
+static const Coin coinEmpty;
+
+const Coin& CCoinsViewCache::AccessCoin(const COutPoint& outpoint) const
+{
+    CCoinsMap::const_iterator it = FetchCoin(outpoint);
+    if (it == cacheCoins.end())
+        return coinEmpty;
+    return it->second.coin;
+}
+
+bool CCoinsViewCache::HaveCoin(const COutPoint& outpoint) const
+{
+    CCoinsMap::const_iterator it = FetchCoin(outpoint);
+    return (it != cacheCoins.end() && !it->second.coin.IsSpent());
 }
 
-bool CCoinsViewCache::HaveCoins(const uint256& txid) const
+bool CCoinsViewCache::HaveCoinInCache(const COutPoint& outpoint) const
 {
-    CCoinsMap::const_iterator it = FetchCoins(txid);
-    // We're using vtx.empty() instead of IsPruned here for performance reasons,
-    // as we only care about the case where a transaction was replaced entirely
-    // in a reorganization (which wipes vout entirely, as opposed to spending
-    // which just cleans individual outputs).
-    return (it != cacheCoins.end() && !it->second.coins.vout.empty());
+    CCoinsMap::const_iterator it = cacheCoins.find(outpoint);
+    return (it != cacheCoins.end() && !it->second.coin.IsSpent());
 }
 
 uint256 CCoinsViewCache::GetBestBlock() const
@@ -166,36 +423,49 @@ void CCoinsViewCache::SetBestBlock(const uint256& hashBlockIn)
 
 bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn)
 {
-    assert(!hasModifier);
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
-        if (it->second.flags & CCoinsCacheEntry::DIRTY) { // Ignore non-dirty entries (optimization).
-            CCoinsMap::iterator itUs = cacheCoins.find(it->first);
-            if (itUs == cacheCoins.end()) {
-                if (!it->second.coins.IsPruned()) {
-                    // The parent cache does not have an entry, while the child
-                    // cache does have (a non-pruned) one. Move the data up, and
-                    // mark it as fresh (if the grandparent did have it, we
-                    // would have pulled it in at first GetCoins).
-                    assert(it->second.flags & CCoinsCacheEntry::FRESH);
-                    CCoinsCacheEntry& entry = cacheCoins[it->first];
-                    entry.coins.swap(it->second.coins);
-                    entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
-                }
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); it = mapCoins.erase(it)) {
+        // Ignore non-dirty entries (optimization).
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+            continue;
+        CCoinsMap::iterator itUs = cacheCoins.find(it->first);
+        if (itUs == cacheCoins.end()) {
+            // The parent cache does not have an entry, while the child does.
+            // We can ignore it if it's both FRESH and spent in the child.
+            if (!(it->second.flags & CCoinsCacheEntry::FRESH && it->second.coin.IsSpent())) {
+                // Otherwise we need to create it in the parent, move the data
+                // up and mark it as dirty. It can only be FRESH in the parent
+                // if it was FRESH in the child; otherwise it might have just
+                // been flushed from the parent's cache and already exist in
+                // the grandparent.
+                CCoinsCacheEntry& entry = cacheCoins[it->first];
+                entry.coin = std::move(it->second.coin);
+                cachedCoinsUsage += entry.coin.DynamicMemoryUsage();
+                entry.flags = CCoinsCacheEntry::DIRTY;
+                if (it->second.flags & CCoinsCacheEntry::FRESH)
+                    entry.flags |= CCoinsCacheEntry::FRESH;
+            }
+        } else {
+            // A FRESH child entry can't replace an unspent parent entry, that
+            // would mean the FRESH flag was misapplied somewhere.
+            if ((it->second.flags & CCoinsCacheEntry::FRESH) && !itUs->second.coin.IsSpent())
+                throw std::logic_error("FRESH flag misapplied to cache entry for base transaction with spendable outputs");
+
+            if ((itUs->second.flags & CCoinsCacheEntry::FRESH) && it->second.coin.IsSpent()) {
+                // The grandparent does not have an entry, and the child is
+                // modified and being pruned. This means we can just delete
+                // it from the parent.
+                cachedCoinsUsage -= itUs->second.coin.DynamicMemoryUsage();
+                cacheCoins.erase(itUs);
             } else {
-                if ((itUs->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
-                    // The grandparent does not have an entry, and the child is
-                    // modified and being pruned. This means we can just delete
-                    // it from the parent.
-                    cacheCoins.erase(itUs);
-                } else {
-                    // A normal modification.
-                    itUs->second.coins.swap(it->second.coins);
-                    itUs->second.flags |= CCoinsCacheEntry::DIRTY;
-                }
+                // A normal modification. The child may be FRESH when our entry
+                // is spent, but that must not be copied up: the spend likely
+                // still needs to reach the grandparent.
+                cachedCoinsUsage -= itUs->second.coin.DynamicMemoryUsage();
+                itUs->second.coin = std::move(it->second.coin);
+                cachedCoinsUsage += itUs->second.coin.DynamicMemoryUsage();
+                itUs->second.flags |= CCoinsCacheEntry::DIRTY;
             }
         }
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
     }
     hashBlock = hashBlockIn;
     return true;
@@ -204,10 +474,31 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn
 bool CCoinsViewCache::Flush()
 {
     bool fOk = base->BatchWrite(cacheCoins, hashBlock);
-    cacheCoins.clear();
+    ResetCache();
     return fOk;
 }
 
+void CCoinsViewCache::ResetCache()
+{
+    {
+        // Swap in a map without buckets, so the pool can be released once the old one is gone
+        CCoinsMap mapEmpty(0, SaltedOutpointHasher(), std::equal_to<COutPoint>(), CCoinsMapAllocator(&cacheCoinsResource));
+        cacheCoins.swap(mapEmpty);
+    }
+    if (cacheCoinsResource.IsUnused())
+        cacheCoinsResource.Release();
+    cachedCoinsUsage = 0;
+}
+
+void CCoinsViewCache::Uncache(const COutPoint& outpoint)
+{
+    CCoinsMap::iterator it = cacheCoins.find(outpoint);
+    if (it != cacheCoins.end() && it->second.flags == 0) {
+        cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
+        cacheCoins.erase(it);
+    }
+}
+
 unsigned int CCoinsViewCache::GetCacheSize() const
 {
     return cacheCoins.size();
@@ -215,10 +506,9 @@ unsigned int CCoinsViewCache::GetCacheSize() const
 
 const CTxOut& CCoinsViewCache::GetOutputFor(const CTxIn& input) const
 {
-    const CCoins* coins = AccessCoins(input.prevout.hash);
-    assert(coins && coins->IsAvailable(input.prevout.n));
-
-    return coins->vout[input.prevout.n];
+    const Coin& coin = AccessCoin(input.prevout);
+    assert(!coin.IsSpent());
+    return coin.out;
 }
 
 CAmount CCoinsViewCache::GetValueIn(const CTransaction& tx) const
@@ -237,11 +527,8 @@ bool CCoinsViewCache::HaveInputs(const CTransaction& tx) const
 {
     if (!tx.IsCoinBase()) {
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
-            const COutPoint& prevout = tx.vin[i].prevout;
-            const CCoins* coins = AccessCoins(prevout.hash);
-            if (!coins || !coins->IsAvailable(prevout.n)) {
+            if (!HaveCoin(tx.vin[i].prevout))
                 return false;
-            }
         }
     }
 
@@ -255,29 +542,26 @@ double CCoinsViewCache::GetPriority(const CTransaction& tx, int nHeight) const
     double dResult = 0.0;
     
     for (const CTxIn& txin:  tx.vin) {
-        const CCoins* coins = AccessCoins(txin.prevout.hash);
-        assert(coins);
-        if (!coins->IsAvailable(txin.prevout.n)) continue;
-        if (coins->nHeight < nHeight) {
-            dResult += coins->vout[txin.prevout.n].nValue * (nHeight - coins->nHeight);
+        const Coin& coin = AccessCoin(txin.prevout);
+        if (coin.IsSpent()) continue;
+        if (coin.nHeight < (unsigned int)nHeight) {
+            dResult += coin.out.nValue * (nHeight - coin.nHeight);
         }
     }
 
     return tx.ComputePriority(dResult);
 }
 
-CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_) : cache(cache_), it(it_)
-{
-    assert(!cache.hasModifier);
-    cache.hasModifier = true;
-}
+static const size_t MAX_OUTPUTS_PER_BLOCK = MAX_BLOCK_SIZE_CURRENT / ::GetSerializeSize(CTxOut(), SER_NETWORK, PROTOCOL_VERSION);
 
-CCoinsModifier::~CCoinsModifier()
+const Coin& AccessByTxid(const CCoinsViewCache& view, const uint256& txid)
 {
-    assert(cache.hasModifier);
-    cache.hasModifier = false;
-    it->second.coins.Cleanup();
-    if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
-        cache.cacheCoins.erase(it);
+    COutPoint iter(txid, 0);
+    while (iter.n < MAX_OUTPUTS_PER_BLOCK) {
+        const Coin& alternate = view.AccessCoin(iter);
+        if (!alternate.IsSpent())
+            return alternate;
+        ++iter.n;
     }
+    return coinEmpty;
 }
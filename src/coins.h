@@ -10,303 +10,139 @@
 #include "compressor.h"
 #include "script/standard.h"
 #include "serialize.h"
+#include "support/pool.h"
 #include "uint256.h"
-#include "undo.h"
 
 #include <assert.h>
 #include <stdint.h>
 
 #include <boost/foreach.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 #include <boost/unordered_map.hpp>
 
-/** 
-
-    ****Note - for BYRON we added fCoinStake to the 2nd bit. Keep in mind when reading the following and adjust as needed.
- * Pruned version of CTransaction: only retains metadata and unspent transaction outputs
+/**
+ * A UTXO entry.
  *
  * Serialized format:
- * - VARINT(nVersion)
- * - VARINT(nCode)
- * - unspentness bitvector, for vout[2] and further; least significant byte first
- * - the non-spent CTxOuts (via CTxOutCompressor)
- * - VARINT(nHeight)
- *
- * The nCode value consists of:
- * - bit 1: IsCoinBase()
- * - bit 2: vout[0] is not spent
- * - bit 4: vout[1] is not spent
- * - The higher bits encode N, the number of non-zero bytes in the following bitvector.
- *   - In case both bit 2 and bit 4 are unset, they encode N-1, as there must be at
- *     least one non-spent output).
- *
- * Example: 0104835800816115944e077fe7c803cfa57f29b36bf87c1d358bb85e
- *          <><><--------------------------------------------><---->
- *          |  \                  |                             /
- *    version   code             vout[1]                  height
- *
- *    - version = 1
- *    - code = 4 (vout[1] is not spent, and 0 non-zero bytes of bitvector follow)
- *    - unspentness bitvector: as 0 non-zero bytes follow, it has length 0
- *    - vout[1]: 835800816115944e077fe7c803cfa57f29b36bf87c1d35
- *               * 8358: compact amount representation for 60000000000 (600 BTC)
- *               * 00: special txout type pay-to-pubkey-hash
- *               * 816115944e077fe7c803cfa57f29b36bf87c1d35: address uint160
- *    - height = 203998
+ * - VARINT((nHeight << 2) | (fCoinBase << 1) | fCoinStake)
+ * - the non-spent CTxOut (via CTxOutCompressor)
  *
- *
- * Example: 0109044086ef97d5790061b01caab50f1b8e9c50a5057eb43c2d9563a4eebbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa486af3b
- *          <><><--><--------------------------------------------------><----------------------------------------------><---->
- *         /  \   \                     |                                                           |                     /
- *  version  code  unspentness       vout[4]                                                     vout[16]           height
- *
- *  - version = 1
- *  - code = 9 (coinbase, neither vout[0] or vout[1] are unspent, 2 (1, +1 because both bit 2 and bit 4 are unset) non-zero bitvector bytes follow)
- *  - unspentness bitvector: bits 2 (0x04) and 14 (0x4000) are set, so vout[2+2] and vout[14+2] are unspent
- *  - vout[4]: 86ef97d5790061b01caab50f1b8e9c50a5057eb43c2d9563a4ee
- *             * 86ef97d579: compact amount representation for 234925952 (2.35 BTC)
- *             * 00: special txout type pay-to-pubkey-hash
- *             * 61b01caab50f1b8e9c50a5057eb43c2d9563a4ee: address uint160
- *  - vout[16]: bbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa4
- *              * bbd123: compact amount representation for 110397 (0.001 BTC)
- *              * 00: special txout type pay-to-pubkey-hash
- *              * 8c988f1a4a4de2161e0f50aac7f17e7f9555caa4: address uint160
- *  - height = 120891
+ * This is the same header code CTxInUndo used, so undo records and coins
+ * share one encoding.
  */
-class CCoins
+class Coin
 {
 public:
-    //! whether transaction is a coinbase
+    //! unspent transaction output
+    CTxOut out;
+
+    //! whether containing transaction was a coinbase
     bool fCoinBase;
+    //! whether containing transaction was a coinstake
     bool fCoinStake;
 
-    //! unspent transaction outputs; spent outputs are .IsNull(); spent outputs at the end of the array are dropped
-    std::vector<CTxOut> vout;
-
-    //! at which height this transaction was included in the active block chain
-    int nHeight;
-
-    //! version of the CTransaction; accesses to this value should probably check for nHeight as well,
-    //! as new tx version will probably only be introduced at certain heights
-    int nVersion;
+    //! at which height this containing transaction was included in the active block chain
+    uint32_t nHeight;
 
-    void FromTx(const CTransaction& tx, int nHeightIn)
-    {
-        fCoinBase = tx.IsCoinBase();
-        fCoinStake = tx.IsCoinStake();
-        vout = tx.vout;
-        nHeight = nHeightIn;
-        nVersion = tx.nVersion;
-        ClearUnspendable();
-    }
+    //! construct a Coin from a CTxOut and height/coinbase/coinstake information.
+    Coin(const CTxOut& outIn, int nHeightIn, bool fCoinBaseIn, bool fCoinStakeIn) : out(outIn), fCoinBase(fCoinBaseIn), fCoinStake(fCoinStakeIn), nHeight(nHeightIn) {}
 
-    //! construct a CCoins from a CTransaction, at a given height
-    CCoins(const CTransaction& tx, int nHeightIn)
-    {
-        FromTx(tx, nHeightIn);
-    }
+    //! empty constructor
+    Coin() : fCoinBase(false), fCoinStake(false), nHeight(0) {}
 
     void Clear()
     {
+        out.SetNull();
         fCoinBase = false;
         fCoinStake = false;
-        std::vector<CTxOut>().swap(vout);
         nHeight = 0;
-        nVersion = 0;
     }
 
-    //! empty constructor
-    CCoins() : fCoinBase(false), fCoinStake(false), vout(0), nHeight(0), nVersion(0) {}
-
-    //!remove spent outputs at the end of vout
-    void Cleanup()
+    bool IsCoinBase() const
     {
-        while (vout.size() > 0 && vout.back().IsNull())
-            vout.pop_back();
-        if (vout.empty())
-            std::vector<CTxOut>().swap(vout);
+        return fCoinBase;
     }
 
-    void ClearUnspendable()
+    bool IsCoinStake() const
     {
-        BOOST_FOREACH (CTxOut& txout, vout) {
-            if (txout.scriptPubKey.IsUnspendable())
-                txout.SetNull();
-        }
-        Cleanup();
+        return fCoinStake;
     }
 
-    void swap(CCoins& to)
+    //! whether the output was spent (or never existed); spent coins can't be serialized
+    bool IsSpent() const
     {
-        std::swap(to.fCoinBase, fCoinBase);
-        std::swap(to.fCoinStake, fCoinStake);
-        to.vout.swap(vout);
-        std::swap(to.nHeight, nHeight);
-        std::swap(to.nVersion, nVersion);
+        return out.IsNull();
     }
 
-    //! equality test
-    friend bool operator==(const CCoins& a, const CCoins& b)
+    //! heap memory used by the script, not counting the Coin itself
+    size_t DynamicMemoryUsage() const;
+
+    friend bool operator==(const Coin& a, const Coin& b)
     {
-        // Empty CCoins objects are always equal.
-        if (a.IsPruned() && b.IsPruned())
+        // Empty Coin objects are always equal.
+        if (a.IsSpent() && b.IsSpent())
             return true;
         return a.fCoinBase == b.fCoinBase &&
                a.fCoinStake == b.fCoinStake &&
                a.nHeight == b.nHeight &&
-               a.nVersion == b.nVersion &&
-               a.vout == b.vout;
+               a.out == b.out;
     }
-    friend bool operator!=(const CCoins& a, const CCoins& b)
+    friend bool operator!=(const Coin& a, const Coin& b)
     {
         return !(a == b);
     }
 
-    void CalcMaskSize(unsigned int& nBytes, unsigned int& nNonzeroBytes) const;
-
-    bool IsCoinBase() const
-    {
-        return fCoinBase;
-    }
-
-    bool IsCoinStake() const
-    {
-        return fCoinStake;
-    }
-
     unsigned int GetSerializeSize(int nType, int nVersion) const
     {
-        unsigned int nSize = 0;
-        unsigned int nMaskSize = 0, nMaskCode = 0;
-        CalcMaskSize(nMaskSize, nMaskCode);
-        bool fFirst = vout.size() > 0 && !vout[0].IsNull();
-        bool fSecond = vout.size() > 1 && !vout[1].IsNull();
-        assert(fFirst || fSecond || nMaskCode);
-        unsigned int nCode = 8 * (nMaskCode - (fFirst || fSecond ? 0 : 1)) + (fCoinBase ? 1 : 0) + (fCoinStake ? 2 : 0) + (fFirst ? 4 : 0) + (fSecond ? 8 : 0);
-        // version
-        nSize += ::GetSerializeSize(VARINT(this->nVersion), nType, nVersion);
-        // size of header code
-        nSize += ::GetSerializeSize(VARINT(nCode), nType, nVersion);
-        // spentness bitmask
-        nSize += nMaskSize;
-        // txouts themself
-        for (unsigned int i = 0; i < vout.size(); i++)
-            if (!vout[i].IsNull())
-                nSize += ::GetSerializeSize(CTxOutCompressor(REF(vout[i])), nType, nVersion);
-        // height
-        nSize += ::GetSerializeSize(VARINT(nHeight), nType, nVersion);
-        return nSize;
+        uint32_t nCode = nHeight * 4 + (fCoinBase ? 2 : 0) + (fCoinStake ? 1 : 0);
+        return ::GetSerializeSize(VARINT(nCode), nType, nVersion) +
+               ::GetSerializeSize(CTxOutCompressor(REF(out)), nType, nVersion);
     }
 
     template <typename Stream>
     void Serialize(Stream& s, int nType, int nVersion) const
     {
-        unsigned int nMaskSize = 0, nMaskCode = 0;
-        CalcMaskSize(nMaskSize, nMaskCode);
-        bool fFirst = vout.size() > 0 && !vout[0].IsNull();
-        bool fSecond = vout.size() > 1 && !vout[1].IsNull();
-        assert(fFirst || fSecond || nMaskCode);
-        unsigned int nCode = 16 * (nMaskCode - (fFirst || fSecond ? 0 : 1)) + (fCoinBase ? 1 : 0) + (fCoinStake ? 2 : 0) + (fFirst ? 4 : 0) + (fSecond ? 8 : 0);
-        // version
-        ::Serialize(s, VARINT(this->nVersion), nType, nVersion);
-        // header code
+        assert(!IsSpent());
+        uint32_t nCode = nHeight * 4 + (fCoinBase ? 2 : 0) + (fCoinStake ? 1 : 0);
         ::Serialize(s, VARINT(nCode), nType, nVersion);
-        // spentness bitmask
-        for (unsigned int b = 0; b < nMaskSize; b++) {
-            unsigned char chAvail = 0;
-            for (unsigned int i = 0; i < 8 && 2 + b * 8 + i < vout.size(); i++)
-                if (!vout[2 + b * 8 + i].IsNull())
-                    chAvail |= (1 << i);
-            ::Serialize(s, chAvail, nType, nVersion);
-        }
-        // txouts themself
-        for (unsigned int i = 0; i < vout.size(); i++) {
-            if (!vout[i].IsNull())
-                ::Serialize(s, CTxOutCompressor(REF(vout[i])), nType, nVersion);
-        }
-        // coinbase height
-        ::Serialize(s, VARINT(nHeight), nType, nVersion);
+        ::Serialize(s, CTxOutCompressor(REF(out)), nType, nVersion);
     }
 
     template <typename Stream>
     void Unserialize(Stream& s, int nType, int nVersion)
     {
-        unsigned int nCode = 0;
-        // version
-        ::Unserialize(s, VARINT(this->nVersion), nType, nVersion);
-        // header code
+        uint32_t nCode = 0;
         ::Unserialize(s, VARINT(nCode), nType, nVersion);
-        fCoinBase = nCode & 1;         //0001 - means coinbase
-        fCoinStake = (nCode & 2) != 0; //0010 coinstake
-        std::vector<bool> vAvail(2, false);
-        vAvail[0] = (nCode & 4) != 0; // 0100
-        vAvail[1] = (nCode & 8) != 0; // 1000
-        unsigned int nMaskCode = (nCode / 16) + ((nCode & 12) != 0 ? 0 : 1);
-        // spentness bitmask
-        while (nMaskCode > 0) {
-            unsigned char chAvail = 0;
-            ::Unserialize(s, chAvail, nType, nVersion);
-            for (unsigned int p = 0; p < 8; p++) {
-                bool f = (chAvail & (1 << p)) != 0;
-                vAvail.push_back(f);
-            }
-            if (chAvail != 0)
-                nMaskCode--;
-        }
-        // txouts themself
-        vout.assign(vAvail.size(), CTxOut());
-        for (unsigned int i = 0; i < vAvail.size(); i++) {
-            if (vAvail[i])
-                ::Unserialize(s, REF(CTxOutCompressor(vout[i])), nType, nVersion);
-        }
-        // coinbase height
-        ::Unserialize(s, VARINT(nHeight), nType, nVersion);
-        Cleanup();
-    }
-
-    //! mark an outpoint spent, and construct undo information
-    bool Spend(const COutPoint& out, CTxInUndo& undo);
-
-    //! mark a vout spent
-    bool Spend(int nPos);
-
-    //! check whether a particular output is still available
-    bool IsAvailable(unsigned int nPos) const
-    {
-        return (nPos < vout.size() && !vout[nPos].IsNull());
-    }
-
-    //! check whether the entire CCoins is spent
-    //! note that only !IsPruned() CCoins can be serialized
-    bool IsPruned() const
-    {
-        BOOST_FOREACH (const CTxOut& out, vout)
-            if (!out.IsNull())
-                return false;
-        return true;
+        nHeight = nCode >> 2;
+        fCoinBase = nCode & 2;
+        fCoinStake = nCode & 1;
+        ::Unserialize(s, REF(CTxOutCompressor(out)), nType, nVersion);
     }
 };
 
-class CCoinsKeyHasher
+class SaltedOutpointHasher
 {
 private:
     uint256 salt;
 
 public:
-    CCoinsKeyHasher();
+    SaltedOutpointHasher();
 
     /**
      * This *must* return size_t. With Boost 1.46 on 32-bit systems the
      * unordered_map will behave unpredictably if the custom hasher returns a
      * uint64_t, resulting in failures when syncing the chain (#4634).
      */
-    size_t operator()(const uint256& key) const
+    size_t operator()(const COutPoint& outpoint) const
     {
-        return key.GetHash(salt);
+        return outpoint.hash.GetHash(salt) ^ ((uint64_t)outpoint.n * 0x9E3779B97F4A7C15ULL);
     }
 };
 
 struct CCoinsCacheEntry {
-    CCoins coins; // The actual cached data.
+    Coin coin; // The actual cached data.
     unsigned char flags;
 
     enum Flags {
@@ -314,10 +150,16 @@ struct CCoinsCacheEntry {
         FRESH = (1 << 1), // The parent view does not have this entry (or it is pruned).
     };
 
-    CCoinsCacheEntry() : coins(), flags(0) {}
+    CCoinsCacheEntry() : flags(0) {}
+    explicit CCoinsCacheEntry(Coin&& coinIn) : coin(std::move(coinIn)), flags(0) {}
 };
 
-typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
+//! Largest map node served from the pool; entries with their key and links fit well within this
+static const size_t COINS_MAP_POOL_BLOCK_SIZE = 128;
+
+typedef CPoolResource<COINS_MAP_POOL_BLOCK_SIZE, 8> CCoinsMapResource;
+typedef CPoolAllocator<std::pair<const COutPoint, CCoinsCacheEntry>, COINS_MAP_POOL_BLOCK_SIZE, 8> CCoinsMapAllocator;
+typedef boost::unordered_map<COutPoint, CCoinsCacheEntry, SaltedOutpointHasher, std::equal_to<COutPoint>, CCoinsMapAllocator> CCoinsMap;
 
 struct CCoinsStats {
     int nHeight;
@@ -332,27 +174,96 @@ struct CCoinsStats {
 };
 
 
+/**
+ * Writes coins, given in outpoint order, in the form GetStats hashes them and
+ * UTXO snapshots store them: grouped by transaction, with the height and
+ * coinbase/coinstake flags once per transaction, each group closed by a zero.
+ */
+template <typename Stream>
+class CTxOutSetWriter
+{
+private:
+    Stream& s;
+    uint256 hashPrev;
+    bool fFirst;
+
+public:
+    uint64_t nTransactions;
+    uint64_t nTransactionOutputs;
+
+    CTxOutSetWriter(Stream& sIn) : s(sIn), fFirst(true), nTransactions(0), nTransactionOutputs(0) {}
+
+    void Add(const COutPoint& outpoint, const Coin& coin)
+    {
+        if (fFirst || outpoint.hash != hashPrev) {
+            if (!fFirst)
+                s << VARINT(0);
+            s << outpoint.hash;
+            s << VARINT(coin.nHeight * 4 + (coin.fCoinBase ? 2 : 0) + (coin.fCoinStake ? 1 : 0));
+            nTransactions++;
+            hashPrev = outpoint.hash;
+            fFirst = false;
+        }
+        nTransactionOutputs++;
+        s << VARINT(outpoint.n + 1);
+        s << coin.out;
+    }
+
+    void Finish()
+    {
+        if (!fFirst)
+            s << VARINT(0);
+    }
+};
+
+/** Cursor over the coins of a view, in outpoint order */
+class CCoinsViewCursor
+{
+public:
+    CCoinsViewCursor(const uint256& hashBlockIn) : hashBlock(hashBlockIn) {}
+    virtual ~CCoinsViewCursor() {}
+
+    virtual bool GetKey(COutPoint& key) const = 0;
+    virtual bool GetValue(Coin& coin) const = 0;
+    //! Size of the current entry as stored by the view
+    virtual unsigned int GetSize() const = 0;
+
+    virtual bool Valid() const = 0;
+    virtual void Next() = 0;
+
+    //! Best block of the view when the cursor was created
+    const uint256& GetBestBlock() const { return hashBlock; }
+
+private:
+    uint256 hashBlock;
+};
+
 /** Abstract view on the open txout dataset. */
 class CCoinsView
 {
 public:
-    //! Retrieve the CCoins (unspent transaction outputs) for a given txid
-    virtual bool GetCoins(const uint256& txid, CCoins& coins) const;
+    //! Retrieve the Coin (unspent transaction output) for a given outpoint.
+    //! Returns true only when an unspent coin was found, which is returned in coin.
+    //! When false is returned, coin's value is unspecified.
+    virtual bool GetCoin(const COutPoint& outpoint, Coin& coin) const;
 
-    //! Just check whether we have data for a given txid.
-    //! This may (but cannot always) return true for fully spent transactions
-    virtual bool HaveCoins(const uint256& txid) const;
+    //! Just check whether a given outpoint is unspent.
+    virtual bool HaveCoin(const COutPoint& outpoint) const;
 
     //! Retrieve the block hash whose state this CCoinsView currently represents
     virtual uint256 GetBestBlock() const;
 
-    //! Do a bulk modification (multiple CCoins changes + BestBlock change).
+    //! Do a bulk modification (multiple Coin changes + BestBlock change).
     //! The passed mapCoins can be modified.
     virtual bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
 
     //! Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats& stats) const;
 
+    //! Get a cursor over the unspent transaction output set, or NULL if the view has none.
+    //! The caller owns it; it sees the set as it was when created.
+    virtual CCoinsViewCursor* Cursor() const;
+
     //! As we use CCoinsViews polymorphically, have a virtual destructor
     virtual ~CCoinsView() {}
 };
@@ -366,15 +277,120 @@ protected:
 
 public:
     CCoinsViewBacked(CCoinsView* viewIn);
-    bool GetCoins(const uint256& txid, CCoins& coins) const;
-    bool HaveCoins(const uint256& txid) const;
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const;
+    bool HaveCoin(const COutPoint& outpoint) const;
     uint256 GetBestBlock() const;
     void SetBackend(CCoinsView& viewIn);
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
     bool GetStats(CCoinsStats& stats) const;
+    CCoinsViewCursor* Cursor() const;
 };
 
-class CCoinsViewCache;
+/**
+ * CCoinsView that buffers coins read ahead of time from its base by
+ * background threads (see ThreadCoinsPrefetch). Every buffered entry is
+ * handed out at most once, and the buffer is dropped whenever the base is
+ * written to, so a lookup can never observe data older than the base.
+ * Prefetch() may be called from any thread as long as the base view's
+ * GetCoin is thread safe (CCoinsViewDB is); all other methods follow the
+ * usual cs_main rules.
+ */
+class CCoinsViewPrefetch : public CCoinsViewBacked
+{
+private:
+    typedef boost::unordered_map<COutPoint, Coin, SaltedOutpointHasher> CCoinsPrefetchMap;
+
+    mutable boost::mutex cs;
+    mutable CCoinsPrefetchMap mapPrefetched;
+    //! Bumped before and after every write to the base, to discard reads that raced with it
+    uint64_t nGeneration;
+    size_t nMaxEntries;
+    mutable uint64_t nHits;
+    mutable uint64_t nMisses;
+
+public:
+    CCoinsViewPrefetch(CCoinsView* viewIn, size_t nMaxEntriesIn);
+
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const;
+    bool HaveCoin(const COutPoint& outpoint) const;
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
+
+    //! Read outpoint from the base view into the buffer. Returns whether an entry was added.
+    bool Prefetch(const COutPoint& outpoint);
+
+    //! Drop all buffered entries
+    void Clear();
+
+    //! Number of buffered entries, and how many lookups were served from / missed the buffer
+    void GetPrefetchStats(size_t& nEntries, uint64_t& nHitsOut, uint64_t& nMissesOut) const;
+};
+
+/**
+ * CCoinsView that writes the batches it receives to its base on a
+ * background thread. BatchWrite only moves the dirty entries into a queued
+ * snapshot and returns; the writer thread hands the snapshot to the base in
+ * one batch together with its best block, so the base always holds the
+ * state as of some complete flush. Until then lookups are answered from the
+ * queued and the in-flight snapshot, so callers see the newest state.
+ * At most one snapshot is queued while another is being written; a further
+ * BatchWrite waits for the write to finish. The base view must allow
+ * BatchWrite from another thread concurrently with reads (CCoinsViewDB does).
+ */
+class CCoinsViewWriteBehind : public CCoinsViewBacked
+{
+private:
+    mutable boost::mutex cs;
+    mutable boost::condition_variable condWriter;
+    mutable boost::condition_variable condDone;
+
+    //! Backs both snapshot maps, so they can be swapped; only used with cs held
+    CCoinsMapResource resource;
+    //! Entries waiting for the writer, merged from every BatchWrite since it last started
+    CCoinsMap mapQueued;
+    uint256 hashQueued;
+    bool fQueued;
+    //! Entries the writer is passing to the base; not modified until the write finishes
+    CCoinsMap mapWriting;
+    uint256 hashWriting;
+    bool fWriting;
+    //! Set when a write to the base failed; nothing is written after that
+    bool fFailed;
+    bool fStop;
+
+    //! Statistics of the last finished write
+    size_t nLastWriteEntries;
+    int64_t nLastWriteMicros;
+
+    boost::thread threadWriter;
+
+    void ThreadWrite();
+    //! Write the queued snapshot to the base. cs must be held by lock; it is released during the write.
+    void WriteQueued(boost::unique_lock<boost::mutex>& lock);
+    //! Look outpoint up in the snapshots; returns false when the base has to be asked
+    bool FindPending(const COutPoint& outpoint, Coin& coin, bool& fFound) const;
+
+public:
+    CCoinsViewWriteBehind(CCoinsView* viewIn);
+    //! Writes what is still queued and stops the writer thread
+    ~CCoinsViewWriteBehind();
+
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const;
+    bool HaveCoin(const COutPoint& outpoint) const;
+    uint256 GetBestBlock() const;
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
+    bool GetStats(CCoinsStats& stats) const;
+    CCoinsViewCursor* Cursor() const;
+
+    //! Wait until everything handed to BatchWrite is in the base. Returns false if a write failed.
+    bool Sync() const;
+
+    //! Number of entries not yet in the base, and size and duration of the last write
+    void GetWriteStats(size_t& nPending, size_t& nLastEntries, int64_t& nLastMicros) const;
+
+private:
+    CCoinsViewWriteBehind(const CCoinsViewWriteBehind&);
+    void operator=(const CCoinsViewWriteBehind&);
+};
 
 /** Flags for nSequence and nLockTime locks */
 enum {
@@ -389,63 +405,58 @@ enum {
 static const unsigned int STANDARD_LOCKTIME_VERIFY_FLAGS = LOCKTIME_VERIFY_SEQUENCE |
                                                            LOCKTIME_MEDIAN_TIME_PAST;
 
-/** 
- * A reference to a mutable cache entry. Encapsulating it allows us to run
- *  cleanup code after the modification is finished, and keeping track of
- *  concurrent modifications. 
- */
-class CCoinsModifier
-{
-private:
-    CCoinsViewCache& cache;
-    CCoinsMap::iterator it;
-    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_);
-
-public:
-    CCoins* operator->() { return &it->second.coins; }
-    CCoins& operator*() { return it->second.coins; }
-    ~CCoinsModifier();
-    friend class CCoinsViewCache;
-};
-
 /** CCoinsView that adds a memory cache for transactions to another CCoinsView */
 class CCoinsViewCache : public CCoinsViewBacked
 {
 protected:
-    /* Whether this cache has an active modifier. */
-    bool hasModifier;
-
     /**
      * Make mutable so that we can "fill the cache" even from Get-methods
      * declared as "const".  
      */
     mutable uint256 hashBlock;
+    //! Backs the nodes of cacheCoins; declared first so it outlives the map
+    mutable CCoinsMapResource cacheCoinsResource;
     mutable CCoinsMap cacheCoins;
 
+    /* Cached dynamic memory usage for the scripts of the coins in cacheCoins. */
+    mutable size_t cachedCoinsUsage;
+
 public:
     CCoinsViewCache(CCoinsView* baseIn);
     ~CCoinsViewCache();
 
     // Standard CCoinsView methods
-    bool GetCoins(const uint256& txid, CCoins& coins) const;
-    bool HaveCoins(const uint256& txid) const;
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const;
+    bool HaveCoin(const COutPoint& outpoint) const;
     uint256 GetBestBlock() const;
     void SetBestBlock(const uint256& hashBlock);
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
 
     /**
-     * Return a pointer to CCoins in the cache, or NULL if not found. This is
-     * more efficient than GetCoins. Modifications to other cache entries are
-     * allowed while accessing the returned pointer.
+     * Check if we have the given utxo already loaded in this cache, without
+     * querying the base view.
+     */
+    bool HaveCoinInCache(const COutPoint& outpoint) const;
+
+    /**
+     * Return a reference to Coin in the cache, or a spent coin if not found. This is
+     * more efficient than GetCoin. Modifications to other cache entries are
+     * allowed while accessing the returned reference.
      */
-    const CCoins* AccessCoins(const uint256& txid) const;
+    const Coin& AccessCoin(const COutPoint& outpoint) const;
 
     /**
-     * Return a modifiable reference to a CCoins. If no entry with the given
-     * txid exists, a new one is created. Simultaneous modifications are not
-     * allowed.
+     * Add a coin. Set possible_overwrite to true if an unspent version may
+     * already exist in the cache.
      */
-    CCoinsModifier ModifyCoins(const uint256& txid);
+    void AddCoin(const COutPoint& outpoint, Coin&& coin, bool possible_overwrite);
+
+    /**
+     * Spend a coin. Pass moveto in order to get the deleted data.
+     * If no unspent output exists for the passed outpoint, this call
+     * has no effect.
+     */
+    bool SpendCoin(const COutPoint& outpoint, Coin* moveto = NULL);
 
     /**
      * Push the modifications applied to this cache to its base.
@@ -454,9 +465,18 @@ public:
      */
     bool Flush();
 
-    //! Calculate the size of the cache (in number of transactions)
+    /**
+     * Removes the UTXO with the given outpoint from the cache, if it is
+     * not modified.
+     */
+    void Uncache(const COutPoint& outpoint);
+
+    //! Calculate the size of the cache (in number of transaction outputs)
     unsigned int GetCacheSize() const;
 
+    //! Calculate the size of the cache (in bytes)
+    size_t DynamicMemoryUsage() const;
+
     /** 
      * Amount of byron coming in to a transaction
      * Note that lightweight clients may not know anything besides the hash of previous transactions,
@@ -475,11 +495,26 @@ public:
 
     const CTxOut& GetOutputFor(const CTxIn& input) const;
 
-    friend class CCoinsModifier;
-
 private:
-    CCoinsMap::iterator FetchCoins(const uint256& txid);
-    CCoinsMap::const_iterator FetchCoins(const uint256& txid) const;
+    CCoinsMap::iterator FetchCoin(const COutPoint& outpoint) const;
+
+    /** Start over with an empty map, giving the pooled memory back to the system */
+    void ResetCache();
+
+    CCoinsViewCache(const CCoinsViewCache&);
+    void operator=(const CCoinsViewCache&);
 };
 
+//! Utility function to add all of a transaction's outputs to a cache.
+// When check is false, this assumes that overwrites are only possible for coinbase transactions.
+// When check is true, the underlying view may be queried to determine whether an addition is
+// an overwrite.
+void AddCoins(CCoinsViewCache& cache, const CTransaction& tx, int nHeight, bool check = false);
+
+//! Utility function to find any unspent output with a given txid.
+// This function can be quite expensive because in the event of a transaction
+// which is not found in the cache, it can cause up to MAX_OUTPUTS_PER_BLOCK
+// lookups to database, so it should be used with care.
+const Coin& AccessByTxid(const CCoinsViewCache& cache, const uint256& txid);
+
 #endif // BITCOIN_COINS_H
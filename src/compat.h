@@ -94,6 +94,13 @@ typedef u_int SOCKET;
 size_t strnlen( const char *start, size_t max_len);
 #endif // HAVE_DECL_STRNLEN
 
+// poll() is unreliable for sockets on Windows and OS X, so only Linux gets the
+// poll and epoll socket event backends; everything else keeps using select().
+#if defined(__linux__)
+#define USE_POLL
+#define USE_EPOLL
+#endif
+
 bool static inline IsSelectableSocket(SOCKET s)
 {
 #ifdef WIN32
@@ -5,6 +5,10 @@
 #ifndef BITCOIN_CRYPTO_COMMON_H
 #define BITCOIN_CRYPTO_COMMON_H
 
+#if defined(HAVE_CONFIG_H)
+#include "config/byron-config.h"
+#endif
+
 #include <stdint.h>
 
 #if defined(HAVE_ENDIAN_H)
@@ -0,0 +1,244 @@
+// Copyright (c) 2016 Jeremy Rubin
+// Copyright (c) 2026 The Byron developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CUCKOOCACHE_H
+#define BITCOIN_CUCKOOCACHE_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Fixed size, mostly lock-free cuckoo hash set.
+ *
+ * The table is a flat array of elements, each of which may live in one of
+ * eight slots picked by the hash functions. Instead of removing elements,
+ * readers mark slots as collectable through an array of atomic flags, so a
+ * lookup that erases never needs a write lock; the slot is simply reused by
+ * a later insert. Slots that were not used for a while are aged out in
+ * epochs, which keeps recently inserted elements around when the table is
+ * full.
+ */
+namespace CuckooCache
+{
+/** Array of atomic flags packed 8 to a byte; all flags start out set */
+class bit_packed_atomic_flags
+{
+    std::unique_ptr<std::atomic<uint8_t>[]> mem;
+
+public:
+    bit_packed_atomic_flags() = delete;
+
+    explicit bit_packed_atomic_flags(uint32_t size)
+    {
+        size = (size + 7) / 8;
+        mem.reset(new std::atomic<uint8_t>[size]);
+        for (uint32_t i = 0; i < size; ++i)
+            mem[i].store(0xFF);
+    }
+
+    /** Replace the flags with a new all-set array of b bits; not thread safe */
+    inline void setup(uint32_t b)
+    {
+        bit_packed_atomic_flags d(b);
+        std::swap(mem, d.mem);
+    }
+
+    inline void bit_set(uint32_t s) const
+    {
+        mem[s >> 3].fetch_or(1 << (s & 7), std::memory_order_relaxed);
+    }
+
+    inline void bit_unset(uint32_t s) const
+    {
+        mem[s >> 3].fetch_and(~(1 << (s & 7)), std::memory_order_relaxed);
+    }
+
+    inline bool bit_is_set(uint32_t s) const
+    {
+        return (1 << (s & 7)) & mem[s >> 3].load(std::memory_order_relaxed);
+    }
+};
+
+/**
+ * Cuckoo set of Element, hashed with the eight functions of Hash selected by
+ * Hash::operator()<0..7>. Element must be default constructible, movable and
+ * comparable; an all-zero default element never matches a real entry as long
+ * as the hashes are salted.
+ *
+ * contains() may run concurrently with other contains() calls, insert() and
+ * setup() need exclusive access. Callers provide that locking.
+ */
+template <typename Element, typename Hash>
+class cache
+{
+private:
+    std::vector<Element> table;
+    uint32_t size;
+
+    //! Set for slots that may be overwritten, either empty or erased
+    mutable bit_packed_atomic_flags collection_flags;
+
+    //! Set for slots inserted or refreshed during the current epoch
+    std::vector<bool> epoch_flags;
+
+    //! Inserts left before the next check whether the epoch has to end
+    uint32_t epoch_heuristic_counter;
+
+    //! Number of live entries that ends an epoch, about 45% of the table
+    uint32_t epoch_size;
+
+    //! Number of displacements before an insert gives up and drops an element
+    uint8_t depth_limit;
+
+    const Hash hash_function;
+
+    /** Map the eight hashes of e onto the table without a modulo */
+    inline std::array<uint32_t, 8> compute_hashes(const Element& e) const
+    {
+        return {{(uint32_t)(((uint64_t)hash_function.template operator()<0>(e) * (uint64_t)size) >> 32),
+            (uint32_t)(((uint64_t)hash_function.template operator()<1>(e) * (uint64_t)size) >> 32),
+            (uint32_t)(((uint64_t)hash_function.template operator()<2>(e) * (uint64_t)size) >> 32),
+            (uint32_t)(((uint64_t)hash_function.template operator()<3>(e) * (uint64_t)size) >> 32),
+            (uint32_t)(((uint64_t)hash_function.template operator()<4>(e) * (uint64_t)size) >> 32),
+            (uint32_t)(((uint64_t)hash_function.template operator()<5>(e) * (uint64_t)size) >> 32),
+            (uint32_t)(((uint64_t)hash_function.template operator()<6>(e) * (uint64_t)size) >> 32),
+            (uint32_t)(((uint64_t)hash_function.template operator()<7>(e) * (uint64_t)size) >> 32)}};
+    }
+
+    static uint32_t invalid()
+    {
+        return ~(uint32_t)0;
+    }
+
+    inline void allow_erase(uint32_t n) const
+    {
+        collection_flags.bit_set(n);
+    }
+
+    inline void please_keep(uint32_t n) const
+    {
+        collection_flags.bit_unset(n);
+    }
+
+    /**
+     * Age out the previous epoch once enough live entries were inserted
+     * since it started. The scan is skipped for a number of inserts that is
+     * a lower bound for how long the epoch can still last.
+     */
+    void epoch_check()
+    {
+        if (epoch_heuristic_counter != 0) {
+            --epoch_heuristic_counter;
+            return;
+        }
+
+        uint32_t epoch_unused_count = 0;
+        for (uint32_t i = 0; i < size; ++i)
+            epoch_unused_count += epoch_flags[i] && !collection_flags.bit_is_set(i);
+
+        if (epoch_unused_count >= epoch_size) {
+            for (uint32_t i = 0; i < size; ++i) {
+                if (epoch_flags[i]) {
+                    epoch_flags[i] = false;
+                } else {
+                    allow_erase(i);
+                }
+            }
+            epoch_heuristic_counter = epoch_size;
+        } else {
+            epoch_heuristic_counter = std::max(1u, std::max(epoch_size / 16, epoch_size - std::min(epoch_size, epoch_unused_count)));
+        }
+    }
+
+public:
+    cache() : table(), size(), collection_flags(0), epoch_flags(), epoch_heuristic_counter(), epoch_size(), depth_limit(0), hash_function()
+    {
+    }
+
+    /** Size the table for new_size elements, dropping all current entries; returns the size used */
+    uint32_t setup(uint32_t new_size)
+    {
+        depth_limit = static_cast<uint8_t>(std::log2(static_cast<float>(std::max((uint32_t)2, new_size))));
+        size = std::max<uint32_t>(2, new_size);
+        table.assign(size, Element());
+        collection_flags.setup(size);
+        epoch_flags.assign(size, false);
+        epoch_size = std::max((uint32_t)1, (45 * size) / 100);
+        epoch_heuristic_counter = epoch_size;
+        return size;
+    }
+
+    /** Size the table to use at most bytes of element storage; returns the number of elements */
+    uint32_t setup_bytes(size_t bytes)
+    {
+        return setup(std::min<size_t>(bytes / sizeof(Element), ~(uint32_t)0 >> 1));
+    }
+
+    /**
+     * Insert e, displacing other elements along their alternative slots when
+     * all eight slots are taken. After depth_limit displacements the last
+     * displaced element is dropped, preferring ones from the old epoch.
+     */
+    inline void insert(Element e)
+    {
+        epoch_check();
+        uint32_t last_loc = invalid();
+        bool last_epoch = true;
+        std::array<uint32_t, 8> locs = compute_hashes(e);
+        // Refresh an existing copy instead of storing a second one
+        for (uint32_t loc : locs) {
+            if (table[loc] == e) {
+                please_keep(loc);
+                epoch_flags[loc] = last_epoch;
+                return;
+            }
+        }
+        for (uint8_t depth = 0; depth < depth_limit; ++depth) {
+            for (uint32_t loc : locs) {
+                if (!collection_flags.bit_is_set(loc))
+                    continue;
+                table[loc] = std::move(e);
+                please_keep(loc);
+                epoch_flags[loc] = last_epoch;
+                return;
+            }
+            // Evict the slot after the one we came from, so chains don't cycle
+            last_loc = locs[(1 + (std::find(locs.begin(), locs.end(), last_loc) - locs.begin())) & 7];
+            std::swap(table[last_loc], e);
+            bool epoch = last_epoch;
+            last_epoch = epoch_flags[last_loc];
+            epoch_flags[last_loc] = epoch;
+            locs = compute_hashes(e);
+        }
+    }
+
+    /** Look up e; with erase set, a hit also marks the slot as reusable */
+    inline bool contains(const Element& e, const bool erase) const
+    {
+        std::array<uint32_t, 8> locs = compute_hashes(e);
+        for (uint32_t loc : locs) {
+            if (table[loc] == e) {
+                if (erase)
+                    allow_erase(loc);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    uint32_t capacity() const
+    {
+        return size;
+    }
+};
+} // namespace CuckooCache
+
+#endif // BITCOIN_CUCKOOCACHE_H
@@ -315,11 +315,42 @@ unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char
 
 void BIP32Hash(const ChainCode chainCode, unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64]);
 
+/** SipHash-2-4, a keyed 64-bit hash that is fast on short inputs */
+class CSipHasher
+{
+private:
+    uint64_t v[4];
+    uint64_t tmp;
+    int count;
+
+public:
+    /** Construct a SipHash calculator initialized with 128-bit key (k0, k1) */
+    CSipHasher(uint64_t k0, uint64_t k1);
+    /**
+     * Hash a 64-bit integer worth of data, as the little-endian interpretation of 8 bytes.
+     * Only usable when a multiple of 8 bytes has been written so far.
+     */
+    CSipHasher& Write(uint64_t data);
+    /** Hash arbitrary bytes */
+    CSipHasher& Write(const unsigned char* data, size_t size);
+    /** Compute the 64-bit SipHash-2-4 of the data written so far. The object remains untouched. */
+    uint64_t Finalize() const;
+};
+
+/** SipHash-2-4 of a uint256, without going through CSipHasher */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+
 //int HMAC_SHA512_Init(HMAC_SHA512_CTX *pctx, const void *pkey, size_t len);
 //int HMAC_SHA512_Update(HMAC_SHA512_CTX *pctx, const void *pdata, size_t len);
 //int HMAC_SHA512_Final(unsigned char *pmd, HMAC_SHA512_CTX *pctx);
 
 /* ----------- Quark Hash ------------------------------------------------ */
+/** The bit that selects the next Quark function; same as (hash & 8) != 0, without uint512 temporaries */
+inline bool QuarkSelectBit(const uint512& hash)
+{
+    return (hash.Get32() & 8) != 0;
+}
+
 template <typename T1>
 inline uint256 HashQuark(const T1 pbegin, const T1 pend)
 
@@ -332,9 +363,6 @@ inline uint256 HashQuark(const T1 pbegin, const T1 pend)
     sph_skein512_context ctx_skein;
     static unsigned char pblank[1];
 
-    uint512 mask = 8;
-    uint512 zero = 0;
-
     uint512 hash[9];
 
     sph_blake512_init(&ctx_blake);
@@ -347,7 +375,7 @@ inline uint256 HashQuark(const T1 pbegin, const T1 pend)
     sph_bmw512(&ctx_bmw, static_cast<const void*>(&hash[0]), 64);
     sph_bmw512_close(&ctx_bmw, static_cast<void*>(&hash[1]));
 
-    if ((hash[1] & mask) != zero) {
+    if (QuarkSelectBit(hash[1])) {
         sph_groestl512_init(&ctx_groestl);
         // ZGROESTL;
         sph_groestl512(&ctx_groestl, static_cast<const void*>(&hash[1]), 64);
@@ -369,7 +397,7 @@ inline uint256 HashQuark(const T1 pbegin, const T1 pend)
     sph_jh512(&ctx_jh, static_cast<const void*>(&hash[3]), 64);
     sph_jh512_close(&ctx_jh, static_cast<void*>(&hash[4]));
 
-    if ((hash[4] & mask) != zero) {
+    if (QuarkSelectBit(hash[4])) {
         sph_blake512_init(&ctx_blake);
         // ZBLAKE;
         sph_blake512(&ctx_blake, static_cast<const void*>(&hash[4]), 64);
@@ -391,7 +419,7 @@ inline uint256 HashQuark(const T1 pbegin, const T1 pend)
     sph_skein512(&ctx_skein, static_cast<const void*>(&hash[6]), 64);
     sph_skein512_close(&ctx_skein, static_cast<void*>(&hash[7]));
 
-    if ((hash[7] & mask) != zero) {
+    if (QuarkSelectBit(hash[7])) {
         sph_keccak512_init(&ctx_keccak);
         // ZKECCAK;
         sph_keccak512(&ctx_keccak, static_cast<const void*>(&hash[7]), 64);
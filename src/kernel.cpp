@@ -5,8 +5,11 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/assign/list_of.hpp>
+#include <boost/thread.hpp>
 
+#include "crypto/common.h"
 #include "db.h"
+#include "init.h"
 #include "kernel.h"
 #include "script/interpreter.h"
 #include "timedata.h"
@@ -253,7 +256,7 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
 
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
-bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
+bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake, const CBlockIndex** ppindexModifier)
 {
     nStakeModifier = 0;
     if (!mapBlockIndex.count(hashBlockFrom))
@@ -281,6 +284,8 @@ bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int
         }
     }
     nStakeModifier = pindex->nStakeModifier;
+    if (ppindexModifier)
+        *ppindexModifier = pindex;
 
     return true;
 }
@@ -305,6 +310,165 @@ bool CheckStake(const CDataStream& ssUniqueID, CAmount nValueIn, const uint64_t
     return stakeTargetHit(hashProofOfStake, nValueIn, bnTarget);
 }
 
+int nStakeSearchThreads = DEFAULT_STAKE_SEARCH_THREADS;
+
+CStakeKernel::CStakeKernel(uint64_t nStakeModifier, unsigned int nTimeBlockFrom, const CDataStream& ssUniqueID, CAmount nValueIn, const uint256& bnTargetPerCoinDay)
+{
+    // Same layout as CheckStake() without the trailing nTimeTx
+    CDataStream ss(SER_GETHASH, 0);
+    ss << nStakeModifier << nTimeBlockFrom << ssUniqueID;
+    hasherPrefix.Write((const unsigned char*)&ss[0], ss.size());
+
+    bnWeightedTarget = (uint256(nValueIn) / 100) * bnTargetPerCoinDay;
+}
+
+uint256 CStakeKernel::GetHash(unsigned int nTimeTx) const
+{
+    unsigned char buf[CSHA256::OUTPUT_SIZE];
+    unsigned char time[4];
+    WriteLE32(time, nTimeTx);
+
+    CSHA256 hasher(hasherPrefix);
+    hasher.Write(time, sizeof(time)).Finalize(buf);
+
+    uint256 hash;
+    hasher.Reset().Write(buf, sizeof(buf)).Finalize((unsigned char*)&hash);
+    return hash;
+}
+
+bool CStakeKernel::CheckHash(unsigned int nTimeTx, uint256& hashProofOfStake) const
+{
+    hashProofOfStake = GetHash(nTimeTx);
+    return hashProofOfStake < bnWeightedTarget;
+}
+
+namespace {
+
+/** Shared state of one SearchStakeKernels() call */
+class CStakeKernelSearch
+{
+private:
+    const std::vector<CStakeKernel>& vKernels;
+    unsigned int nTimeStart;
+    int nHeightStart;
+
+    boost::mutex cs;
+    unsigned int nBestStep;
+    size_t nBestKernel;
+    uint256 hashBest;
+    uint64_t nHashes;
+
+    // Lowest drift step with a hit so far, STAKE_HASH_DRIFT if none
+    unsigned int GetBestStep()
+    {
+        boost::lock_guard<boost::mutex> lock(cs);
+        return nBestStep;
+    }
+
+public:
+    CStakeKernelSearch(const std::vector<CStakeKernel>& vKernelsIn, unsigned int nTimeStartIn) : vKernels(vKernelsIn), nTimeStart(nTimeStartIn),
+                                                                                               nHeightStart(chainActive.Height()), nBestStep(STAKE_HASH_DRIFT),
+                                                                                               nBestKernel(0), nHashes(0) {}
+
+    /** Hash every nStride-th kernel starting at nFirst, a whole drift step at a time */
+    void Run(size_t nFirst, size_t nStride)
+    {
+        uint64_t nDone = 0;
+        for (unsigned int nStep = 0; nStep < STAKE_HASH_DRIFT; nStep++) {
+            // Another thread already hit at an earlier (later in time) step, or a new block came in
+            if (GetBestStep() < nStep || chainActive.Height() != nHeightStart || ShutdownRequested())
+                break;
+
+            unsigned int nTryTime = nTimeStart + STAKE_HASH_DRIFT - nStep;
+            bool fFound = false;
+            for (size_t i = nFirst; i < vKernels.size(); i += nStride) {
+                uint256 hashProofOfStake;
+                nDone++;
+                if (!vKernels[i].CheckHash(nTryTime, hashProofOfStake))
+                    continue;
+
+                boost::lock_guard<boost::mutex> lock(cs);
+                if (nStep < nBestStep || (nStep == nBestStep && i < nBestKernel)) {
+                    nBestStep = nStep;
+                    nBestKernel = i;
+                    hashBest = hashProofOfStake;
+                }
+                fFound = true;
+                break;
+            }
+            if (fFound)
+                break;
+        }
+
+        boost::lock_guard<boost::mutex> lock(cs);
+        nHashes += nDone;
+    }
+
+    bool GetResult(size_t& nKernel, unsigned int& nTimeTx, uint256& hashProofOfStake) const
+    {
+        if (nBestStep >= STAKE_HASH_DRIFT)
+            return false;
+        nKernel = nBestKernel;
+        nTimeTx = nTimeStart + STAKE_HASH_DRIFT - nBestStep;
+        hashProofOfStake = hashBest;
+        return true;
+    }
+
+    uint64_t GetHashes() const { return nHashes; }
+};
+
+boost::mutex csStakeSearchStats;
+CStakeSearchStats stakeSearchStats;
+
+} // anon namespace
+
+// Kernels per thread below which extra threads are not worth starting
+static const size_t STAKE_SEARCH_THREAD_MIN_KERNELS = 256;
+
+bool SearchStakeKernels(const std::vector<CStakeKernel>& vKernels, unsigned int nTimeStart, size_t& nKernel, unsigned int& nTimeTx, uint256& hashProofOfStake)
+{
+    int64_t nTimeBegin = GetTimeMicros();
+    CStakeKernelSearch search(vKernels, nTimeStart);
+
+    size_t nThreads = std::max(1, std::min(nStakeSearchThreads, MAX_STAKE_SEARCH_THREADS));
+    nThreads = std::min(nThreads, std::max((size_t)1, vKernels.size() / STAKE_SEARCH_THREAD_MIN_KERNELS));
+    if (nThreads > 1) {
+        boost::thread_group threads;
+        for (size_t n = 1; n < nThreads; n++)
+            threads.create_thread(boost::bind(&CStakeKernelSearch::Run, &search, n, nThreads));
+        search.Run(0, nThreads);
+        threads.join_all();
+    } else {
+        search.Run(0, 1);
+    }
+
+    bool fFound = search.GetResult(nKernel, nTimeTx, hashProofOfStake);
+    int64_t nTimeEnd = GetTimeMicros();
+
+    {
+        boost::lock_guard<boost::mutex> lock(csStakeSearchStats);
+        stakeSearchStats.nSearches++;
+        stakeSearchStats.nHashes += search.GetHashes();
+        if (fFound)
+            stakeSearchStats.nKernelsFound++;
+        stakeSearchStats.nLastKernels = vKernels.size();
+        stakeSearchStats.nLastHashes = search.GetHashes();
+        stakeSearchStats.nLastSearchTime = GetTime();
+        stakeSearchStats.nLastSearchMicros = nTimeEnd - nTimeBegin;
+    }
+
+    LogPrint("staking", "%s : %u kernels, %u hashes in %.2fms (%u threads)%s\n", __func__, vKernels.size(), search.GetHashes(),
+             (nTimeEnd - nTimeBegin) * 0.001, nThreads, fFound ? ", kernel found" : "");
+
+    return fFound;
+}
+
+void GetStakeSearchStats(CStakeSearchStats& stats)
+{
+    boost::lock_guard<boost::mutex> lock(csStakeSearchStats);
+    stats = stakeSearchStats;
+}
+
 bool Stake(CStakeInput* stakeInput, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int& nTimeTx, uint256& hashProofOfStake)
 {
     if (nTimeTx < nTimeBlockFrom)
@@ -323,31 +487,11 @@ bool Stake(CStakeInput* stakeInput, unsigned int nBits, unsigned int nTimeBlockF
     if (!stakeInput->GetModifier(nStakeModifier))
         return error("failed to get kernel stake modifier");
 
-    bool fSuccess = false;
-    unsigned int nTryTime = 0;
-    int nHeightStart = chainActive.Height();
-    int nHashDrift = 30;
+    std::vector<CStakeKernel> vKernels;
+    vKernels.push_back(CStakeKernel(nStakeModifier, nTimeBlockFrom, stakeInput->GetUniqueness(), stakeInput->GetValue(), bnTargetPerCoinDay));
 
-    CDataStream ssUniqueID = stakeInput->GetUniqueness();
-    CAmount nValueIn = stakeInput->GetValue();
-    for (int i = 0; i < nHashDrift; i++) //iterate the hashing
-    {
-        // New block came in, move on
-        if (chainActive.Height() != nHeightStart)
-            break;
-
-        // Hash this iteration
-        nTryTime = nTimeTx + nHashDrift - i;
-
-        // If stake hash does not meet the target then continue to next iteration
-        if (!CheckStake(ssUniqueID, nValueIn, nStakeModifier, bnTargetPerCoinDay, nTimeBlockFrom, nTryTime, hashProofOfStake))
-            continue;
-
-        fSuccess = true; // If we make it this far then we have successfully created a stake hash
-
-        nTimeTx = nTryTime;
-        break;
-    }
+    size_t nKernel;
+    bool fSuccess = SearchStakeKernels(vKernels, nTimeTx, nKernel, nTimeTx, hashProofOfStake);
 
     mapHashedBlocks.clear();
     mapHashedBlocks[chainActive.Tip()->nHeight] = GetTime(); // Store a time stamp of when we last hashed on this block
@@ -366,29 +510,34 @@ bool CheckProofOfStake(const CBlock block, uint256& hashProofOfStake, std::uniqu
     const CTxIn& txin = tx.vin[0];
 
     // Construct the stakeinput object
-    // First try finding the previous transaction in database
+    // First try finding the previous transaction in database, then fall back to
+    // the UTXO set, which is all there is for coins loaded from a snapshot
     uint256 hashBlock;
     CTransaction txPrev;
-    if (!GetTransaction(txin.prevout.hash, txPrev, hashBlock, true))
-        return error("CheckProofOfStake() : INFO: read txPrev failed");
+    CScript scriptPubKeyPrev;
+    CBYRONStake* byronInput = new CBYRONStake();
+    stake = std::unique_ptr<CStakeInput>(byronInput);
+    if (GetTransaction(txin.prevout.hash, txPrev, hashBlock, true)) {
+        if (txin.prevout.n >= txPrev.vout.size())
+            return error("CheckProofOfStake() : INFO: txPrev has no output %u", txin.prevout.n);
+        scriptPubKeyPrev = txPrev.vout[txin.prevout.n].scriptPubKey;
+        byronInput->SetInput(txPrev, txin.prevout.n);
+    } else {
+        Coin coin;
+        if (!pcoinsTip->GetCoin(txin.prevout, coin))
+            return error("CheckProofOfStake() : INFO: read txPrev failed");
+        scriptPubKeyPrev = coin.out.scriptPubKey;
+        byronInput->SetInput(txin.prevout, coin);
+    }
 
     // Verify signature and script
-    if (!VerifyScript(txin.scriptSig, txPrev.vout[txin.prevout.n].scriptPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&tx, 0)))
+    if (!VerifyScript(txin.scriptSig, scriptPubKeyPrev, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&tx, 0)))
         return error("CheckProofOfStake() : VerifySignature failed on coinstake %s", tx.GetHash().ToString().c_str());
 
-    CBYRONStake* byronInput = new CBYRONStake();
-    byronInput->SetInput(txPrev, txin.prevout.n);
-    stake = std::unique_ptr<CStakeInput>(byronInput);
-
     CBlockIndex* pindex = stake->GetIndexFrom();
     if (!pindex)
         return error("%s: Failed to find the block index", __func__);
 
-    // Read block header
-    CBlock blockprev;
-    if (!ReadBlockFromDisk(blockprev, pindex->GetBlockPos()))
-        return error("CheckProofOfStake(): INFO: failed to find block");
-
     uint256 bnTargetPerCoinDay;
     bnTargetPerCoinDay.SetCompact(block.nBits);
 
@@ -396,7 +545,7 @@ bool CheckProofOfStake(const CBlock block, uint256& hashProofOfStake, std::uniqu
     if (!stake->GetModifier(nStakeModifier))
         return error("%s failed to get modifier for stake input\n", __func__);
 
-    unsigned int nBlockFromTime = blockprev.nTime;
+    unsigned int nBlockFromTime = pindex->nTime;
     unsigned int nTxTime = block.nTime;
     if (!CheckStake(stake->GetUniqueness(), stake->GetValue(), nStakeModifier, bnTargetPerCoinDay, nBlockFromTime,
                     nTxTime, hashProofOfStake)) {
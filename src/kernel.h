@@ -6,6 +6,7 @@
 #ifndef BITCOIN_KERNEL_H
 #define BITCOIN_KERNEL_H
 
+#include "crypto/sha256.h"
 #include "main.h"
 #include "stakeinput.h"
 
@@ -20,8 +21,58 @@ extern unsigned int getIntervalVersion(bool fTestNet);
 // ratio of group interval length between the last group and the first group
 static const int MODIFIER_INTERVAL_RATIO = 3;
 
-// Compute the hash modifier for proof-of-stake
-bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake);
+// STAKE_HASH_DRIFT: number of future timestamps tried for every stake kernel
+static const unsigned int STAKE_HASH_DRIFT = 30;
+
+// Threads hashing stake kernels in parallel
+static const int DEFAULT_STAKE_SEARCH_THREADS = 1;
+static const int MAX_STAKE_SEARCH_THREADS = 16;
+extern int nStakeSearchThreads;
+
+/**
+ * A stake kernel with the part of the hash input that does not depend on the
+ * coinstake time (modifier, nTimeBlockFrom and uniqueness) already absorbed and
+ * the value weighted target precomputed, so that trying one timestamp costs a
+ * four byte write and the two finalizations.
+ */
+class CStakeKernel
+{
+private:
+    CSHA256 hasherPrefix;
+    uint256 bnWeightedTarget;
+
+public:
+    CStakeKernel(uint64_t nStakeModifier, unsigned int nTimeBlockFrom, const CDataStream& ssUniqueID, CAmount nValueIn, const uint256& bnTargetPerCoinDay);
+
+    uint256 GetHash(unsigned int nTimeTx) const;
+    bool CheckHash(unsigned int nTimeTx, uint256& hashProofOfStake) const;
+};
+
+/** Counters of the stake kernel search, reported by getstakingstatus */
+struct CStakeSearchStats {
+    uint64_t nSearches;
+    uint64_t nKernelsFound;
+    uint64_t nHashes;
+    unsigned int nLastKernels;
+    uint64_t nLastHashes;
+    int64_t nLastSearchTime;   // time of the last search
+    int64_t nLastSearchMicros; // duration of the last search
+
+    CStakeSearchStats() : nSearches(0), nKernelsFound(0), nHashes(0), nLastKernels(0), nLastHashes(0), nLastSearchTime(0), nLastSearchMicros(0) {}
+};
+
+/**
+ * Hash all kernels over the timestamps nTimeStart + STAKE_HASH_DRIFT down to
+ * nTimeStart + 1, one timestamp at a time across all kernels, using up to
+ * nStakeSearchThreads threads. Stops early when the active chain moves on.
+ * On success nKernel, nTimeTx and hashProofOfStake describe the hit with the
+ * latest timestamp, ties going to the lowest kernel index.
+ */
+bool SearchStakeKernels(const std::vector<CStakeKernel>& vKernels, unsigned int nTimeStart, size_t& nKernel, unsigned int& nTimeTx, uint256& hashProofOfStake);
+void GetStakeSearchStats(CStakeSearchStats& stats);
+
+// Compute the hash modifier for proof-of-stake; ppindexModifier, if given, receives the block it was taken from
+bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake, const CBlockIndex** ppindexModifier = NULL);
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
 
 bool CheckStake(const CDataStream& ssUniqueID, CAmount nValueIn, const uint64_t nStakeModifier, const uint256& bnTarget, unsigned int nTimeBlockFrom, unsigned int& nTimeTx, uint256& hashProofOfStake);
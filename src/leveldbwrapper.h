@@ -59,6 +59,11 @@ public:
 
         batch.Delete(slKey);
     }
+
+    void Clear()
+    {
+        batch.Clear();
+    }
 };
 
 class CLevelDBWrapper
@@ -163,6 +168,12 @@ public:
         return WriteBatch(batch, true);
     }
 
+    //! Compact the whole key range, dropping overwritten and erased entries
+    void CompactFull()
+    {
+        pdb->CompactRange(NULL, NULL);
+    }
+
     // not exactly clean encapsulation, but it's easiest for now
     leveldb::Iterator* NewIterator()
     {
@@ -9,6 +9,7 @@
 #include "main.h"
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
 #include "blocksignature.h"
 #include "chainparams.h"
 #include "checkpoints.h"
@@ -18,6 +19,7 @@
 #include "masternode-payments.h"
 #include "masternodeman.h"
 #include "merkleblock.h"
+#include "msgsigverify.h"
 #include "net.h"
 #include "obfuscation.h"
 #include "pow.h"
@@ -26,6 +28,7 @@
 #include "swifttx.h"
 #include "txdb.h"
 #include "txmempool.h"
+#include "txoutsnapshot.h"
 #include "ui_interface.h"
 #include "util.h"
 #include "utilmoneystr.h"
@@ -59,17 +62,25 @@ set<pair<COutPoint, unsigned int> > setStakeSeen;
 map<unsigned int, unsigned int> mapHashedBlocks;
 CChain chainActive;
 CBlockIndex* pindexBestHeader = NULL;
+uint256 hashAssumeValid;
 int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
+int nPrefetchThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = true;
+bool fAddressIndex = DEFAULT_ADDRESSINDEX;
+bool fSpentIndex = DEFAULT_SPENTINDEX;
+bool fTimestampIndex = DEFAULT_TIMESTAMPINDEX;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
 bool fVerifyingBlocks = false;
-unsigned int nCoinCacheSize = 5000;
+bool fHavePruned = false;
+bool fPruneMode = false;
+uint64_t nPruneTarget = 0;
+size_t nCoinCacheUsage = 5000 * 300;
 bool fAlerts = DEFAULT_ALERTS;
 
 unsigned int nStakeMinAge = 20 * 60;
@@ -94,6 +105,7 @@ map<uint256, int64_t> mapRejectedBlocks;
 void EraseOrphansFor(NodeId peer);
 
 static void CheckBlockIndex();
+static bool FinalizeStakeModifierChecksum(CBlockIndex* pindex, CValidationState& state);
 
 /** Constant stuff for coinbase transactions we create: */
 CScript COINBASE_FLAGS;
@@ -133,12 +145,21 @@ CBlockIndex* pindexBestInvalid;
 set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexCandidates;
 /** Number of nodes with fSyncStarted. */
 int nSyncStarted = 0;
+/** Whether a peer's headers ran out before we did, so that every peer can be asked where it stands. Protected by cs_main. */
+bool fHeadersSynced = false;
 /** All pairs A->B, where A (or one if its ancestors) misses transactions, but B has transactions. */
 multimap<CBlockIndex*, CBlockIndex*> mapBlocksUnlinked;
+/** Number of block index entries without a transaction count: headers whose block never arrived. Protected by cs_main. */
+int nBlockIndexHeadersOnly = 0;
+
+/** Mappings of the block and undo files read most recently */
+static CBlockFileMapper blockFileMapper(MAX_MAPPED_BLOCK_FILES);
 
 CCriticalSection cs_LastBlockFile;
 std::vector<CBlockFileInfo> vinfoBlockFile;
 int nLastBlockFile = 0;
+/** Whether block files grew since -prune last looked for ones to delete */
+static bool fCheckForPruning = false;
 
 /**
  * Every received block is assigned a unique and increasing identifier, so we
@@ -167,6 +188,21 @@ map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 /** Number of blocks in flight with validated headers. */
 int nQueuedValidatedHeaders = 0;
 
+/**
+ * Blocks that were downloaded before their parent, kept until the parent is
+ * stored. A proof-of-stake block can only be checked once its parent is, so
+ * blocks fetched in parallel are processed in chain order. Protected by cs_main.
+ */
+struct PendingBlock {
+    CBlock block;
+    NodeId nodeid;          //! Peer that sent it.
+    std::string strCommand; //! Message it came in, for reject messages.
+    size_t nSize;
+};
+map<uint256, PendingBlock> mapBlocksPending;
+multimap<uint256, uint256> mapBlocksPendingByPrev;
+size_t nBlocksPendingSize = 0;
+
 /** Number of preferable block download peers. */
 int nPreferredDownload = 0;
 
@@ -215,14 +251,27 @@ struct CNodeState {
     uint256 hashLastUnknownBlock;
     //! The last full block we both have.
     CBlockIndex* pindexLastCommonBlock;
+    //! Whether the peer has acknowledged our version, so that what it told us about itself is known.
+    bool fGotVerack;
     //! Whether we've started headers synchronization with this peer.
     bool fSyncStarted;
+    //! Whether we stopped taking this peer's headers until block download catches up.
+    bool fHeadersDeferred;
     //! Since when we're stalling block download progress (in microseconds), or 0.
     int64_t nStallingSince;
     list<QueuedBlock> vBlocksInFlight;
     int nBlocksInFlight;
+    //! How many blocks we let this peer have in flight, adapted to how quickly it delivers.
+    int nBlocksInFlightLimit;
+    //! Number of requested blocks this peer delivered.
+    int64_t nBlocksDownloaded;
+    //! Moving average of the time between asking for a block and receiving it, in microseconds.
+    int64_t nBlockLatency;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Block being rebuilt from a cmpctblock this peer sent, waiting for its blocktxn.
+    std::shared_ptr<PartiallyDownloadedBlock> partialBlock;
+    uint256 hashPartialBlock;
 
     CNodeState()
     {
@@ -232,9 +281,14 @@ struct CNodeState {
         pindexBestKnownBlock = NULL;
         hashLastUnknownBlock = uint256(0);
         pindexLastCommonBlock = NULL;
+        fGotVerack = false;
         fSyncStarted = false;
+        fHeadersDeferred = false;
         nStallingSince = 0;
         nBlocksInFlight = 0;
+        nBlocksInFlightLimit = DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER;
+        nBlocksDownloaded = 0;
+        nBlockLatency = 0;
         fPreferredDownload = false;
     }
 };
@@ -302,11 +356,21 @@ void FinalizeNode(NodeId nodeid)
 }
 
 // Requires cs_main.
-void MarkBlockAsReceived(const uint256& hash)
+void MarkBlockAsReceived(const uint256& hash, bool fDelivered = true)
 {
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
         CNodeState* state = State(itInFlight->second.first);
+        if (fDelivered) {
+            int64_t nLatency = GetTimeMicros() - itInFlight->second.second->nTime;
+            state->nBlockLatency = state->nBlocksDownloaded ? (state->nBlockLatency * 7 + nLatency) / 8 : nLatency;
+            state->nBlocksDownloaded++;
+            // Additive increase: a peer that keeps up with everything we ask
+            // of it gets one more block in flight
+            if (state->nBlocksInFlight >= state->nBlocksInFlightLimit && nLatency < 1000000 * BLOCK_DOWNLOAD_TARGET_LATENCY &&
+                state->nBlocksInFlightLimit < MAX_BLOCKS_IN_TRANSIT_PER_PEER)
+                state->nBlocksInFlightLimit++;
+        }
         nQueuedValidatedHeaders -= itInFlight->second.second->fValidatedHeaders;
         state->vBlocksInFlight.erase(itInFlight->second.second);
         state->nBlocksInFlight--;
@@ -322,7 +386,7 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex
     assert(state != NULL);
 
     // Make sure it's not listed somewhere already.
-    MarkBlockAsReceived(hash);
+    MarkBlockAsReceived(hash, false);
 
     QueuedBlock newentry = {hash, pindex, GetTimeMicros(), nQueuedValidatedHeaders, pindex != NULL};
     nQueuedValidatedHeaders += newentry.fValidatedHeaders;
@@ -445,9 +509,12 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
                 // We consider the chain that this peer is on invalid.
                 return;
             }
-            if (pindex->nStatus & BLOCK_HAVE_DATA) {
+            if (pindex->nStatus & BLOCK_HAVE_DATA || chainActive.Contains(pindex)) {
+                // Active chain blocks may lack data when it came from a UTXO snapshot
                 if (pindex->nChainTx)
                     state->pindexLastCommonBlock = pindex;
+            } else if (mapBlocksPending.count(pindex->GetBlockHash())) {
+                // Downloaded already, waiting for its parent.
             } else if (mapBlocksInFlight.count(pindex->GetBlockHash()) == 0) {
                 // The block is not already downloaded, and not yet in flight.
                 if (pindex->nHeight > nWindowEnd) {
@@ -486,6 +553,9 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats& stats)
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.nBlocksInFlightLimit = state->nBlocksInFlightLimit;
+    stats.nBlocksDownloaded = state->nBlocksDownloaded;
+    stats.nBlockLatency = state->nBlockLatency;
 
     return true;
 }
@@ -495,6 +565,7 @@ void RegisterNodeSignals(CNodeSignals& nodeSignals)
     nodeSignals.GetHeight.connect(&GetHeight);
     nodeSignals.ProcessMessages.connect(&ProcessMessages);
     nodeSignals.SendMessages.connect(&SendMessages);
+    nodeSignals.ProcessWorkerMessage.connect(&ProcessWorkerMessage);
     nodeSignals.InitializeNode.connect(&InitializeNode);
     nodeSignals.FinalizeNode.connect(&FinalizeNode);
 }
@@ -504,6 +575,7 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals)
     nodeSignals.GetHeight.disconnect(&GetHeight);
     nodeSignals.ProcessMessages.disconnect(&ProcessMessages);
     nodeSignals.SendMessages.disconnect(&SendMessages);
+    nodeSignals.ProcessWorkerMessage.disconnect(&ProcessWorkerMessage);
     nodeSignals.InitializeNode.disconnect(&InitializeNode);
     nodeSignals.FinalizeNode.disconnect(&FinalizeNode);
 }
@@ -524,6 +596,8 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache* pcoinsTip = NULL;
+CCoinsViewPrefetch* pcoinsPrefetch = NULL;
+CCoinsViewWriteBehind* pcoinsWriteBehind = NULL;
 CBlockTreeDB* pblocktree = NULL;
 CSporkDB* pSporkDB = NULL;
 
@@ -813,16 +887,23 @@ int GetInputAge(CTxIn& vin)
         CCoinsViewMemPool viewMempool(pcoinsTip, mempool);
         view.SetBackend(viewMempool); // temporarily switch cache backend to db+mempool view
 
-        const CCoins* coins = view.AccessCoins(vin.prevout.hash);
+        const Coin& coin = view.AccessCoin(vin.prevout);
 
-        if (coins) {
-            if (coins->nHeight < 0) return 0;
-            return (chainActive.Tip()->nHeight + 1) - coins->nHeight;
-        } else
+        if (!coin.IsSpent())
+            return (chainActive.Tip()->nHeight + 1) - (int)coin.nHeight;
+        else
             return -1;
     }
 }
 
+bool GetUTXOCoin(const COutPoint& outpoint, Coin& coin)
+{
+    LOCK(cs_main);
+    if (!pcoinsTip->GetCoin(outpoint, coin))
+        return false;
+    return !coin.IsSpent();
+}
+
 int GetInputAgeIX(uint256 nTXHash, CTxIn& vin)
 {
     int sigs = 0;
@@ -978,7 +1059,19 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age)
+{
+    int expired = pool.Expire(GetTime() - age);
+    if (expired != 0)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
+
+    std::vector<COutPoint> vNoSpendsRemaining;
+    pool.TrimToSize(limit, &vNoSpendsRemaining);
+    BOOST_FOREACH (const COutPoint& removed, vNoSpendsRemaining)
+        pcoinsTip->Uncache(removed);
+}
+
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees, bool fOverrideMempoolLimit)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1042,14 +1135,16 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         view.SetBackend(viewMemPool);
 
         // do we already have it?
-        if (view.HaveCoins(hash))
-            return false;
+        for (size_t out = 0; out < tx.vout.size(); out++) {
+            if (view.HaveCoin(COutPoint(hash, out)))
+                return false;
+        }
 
         // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // only helps filling in pfMissingInputs (to determine missing vs spent).
+        // A missing input may also be spent already; either way the
+        // transaction is kept as an orphan until its parents show up.
         for (const CTxIn& txin : tx.vin) {
-            if (!view.HaveCoins(txin.prevout.hash)) {
+            if (!view.HaveCoin(txin.prevout)) {
                 if (pfMissingInputs)
                     *pfMissingInputs = true;
                 return false;
@@ -1095,9 +1190,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
 
         CAmount nValueOut = tx.GetValueOut();
         CAmount nFees = nValueIn - nValueOut;
-        double dPriority = 0;
-        
-        view.GetPriority(tx, chainActive.Height());
+        double dPriority = view.GetPriority(tx, chainActive.Height());
 
         CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
         unsigned int nSize = entry.GetTxSize();
@@ -1113,6 +1206,13 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
                                         hash.ToString(), nFees, txMinFee),
                     REJECT_INSUFFICIENTFEE, "insufficient fee");
 
+            CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+            if (mempoolRejectFee > 0 && nFees < mempoolRejectFee) {
+                return state.DoS(0, error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                                        hash.ToString(), nFees, mempoolRejectFee),
+                    REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+            }
+
             if (GetBoolArg("-relaypriority", true) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
                 return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
             }
@@ -1147,6 +1247,18 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
                 nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
 
 
+        // Calculate in-mempool ancestors, up to a limit.
+        CTxMemPool::setEntries setAncestors;
+        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000;
+        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000;
+        std::string errString;
+        if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
+            return state.DoS(0, error("AcceptToMemoryPool : too long mempool chain %s: %s", hash.ToString(), errString),
+                REJECT_NONSTANDARD, "too-long-mempool-chain");
+        }
+
         bool fCLTVHasMajority = true;
 
         // Check against previous transactions
@@ -1175,7 +1287,14 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         }
 
         // Store transaction in memory
-        pool.addUnchecked(hash, entry);
+        pool.addUnchecked(hash, entry, setAncestors);
+
+        // trim mempool and check if tx was trimmed
+        if (!fOverrideMempoolLimit) {
+            LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+            if (!pool.exists(hash))
+                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+        }
     }
 
     SyncWithWallets(tx, NULL);
@@ -1239,14 +1358,16 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
             view.SetBackend(viewMemPool);
 
             // do we already have it?
-            if (view.HaveCoins(hash))
-                return false;
+            for (size_t out = 0; out < tx.vout.size(); out++) {
+                if (view.HaveCoin(COutPoint(hash, out)))
+                    return false;
+            }
 
             // do all inputs exist?
-            // Note that this does not check for the presence of actual outputs (see the next check for that),
-            // only helps filling in pfMissingInputs (to determine missing vs spent).
+            // A missing input may also be spent already; either way the
+            // transaction is kept as an orphan until its parents show up.
             for (const CTxIn& txin : tx.vin) {
-                if (!view.HaveCoins(txin.prevout.hash)) {
+                if (!view.HaveCoin(txin.prevout)) {
                     if (pfMissingInputs)
                         *pfMissingInputs = true;
                     return false;
@@ -1359,6 +1480,47 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
     return true;
 }
 
+bool GetSpentIndex(const CSpentIndexKey& key, CSpentIndexValue& value)
+{
+    if (!fSpentIndex)
+        return false;
+
+    return pblocktree->ReadSpentIndex(key, value);
+}
+
+bool GetAddressIndex(unsigned int type, const uint160& addressHash, std::vector<std::pair<CAddressIndexKey, CAmount> >& addressIndex, int nStart, int nEnd)
+{
+    if (!fAddressIndex)
+        return error("%s : address index not enabled", __func__);
+
+    if (!pblocktree->ReadAddressIndex(type, addressHash, addressIndex, nStart, nEnd))
+        return error("%s : unable to get txids for address", __func__);
+
+    return true;
+}
+
+bool GetAddressUnspent(unsigned int type, const uint160& addressHash, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& unspentOutputs)
+{
+    if (!fAddressIndex)
+        return error("%s : address index not enabled", __func__);
+
+    if (!pblocktree->ReadAddressUnspentIndex(type, addressHash, unspentOutputs))
+        return error("%s : unable to get txids for address", __func__);
+
+    return true;
+}
+
+bool GetTimestampIndex(unsigned int nHigh, unsigned int nLow, std::vector<uint256>& vHashes)
+{
+    if (!fTimestampIndex)
+        return error("%s : timestamp index not enabled", __func__);
+
+    if (!pblocktree->ReadTimestampIndex(nHigh, nLow, vHashes))
+        return error("%s : unable to get hashes for timestamps", __func__);
+
+    return true;
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock, bool fAllowSlow)
 {
@@ -1374,14 +1536,23 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
         if (fTxIndex) {
             CDiskTxPos postx;
             if (pblocktree->ReadTxIndex(hash, postx)) {
-                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-                if (file.IsNull())
-                    return error("%s: OpenBlockFile failed", __func__);
                 CBlockHeader header;
                 try {
-                    file >> header;
-                    fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                    file >> txOut;
+                    CDiskBlockView view;
+                    if (blockFileMapper.GetRecord(postx, "blk", 0, view)) {
+                        // Only the header and the transaction are deserialized
+                        CMemoryReader reader = view.GetReader();
+                        reader >> header;
+                        reader.ignore(postx.nTxOffset);
+                        reader >> txOut;
+                    } else {
+                        CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+                        if (file.IsNull())
+                            return error("%s: OpenBlockFile failed", __func__);
+                        file >> header;
+                        fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
+                        file >> txOut;
+                    }
                 } catch (std::exception& e) {
                     return error("%s : Deserialize or I/O error - %s", __func__, e.what());
                 }
@@ -1399,10 +1570,9 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
         if (fAllowSlow) { 
             int nHeight = -1;
             {
-                CCoinsViewCache& view = *pcoinsTip;
-                const CCoins* coins = view.AccessCoins(hash);
-                if (coins)
-                    nHeight = coins->nHeight;
+                const Coin& coin = AccessByTxid(*pcoinsTip, hash);
+                if (!coin.IsSpent())
+                    nHeight = coin.nHeight;
             }
             if (nHeight > 0)
                 pindexSlow = chainActive[nHeight];
@@ -1456,14 +1626,18 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk : OpenBlockFile failed");
-
     // Read block
     try {
-        filein >> block;
+        CDiskBlockView view;
+        if (blockFileMapper.GetRecord(pos, "blk", 0, view)) {
+            view.GetReader() >> block;
+        } else {
+            // Open history file to read
+            CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+            if (filein.IsNull())
+                return error("ReadBlockFromDisk : OpenBlockFile failed");
+            filein >> block;
+        }
     } catch (std::exception& e) {
         return error("%s : Deserialize or I/O error - %s", __func__, e.what());
     }
@@ -1488,6 +1662,23 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return true;
 }
 
+bool ReadBlockViewFromDisk(CDiskBlockView& view, const CBlockIndex* pindex)
+{
+    if (!blockFileMapper.GetRecord(pindex->GetBlockPos(), "blk", 0, view))
+        return false;
+
+    // Only the header is deserialized to make sure this is the right block
+    CBlockHeader header;
+    try {
+        view.GetReader() >> header;
+    } catch (std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    if (header.GetHash() != pindex->GetBlockHash())
+        return error("%s : block=%s index=%s", __func__, header.GetHash().ToString(), pindex->GetBlockHash().ToString());
+    return true;
+}
+
 
 double ConvertBitsToDouble(unsigned int nBits)
 {
@@ -1614,12 +1805,13 @@ void CheckForkWarningConditionsOnNewFork(CBlockIndex* pindexNewForkTip)
     CheckForkWarningConditions();
 }
 
-// Requires cs_main.
+// Takes cs_main itself, as the gossip handlers call this from the message worker threads.
 void Misbehaving(NodeId pnode, int howmuch)
 {
     if (howmuch == 0)
         return;
 
+    LOCK(cs_main);
     CNodeState* state = State(pnode);
     if (state == NULL)
         return;
@@ -1674,14 +1866,14 @@ void UpdateCoins(const CTransaction& tx, CValidationState& state, CCoinsViewCach
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
         BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-            txundo.vprevout.push_back(CTxInUndo());
-            bool ret = inputs.ModifyCoins(txin.prevout.hash)->Spend(txin.prevout, txundo.vprevout.back());
+            txundo.vprevout.push_back(Coin());
+            bool ret = inputs.SpendCoin(txin.prevout, &txundo.vprevout.back());
             assert(ret);
         }
     }
 
     // Add outputs
-    inputs.ModifyCoins(tx.GetHash())->FromTx(tx, nHeight);
+    AddCoins(inputs, tx, nHeight);
 }
 
 bool CScriptCheck::operator()()
@@ -1705,12 +1897,12 @@ CAmount GetInvalidUTXOValue()
     for (auto out : invalid_out::setInvalidOutPoints) {
         bool fSpent = false;
         CCoinsViewCache cache(pcoinsTip);
-        const CCoins *coins = cache.AccessCoins(out.hash);
-        if(!coins || !coins->IsAvailable(out.n))
+        const Coin& coin = cache.AccessCoin(out);
+        if (coin.IsSpent())
             fSpent = true;
 
         if (!fSpent)
-            nValue += coins->vout[out.n].nValue;
+            nValue += coin.out.nValue;
     }
 
     return nValue;
@@ -1735,20 +1927,20 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
         CAmount nFees = 0;
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
             const COutPoint& prevout = tx.vin[i].prevout;
-            const CCoins* coins = inputs.AccessCoins(prevout.hash);
-            assert(coins);
+            const Coin& coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
             // If prev is coinbase, check that it's matured
-            if (coins->IsCoinBase() || coins->IsCoinStake()) {
-                if (nSpendHeight - coins->nHeight < Params().COINBASE_MATURITY())
+            if (coin.IsCoinBase() || coin.IsCoinStake()) {
+                if (nSpendHeight - (int)coin.nHeight < Params().COINBASE_MATURITY())
                     return state.Invalid(
-                        error("CheckInputs() : tried to spend coinbase at depth %d, coinstake=%d", nSpendHeight - coins->nHeight, coins->IsCoinStake()),
+                        error("CheckInputs() : tried to spend coinbase at depth %d, coinstake=%d", nSpendHeight - (int)coin.nHeight, coin.IsCoinStake()),
                         REJECT_INVALID, "bad-txns-premature-spend-of-coinbase");
             }
 
             // Check for negative or overflow input values
-            nValueIn += coins->vout[prevout.n].nValue;
-            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, error("CheckInputs() : txin values out of range"),
                     REJECT_INVALID, "bad-txns-inputvalues-outofrange");
         }
@@ -1779,11 +1971,11 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
         if (fScriptChecks) {
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint& prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore);
+                CScriptCheck check(coin.out, tx, i, flags, cacheStore);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1795,7 +1987,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check(*coins, tx, i,
+                        CScriptCheck check(coin.out, tx, i,
                             flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
                         if (check())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
@@ -1837,32 +2029,42 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
         return error("DisconnectBlock() : block and undo data inconsistent");
 
+    // Only update the optional indexes when disconnecting the tip, not from VerifyDB
+    bool fUpdateIndexes = !pfClean && (fAddressIndex || fSpentIndex);
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
+
     // Undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
         const CTransaction& tx = block.vtx[i];
 
         uint256 hash = tx.GetHash();
 
+        if (fUpdateIndexes && fAddressIndex) {
+            for (unsigned int k = tx.vout.size(); k-- > 0;) {
+                const CTxOut& out = tx.vout[k];
+                unsigned int addressType;
+                uint160 hashBytes;
+                if (!GetAddressIndexKey(out.scriptPubKey, addressType, hashBytes))
+                    continue;
+
+                // undo receiving activity and the unspent output
+                addressIndex.push_back(make_pair(CAddressIndexKey(addressType, hashBytes, pindex->nHeight, i, hash, k, false), out.nValue));
+                addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(addressType, hashBytes, hash, k), CAddressUnspentValue()));
+            }
+        }
+
         // Check that all outputs are available and match the outputs in the block itself
-        // exactly. Note that transactions with only provably unspendable outputs won't
-        // have outputs available even in the block itself, so we handle that case
-        // specially with outsEmpty.
-        {
-            CCoins outsEmpty;
-            CCoinsModifier outs = view.ModifyCoins(hash);
-            outs->ClearUnspendable();
-
-            CCoins outsBlock(tx, pindex->nHeight);
-            // The CCoins serialization does not serialize negative numbers.
-            // No network rules currently depend on the version here, so an inconsistency is harmless
-            // but it must be corrected before txout nversion ever influences a network rule.
-            if (outsBlock.nVersion < 0)
-                outs->nVersion = outsBlock.nVersion;
-            if (*outs != outsBlock)
+        // exactly. Provably unspendable outputs never made it into the coins view.
+        for (unsigned int k = 0; k < tx.vout.size(); k++) {
+            if (tx.vout[k].scriptPubKey.IsUnspendable())
+                continue;
+            Coin coin;
+            bool fSpent = view.SpendCoin(COutPoint(hash, k), &coin);
+            if (!fSpent || tx.vout[k] != coin.out || (unsigned int)pindex->nHeight != coin.nHeight ||
+                tx.IsCoinBase() != coin.fCoinBase || tx.IsCoinStake() != coin.fCoinStake)
                 fClean = fClean && error("DisconnectBlock() : added transaction mismatch? database corrupted");
-
-            // Remove outputs
-            outs->Clear();
         }
 
         // Restore inputs
@@ -1872,29 +2074,53 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
                 return error("DisconnectBlock() : transaction and undo data inconsistent - txundo.vprevout.siz=%d tx.vin.siz=%d", txundo.vprevout.size(), tx.vin.size());
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint& out = tx.vin[j].prevout;
-                const CTxInUndo& undo = txundo.vprevout[j];
-                CCoinsModifier coins = view.ModifyCoins(out.hash);
-                if (undo.nHeight != 0) {
-                    // Undo data contains height: this is the last output of the prevout tx being spent
-                    if (!coins->IsPruned())
-                        fClean = fClean && error("DisconnectBlock() : undo data overwriting existing transaction");
-                    coins->Clear();
-                    coins->fCoinBase = undo.fCoinBase;
-                    coins->nHeight = undo.nHeight;
-                    coins->nVersion = undo.nVersion;
-                } else {
-                    if (coins->IsPruned())
-                        fClean = fClean && error("DisconnectBlock() : undo data adding output to missing transaction");
-                }
-                if (coins->IsAvailable(out.n))
+                Coin undo = txundo.vprevout[j];
+                bool fOverwrite = view.HaveCoin(out);
+                if (fOverwrite)
                     fClean = fClean && error("DisconnectBlock() : undo data overwriting existing output");
-                if (coins->vout.size() < out.n + 1)
-                    coins->vout.resize(out.n + 1);
-                coins->vout[out.n] = undo.txout;
+                if (undo.nHeight == 0) {
+                    // Undo records written before the per-output format only carry
+                    // the metadata on the last spend of a transaction; that spend
+                    // was restored first, so a sibling output has it.
+                    const Coin& alternate = AccessByTxid(view, out.hash);
+                    if (alternate.IsSpent())
+                        return error("DisconnectBlock() : undo data adding output to missing transaction");
+                    undo.nHeight = alternate.nHeight;
+                    undo.fCoinBase = alternate.fCoinBase;
+                    undo.fCoinStake = alternate.fCoinStake;
+                }
+                const CTxOut txout = undo.out;
+                const unsigned int nUndoHeight = undo.nHeight;
+                view.AddCoin(out, std::move(undo), fOverwrite);
+
+                if (fUpdateIndexes) {
+                    unsigned int addressType;
+                    uint160 hashBytes;
+                    if (fAddressIndex && GetAddressIndexKey(txout.scriptPubKey, addressType, hashBytes)) {
+                        // undo spending activity and restore the unspent output
+                        addressIndex.push_back(make_pair(CAddressIndexKey(addressType, hashBytes, pindex->nHeight, i, hash, j, true), txout.nValue * -1));
+                        addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(addressType, hashBytes, out.hash, out.n), CAddressUnspentValue(txout.nValue, txout.scriptPubKey, nUndoHeight)));
+                    }
+                    if (fSpentIndex)
+                        spentIndex.push_back(make_pair(CSpentIndexKey(out.hash, out.n), CSpentIndexValue()));
+                }
             }
         }
     }
 
+    if (fUpdateIndexes) {
+        if (fAddressIndex) {
+            if (!pblocktree->EraseAddressIndex(addressIndex))
+                return state.Abort("Failed to delete address index");
+            if (!pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex))
+                return state.Abort("Failed to write address unspent index");
+        }
+        if (fSpentIndex && !pblocktree->UpdateSpentIndex(spentIndex))
+            return state.Abort("Failed to delete spent index");
+    }
+    if (!pfClean && fTimestampIndex && !pblocktree->EraseTimestampIndex(CTimestampIndexKey(pindex->nTime, pindex->GetBlockHash())))
+        return state.Abort("Failed to delete timestamp index");
+
     // Move best block pointer to prevout block
     view.SetBestBlock(pindex->pprev->GetBlockHash());
 
@@ -1939,54 +2165,256 @@ void ThreadScriptCheck()
     scriptcheckqueue.Thread();
 }
 
-bool RecalculateBYRONSupply(int nHeightStart)
+/**
+ * Queue of work for the coins prefetch threads. The thread connecting blocks
+ * pushes blocks that are about to be connected (either by disk position, or
+ * directly as a list of input outpoints); the workers read the blocks, split
+ * their inputs into batches and load them from the coins database into
+ * pcoinsPrefetch, so ConnectBlock finds them in memory.
+ */
+class CCoinsPrefetchQueue
 {
-    if (nHeightStart > chainActive.Height())
-        return false;
+private:
+    //! Number of outpoints looked up by a worker in one go
+    static const unsigned int nBatchSize = 16;
 
-    CBlockIndex* pindex = chainActive[nHeightStart];
-    CAmount nSupplyPrev = pindex->pprev->nMoneySupply;
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
 
-    while (true) {
-        if (pindex->nHeight % 1000 == 0)
-            LogPrintf("%s : block %d...\n", __func__, pindex->nHeight);
+    //! Blocks still to be read from disk
+    std::deque<CDiskBlockPos> queueBlocks;
+    //! Batches of outpoints still to be looked up
+    std::deque<std::vector<COutPoint> > queueOutpoints;
+    //! Blocks recently queued, so re-entering ActivateBestChainStep does not repeat work
+    mruset<uint256> setQueued;
 
-        CBlock block;
-        assert(ReadBlockFromDisk(block, pindex));
+    void PushOutpointsLocked(const std::vector<COutPoint>& vOutpoints)
+    {
+        for (unsigned int i = 0; i < vOutpoints.size(); i += nBatchSize) {
+            queueOutpoints.push_back(std::vector<COutPoint>(vOutpoints.begin() + i, vOutpoints.begin() + std::min<size_t>(i + nBatchSize, vOutpoints.size())));
+        }
+        condWorker.notify_all();
+    }
 
-        CAmount nValueIn = 0;
-        CAmount nValueOut = 0;
-        for (const CTransaction& tx : block.vtx) {
-            for (unsigned int i = 0; i < tx.vin.size(); i++) {
-                if (tx.IsCoinBase())
-                    break;
+public:
+    CCoinsPrefetchQueue() : setQueued(64) {}
+
+    //! Collect the outpoints spent by block that it does not create itself
+    static void GetBlockInputs(const CBlock& block, std::vector<COutPoint>& vOutpoints)
+    {
+        std::set<uint256> setCreated;
+        BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+            if (!tx.IsCoinBase()) {
+                BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+                    if (!setCreated.count(txin.prevout.hash))
+                        vOutpoints.push_back(txin.prevout);
+                }
+            }
+            setCreated.insert(tx.GetHash());
+        }
+    }
+
+    void PushBlock(const uint256& hashBlock, const CDiskBlockPos& pos)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (!setQueued.insert(hashBlock).second)
+            return;
+        queueBlocks.push_back(pos);
+        condWorker.notify_one();
+    }
+
+    void PushOutpoints(const uint256& hashBlock, const std::vector<COutPoint>& vOutpoints)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (!setQueued.insert(hashBlock).second)
+            return;
+        PushOutpointsLocked(vOutpoints);
+    }
+
+    //! Drop the work not yet picked up and forget which blocks were queued, so they can be queued again
+    void Clear()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        queueBlocks.clear();
+        queueOutpoints.clear();
+        setQueued.clear();
+    }
 
-                COutPoint prevout = tx.vin[i].prevout;
-                CTransaction txPrev;
-                uint256 hashBlock;
-                assert(GetTransaction(prevout.hash, txPrev, hashBlock, true));
-                nValueIn += txPrev.vout[prevout.n].nValue;
+    void Thread()
+    {
+        while (true) {
+            CDiskBlockPos pos;
+            std::vector<COutPoint> vOutpoints;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queueBlocks.empty() && queueOutpoints.empty())
+                    condWorker.wait(lock); // interruption point
+                // Finish the lookups already split up before reading more blocks.
+                if (!queueOutpoints.empty()) {
+                    vOutpoints.swap(queueOutpoints.front());
+                    queueOutpoints.pop_front();
+                } else {
+                    pos = queueBlocks.front();
+                    queueBlocks.pop_front();
+                }
             }
 
-            for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                if (i == 0 && tx.IsCoinStake())
+            if (!pos.IsNull()) {
+                CBlock block;
+                if (!ReadBlockFromDisk(block, pos))
                     continue;
+                GetBlockInputs(block, vOutpoints);
+                boost::unique_lock<boost::mutex> lock(mutex);
+                PushOutpointsLocked(vOutpoints);
+                continue;
+            }
 
-                nValueOut += tx.vout[i].nValue;
+            BOOST_FOREACH (const COutPoint& outpoint, vOutpoints) {
+                boost::this_thread::interruption_point();
+                pcoinsPrefetch->Prefetch(outpoint);
             }
         }
+    }
+};
+
+static CCoinsPrefetchQueue coinsprefetchqueue;
+
+void ThreadCoinsPrefetch()
+{
+    RenameThread("byron-prefetch");
+    coinsprefetchqueue.Thread();
+}
+
+/**
+ * Start loading the inputs of the blocks that follow vpindexToConnect[nPos]
+ * (the list is in reverse connection order) while it is being connected.
+ */
+static void PrefetchBlockInputs(const std::vector<CBlockIndex*>& vpindexToConnect, int nPos)
+{
+    AssertLockHeld(cs_main);
+    if (pcoinsPrefetch == NULL)
+        return;
+    for (int i = nPos - 1; i >= 0 && i >= nPos - PREFETCH_BLOCKS_AHEAD; i--) {
+        const CBlockIndex* pindex = vpindexToConnect[i];
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+            break;
+        coinsprefetchqueue.PushBlock(pindex->GetBlockHash(), pindex->GetBlockPos());
+    }
+}
+
+/** Start loading the inputs of a block already in memory that are not yet in pcoinsTip. */
+static void PrefetchBlockInputs(const CBlock& block)
+{
+    AssertLockHeld(cs_main);
+    if (pcoinsPrefetch == NULL)
+        return;
+    std::vector<COutPoint> vOutpoints;
+    CCoinsPrefetchQueue::GetBlockInputs(block, vOutpoints);
+    std::vector<COutPoint> vMissing;
+    BOOST_FOREACH (const COutPoint& outpoint, vOutpoints) {
+        if (!pcoinsTip->HaveCoinInCache(outpoint))
+            vMissing.push_back(outpoint);
+    }
+    if (!vMissing.empty())
+        coinsprefetchqueue.PushOutpoints(block.GetHash(), vMissing);
+}
+
+/** Rebuild the transaction totals of a connected block from its block and undo data */
+static bool ReadBlockStats(const CBlockIndex* pindex, CBlockStats& stats)
+{
+    stats.SetNull();
+
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex))
+        return error("%s : failed to read block %s", __func__, pindex->GetBlockHash().ToString());
+
+    CBlockUndo blockUndo;
+    if (pindex->pprev) {
+        CDiskBlockPos pos = pindex->GetUndoPos();
+        if (pos.IsNull() || !blockUndo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
+            return error("%s : failed to read undo data of block %s", __func__, pindex->GetBlockHash().ToString());
+        if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
+            return error("%s : block and undo data inconsistent", __func__);
+    }
+
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = block.vtx[i];
+        CAmount nTxValueOut = tx.GetValueOut();
+        stats.nValueOut += nTxValueOut;
+        if (tx.IsCoinBase() || !pindex->pprev)
+            continue;
+
+        const CTxUndo& txundo = blockUndo.vtxundo[i - 1];
+        CAmount nTxValueIn = 0;
+        BOOST_FOREACH (const Coin& undo, txundo.vprevout)
+            nTxValueIn += undo.out.nValue;
+        stats.nValueIn += nTxValueIn;
+
+        if (!tx.IsCoinStake()) {
+            stats.nFees += nTxValueIn - nTxValueOut;
+            stats.nFeeTxs++;
+            stats.nFeeTxBytes += ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        }
+    }
+
+    return true;
+}
+
+bool GetBlockStats(CBlockIndex* pindex, CBlockStats& stats)
+{
+    {
+        LOCK(cs_main);
+        if (pindex->nStatus & BLOCK_HAVE_STATS) {
+            stats = pindex->stats;
+            return true;
+        }
+    }
+
+    // Connected before the totals were recorded; the disk reads run without cs_main
+    if (!ReadBlockStats(pindex, stats))
+        return false;
+
+    LOCK(cs_main);
+    if (!(pindex->nStatus & BLOCK_HAVE_STATS)) {
+        pindex->stats = stats;
+        pindex->nStatus |= BLOCK_HAVE_STATS;
+        setDirtyBlockIndex.insert(pindex);
+    }
+    return true;
+}
+
+bool RecalculateBYRONSupply(int nHeightStart)
+{
+    CBlockIndex* pindex;
+    {
+        LOCK(cs_main);
+        if (nHeightStart > chainActive.Height())
+            return false;
+        pindex = chainActive[nHeightStart];
+    }
+    CAmount nSupplyPrev = pindex->pprev->nMoneySupply;
+
+    while (true) {
+        if (pindex->nHeight % 1000 == 0)
+            LogPrintf("%s : block %d...\n", __func__, pindex->nHeight);
 
+        CBlockStats stats;
+        if (!GetBlockStats(pindex, stats))
+            return error("%s : failed to get totals of block %d", __func__, pindex->nHeight);
+
+        LOCK(cs_main);
         // Rewrite money supply.
-        pindex->nMoneySupply = nSupplyPrev + nValueOut - nValueIn;
+        pindex->nMoneySupply = nSupplyPrev + stats.nValueOut - stats.nValueIn;
         nSupplyPrev = pindex->nMoneySupply;
-
-        assert(pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex)));
+        setDirtyBlockIndex.insert(pindex);
 
         if (pindex->nHeight < chainActive.Height())
             pindex = chainActive.Next(pindex);
         else
             break;
     }
+
+    FlushStateToDisk();
     return true;
 }
 
@@ -1996,6 +2424,49 @@ static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
 
+// Time spent connecting and verifying blocks with and without script checks, and
+// the inputs involved, to estimate what skipping the checks saves
+static int64_t nTimeScriptsChecked = 0;
+static int64_t nInputsScriptsChecked = 0;
+static int64_t nTimeScriptsSkipped = 0;
+static int64_t nInputsScriptsSkipped = 0;
+static int64_t nBlocksScriptsSkipped = 0;
+
+/**
+ * Whether pindex is an ancestor of the -assumevalid block on the chain we're
+ * syncing. Its hash commits to every transaction in pindex, so their scripts
+ * were checked by everyone who accepted that block. Blocks below the last
+ * checkpoint qualify too, as no other chain can get there, even before the
+ * -assumevalid header is known (as during -reindex).
+ */
+static bool IsAssumedValid(CBlockIndex* pindex)
+{
+    if (hashAssumeValid == 0)
+        return false;
+    if (pindex->nHeight < Checkpoints::GetTotalBlocksEstimate())
+        return true;
+    BlockMap::iterator it = mapBlockIndex.find(hashAssumeValid);
+    if (it == mapBlockIndex.end())
+        return false;
+    CBlockIndex* pindexAssumeValid = it->second;
+    return pindexAssumeValid->GetAncestor(pindex->nHeight) == pindex &&
+           pindexBestHeader && pindexBestHeader->GetAncestor(pindexAssumeValid->nHeight) == pindexAssumeValid;
+}
+
+void GetAssumeValidStats(CAssumeValidStats& stats)
+{
+    AssertLockHeld(cs_main);
+    stats.nBlocks = nBlocksScriptsSkipped;
+    stats.nInputs = nInputsScriptsSkipped;
+    stats.nTimeSaved = 0;
+    if (nInputsScriptsChecked > 0 && nInputsScriptsSkipped > 0) {
+        double dPerInputChecked = (double)nTimeScriptsChecked / nInputsScriptsChecked;
+        double dPerInputSkipped = (double)nTimeScriptsSkipped / nInputsScriptsSkipped;
+        if (dPerInputChecked > dPerInputSkipped)
+            stats.nTimeSaved = (int64_t)((dPerInputChecked - dPerInputSkipped) * nInputsScriptsSkipped);
+    }
+}
+
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck, bool fAlreadyChecked)
 {
     AssertLockHeld(cs_main);
@@ -2024,7 +2495,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         return state.DoS(100, error("ConnectBlock() : PoW period ended"),
             REJECT_INVALID, "PoW-ended");
 
-    bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
+    // Blocks may arrive before their parents; by now the parent is connected and its checksum final
+    if (!fJustCheck && !FinalizeStakeModifierChecksum(pindex, state))
+        return false;
+
+    bool fScriptChecks = !IsAssumedValid(pindex);
 
     // If scripts won't be checked anyways, don't bother seeing if CLTV is activated
     bool fCLTVHasMajority = false;
@@ -2049,10 +2524,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                              (pindex->nHeight == 91880 && pindex->GetBlockHash() == uint256("0x00000000000743f190a18c5577a3c2d2a1f610ae9601ac046a38084ccb7cd721")));
     if (fEnforceBIP30) {
         BOOST_FOREACH (const CTransaction& tx, block.vtx) {
-            const CCoins* coins = view.AccessCoins(tx.GetHash());
-            if (coins && !coins->IsPruned())
-                return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"),
-                    REJECT_INVALID, "bad-txns-BIP30");
+            for (unsigned int o = 0; o < tx.vout.size(); o++) {
+                if (view.HaveCoin(COutPoint(tx.GetHash(), o)))
+                    return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"),
+                        REJECT_INVALID, "bad-txns-BIP30");
+            }
         }
     }
 
@@ -2069,7 +2545,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
     CAmount nValueOut = 0;
     CAmount nValueIn = 0;
+    CBlockStats blockStats;
     unsigned int nMaxBlockSigOps = MAX_BLOCK_SIGOPS_CURRENT;
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
     vector<uint256> vSpendsInBlock;
 
     for (unsigned int i = 0; i < block.vtx.size(); i++) {
@@ -2100,10 +2580,14 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             if (nSigOps > nMaxBlockSigOps)
                 return state.DoS(100, error("ConnectBlock() : too many sigops"), REJECT_INVALID, "bad-blk-sigops");
 
-            if (!tx.IsCoinStake())
-                nFees += view.GetValueIn(tx) - tx.GetValueOut();
-            
-            nValueIn += view.GetValueIn(tx);
+            CAmount nTxValueIn = view.GetValueIn(tx);
+            if (!tx.IsCoinStake()) {
+                nFees += nTxValueIn - tx.GetValueOut();
+                blockStats.nFeeTxs++;
+                blockStats.nFeeTxBytes += ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            }
+
+            nValueIn += nTxValueIn;
 
             std::vector<CScriptCheck> vChecks;
             unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG;
@@ -2113,9 +2597,43 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
             control.Add(vChecks);
+
+            if (fAddressIndex || fSpentIndex) {
+                const uint256& txhash = tx.GetHash();
+                for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                    const CTxIn& input = tx.vin[j];
+                    const CTxOut& prevout = view.GetOutputFor(input);
+                    unsigned int addressType = ADDRESS_INDEX_NONE;
+                    uint160 hashBytes;
+                    bool fAddress = GetAddressIndexKey(prevout.scriptPubKey, addressType, hashBytes);
+
+                    if (fAddressIndex && fAddress) {
+                        // record spending activity and remove the unspent output
+                        addressIndex.push_back(make_pair(CAddressIndexKey(addressType, hashBytes, pindex->nHeight, i, txhash, j, true), prevout.nValue * -1));
+                        addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(addressType, hashBytes, input.prevout.hash, input.prevout.n), CAddressUnspentValue()));
+                    }
+                    if (fSpentIndex)
+                        spentIndex.push_back(make_pair(CSpentIndexKey(input.prevout.hash, input.prevout.n), CSpentIndexValue(txhash, j, pindex->nHeight, prevout.nValue, addressType, hashBytes)));
+                }
+            }
         }
         nValueOut += tx.GetValueOut();
 
+        if (fAddressIndex) {
+            const uint256& txhash = tx.GetHash();
+            for (unsigned int k = 0; k < tx.vout.size(); k++) {
+                const CTxOut& out = tx.vout[k];
+                unsigned int addressType;
+                uint160 hashBytes;
+                if (!GetAddressIndexKey(out.scriptPubKey, addressType, hashBytes))
+                    continue;
+
+                // record receiving activity and the new unspent output
+                addressIndex.push_back(make_pair(CAddressIndexKey(addressType, hashBytes, pindex->nHeight, i, txhash, k, false), out.nValue));
+                addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(addressType, hashBytes, txhash, k), CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight)));
+            }
+        }
+
         CTxUndo undoDummy;
         if (i > 0) {
             blockundo.vtxundo.push_back(CTxUndo());
@@ -2130,6 +2648,9 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     CAmount nMoneySupplyPrev = pindex->pprev ? pindex->pprev->nMoneySupply : 0;
     pindex->nMoneySupply = nMoneySupplyPrev + nValueOut - nValueIn;
     pindex->nMint = pindex->nMoneySupply - nMoneySupplyPrev + nFees;
+    blockStats.nValueIn = nValueIn;
+    blockStats.nValueOut = nValueOut;
+    blockStats.nFees = nFees;
 
     int64_t nTime1 = GetTimeMicros();
     nTimeConnect += nTime1 - nTimeStart;
@@ -2157,6 +2678,18 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     if (fJustCheck)
         return true;
 
+    if (fScriptChecks) {
+        if (nInputsScriptsChecked == 0 && nBlocksScriptsSkipped > 0)
+            LogPrintf("%s : checking scripts from height %d, skipped them for %d blocks (%d inputs)\n", __func__,
+                pindex->nHeight, nBlocksScriptsSkipped, nInputsScriptsSkipped);
+        nTimeScriptsChecked += nTime2 - nTimeStart;
+        nInputsScriptsChecked += nInputs - 1;
+    } else {
+        nTimeScriptsSkipped += nTime2 - nTimeStart;
+        nInputsScriptsSkipped += nInputs - 1;
+        nBlocksScriptsSkipped++;
+    }
+
     // Write undo information to disk
     if (pindex->GetUndoPos().IsNull() || !pindex->IsValid(BLOCK_VALID_SCRIPTS)) {
         if (pindex->GetUndoPos().IsNull()) {
@@ -2175,10 +2708,30 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         setDirtyBlockIndex.insert(pindex);
     }
 
+    // Record the transaction totals used by getfeeinfo and the money supply recalculation
+    if (!(pindex->nStatus & BLOCK_HAVE_STATS)) {
+        pindex->stats = blockStats;
+        pindex->nStatus |= BLOCK_HAVE_STATS;
+        setDirtyBlockIndex.insert(pindex);
+    }
+
     if (fTxIndex)
         if (!pblocktree->WriteTxIndex(vPos))
             return state.Abort("Failed to write transaction index");
 
+    if (fAddressIndex) {
+        if (!pblocktree->WriteAddressIndex(addressIndex))
+            return state.Abort("Failed to write address index");
+        if (!pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex))
+            return state.Abort("Failed to write address unspent index");
+    }
+
+    if (fSpentIndex && !pblocktree->UpdateSpentIndex(spentIndex))
+        return state.Abort("Failed to write spent index");
+
+    if (fTimestampIndex && !pblocktree->WriteTimestampIndex(CTimestampIndexKey(pindex->nTime, pindex->GetBlockHash())))
+        return state.Abort("Failed to write timestamp index");
+
     // Add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
@@ -2204,26 +2757,132 @@ enum FlushStateMode {
     FLUSH_STATE_ALWAYS
 };
 
-/**
- * Update the on-disk chain state.
- * The caches and indexes are flushed if either they're too large, forceWrite is set, or
- * fast is not set and it's been a while since the last write.
- */
-bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
+uint64_t CalculateCurrentUsage()
 {
-    LOCK(cs_main);
-    static int64_t nLastWrite = 0;
-    try {
-        if ((mode == FLUSH_STATE_ALWAYS) ||
-            ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
-            (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
-            // Typical CCoins structures on disk are around 100 bytes in size.
-            // Pushing a new one to the database can cause it to be written
-            // twice (once in the log, and once in the tables). This is already
-            // an overestimation, as most will delete an existing entry or
-            // overwrite one. Still, use a conservative safety factor of 2.
-            if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
-                return state.Error("out of disk space");
+    LOCK(cs_LastBlockFile);
+    uint64_t retval = 0;
+    BOOST_FOREACH (const CBlockFileInfo& file, vinfoBlockFile) {
+        retval += file.nSize + file.nUndoSize;
+    }
+    return retval;
+}
+
+/** Forget the data of the blocks in a block file, which is about to be deleted */
+static void PruneOneBlockFile(const int fileNumber)
+{
+    for (BlockMap::iterator it = mapBlockIndex.begin(); it != mapBlockIndex.end(); ++it) {
+        CBlockIndex* pindex = it->second;
+        if ((pindex->nStatus & (BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO)) && pindex->nFile == fileNumber) {
+            pindex->nStatus &= ~BLOCK_HAVE_DATA;
+            pindex->nStatus &= ~BLOCK_HAVE_UNDO;
+            pindex->nFile = 0;
+            pindex->nDataPos = 0;
+            pindex->nUndoPos = 0;
+            setDirtyBlockIndex.insert(pindex);
+
+            // A pruned block has to be downloaded again before its chain can be
+            // considered, which puts it back in mapBlocksUnlinked if need be
+            std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex->pprev);
+            while (range.first != range.second) {
+                std::multimap<CBlockIndex*, CBlockIndex*>::iterator itUnlinked = range.first;
+                range.first++;
+                if (itUnlinked->second == pindex)
+                    mapBlocksUnlinked.erase(itUnlinked);
+            }
+        }
+    }
+
+    vinfoBlockFile[fileNumber].SetNull();
+    setDirtyFileInfo.insert(fileNumber);
+}
+
+static void UnlinkPrunedFiles(const std::set<int>& setFilesToPrune)
+{
+    for (std::set<int>::const_iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
+        CDiskBlockPos pos(*it, 0);
+        blockFileMapper.Forget(*it);
+        boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
+        boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
+        LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
+    }
+}
+
+/**
+ * Pick the oldest block files to delete until the block and undo files fit in
+ * nPruneTarget, never touching one that holds any of the last MIN_BLOCKS_TO_KEEP
+ * blocks. The file currently written to is kept too.
+ */
+static void FindFilesToPrune(std::set<int>& setFilesToPrune)
+{
+    LOCK2(cs_main, cs_LastBlockFile);
+    if (chainActive.Tip() == NULL || nPruneTarget == 0)
+        return;
+    int nBlocksToKeep = std::max((int)MIN_BLOCKS_TO_KEEP, Params().MaxReorganizationDepth() + 1);
+    if (chainActive.Height() <= nBlocksToKeep)
+        return;
+
+    unsigned int nLastBlockWeCanPrune = chainActive.Height() - nBlocksToKeep;
+    uint64_t nCurrentUsage = CalculateCurrentUsage();
+    // Leave room for the space the next block and undo data may preallocate
+    uint64_t nBuffer = BLOCKFILE_CHUNK_SIZE + UNDOFILE_CHUNK_SIZE;
+    int nPruned = 0;
+    if (nCurrentUsage + nBuffer >= nPruneTarget) {
+        for (int fileNumber = 0; fileNumber < nLastBlockFile; fileNumber++) {
+            uint64_t nBytesToPrune = vinfoBlockFile[fileNumber].nSize + vinfoBlockFile[fileNumber].nUndoSize;
+            if (vinfoBlockFile[fileNumber].nSize == 0)
+                continue;
+            if (nCurrentUsage + nBuffer < nPruneTarget)
+                break;
+            if (vinfoBlockFile[fileNumber].nHeightLast > nLastBlockWeCanPrune)
+                continue;
+
+            PruneOneBlockFile(fileNumber);
+            setFilesToPrune.insert(fileNumber);
+            nCurrentUsage -= nBytesToPrune;
+            nPruned++;
+        }
+    }
+
+    LogPrint("prune", "Prune: target=%dMiB actual=%dMiB diff=%dMiB max_prune_height=%d removed %d blk/rev pairs\n",
+        nPruneTarget / 1024 / 1024, nCurrentUsage / 1024 / 1024,
+        ((int64_t)nPruneTarget - (int64_t)nCurrentUsage) / 1024 / 1024,
+        nLastBlockWeCanPrune, nPruned);
+}
+
+/**
+ * Update the on-disk chain state.
+ * The caches and indexes are flushed if either they're too large, forceWrite is set, or
+ * fast is not set and it's been a while since the last write. In -prune mode block
+ * files no longer needed are deleted, once the block index no longer refers to them.
+ */
+bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
+{
+    LOCK2(cs_main, cs_LastBlockFile);
+    static int64_t nLastWrite = 0;
+    std::set<int> setFilesToPrune;
+    bool fFlushForPrune = false;
+    try {
+        if (fPruneMode && fCheckForPruning && !fReindex) {
+            FindFilesToPrune(setFilesToPrune);
+            fCheckForPruning = false;
+            if (!setFilesToPrune.empty()) {
+                fFlushForPrune = true;
+                if (!fHavePruned) {
+                    pblocktree->WriteFlag("prunedblockfiles", true);
+                    fHavePruned = true;
+                }
+            }
+        }
+        if ((mode == FLUSH_STATE_ALWAYS) || fFlushForPrune ||
+            ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage) ||
+            (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
+            // Typical Coin records on disk are around 50 bytes in size.
+            // Pushing a new one to the database can cause it to be written
+            // twice (once in the log, and once in the tables). This is already
+            // an overestimation, as most will delete an existing entry or
+            // overwrite one. Still, use a conservative safety factor of 2.
+            if (!CheckDiskSpace(50 * 2 * 2 * pcoinsTip->GetCacheSize()))
+                return state.Error("out of disk space");
             // First make sure all block and undo data is flushed to disk.
             FlushBlockFile();
             // Then update all block file information (which may refer to block and undo files).
@@ -2246,11 +2905,21 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
             }
 
             pblocktree->Sync();
-            // Finally flush the chainstate (which may refer to block index entries).
+            // Then flush the chainstate (which may refer to block index entries).
+            // With -asyncflush this only hands the dirty entries to the background
+            // writer; forced flushes (shutdown, explicit requests) and prunes wait
+            // for the disk.
             if (!pcoinsTip->Flush())
                 return state.Abort("Failed to write to coin database");
-            // Update best block in wallet (so we can detect restored wallets).
-            if (mode != FLUSH_STATE_IF_NEEDED) {
+            bool fCoinsSynced = !pcoinsWriteBehind || mode == FLUSH_STATE_ALWAYS || fFlushForPrune;
+            if (pcoinsWriteBehind && fCoinsSynced && !pcoinsWriteBehind->Sync())
+                return state.Abort("Failed to write to coin database");
+            // Neither the block index nor the coins on disk point into the pruned files now, so they can go
+            if (fFlushForPrune)
+                UnlinkPrunedFiles(setFilesToPrune);
+            // Update best block in wallet (so we can detect restored wallets). Not while coins are
+            // still queued, or a crash would leave the wallet ahead of the chainstate.
+            if (mode != FLUSH_STATE_IF_NEEDED && fCoinsSynced) {
                 GetMainSignals().SetBestChain(chainActive.GetLocator());
             }
             nLastWrite = GetTimeMicros();
@@ -2267,6 +2936,13 @@ void FlushStateToDisk()
     FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
 }
 
+void PruneAndFlush()
+{
+    CValidationState state;
+    fCheckForPruning = true;
+    FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED);
+}
+
 /** Update chainActive and related internal data structures. */
 void static UpdateTip(CBlockIndex* pindexNew)
 {
@@ -2327,13 +3003,23 @@ bool static DisconnectTip(CValidationState& state)
     if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS))
         return false;
     // Resurrect mempool transactions from the disconnected block.
+    std::vector<uint256> vHashUpdate;
     BOOST_FOREACH (const CTransaction& tx, block.vtx) {
         // ignore validation errors in resurrected transactions
         list<CTransaction> removed;
         CValidationState stateDummy;
-        if (tx.IsCoinBase() || tx.IsCoinStake() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, false, false, true))
             mempool.remove(tx, removed, true);
-    }
+        else if (mempool.exists(tx.GetHash()))
+            vHashUpdate.push_back(tx.GetHash());
+    }
+    // AcceptToMemoryPool/addUnchecked all assume that new mempool entries have
+    // no in-mempool children, which is generally not true when adding
+    // previously-confirmed transactions back to the mempool.
+    // UpdateTransactionsFromBlock finds descendants of any transactions in this
+    // block that were added back and cleans up the mempool state.
+    mempool.UpdateTransactionsFromBlock(vHashUpdate);
+    LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
     mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight);
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
@@ -2378,6 +3064,8 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
     nTimeReadFromDisk += nTime2 - nTime1;
     int64_t nTime3;
     LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+    // Let the prefetch threads load the inputs while the block is being checked.
+    PrefetchBlockInputs(*pblock);
     {
         CInv inv(MSG_BLOCK, pindexNew->GetBlockHash());
         bool rv = ConnectBlock(*pblock, state, pindexNew, view, false, fAlreadyChecked);
@@ -2391,6 +3079,12 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
         nTime3 = GetTimeMicros();
         nTimeConnectTotal += nTime3 - nTime2;
         LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, nTimeConnectTotal * 0.000001);
+        if (pcoinsPrefetch) {
+            size_t nPrefetched;
+            uint64_t nHits, nMisses;
+            pcoinsPrefetch->GetPrefetchStats(nPrefetched, nHits, nMisses);
+            LogPrint("bench", "  - Prefetch: %u buffered, %u hits, %u misses\n", nPrefetched, nHits, nMisses);
+        }
         assert(view.Flush());
     }
     int64_t nTime4 = GetTimeMicros();
@@ -2569,6 +3263,19 @@ static CBlockIndex* FindMostWorkChain()
             }
             pindexTest = pindexTest->pprev;
         }
+        // Switching to the candidate disconnects the active chain down to the fork,
+        // which can't be done past blocks a UTXO snapshot left without data and undo.
+        if (!fInvalidAncestor && fHavePruned && pindexTest) {
+            for (CBlockIndex* pindexWalk = chainActive.Tip(); pindexWalk && pindexWalk != pindexTest; pindexWalk = pindexWalk->pprev) {
+                if ((pindexWalk->nStatus & (BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO)) != (BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO)) {
+                    LogPrintf("%s : cannot reorganize to %s, it forks off below block %s which has no undo data\n",
+                        __func__, pindexNew->GetBlockHash().ToString(), pindexWalk->GetBlockHash().ToString());
+                    setBlockIndexCandidates.erase(pindexNew);
+                    fInvalidAncestor = true;
+                    break;
+                }
+            }
+        }
         if (!fInvalidAncestor)
             return pindexNew;
     } while (true);
@@ -2624,7 +3331,9 @@ static bool ActivateBestChainStep(CValidationState& state, CBlockIndex* pindexMo
         nHeight = nTargetHeight;
 
         // Connect new blocks.
-        BOOST_REVERSE_FOREACH (CBlockIndex* pindexConnect, vpindexToConnect) {
+        for (int nPos = (int)vpindexToConnect.size() - 1; nPos >= 0; nPos--) {
+            CBlockIndex* pindexConnect = vpindexToConnect[nPos];
+            PrefetchBlockInputs(vpindexToConnect, nPos);
             if (!ConnectTip(state, pindexConnect, pindexConnect == pindexMostWork ? pblock : NULL, fAlreadyChecked)) {
                 if (state.IsInvalid()) {
                     // The block violates a consensus rule.
@@ -2696,13 +3405,42 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock, bool fAlreadyChe
         // Notifications/callbacks that can run without cs_main
         if (!fInitialDownload) {
             uint256 hashNewTip = pindexNewTip->GetBlockHash();
+            CInv inv(MSG_BLOCK, hashNewTip);
             // Relay inventory, but don't relay old inventory during initial block download.
+            // Peers that asked for high-bandwidth compact blocks get the block itself
+            // straight away, serialized once for all of them, and peers that sync
+            // headers-first get the header.
             int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
+            CSerializedNetMsgRef cmpctMsg;
+            CSerializedNetMsgRef headersMsg;
             {
                 LOCK(cs_vNodes);
-                BOOST_FOREACH (CNode* pnode, vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                BOOST_FOREACH (CNode* pnode, vNodes) {
+                    if (chainActive.Height() <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                        continue;
+                    bool fCompact = pblock && pblock->GetHash() == hashNewTip && pnode->fSuccessfullyConnected && pnode->fPreferHighBandwidthCompact;
+                    if (fCompact || pnode->fPreferHeaders) {
+                        bool fKnown;
+                        {
+                            LOCK(pnode->cs_inventory);
+                            fKnown = pnode->setInventoryKnown.count(inv);
+                        }
+                        if (fKnown)
+                            continue;
+                        pnode->AddInventoryKnown(inv);
+                        if (fCompact) {
+                            if (!cmpctMsg)
+                                cmpctMsg = MakeNetMsg("cmpctblock", CBlockHeaderAndShortTxIDs(*pblock));
+                            pnode->PushSerializedMessage(cmpctMsg);
+                        } else {
+                            if (!headersMsg)
+                                headersMsg = MakeNetMsg("headers", vector<CBlock>(1, CBlock(pindexNewTip->GetBlockHeader())));
+                            pnode->PushSerializedMessage(headersMsg);
+                        }
+                        continue;
+                    }
+                    pnode->PushInventory(inv);
+                }
             }
             // Notify external listeners about the new tip.
             // Note: uiInterface, should switch main signals.
@@ -2797,6 +3535,15 @@ bool ReconsiderBlock(CValidationState& state, CBlockIndex* pindex)
     return true;
 }
 
+/** Start the stake modifier checksums at the genesis block, whose modifier is 0 and counts as generated */
+static void SeedStakeModifierChecksum(CBlockIndex* pindexGenesis)
+{
+    pindexGenesis->SetStakeModifier(0, true);
+    pindexGenesis->nStakeModifierChecksum = GetStakeModifierChecksum(pindexGenesis);
+    pindexGenesis->nStatus |= BLOCK_HAVE_STAKE_CHECKSUM;
+    assert(CheckStakeModifierCheckpoints(0, pindexGenesis->nStakeModifierChecksum));
+}
+
 CBlockIndex* AddToBlockIndex(const CBlock& block)
 {
     // Check for duplicate
@@ -2813,6 +3560,7 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
     // competitive advantage.
     pindexNew->nSequenceId = 0;
     BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    nBlockIndexHeadersOnly++;
 
     //mark as PoS seen
     if (pindexNew->IsProofOfStake())
@@ -2825,6 +3573,11 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
         pindexNew->BuildSkip();
 
+        // A header alone doesn't show whether the block is proof-of-stake, but its
+        // height does, and that is all the trust and stake modifier depend on
+        if (block.vtx.empty() && pindexNew->nHeight > Params().LAST_POW_BLOCK())
+            pindexNew->SetProofOfStake();
+
         //update previous block pointer
         pindexNew->pprev->pnext = pindexNew;
 
@@ -2836,9 +3589,11 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
             LogPrintf("AddToBlockIndex() : SetStakeEntropyBit() failed \n");
 
         // ppcoin: record proof-of-stake hash value
-        if (pindexNew->IsProofOfStake()) {
+        if (pindexNew->IsProofOfStake() && !block.vtx.empty()) {
             if (!mapProofOfStake.count(hash))
                 LogPrintf("AddToBlockIndex() : hashProofOfStake not found in map \n");
+            else
+                pindexNew->nStatus |= BLOCK_HAVE_STAKE_HASH;
             pindexNew->hashProofOfStake = mapProofOfStake[hash];
         }
 
@@ -2848,9 +3603,11 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         if (!ComputeNextStakeModifier(pindexNew->pprev, nStakeModifier, fGeneratedStakeModifier))
             LogPrintf("AddToBlockIndex() : ComputeNextStakeModifier() failed \n");
         pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
+        // The checksum covers the proof-of-stake hash, which needs the block; until
+        // FinalizeStakeModifierChecksum can make it final this is only provisional
         pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew);
-        if (!CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
-            LogPrintf("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=%s \n", pindexNew->nHeight, std::to_string(nStakeModifier));
+    } else {
+        SeedStakeModifierChecksum(pindexNew);
     }
     pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + GetBlockProof(*pindexNew);
     pindexNew->RaiseValidity(BLOCK_VALID_TREE);
@@ -2866,12 +3623,75 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
     return pindexNew;
 }
 
+/**
+ * An index entry created from a header alone lacks what only the block can
+ * tell: the coinstake and its proof-of-stake hash. Fill in the stake fields
+ * now that the block has arrived, and redo what depends on them. The parent
+ * was completed the same way when its block came.
+ */
+void UpdateBlockIndexStake(const CBlock& block, CBlockIndex* pindex)
+{
+    AssertLockHeld(cs_main);
+    uint256 hash = block.GetHash();
+    if (block.IsProofOfStake()) {
+        pindex->SetProofOfStake();
+        pindex->prevoutStake = block.vtx[1].vin[0].prevout;
+        pindex->nStakeTime = block.nTime;
+        setStakeSeen.insert(make_pair(pindex->prevoutStake, pindex->nStakeTime));
+        if (mapProofOfStake.count(hash)) {
+            pindex->hashProofOfStake = mapProofOfStake[hash];
+            pindex->nStatus |= BLOCK_HAVE_STAKE_HASH;
+        }
+    }
+
+    if (pindex->pprev) {
+        pindex->bnChainTrust = pindex->pprev->bnChainTrust + pindex->GetBlockTrust();
+
+        uint64_t nStakeModifier = 0;
+        bool fGeneratedStakeModifier = false;
+        if (!ComputeNextStakeModifier(pindex->pprev, nStakeModifier, fGeneratedStakeModifier))
+            LogPrintf("UpdateBlockIndexStake() : ComputeNextStakeModifier() failed \n");
+        pindex->nFlags &= ~CBlockIndex::BLOCK_STAKE_MODIFIER;
+        pindex->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
+        if (!(pindex->nStatus & BLOCK_HAVE_STAKE_CHECKSUM))
+            pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex);
+    }
+    setDirtyBlockIndex.insert(pindex);
+}
+
+/**
+ * Stake modifier checksums chain from the genesis block through every block's
+ * proof-of-stake hash. Make pindex's final, and stored from then on, once its
+ * parent's is and its own proof-of-stake hash is known, and reject the block if
+ * it then misses a checkpoint. Anything missing leaves it provisional.
+ */
+static bool FinalizeStakeModifierChecksum(CBlockIndex* pindex, CValidationState& state)
+{
+    AssertLockHeld(cs_main);
+    if ((pindex->nStatus & BLOCK_HAVE_STAKE_CHECKSUM) || !pindex->pprev || !(pindex->pprev->nStatus & BLOCK_HAVE_STAKE_CHECKSUM))
+        return true;
+    if (pindex->IsProofOfStake() && !(pindex->nStatus & BLOCK_HAVE_STAKE_HASH))
+        return true;
+
+    pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex);
+    pindex->nStatus |= BLOCK_HAVE_STAKE_CHECKSUM;
+    setDirtyBlockIndex.insert(pindex);
+    if (!CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum)) {
+        pindex->nStatus |= BLOCK_FAILED_VALID;
+        return state.DoS(100, error("%s : stake modifier checksum %08x at height %d is rejected by checkpoint", __func__, pindex->nStakeModifierChecksum, pindex->nHeight),
+                         REJECT_INVALID, "bad-stakemodifier");
+    }
+    return true;
+}
+
 /** Mark a block as having its data received and checked (up to BLOCK_VALID_TRANSACTIONS). */
 bool ReceivedBlockTransactions(const CBlock& block, CValidationState& state, CBlockIndex* pindexNew, const CDiskBlockPos& pos)
 {
     if (block.IsProofOfStake()){
         pindexNew->SetProofOfStake();
     }
+    if (pindexNew->nTx == 0)
+        nBlockIndexHeadersOnly--;
     pindexNew->nTx = block.vtx.size();
     pindexNew->nChainTx = 0;
     pindexNew->nFile = pos.nFile;
@@ -2957,6 +3777,8 @@ bool FindBlockPos(CValidationState& state, CDiskBlockPos& pos, unsigned int nAdd
                 }
             } else
                 return state.Error("out of disk space");
+            if (fPruneMode)
+                fCheckForPruning = true;
         }
     }
 
@@ -2987,6 +3809,8 @@ bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigne
             }
         } else
             return state.Error("out of disk space");
+        if (fPruneMode)
+            fCheckForPruning = true;
     }
 
     return true;
@@ -3189,6 +4013,32 @@ bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& sta
     return true;
 }
 
+/**
+ * What can be checked of a header that isn't in the index yet before its block
+ * arrives. Its stake can't be, so a header chain is only as good as its
+ * difficulty, timestamps and (for the proof-of-work part) hashes say it is.
+ */
+static bool CheckHeaderBeforeBlock(const CBlockHeader& header, CValidationState& state, CBlockIndex* const pindexPrev)
+{
+    const int nHeight = pindexPrev->nHeight + 1;
+    const bool fProofOfStake = nHeight > Params().LAST_POW_BLOCK();
+
+    if (!fProofOfStake && !CheckProofOfWork(header.GetHash(), header.nBits))
+        return state.DoS(50, error("%s : proof of work failed at %d", __func__, nHeight),
+            REJECT_INVALID, "high-hash");
+
+    // CheckWork can only tell a proof-of-stake block by its coinstake, so check those by height
+    if (fProofOfStake ? header.nBits != GetNextWorkRequired(pindexPrev, &header) : !CheckWork(CBlock(header), pindexPrev))
+        return state.DoS(100, error("%s : incorrect difficulty at %d", __func__, nHeight),
+            REJECT_INVALID, "bad-diffbits");
+
+    if (header.GetBlockTime() > GetAdjustedTime() + (fProofOfStake ? 180 : 7200))
+        return state.Invalid(error("%s : block timestamp too far in the future", __func__),
+            REJECT_INVALID, "time-too-new");
+
+    return true;
+}
+
 bool IsBlockHashInChain(const uint256& hashBlock)
 {
     if (hashBlock == 0 || !mapBlockIndex.count(hashBlock))
@@ -3290,8 +4140,11 @@ bool AcceptBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex
     if (!ContextualCheckBlockHeader(block, state, pindexPrev))
         return false;
 
-    if (pindex == NULL)
+    if (pindex == NULL) {
         pindex = AddToBlockIndex(block);
+        if (!FinalizeStakeModifierChecksum(pindex, state))
+            return false;
+    }
 
     if (ppindex)
         *ppindex = pindex;
@@ -3348,6 +4201,9 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
             mapProofOfStake.insert(make_pair(hash, hashProofOfStake));
     }
 
+    BlockMap::iterator miSelf = mapBlockIndex.find(block.GetHash());
+    bool fHeaderOnly = miSelf != mapBlockIndex.end() && !(miSelf->second->nStatus & BLOCK_HAVE_DATA);
+
     if (!AcceptBlockHeader(block, state, &pindex))
         return false;
 
@@ -3355,6 +4211,13 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
         return true;
     }
 
+    // Synced headers-first: the index entry predates the block
+    if (fHeaderOnly) {
+        UpdateBlockIndexStake(block, pindex);
+        if (!FinalizeStakeModifierChecksum(pindex, state))
+            return false;
+    }
+
     if ((!fAlreadyCheckedBlock && !CheckBlock(block, state)) || !ContextualCheckBlock(block, state, pindex->pprev)) {
         if (state.IsInvalid() && !state.CorruptionPossible()) {
             pindex->nStatus |= BLOCK_FAILED_VALID;
@@ -3452,16 +4315,19 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
         const CCoinsViewCache coins(pcoinsTip);
         
         for (const CTxIn& in: stakeTxIn.vin) {
-            const CCoins* coin = coins.AccessCoins(in.prevout.hash);
-
-            if(!coin && !isBlockFromFork){
-                // No coins on the main chain
-                return error("%s: coin stake inputs not available on main chain, received height %d vs current %d", __func__, nHeight, chainActive.Height());
-            }
-            if(coin && !coin->IsAvailable(in.prevout.n)){
+            const Coin& coin = coins.AccessCoin(in.prevout);
+
+            if(coin.IsSpent()){
+                // Spent outputs are gone from the per-output view; a still unspent
+                // sibling output tells whether the transaction is on the main chain
+                const Coin& sibling = AccessByTxid(coins, in.prevout.hash);
+                if(sibling.IsSpent() && !isBlockFromFork){
+                    // No coins on the main chain
+                    return error("%s: coin stake inputs not available on main chain, received height %d vs current %d", __func__, nHeight, chainActive.Height());
+                }
                 // If this is not available get the height of the spent and validate it with the forked height
                 // Check if this occurred before the chain split
-                if(!(isBlockFromFork && coin->nHeight > splitHeight)){
+                if(!sibling.IsSpent() && !(isBlockFromFork && (int)sibling.nHeight > splitHeight)){
                     // Coins not available
                     return error("%s: coin stake inputs already spent in main chain", __func__);
                 }
@@ -3538,13 +4404,13 @@ void CBlockIndex::BuildSkip()
         pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
 }
 
-bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp)
+bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp, bool fAlreadyChecked)
 {
     // Preliminary checks
     int64_t nStartTime = GetTimeMillis();
-    bool checked = CheckBlock(*pblock, state);
+    bool checked = fAlreadyChecked || CheckBlock(*pblock, state);
 
-    if (!CheckBlockSignature(*pblock))
+    if (!fAlreadyChecked && !CheckBlockSignature(*pblock))
         return error("ProcessNewBlock() : bad proof-of-stake block signature");
 
     if (pblock->GetHash() != Params().HashGenesisBlock() && pfrom != NULL) {
@@ -3729,7 +4595,8 @@ bool static LoadBlockIndexDB(string& strError)
     BOOST_FOREACH (const PAIRTYPE(int, CBlockIndex*) & item, vSortedByHeight) {
         CBlockIndex* pindex = item.second;
         pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
-        if (pindex->nStatus & BLOCK_HAVE_DATA) {
+        // A block that was processed counts towards nChainTx even if its data is gone
+        if (pindex->nTx > 0) {
             if (pindex->pprev) {
                 if (pindex->pprev->nChainTx) {
                     pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
@@ -3740,6 +4607,8 @@ bool static LoadBlockIndexDB(string& strError)
             } else {
                 pindex->nChainTx = pindex->nTx;
             }
+        } else {
+            nBlockIndexHeadersOnly++;
         }
         if (pindex->IsValid(BLOCK_VALID_TRANSACTIONS) && (pindex->nChainTx || pindex->pprev == NULL))
             setBlockIndexCandidates.insert(pindex);
@@ -3751,6 +4620,13 @@ bool static LoadBlockIndexDB(string& strError)
             pindexBestHeader = pindex;
     }
 
+    // Databases from before stake modifier checksums were stored have none to chain from
+    BlockMap::iterator miGenesis = mapBlockIndex.find(Params().HashGenesisBlock());
+    if (miGenesis != mapBlockIndex.end() && !(miGenesis->second->nStatus & BLOCK_HAVE_STAKE_CHECKSUM)) {
+        SeedStakeModifierChecksum(miGenesis->second);
+        setDirtyBlockIndex.insert(miGenesis->second);
+    }
+
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
     vinfoBlockFile.resize(nLastBlockFile + 1);
@@ -3798,9 +4674,28 @@ bool static LoadBlockIndexDB(string& strError)
     pblocktree->ReadFlag("txindex", fTxIndex);
     LogPrintf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? "enabled" : "disabled");
 
+    // Check whether the optional indexes are enabled
+    pblocktree->ReadFlag("addressindex", fAddressIndex);
+    LogPrintf("LoadBlockIndexDB(): address index %s\n", fAddressIndex ? "enabled" : "disabled");
+    pblocktree->ReadFlag("spentindex", fSpentIndex);
+    LogPrintf("LoadBlockIndexDB(): spent index %s\n", fSpentIndex ? "enabled" : "disabled");
+    pblocktree->ReadFlag("timestampindex", fTimestampIndex);
+    LogPrintf("LoadBlockIndexDB(): timestamp index %s\n", fTimestampIndex ? "enabled" : "disabled");
+
     // If this is written true before the next client init, then we know the shutdown process failed
     pblocktree->WriteFlag("shutdown", false);
 
+    pblocktree->ReadFlag("prunedblockfiles", fHavePruned);
+    if (fHavePruned)
+        LogPrintf("LoadBlockIndexDB(): block data below the chain state may be missing\n");
+
+    bool fSnapshotLoading = false;
+    pblocktree->ReadFlag("txoutsnapshotloading", fSnapshotLoading);
+    if (fSnapshotLoading) {
+        strError = _("Loading a UTXO snapshot was interrupted and the chain state is incomplete. Restart with -reindex.");
+        return false;
+    }
+
     // Load pointer to end of best chain
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())
@@ -3850,6 +4745,11 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
         uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
         if (pindex->nHeight < chainActive.Height() - nCheckDepth)
             break;
+        if (fHavePruned && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
+            // The chain below here was not downloaded, or no longer is on disk
+            LogPrintf("VerifyDB(): block data missing from height %d, only verifying the blocks above\n", pindex->nHeight);
+            break;
+        }
         CBlock block;
         // check level 0: read from disk
         if (!ReadBlockFromDisk(block, pindex))
@@ -3867,7 +4767,7 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
+        if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
             bool fClean = true;
             if (!DisconnectBlock(block, state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
@@ -3907,6 +4807,7 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
 void UnloadBlockIndex()
 {
     mapBlockIndex.clear();
+    nBlockIndexHeadersOnly = 0;
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
     pindexBestInvalid = NULL;
@@ -3931,6 +4832,12 @@ bool InitBlockIndex()
     // Use the provided setting for -txindex in the new database
     fTxIndex = GetBoolArg("-txindex", true);
     pblocktree->WriteFlag("txindex", fTxIndex);
+    fAddressIndex = GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX);
+    pblocktree->WriteFlag("addressindex", fAddressIndex);
+    fSpentIndex = GetBoolArg("-spentindex", DEFAULT_SPENTINDEX);
+    pblocktree->WriteFlag("spentindex", fSpentIndex);
+    fTimestampIndex = GetBoolArg("-timestampindex", DEFAULT_TIMESTAMPINDEX);
+    pblocktree->WriteFlag("timestampindex", fTimestampIndex);
     LogPrintf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -4051,6 +4958,9 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
                 }
             } catch (std::exception& e) {
                 LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
+                // The blocks retried from nRewind may have been queued already; their inputs
+                // have to be fetched again rather than skipped as done
+                coinsprefetchqueue.Clear();
             }
         }
     } catch (std::runtime_error& e) {
@@ -4094,16 +5004,20 @@ void static CheckBlockIndex()
     // Along the way, remember whether there are blocks on the path from genesis
     // block being explored which are the first to have certain properties.
     size_t nNodes = 0;
+    int nNeverProcessed = 0;
     int nHeight = 0;
     CBlockIndex* pindexFirstInvalid = NULL;         // Oldest ancestor of pindex which is invalid.
     CBlockIndex* pindexFirstMissing = NULL;         // Oldest ancestor of pindex which does not have BLOCK_HAVE_DATA.
+    CBlockIndex* pindexFirstNeverProcessed = NULL;  // Oldest ancestor of pindex for which nTx == 0.
     CBlockIndex* pindexFirstNotTreeValid = NULL;    // Oldest ancestor of pindex which does not have BLOCK_VALID_TREE (regardless of being valid or not).
     CBlockIndex* pindexFirstNotChainValid = NULL;   // Oldest ancestor of pindex which does not have BLOCK_VALID_CHAIN (regardless of being valid or not).
     CBlockIndex* pindexFirstNotScriptsValid = NULL; // Oldest ancestor of pindex which does not have BLOCK_VALID_SCRIPTS (regardless of being valid or not).
     while (pindex != NULL) {
         nNodes++;
+        if (pindex->nTx == 0) nNeverProcessed++;
         if (pindexFirstInvalid == NULL && pindex->nStatus & BLOCK_FAILED_VALID) pindexFirstInvalid = pindex;
         if (pindexFirstMissing == NULL && !(pindex->nStatus & BLOCK_HAVE_DATA)) pindexFirstMissing = pindex;
+        if (pindexFirstNeverProcessed == NULL && pindex->nTx == 0) pindexFirstNeverProcessed = pindex;
         if (pindex->pprev != NULL && pindexFirstNotTreeValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_TREE) pindexFirstNotTreeValid = pindex;
         if (pindex->pprev != NULL && pindexFirstNotChainValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_CHAIN) pindexFirstNotChainValid = pindex;
         if (pindex->pprev != NULL && pindexFirstNotScriptsValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_SCRIPTS) pindexFirstNotScriptsValid = pindex;
@@ -4114,12 +5028,18 @@ void static CheckBlockIndex()
             assert(pindex->GetBlockHash() == Params().HashGenesisBlock()); // Genesis block's hash must match.
             assert(pindex == chainActive.Genesis());                       // The current active chain's genesis block must be this block.
         }
-        // HAVE_DATA is equivalent to VALID_TRANSACTIONS and equivalent to nTx > 0 (we stored the number of transactions in the block)
-        assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
+        // VALID_TRANSACTIONS is equivalent to nTx > 0 (we stored the number of transactions in the block),
+        // and so is HAVE_DATA unless block data has gone missing since (see fHavePruned)
+        if (!fHavePruned) {
+            assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
+            assert(pindexFirstMissing == pindexFirstNeverProcessed);
+        } else if (pindex->nStatus & BLOCK_HAVE_DATA) {
+            assert(pindex->nTx > 0);
+        }
         assert(((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS) == (pindex->nTx > 0));
         if (pindex->nChainTx == 0) assert(pindex->nSequenceId == 0); // nSequenceId can't be set for blocks that aren't linked
-        // All parents having data is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
-        assert((pindexFirstMissing != NULL) == (pindex->nChainTx == 0));                                             // nChainTx == 0 is used to signal that all parent block's transaction data is available.
+        // All parents having been processed is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
+        assert((pindexFirstNeverProcessed != NULL) == (pindex->nChainTx == 0));                                      // nChainTx == 0 is used to signal that all parent blocks were processed.
         assert(pindex->nHeight == nHeight);                                                                          // nHeight must be consistent.
         assert(pindex->pprev == NULL || pindex->nChainWork >= pindex->pprev->nChainWork);                            // For every block except the genesis block, the chainwork must be larger than the parent's.
         assert(nHeight < 2 || (pindex->pskip && (pindex->pskip->nHeight < nHeight)));                                // The pskip pointer must point back for all but the first 2 blocks.
@@ -4131,8 +5051,9 @@ void static CheckBlockIndex()
             // Checks for not-invalid blocks.
             assert((pindex->nStatus & BLOCK_FAILED_MASK) == 0); // The failed mask cannot be set for blocks without invalid parents.
         }
-        if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && pindexFirstMissing == NULL) {
-            if (pindexFirstInvalid == NULL) { // If this block sorts at least as good as the current tip and is valid, it must be in setBlockIndexCandidates.
+        if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && pindexFirstNeverProcessed == NULL) {
+            // If this block sorts at least as good as the current tip, is valid and we have all its data (or it is the tip), it must be in setBlockIndexCandidates.
+            if (pindexFirstInvalid == NULL && (pindexFirstMissing == NULL || pindex == chainActive.Tip())) {
                 assert(setBlockIndexCandidates.count(pindex));
             }
         } else { // If this block sorts worse than the current tip, it cannot be in setBlockIndexCandidates.
@@ -4149,13 +5070,12 @@ void static CheckBlockIndex()
             }
             rangeUnlinked.first++;
         }
-        if (pindex->pprev && pindex->nStatus & BLOCK_HAVE_DATA && pindexFirstMissing != NULL) {
-            if (pindexFirstInvalid == NULL) { // If this block has block data available, some parent doesn't, and has no invalid parents, it must be in mapBlocksUnlinked.
-                assert(foundInUnlinked);
-            }
-        } else { // If this block does not have block data available, or all parents do, it cannot be in mapBlocksUnlinked.
-            assert(!foundInUnlinked);
+        if (pindex->pprev && (pindex->nStatus & BLOCK_HAVE_DATA) && pindexFirstNeverProcessed != NULL && pindexFirstInvalid == NULL) {
+            // If this block has block data available, some parent was never received, and has no invalid parents, it must be in mapBlocksUnlinked.
+            assert(foundInUnlinked);
         }
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA)) assert(!foundInUnlinked); // Can't be in mapBlocksUnlinked if we don't HAVE_DATA
+        if (pindexFirstMissing == NULL) assert(!foundInUnlinked);          // We aren't missing data for any parent -- cannot be in mapBlocksUnlinked.
         // assert(pindex->GetBlockHash() == pindex->GetBlockHeader().GetHash()); // Perhaps too slow
         // End: actual consistency checks.
 
@@ -4174,6 +5094,7 @@ void static CheckBlockIndex()
             // If pindex was the first with a certain property, unset the corresponding variable.
             if (pindex == pindexFirstInvalid) pindexFirstInvalid = NULL;
             if (pindex == pindexFirstMissing) pindexFirstMissing = NULL;
+            if (pindex == pindexFirstNeverProcessed) pindexFirstNeverProcessed = NULL;
             if (pindex == pindexFirstNotTreeValid) pindexFirstNotTreeValid = NULL;
             if (pindex == pindexFirstNotChainValid) pindexFirstNotChainValid = NULL;
             if (pindex == pindexFirstNotScriptsValid) pindexFirstNotScriptsValid = NULL;
@@ -4202,6 +5123,259 @@ void static CheckBlockIndex()
 
     // Check that we actually traversed the entire map.
     assert(nNodes == forward.size());
+    assert(nNeverProcessed == nBlockIndexHeadersOnly);
+}
+
+bool DumpTxOutSnapshot(const boost::filesystem::path& path, CCoinsStats& stats, uint256& hashSnapshot, std::string& strError)
+{
+    CTxOutSnapshotMetadata metadata;
+    boost::scoped_ptr<CCoinsViewCursor> pcursor;
+    {
+        LOCK(cs_main);
+        FlushStateToDisk();
+        pcursor.reset(pcoinsTip->Cursor());
+        CBlockIndex* pindex = chainActive.Tip();
+        if (!pcursor || pcursor->GetBestBlock() != pindex->GetBlockHash()) {
+            strError = "unable to read the UTXO set";
+            return false;
+        }
+        memcpy(metadata.pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE);
+        metadata.hashBlock = pindex->GetBlockHash();
+        metadata.nHeight = pindex->nHeight;
+        metadata.nMoneySupply = pindex->nMoneySupply;
+        metadata.nMint = pindex->nMint;
+        metadata.nStakeModifier = pindex->nStakeModifier;
+        metadata.nStakeModifierChecksum = pindex->nStakeModifierChecksum;
+        metadata.vTxCount.resize(pindex->nHeight + 1);
+        for (CBlockIndex* pindexWalk = pindex; pindexWalk; pindexWalk = pindexWalk->pprev)
+            metadata.vTxCount[pindexWalk->nHeight] = pindexWalk->nTx;
+    }
+
+    // The cursor reads a database snapshot, so the coins are written without holding cs_main
+    boost::filesystem::path pathTmp = path.string() + ".incomplete";
+    CAutoFile fileout(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull()) {
+        strError = strprintf("unable to open %s for writing", pathTmp.string());
+        return false;
+    }
+    try {
+        if (!WriteTxOutSnapshot(fileout, metadata, *pcursor, stats)) {
+            strError = "unable to read the UTXO set";
+            fileout.fclose();
+            boost::filesystem::remove(pathTmp);
+            return false;
+        }
+        FileCommit(fileout.Get());
+    } catch (const std::exception& e) {
+        strError = strprintf("failed to write %s: %s", pathTmp.string(), e.what());
+        fileout.fclose();
+        boost::filesystem::remove(pathTmp);
+        return false;
+    }
+    fileout.fclose();
+    if (!RenameOver(pathTmp, path)) {
+        strError = strprintf("unable to rename %s to %s", pathTmp.string(), path.string());
+        return false;
+    }
+    hashSnapshot = metadata.GetSnapshotHash(stats.hashSerialized);
+
+    LogPrintf("Wrote UTXO snapshot of block %s at height %d to %s: %u transactions, %u outputs, hash %s\n",
+        stats.hashBlock.ToString(), stats.nHeight, path.string(), stats.nTransactions, stats.nTransactionOutputs, hashSnapshot.ToString());
+    return true;
+}
+
+/** Whether the node can take the chain state a snapshot holds. Requires cs_main. */
+static bool CheckTxOutSnapshotBase(const CTxOutSnapshotMetadata& metadata, CBlockIndex*& pindexBase, std::string& strError)
+{
+    AssertLockHeld(cs_main);
+    if (memcmp(metadata.pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE)) {
+        strError = "snapshot is for a different network";
+        return false;
+    }
+    if (fAddressIndex || fSpentIndex || fTimestampIndex) {
+        strError = "the address, spent and timestamp indexes need the full history, which a snapshot skips";
+        return false;
+    }
+    if (chainActive.Height() != 0) {
+        strError = "a snapshot can only be loaded while the chain state is at the genesis block";
+        return false;
+    }
+    BlockMap::iterator mi = mapBlockIndex.find(metadata.hashBlock);
+    if (mi == mapBlockIndex.end()) {
+        strError = strprintf("snapshot block %s is not among the known headers; wait for the headers to sync", metadata.hashBlock.ToString());
+        return false;
+    }
+    pindexBase = mi->second;
+    if (pindexBase->nHeight == 0) {
+        strError = "snapshot is of the genesis block, there is nothing to load";
+        return false;
+    }
+    if (pindexBase->nHeight != metadata.nHeight || metadata.vTxCount.size() != (size_t)pindexBase->nHeight + 1) {
+        strError = strprintf("snapshot describes block %s at a different height", metadata.hashBlock.ToString());
+        return false;
+    }
+    if (pindexBase->nStatus & BLOCK_FAILED_MASK) {
+        strError = strprintf("snapshot block %s is invalid", metadata.hashBlock.ToString());
+        return false;
+    }
+    if (pindexBestHeader->GetAncestor(pindexBase->nHeight) != pindexBase) {
+        strError = strprintf("snapshot block %s is not on the best header chain", metadata.hashBlock.ToString());
+        return false;
+    }
+    if (pindexBase->nStakeModifier != metadata.nStakeModifier) {
+        strError = strprintf("snapshot stake modifier %016x differs from the one the headers give, %016x", metadata.nStakeModifier, pindexBase->nStakeModifier);
+        return false;
+    }
+    if (!CheckStakeModifierCheckpoints(pindexBase->nHeight, metadata.nStakeModifierChecksum)) {
+        strError = strprintf("snapshot stake modifier checksum %08x is rejected by checkpoint", metadata.nStakeModifierChecksum);
+        return false;
+    }
+    return true;
+}
+
+bool LoadTxOutSnapshot(const boost::filesystem::path& path, const uint256& hashExpected, CCoinsStats& stats, uint256& hashSnapshot, std::string& strError)
+{
+    COutPoint outpoint;
+    Coin coin;
+    CBlockIndex* pindexBase = NULL;
+
+    // First pass: check the file hashes to what it claims to, or what the caller expects,
+    // before touching the chain state. What the caller expects covers the metadata too,
+    // since the block index takes the money supply and stake modifier checksum from it.
+    {
+        CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull()) {
+            strError = strprintf("unable to open %s", path.string());
+            return false;
+        }
+        try {
+            CTxOutSnapshotReader reader(filein);
+            {
+                LOCK(cs_main);
+                if (!CheckTxOutSnapshotBase(reader.metadata, pindexBase, strError))
+                    return false;
+            }
+            while (reader.Next(outpoint, coin))
+                boost::this_thread::interruption_point();
+            if (!reader.Finish(stats, strError))
+                return false;
+            hashSnapshot = reader.metadata.GetSnapshotHash(stats.hashSerialized);
+        } catch (const std::exception& e) {
+            strError = strprintf("failed to read %s: %s", path.string(), e.what());
+            return false;
+        }
+        if (hashExpected != 0 && hashSnapshot != hashExpected) {
+            strError = strprintf("snapshot hashes to %s, expected %s", hashSnapshot.ToString(), hashExpected.ToString());
+            return false;
+        }
+    }
+
+    // Second pass: load the coins. Nothing else may change the chain state meanwhile, and
+    // once the coins database is touched, only a reindex undoes a failure.
+    LOCK(cs_main);
+    int64_t nStart = GetTimeMillis();
+    CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull()) {
+        strError = strprintf("unable to open %s", path.string());
+        return false;
+    }
+    CTxOutSnapshotMetadata metadata;
+    try {
+        CTxOutSnapshotReader reader(filein);
+        metadata = reader.metadata;
+        if (!CheckTxOutSnapshotBase(metadata, pindexBase, strError))
+            return false;
+
+        mempool.clear();
+        if (!pblocktree->WriteFlag("txoutsnapshotloading", true) || !pblocktree->Sync()) {
+            strError = "failed to write to the block index";
+            return false;
+        }
+        while (reader.Next(outpoint, coin)) {
+            pcoinsTip->AddCoin(outpoint, std::move(coin), false);
+            if (pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage) {
+                if (!pcoinsTip->Flush() || (pcoinsWriteBehind && !pcoinsWriteBehind->Sync()))
+                    return AbortNode("Failed to write to coin database");
+            }
+        }
+        CCoinsStats statsLoaded;
+        if (!reader.Finish(statsLoaded, strError) || metadata.GetSnapshotHash(statsLoaded.hashSerialized) != hashSnapshot) {
+            strError = strprintf("%s changed while it was being loaded; restart with -reindex", path.string());
+            return false;
+        }
+    } catch (const std::exception& e) {
+        strError = strprintf("failed to read %s: %s; restart with -reindex", path.string(), e.what());
+        return false;
+    }
+
+    pcoinsTip->SetBestBlock(pindexBase->GetBlockHash());
+    if (!pcoinsTip->Flush() || (pcoinsWriteBehind && !pcoinsWriteBehind->Sync()))
+        return AbortNode("Failed to write to coin database");
+    if (pcoinsPrefetch)
+        pcoinsPrefetch->Clear();
+
+    // The ancestors of the snapshot block count as connected but have no data. Their
+    // transaction counts come from the snapshot, so that nChainTx is right above it.
+    std::vector<CBlockIndex*> vChain;
+    for (CBlockIndex* pindex = pindexBase; pindex->pprev; pindex = pindex->pprev)
+        vChain.push_back(pindex);
+    BOOST_REVERSE_FOREACH (CBlockIndex* pindex, vChain) {
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA)) {
+            if (pindex->nTx == 0)
+                nBlockIndexHeadersOnly--;
+            pindex->nTx = metadata.vTxCount[pindex->nHeight];
+        }
+        pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
+        pindex->RaiseValidity(BLOCK_VALID_SCRIPTS);
+        setDirtyBlockIndex.insert(pindex);
+    }
+    pindexBase->nMoneySupply = metadata.nMoneySupply;
+    pindexBase->nMint = metadata.nMint;
+    pindexBase->nStakeModifierChecksum = metadata.nStakeModifierChecksum;
+    pindexBase->nStatus |= BLOCK_HAVE_STAKE_CHECKSUM;
+
+    chainActive.SetTip(pindexBase);
+    setBlockIndexCandidates.insert(pindexBase);
+
+    // Blocks downloaded earlier that were waiting on these now have all their parents,
+    // as ReceivedBlockTransactions would have found had the parents been downloaded
+    deque<CBlockIndex*> queue(vChain.rbegin(), vChain.rend());
+    queue.push_front(pindexBase->GetAncestor(0));
+    while (!queue.empty()) {
+        CBlockIndex* pindex = queue.front();
+        queue.pop_front();
+        std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex);
+        while (range.first != range.second) {
+            std::multimap<CBlockIndex*, CBlockIndex*>::iterator it = range.first;
+            CBlockIndex* pindexChild = it->second;
+            range.first++;
+            mapBlocksUnlinked.erase(it);
+            if (pindexChild->nChainTx)
+                continue; // On the snapshot chain, and queued already
+            pindexChild->nChainTx = pindex->nChainTx + pindexChild->nTx;
+            {
+                LOCK(cs_nBlockSequenceId);
+                pindexChild->nSequenceId = nBlockSequenceId++;
+            }
+            if (!setBlockIndexCandidates.value_comp()(pindexChild, chainActive.Tip()))
+                setBlockIndexCandidates.insert(pindexChild);
+            queue.push_back(pindexChild);
+        }
+    }
+    PruneBlockIndexCandidates();
+
+    fHavePruned = true;
+    CValidationState state;
+    if (!pblocktree->WriteFlag("prunedblockfiles", true) || !FlushStateToDisk(state, FLUSH_STATE_ALWAYS))
+        return AbortNode("Failed to write to block index");
+    if (!pblocktree->WriteFlag("txoutsnapshotloading", false) || !pblocktree->Sync())
+        return AbortNode("Failed to write to block index");
+    CheckBlockIndex();
+
+    LogPrintf("Loaded UTXO snapshot of block %s at height %d from %s: %u transactions, %u outputs in %dms\n",
+        stats.hashBlock.ToString(), stats.nHeight, path.string(), stats.nTransactions, stats.nTransactionOutputs, GetTimeMillis() - nStart);
+    uiInterface.NotifyBlockTip(pindexBase->GetBlockHash());
+    return ActivateBestChain(state);
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -4269,7 +5443,8 @@ bool static AlreadyHave(const CInv& inv)
         bool txInMap = false;
         txInMap = mempool.exists(inv.hash);
         return txInMap || mapOrphanTransactions.count(inv.hash) ||
-               pcoinsTip->HaveCoins(inv.hash);
+               pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) ||
+               pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
     }
     case MSG_DSTX:
         return mapObfuscationBroadcastTxes.count(inv.hash);
@@ -4282,25 +5457,78 @@ bool static AlreadyHave(const CInv& inv)
         return mapTxLockVote.count(inv.hash);
     case MSG_SPORK:
         return mapSporks.count(inv.hash);
-    case MSG_MASTERNODE_WINNER:
-        if (masternodePayments.mapMasternodePayeeVotes.count(inv.hash)) {
+    case MSG_MASTERNODE_WINNER: {
+        bool fSeen;
+        {
+            LOCK(cs_mapMasternodePayeeVotes);
+            fSeen = masternodePayments.mapMasternodePayeeVotes.count(inv.hash) > 0;
+        }
+        if (fSeen) {
             masternodeSync.AddedMasternodeWinner(inv.hash);
             return true;
         }
         return false;
+    }
     case MSG_MASTERNODE_ANNOUNCE:
-        if (mnodeman.mapSeenMasternodeBroadcast.count(inv.hash)) {
+        if (mnodeman.HasSeenBroadcast(inv.hash)) {
             masternodeSync.AddedMasternodeList(inv.hash);
             return true;
         }
         return false;
     case MSG_MASTERNODE_PING:
-        return mnodeman.mapSeenMasternodePing.count(inv.hash);
+        return mnodeman.HasSeenPing(inv.hash);
     }
     // Don't know what it is, just say we already got one
     return true;
 }
 
+/** Number of serialized "block" messages kept for blocks close to the tip */
+static const unsigned int MAX_BLOCK_MSG_CACHE = 4;
+/** Only blocks at most this many blocks below the tip enter the message cache */
+static const int BLOCK_MSG_CACHE_DEPTH = 6;
+
+static std::map<uint256, CSerializedNetMsgRef> mapBlockMsgCache;
+static std::deque<uint256> vBlockMsgCacheOrder;
+
+/**
+ * Return the complete "block" message for pindex. Blocks near the tip are asked for
+ * by every peer at about the same time, so their message is serialized once and the
+ * same buffer is queued to each of them.
+ */
+static CSerializedNetMsgRef GetBlockMessage(CBlockIndex* pindex)
+{
+    AssertLockHeld(cs_main);
+    const uint256 hash = pindex->GetBlockHash();
+    std::map<uint256, CSerializedNetMsgRef>::iterator mi = mapBlockMsgCache.find(hash);
+    if (mi != mapBlockMsgCache.end())
+        return mi->second;
+
+    // Blocks are stored the way they go over the wire, so a mapped block is
+    // sent as it is without deserializing and serializing it again
+    CSerializedNetMsgRef msg;
+    CDiskBlockView view;
+    if (ReadBlockViewFromDisk(view, pindex)) {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        BeginNetMsg(ss, "block");
+        ss.write(view.begin(), view.size());
+        msg = EndNetMsg(ss);
+    } else {
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindex))
+            assert(!"cannot load block from disk");
+        msg = MakeNetMsg("block", block);
+    }
+
+    if (pindex->nHeight + BLOCK_MSG_CACHE_DEPTH > chainActive.Height()) {
+        if (vBlockMsgCacheOrder.size() >= MAX_BLOCK_MSG_CACHE) {
+            mapBlockMsgCache.erase(vBlockMsgCacheOrder.front());
+            vBlockMsgCacheOrder.pop_front();
+        }
+        mapBlockMsgCache.insert(std::make_pair(hash, msg));
+        vBlockMsgCacheOrder.push_back(hash);
+    }
+    return msg;
+}
 
 void static ProcessGetData(CNode* pfrom)
 {
@@ -4320,7 +5548,7 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK) {
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK) {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end()) {
@@ -4339,14 +5567,24 @@ void static ProcessGetData(CNode* pfrom)
                 }
                 // Don't send not-validated blocks
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
                     if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
+                        pfrom->PushSerializedMessage(GetBlockMessage((*mi).second));
+                    else if (inv.type == MSG_CMPCT_BLOCK) {
+                        // A peer rebuilding an old block would have to ask for most
+                        // of it anyway, so send it in full
+                        if ((*mi).second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
+                            CBlock block;
+                            if (!ReadBlockFromDisk(block, (*mi).second))
+                                assert(!"cannot load block from disk");
+                            pfrom->PushMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+                        } else
+                            pfrom->PushSerializedMessage(GetBlockMessage((*mi).second));
+                    } else // MSG_FILTERED_BLOCK)
                     {
+                        // Send block from disk
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, (*mi).second))
+                            assert(!"cannot load block from disk");
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter) {
                             CMerkleBlock merkleBlock(block, *pfrom->pfilter);
@@ -4382,9 +5620,9 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSerializedNetMsgRef>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushSerializedMessage((*mi).second);
                         pushed = true;
                     }
                 }
@@ -4431,30 +5669,39 @@ void static ProcessGetData(CNode* pfrom)
                 }
 
                 if (!pushed && inv.type == MSG_MASTERNODE_WINNER) {
-                    if (masternodePayments.mapMasternodePayeeVotes.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << masternodePayments.mapMasternodePayeeVotes[inv.hash];
+                    // The vote maps are written from the payments lane
+                    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                    {
+                        LOCK(cs_mapMasternodePayeeVotes);
+                        std::map<uint256, CMasternodePaymentWinner>::iterator mi = masternodePayments.mapMasternodePayeeVotes.find(inv.hash);
+                        if (mi != masternodePayments.mapMasternodePayeeVotes.end()) {
+                            ss.reserve(1000);
+                            ss << mi->second;
+                        }
+                    }
+                    if (!ss.empty()) {
                         pfrom->PushMessage("mnw", ss);
                         pushed = true;
                     }
                 }
 
                 if (!pushed && inv.type == MSG_MASTERNODE_ANNOUNCE) {
-                    if (mnodeman.mapSeenMasternodeBroadcast.count(inv.hash)) {
+                    CMasternodeBroadcast mnb;
+                    if (mnodeman.GetSeenBroadcast(inv.hash, mnb)) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
-                        ss << mnodeman.mapSeenMasternodeBroadcast[inv.hash];
+                        ss << mnb;
                         pfrom->PushMessage("mnb", ss);
                         pushed = true;
                     }
                 }
 
                 if (!pushed && inv.type == MSG_MASTERNODE_PING) {
-                    if (mnodeman.mapSeenMasternodePing.count(inv.hash)) {
+                    CMasternodePing mnp;
+                    if (mnodeman.GetSeenPing(inv.hash, mnp)) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
-                        ss << mnodeman.mapSeenMasternodePing[inv.hash];
+                        ss << mnp;
                         pfrom->PushMessage("mnp", ss);
                         pushed = true;
                     }
@@ -4498,6 +5745,176 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+/** Whether we have the block itself rather than just its header. Requires cs_main. */
+static bool HaveBlockData(const uint256& hash)
+{
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    return mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA);
+}
+
+/** Tell pfrom why its block was rejected and punish it as much as state says */
+static void RejectBlockFromPeer(CNode* pfrom, const CBlock& block, const std::string& strCommand, CValidationState& state)
+{
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), block.GetHash());
+        if (nDoS > 0) {
+            TRY_LOCK(cs_main, lockMain);
+            if (lockMain) Misbehaving(pfrom->GetId(), nDoS);
+        }
+    }
+}
+
+/** Hand a block that pfrom sent in full, or that was rebuilt from its compact block, to ProcessNewBlock */
+static void ProcessBlockFromPeerNow(CNode* pfrom, CBlock& block, const std::string& strCommand, bool fAlreadyChecked = false)
+{
+    CValidationState state;
+    ProcessNewBlock(state, pfrom, &block, NULL, fAlreadyChecked);
+    RejectBlockFromPeer(pfrom, block, strCommand, state);
+    //disconnect this node if its old protocol version
+    pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
+}
+
+/**
+ * Whether block has to wait for its parent, which we know the header of but
+ * not the block itself yet. Requires cs_main.
+ */
+static bool IsBlockAheadOfParent(const CBlock& block, int& nHeight)
+{
+    BlockMap::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
+    if (mi == mapBlockIndex.end() || (mi->second->nStatus & (BLOCK_HAVE_DATA | BLOCK_FAILED_MASK)))
+        return false;
+    nHeight = mi->second->nHeight + 1;
+    return true;
+}
+
+/**
+ * Check what doesn't need the parent of a block that arrived ahead of it, so
+ * that a peer can't fill the pending buffer with blocks that fail anyway, and
+ * the signature is verified while it is waiting rather than when it holds up
+ * the chain.
+ */
+static bool CheckBlockAheadOfParent(CNode* pfrom, const CBlock& block, int nHeight, const std::string& strCommand)
+{
+    CValidationState state;
+    if (CheckBlock(block, state)) {
+        if (!CheckBlockSignature(block))
+            state.DoS(100, error("%s : bad block signature", __func__), REJECT_INVALID, "bad-blk-sig");
+        else if ((nHeight > Params().LAST_POW_BLOCK()) != block.IsProofOfStake())
+            state.DoS(100, error("%s : wrong block type at height %d", __func__, nHeight), REJECT_INVALID, "bad-blk-type");
+    }
+    if (state.IsValid())
+        return true;
+
+    LogPrint("net", "block %s ahead of its parent failed checks peer=%d\n", block.GetHash().ToString(), pfrom->id);
+    {
+        LOCK(cs_main);
+        MarkBlockAsReceived(block.GetHash());
+    }
+    RejectBlockFromPeer(pfrom, block, strCommand, state);
+    return false;
+}
+
+/**
+ * Process a block a peer sent us. Blocks are fetched from several peers at
+ * once, so one can arrive before its parent; it then waits in mapBlocksPending
+ * and is processed right after the parent, together with anything that was
+ * waiting for it in turn.
+ */
+static void ProcessBlockFromPeer(CNode* pfrom, CBlock& block, const std::string& strCommand)
+{
+    uint256 hash = block.GetHash();
+    int nHeight = 0;
+    bool fAhead;
+    {
+        LOCK(cs_main);
+        fAhead = IsBlockAheadOfParent(block, nHeight);
+        if (fAhead && mapBlocksPending.count(hash)) {
+            MarkBlockAsReceived(hash);
+            return;
+        }
+    }
+
+    bool fChecked = false;
+    if (fAhead) {
+        if (!CheckBlockAheadOfParent(pfrom, block, nHeight, strCommand))
+            return;
+        fChecked = true;
+
+        LOCK(cs_main);
+        // The parent may have come in while the block was being checked
+        if (IsBlockAheadOfParent(block, nHeight)) {
+            MarkBlockAsReceived(hash);
+            if (mapBlocksPending.count(hash))
+                return;
+            size_t nSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+            if (nBlocksPendingSize + nSize > MAX_PENDING_BLOCKS_SIZE) {
+                // Dropped; the download window asks for it again once there is room
+                LogPrint("net", "no room for block %s ahead of its parent, dropping it peer=%d\n", hash.ToString(), pfrom->id);
+                return;
+            }
+            PendingBlock& pending = mapBlocksPending[hash];
+            pending.block = block;
+            pending.nodeid = pfrom->GetId();
+            pending.strCommand = strCommand;
+            pending.nSize = nSize;
+            mapBlocksPendingByPrev.insert(make_pair(block.hashPrevBlock, hash));
+            nBlocksPendingSize += nSize;
+            LogPrint("net", "block %s (%d) arrived ahead of its parent, %u blocks waiting peer=%d\n", hash.ToString(),
+                nHeight, mapBlocksPending.size(), pfrom->id);
+            return;
+        }
+    }
+
+    ProcessBlockFromPeerNow(pfrom, block, strCommand, fChecked);
+
+    // Process what was waiting for this block, in chain order
+    std::deque<uint256> queue(1, hash);
+    while (!queue.empty()) {
+        std::vector<PendingBlock> vReady;
+        {
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(queue.front());
+            bool fHaveParent = mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA);
+            std::pair<multimap<uint256, uint256>::iterator, multimap<uint256, uint256>::iterator> range = mapBlocksPendingByPrev.equal_range(queue.front());
+            for (multimap<uint256, uint256>::iterator it = range.first; it != range.second; it++) {
+                map<uint256, PendingBlock>::iterator itPending = mapBlocksPending.find(it->second);
+                nBlocksPendingSize -= itPending->second.nSize;
+                // Children of a block that could not be stored are dropped; if
+                // they are any good they are downloaded again
+                if (fHaveParent)
+                    vReady.push_back(itPending->second);
+                mapBlocksPending.erase(itPending);
+            }
+            mapBlocksPendingByPrev.erase(range.first, range.second);
+            queue.pop_front();
+        }
+
+        BOOST_FOREACH (PendingBlock& pending, vReady) {
+            CNode* pnode = NULL;
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH (CNode* pnodeIter, vNodes) {
+                    if (pnodeIter->GetId() == pending.nodeid && !pnodeIter->fDisconnect) {
+                        pnode = pnodeIter;
+                        pnode->AddRef();
+                        break;
+                    }
+                }
+            }
+            if (pnode) {
+                ProcessBlockFromPeerNow(pnode, pending.block, pending.strCommand, true);
+                pnode->Release();
+            } else {
+                CValidationState state;
+                ProcessNewBlock(state, NULL, &pending.block, NULL, true);
+            }
+            queue.push_back(pending.block.GetHash());
+        }
+    }
+}
+
 bool fRequestedSporksIDB = false;
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
@@ -4639,10 +6056,34 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     else if (strCommand == "verack") {
         pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
 
-        // Mark this node as currently connected, so we update its timestamp later.
-        if (pfrom->fNetworkNode) {
+        {
             LOCK(cs_main);
-            State(pfrom->GetId())->fCurrentlyConnected = true;
+            CNodeState* state = State(pfrom->GetId());
+            state->fGotVerack = true;
+            // Mark this node as currently connected, so we update its timestamp later.
+            if (pfrom->fNetworkNode)
+                state->fCurrentlyConnected = true;
+        }
+
+        // Ask for new blocks as compact blocks. A masternode asks other masternodes
+        // to push them without an inv first, since they need every block quickly.
+        bool fHighBandwidth = fMasterNode && mnodeman.HasMasternodeAt(pfrom->addr);
+        pfrom->PushMessage("sendcmpct", fHighBandwidth, CMPCTBLOCKS_VERSION);
+    }
+
+
+    else if (strCommand == "sendheaders") {
+        pfrom->fPreferHeaders = true;
+    }
+
+
+    else if (strCommand == "sendcmpct") {
+        bool fAnnounceUsingCmpctBlock = false;
+        uint64_t nCmpctBlockVersion = 0;
+        vRecv >> fAnnounceUsingCmpctBlock >> nCmpctBlockVersion;
+        if (nCmpctBlockVersion == CMPCTBLOCKS_VERSION) {
+            pfrom->fSupportsCompactBlocks = true;
+            pfrom->fPreferHighBandwidthCompact = fAnnounceUsingCmpctBlock;
         }
     }
 
@@ -4738,9 +6179,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
             if (inv.type == MSG_BLOCK) {
                 UpdateBlockAvailability(pfrom->GetId(), inv.hash);
-                if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
-                    // Add this to the list of blocks to request
-                    vToFetch.push_back(inv);
+                if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash) && pfrom->fPreferHeaders) {
+                    // Get the headers leading up to it first; the block download
+                    // window fetches the blocks from there
+                    pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
+                    LogPrint("net", "getheaders (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                } else if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
+                    // Add this to the list of blocks to request; a new block at the tip
+                    // mostly holds transactions we have already, so ask for it compact
+                    if (pfrom->fSupportsCompactBlocks && !IsInitialBlockDownload())
+                        vToFetch.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                    else
+                        vToFetch.push_back(inv);
                     LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
                 }
             }
@@ -4779,7 +6229,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "getblocks" || strCommand == "getheaders") {
+    else if (strCommand == "getblocks") {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
@@ -4811,16 +6261,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "headers" && Params().HeadersFirstSyncingActive()) {
+    else if (strCommand == "getheaders") {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
 
         LOCK(cs_main);
 
-        if (IsInitialBlockDownload())
-            return true;
-
         CBlockIndex* pindex = NULL;
         if (locator.IsNull()) {
             // If locator is null, return the hashStop block
@@ -4838,8 +6285,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
         vector<CBlock> vHeaders;
         int nLimit = MAX_HEADERS_RESULTS;
-        if (fDebug)
-            LogPrintf("getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
+        LogPrint("net", "getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
         for (; pindex; pindex = chainActive.Next(pindex)) {
             vHeaders.push_back(pindex->GetBlockHeader());
             if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
@@ -4887,6 +6333,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
                 ignoreFees = true;
                 pmn->allowFreeTx = false;
+                mnodeman.SetMasternodeDirty(vin.prevout);
 
                 if (!mapObfuscationBroadcastTxes.count(tx.GetHash())) {
                     CObfuscationBroadcastTx dstx;
@@ -5020,9 +6467,22 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         if (nCount == 0) {
             // Nothing interesting. Stop asking this peers for more headers.
+            if (State(pfrom->GetId())->fSyncStarted)
+                fHeadersSynced = true;
             return true;
         }
+
+        // An announcement that doesn't connect to anything we know; ask for what leads up to it
+        if (!mapBlockIndex.count(headers[0].hashPrevBlock) && headers[0].GetHash() != Params().HashGenesisBlock()) {
+            UpdateBlockAvailability(pfrom->GetId(), headers.back().GetHash());
+            pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256(0));
+            LogPrint("net", "unconnecting headers, getheaders (%d) to peer=%d\n", pindexBestHeader->nHeight, pfrom->id);
+            return true;
+        }
+
         CBlockIndex* pindexLast = NULL;
+        bool fDeferred = false;
+        bool fTooMany = false;
         BOOST_FOREACH (const CBlockHeader& header, headers) {
             CValidationState state;
             if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
@@ -5030,6 +6490,28 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 return error("non-continuous headers sequence");
             }
 
+            BlockMap::iterator mi = mapBlockIndex.find(header.hashPrevBlock);
+            if (!mapBlockIndex.count(header.GetHash()) && mi != mapBlockIndex.end()) {
+                // Don't let headers run further ahead of the blocks that were actually
+                // checked than block download can close; the rest is asked for again later
+                if (mi->second->nHeight + 1 > chainActive.Height() + MAX_UNVERIFIED_HEADERS) {
+                    fDeferred = true;
+                    break;
+                }
+                // Nor let them fork off anywhere without bound; only the best header chain
+                // still grows once the index is full of headers whose blocks never came
+                if (nBlockIndexHeadersOnly >= MAX_HEADERS_WITHOUT_DATA && mi->second != pindexBestHeader) {
+                    fTooMany = true;
+                    break;
+                }
+                if (!CheckHeaderBeforeBlock(header, state, mi->second)) {
+                    int nDoS;
+                    if (state.IsInvalid(nDoS) && nDoS > 0)
+                        Misbehaving(pfrom->GetId(), nDoS);
+                    return error("invalid header received %s", header.GetHash().ToString());
+                }
+            }
+
             /*TODO: this has a CBlock cast on it so that it will compile. There should be a solution for this
              * before headers are reimplemented on mainnet
              */
@@ -5046,13 +6528,43 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         if (pindexLast)
             UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
-
-        if (nCount == MAX_HEADERS_RESULTS && pindexLast) {
+        State(pfrom->GetId())->fHeadersDeferred = fDeferred;
+        if (nCount < MAX_HEADERS_RESULTS && !fDeferred && !fTooMany && State(pfrom->GetId())->fSyncStarted)
+            fHeadersSynced = true;
+
+        if (fDeferred) {
+            LogPrint("net", "deferring headers past %d from peer=%d until blocks catch up\n", pindexLast ? pindexLast->nHeight : chainActive.Height(), pfrom->id);
+        } else if (fTooMany) {
+            LogPrint("net", "ignoring headers off the best header chain from peer=%d, %d headers are waiting for their blocks\n", pfrom->id, nBlockIndexHeadersOnly);
+        } else if (nCount == MAX_HEADERS_RESULTS && pindexLast) {
             // Headers message had its maximum size; the peer may have more headers.
             // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
             // from there instead.
-            LogPrintf("more getheaders (%d) to end to peer=%d (startheight:%d)\n", pindexLast->nHeight, pfrom->id, pfrom->nStartingHeight);
+            LogPrint("net", "more getheaders (%d) to end to peer=%d (startheight:%d)\n", pindexLast->nHeight, pfrom->id, pfrom->nStartingHeight);
             pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexLast), uint256(0));
+        } else if (pindexLast && !IsInitialBlockDownload() && pindexLast->IsValid(BLOCK_VALID_TREE) &&
+                   pindexLast->nChainWork >= chainActive.Tip()->nChainWork) {
+            // A new block was announced to us; fetch it right away from the peer that
+            // has it rather than waiting for a download slot, unless it is too far ahead
+            vector<CBlockIndex*> vToFetch;
+            CBlockIndex* pindexWalk = pindexLast;
+            while (pindexWalk && !chainActive.Contains(pindexWalk) && vToFetch.size() <= (unsigned int)MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                if (!(pindexWalk->nStatus & BLOCK_HAVE_DATA) && !mapBlocksInFlight.count(pindexWalk->GetBlockHash()) &&
+                    !mapBlocksPending.count(pindexWalk->GetBlockHash()))
+                    vToFetch.push_back(pindexWalk);
+                pindexWalk = pindexWalk->pprev;
+            }
+            if (pindexWalk && chainActive.Contains(pindexWalk) && !vToFetch.empty()) {
+                vector<CInv> vGetData;
+                BOOST_REVERSE_FOREACH (CBlockIndex* pindex, vToFetch) {
+                    // Only the block on top of our tip is likely to be made of mempool transactions
+                    bool fCompact = pfrom->fSupportsCompactBlocks && pindex->pprev == chainActive.Tip();
+                    vGetData.push_back(CInv(fCompact ? MSG_CMPCT_BLOCK : MSG_BLOCK, pindex->GetBlockHash()));
+                    MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), pindex);
+                    LogPrint("net", "Requesting announced block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(), pindex->nHeight, pfrom->id);
+                }
+                pfrom->PushMessage("getdata", vGetData);
+            }
         }
 
         CheckBlockIndex();
@@ -5068,7 +6580,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         //sometimes we will be sent their most recent block and its not the one we want, in that case tell where we are
         if (!mapBlockIndex.count(block.hashPrevBlock)) {
-            if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), hashBlock) != pfrom->vBlockRequested.end()) {
+            if (pfrom->fPreferHeaders) {
+                LOCK(cs_main);
+                pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), hashBlock);
+            } else if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), hashBlock) != pfrom->vBlockRequested.end()) {
                 //we already asked for this block, so lets work backwards and ask for the previous block
                 pfrom->PushMessage("getblocks", chainActive.GetLocator(), block.hashPrevBlock);
                 pfrom->vBlockRequested.push_back(block.hashPrevBlock);
@@ -5080,26 +6595,144 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         } else {
             pfrom->AddInventoryKnown(inv);
 
-            CValidationState state;
-            if (!mapBlockIndex.count(block.GetHash())) {
-                ProcessNewBlock(state, pfrom, &block);
-                int nDoS;
-                if(state.IsInvalid(nDoS)) {
-                    pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                                       state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-                    if(nDoS > 0) {
-                        TRY_LOCK(cs_main, lockMain);
-                        if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
-                    }
-                }
-                //disconnect this node if its old protocol version
-                pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
+            bool fHaveData;
+            {
+                LOCK(cs_main);
+                fHaveData = HaveBlockData(hashBlock);
+            }
+            if (!fHaveData) {
+                ProcessBlockFromPeer(pfrom, block, strCommand);
             } else {
                 LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
             }
         }
     }
 
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+        CInv inv(MSG_BLOCK, hashBlock);
+        LogPrint("net", "received cmpctblock %s peer=%d\n", hashBlock.ToString(), pfrom->id);
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+            pfrom->AddInventoryKnown(inv);
+            if (HaveBlockData(hashBlock))
+                return true;
+
+            // Without the parent the block can't be connected yet; the full block
+            // handler knows how to ask for what is missing
+            if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock)) {
+                pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+                return true;
+            }
+
+            std::shared_ptr<PartiallyDownloadedBlock> partialBlock(new PartiallyDownloadedBlock(&mempool));
+            ReadStatus status = partialBlock->InitData(cmpctblock);
+            if (status == READ_STATUS_INVALID) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer %d sent us an invalid compact block", pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                // Short ID collision; ask for the full block
+                pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+                return true;
+            }
+
+            BlockTransactionsRequest req;
+            for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                if (!partialBlock->IsTxAvailable(i))
+                    req.indexes.push_back(i);
+            }
+            if (!req.indexes.empty()) {
+                req.blockhash = hashBlock;
+                CNodeState* nodestate = State(pfrom->GetId());
+                nodestate->partialBlock = partialBlock;
+                nodestate->hashPartialBlock = hashBlock;
+                pfrom->PushMessage("getblocktxn", req);
+                return true;
+            }
+
+            // Everything was prefilled or in the mempool
+            status = partialBlock->FillBlock(block, std::vector<CTransaction>());
+            if (status != READ_STATUS_OK) {
+                pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+                return true;
+            }
+        }
+        ProcessBlockFromPeer(pfrom, block, strCommand);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+            CNodeState* nodestate = State(pfrom->GetId());
+            if (!nodestate->partialBlock || nodestate->hashPartialBlock != resp.blockhash) {
+                LogPrint("net", "peer %d sent us block transactions for a block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+            std::shared_ptr<PartiallyDownloadedBlock> partialBlock = nodestate->partialBlock;
+            nodestate->partialBlock.reset();
+
+            ReadStatus status = partialBlock->FillBlock(block, resp.txn);
+            if (status == READ_STATUS_INVALID) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer %d sent us block transactions not matching its compact block", pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                // A short ID probably matched the wrong mempool transaction
+                pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, resp.blockhash)));
+                return true;
+            }
+            if (HaveBlockData(resp.blockhash))
+                return true;
+        }
+        ProcessBlockFromPeer(pfrom, block, strCommand);
+    }
+
+
+    else if (strCommand == "getblocktxn") {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrint("net", "peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+
+        // Only recent blocks of the active chain are served piecewise; anything
+        // else goes through the usual getdata checks and is sent in full
+        if (!chainActive.Contains(mi->second) || mi->second->nHeight < chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom);
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, mi->second))
+            assert(!"cannot load block from disk");
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer %d sent us a getblocktxn with out-of-bounds tx indices", pfrom->id);
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
     // This asymmetric behavior for inbound and outbound connections was introduced
     // to prevent a fingerprinting attack: an attacker can send specific fake addresses
     // to users' AddrMan and later request them by sending getaddr messages.
@@ -5338,6 +6971,152 @@ int ActiveProtocol()
 }
 
 // requires LOCK(cs_vRecvMsg)
+/**
+ * Message lanes for the message worker threads. Gossip handled by the masternode,
+ * payment, spork, SwiftX and obfuscation subsystems doesn't depend on the main
+ * handler's state, so it can be processed off that thread. The handlers were written
+ * for a single message thread though, so each lane still handles one message at a
+ * time; different lanes run in parallel.
+ */
+enum MessageLane {
+    LANE_MAIN,      // processed in order on the main message handler thread
+    LANE_UNORDERED, // stateless, any number may run at once
+    LANE_MASTERNODE,
+    LANE_PAYMENTS,
+    LANE_SPORK,
+    LANE_SWIFTTX,
+    LANE_OBFUSCATION,
+
+    LANE_MAX
+};
+
+static CCriticalSection cs_messageLane[LANE_MAX];
+
+static MessageLane GetMessageLane(const string& strCommand)
+{
+    if (strCommand == "ping")
+        return LANE_UNORDERED;
+    if (strCommand == "mnb" || strCommand == "mnp" || strCommand == "dseg" ||
+        strCommand == "dsee" || strCommand == "dseep" || strCommand == "ssc" ||
+        strCommand == "getmnlist" || strCommand == "mnlistdiff")
+        return LANE_MASTERNODE;
+    if (strCommand == "mnget" || strCommand == "mnw")
+        return LANE_PAYMENTS;
+    if (strCommand == "spork" || strCommand == "getsporks")
+        return LANE_SPORK;
+    if (strCommand == "ix" || strCommand == "txlvote")
+        return LANE_SWIFTTX;
+    if (strCommand == "dsa" || strCommand == "dsi" || strCommand == "dsq" || strCommand == "dssu" ||
+        strCommand == "dss" || strCommand == "dsf" || strCommand == "dsc")
+        return LANE_OBFUSCATION;
+    return LANE_MAIN;
+}
+
+/** Run a validated message through ProcessMessage, logging rather than propagating its errors */
+static void HandleMessage(CNode* pfrom, CNetMessage& msg)
+{
+    string strCommand = msg.hdr.GetCommand();
+    unsigned int nMessageSize = msg.hdr.nMessageSize;
+    CDataStream& vRecv = msg.vRecv;
+    int64_t nTimeStart = GetTimeMicros();
+
+    bool fRet = false;
+    try {
+        fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+        boost::this_thread::interruption_point();
+    } catch (std::ios_base::failure& e) {
+        pfrom->PushMessage("reject", strCommand, REJECT_MALFORMED, string("error parsing message"));
+        if (strstr(e.what(), "end of data")) {
+            // Allow exceptions from under-length message on vRecv
+            LogPrintf("ProcessMessages(%s, %u bytes): Exception '%s' caught, normally caused by a message being shorter than its stated length\n", SanitizeString(strCommand), nMessageSize, e.what());
+        } else if (strstr(e.what(), "size too large")) {
+            // Allow exceptions from over-long size
+            LogPrintf("ProcessMessages(%s, %u bytes): Exception '%s' caught\n", SanitizeString(strCommand), nMessageSize, e.what());
+        } else {
+            PrintExceptionContinue(&e, "ProcessMessages()");
+        }
+    } catch (boost::thread_interrupted) {
+        throw;
+    } catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ProcessMessages()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ProcessMessages()");
+    }
+
+    if (!fRet)
+        LogPrintf("ProcessMessage(%s, %u bytes) FAILED peer=%d\n", SanitizeString(strCommand), nMessageSize, pfrom->id);
+
+    int64_t nTimeEnd = GetTimeMicros();
+    RecordMessageLatency(strCommand, nTimeEnd - msg.nTime, nTimeEnd - nTimeStart);
+}
+
+/**
+ * Start recovering the signers of gossip about to wait in a worker queue, so its
+ * handler finds them ready. Malformed messages are left for the handler to reject.
+ */
+static void QueueMessageSignatures(CNode* pfrom, const string& strCommand, const CDataStream& vRecv)
+{
+    if (!messageSigVerifier.IsRunning())
+        return;
+
+    CDataStream ss(vRecv);
+    try {
+        if (strCommand == "mnb") {
+            CMasternodeBroadcast mnb;
+            ss >> mnb;
+            messageSigVerifier.Queue(mnb.GetNewStrMessage(), mnb.sig);
+            messageSigVerifier.Queue(mnb.lastPing.GetStrMessage(), mnb.lastPing.vchSig);
+        } else if (strCommand == "mnp") {
+            CMasternodePing mnp;
+            ss >> mnp;
+            messageSigVerifier.Queue(mnp.GetStrMessage(), mnp.vchSig);
+        } else if (strCommand == "mnlistdiff") {
+            // Lists are only checked when we asked for them; anyone else's would be recovered for nothing
+            if (!mnodeman.IsListDiffRequested(pfrom->GetId()))
+                return;
+            CMasternodeListDiff diff;
+            ss >> diff;
+            BOOST_FOREACH (CMasternodeBroadcast& mnb, diff.vBroadcasts) {
+                messageSigVerifier.Queue(mnb.GetNewStrMessage(), mnb.sig);
+                messageSigVerifier.Queue(mnb.lastPing.GetStrMessage(), mnb.lastPing.vchSig);
+            }
+            BOOST_FOREACH (const CMasternodePing& mnp, diff.vPings)
+                messageSigVerifier.Queue(mnp.GetStrMessage(), mnp.vchSig);
+        } else if (strCommand == "mnw") {
+            CMasternodePaymentWinner winner;
+            ss >> winner;
+            messageSigVerifier.Queue(winner.GetStrMessage(), winner.vchSig);
+        } else if (strCommand == "spork") {
+            CSporkMessage spork;
+            ss >> spork;
+            messageSigVerifier.Queue(spork.GetStrMessage(), spork.vchSig);
+        } else if (strCommand == "txlvote") {
+            CConsensusVote vote;
+            ss >> vote;
+            messageSigVerifier.Queue(vote.GetStrMessage(), vote.vchMasterNodeSignature);
+        }
+    } catch (const std::exception&) {
+    }
+}
+
+void ProcessWorkerMessage(CNode* pfrom, CNetMessage& msg)
+{
+    MessageLane lane = GetMessageLane(msg.hdr.GetCommand());
+    if (lane == LANE_UNORDERED) {
+        HandleMessage(pfrom, msg);
+        return;
+    }
+
+    LOCK(cs_messageLane[lane]);
+    if (lane == LANE_SPORK || lane == LANE_SWIFTTX) {
+        // Spork and SwiftX state has no lock of its own and is read by validation under cs_main
+        LOCK(cs_main);
+        HandleMessage(pfrom, msg);
+    } else {
+        HandleMessage(pfrom, msg);
+    }
+}
+
 bool ProcessMessages(CNode* pfrom)
 {
     //
@@ -5362,6 +7141,10 @@ bool ProcessMessages(CNode* pfrom)
         if (pfrom->nSendSize >= SendBufferSize())
             break;
 
+        // Let the message worker threads catch up with this peer's gossip first
+        if (pfrom->GetWorkerQueueSize() >= ReceiveFloodSize())
+            break;
+
         // get next message
         CNetMessage& msg = *it;
 
@@ -5401,32 +7184,14 @@ bool ProcessMessages(CNode* pfrom)
             continue;
         }
 
-        // Process message
-        bool fRet = false;
-        try {
-            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
-            boost::this_thread::interruption_point();
-        } catch (std::ios_base::failure& e) {
-            pfrom->PushMessage("reject", strCommand, REJECT_MALFORMED, string("error parsing message"));
-            if (strstr(e.what(), "end of data")) {
-                // Allow exceptions from under-length message on vRecv
-                LogPrintf("ProcessMessages(%s, %u bytes): Exception '%s' caught, normally caused by a message being shorter than its stated length\n", SanitizeString(strCommand), nMessageSize, e.what());
-            } else if (strstr(e.what(), "size too large")) {
-                // Allow exceptions from over-long size
-                LogPrintf("ProcessMessages(%s, %u bytes): Exception '%s' caught\n", SanitizeString(strCommand), nMessageSize, e.what());
-            } else {
-                PrintExceptionContinue(&e, "ProcessMessages()");
-            }
-        } catch (boost::thread_interrupted) {
-            throw;
-        } catch (std::exception& e) {
-            PrintExceptionContinue(&e, "ProcessMessages()");
-        } catch (...) {
-            PrintExceptionContinue(NULL, "ProcessMessages()");
+        // Gossip that doesn't need cs_main is handed to the message worker threads
+        if (nMessageWorkerThreads > 0 && pfrom->nVersion != 0 && GetMessageLane(strCommand) != LANE_MAIN) {
+            QueueMessageSignatures(pfrom, strCommand, msg.vRecv);
+            pfrom->QueueWorkerMessage(msg);
+            continue;
         }
 
-        if (!fRet)
-            LogPrintf("ProcessMessage(%s, %u bytes) FAILED peer=%d\n", SanitizeString(strCommand), nMessageSize, pfrom->id);
+        HandleMessage(pfrom, msg);
 
         break;
     }
@@ -5540,15 +7305,30 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (pindexBestHeader == NULL)
             pindexBestHeader = chainActive.Tip();
         bool fFetch = state.fPreferredDownload || (nPreferredDownload == 0 && !pto->fClient && !pto->fOneShot); // Download if this is a nice peer, or we have no nice peers and this one might do.
-        if (!state.fSyncStarted && !pto->fClient && fFetch /*&& !fImporting*/ && !fReindex) {
+        // Wait for the verack, so that we know whether the peer sends headers
+        if (!state.fSyncStarted && state.fGotVerack && !pto->fClient && fFetch /*&& !fImporting*/ && !fReindex) {
             // Only actively request headers from a single peer, unless we're close to end of initial download.
-            if (nSyncStarted == 0 || pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 6 * 60 * 60) { // NOTE: was "close to today" and 24h in Bitcoin
+            if (nSyncStarted == 0 || (fHeadersSynced && pto->fPreferHeaders) || pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 6 * 60 * 60) { // NOTE: was "close to today" and 24h in Bitcoin
                 state.fSyncStarted = true;
                 nSyncStarted++;
-                //CBlockIndex *pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
-                //LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
-                //pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
-                pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                if (pto->fPreferHeaders && Params().HeadersFirstSyncingActive()) {
+                    // The headers let every peer that has the blocks download them in parallel
+                    CBlockIndex* pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
+                    LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
+                    pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
+                } else {
+                    pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                }
+            }
+        }
+
+        // Pick up the headers we held back once block download has closed half the gap
+        if (state.fHeadersDeferred) {
+            CBlockIndex* pindexResume = state.pindexBestKnownBlock ? state.pindexBestKnownBlock : pindexBestHeader;
+            if (pindexResume->nHeight < chainActive.Height() + MAX_UNVERIFIED_HEADERS / 2) {
+                state.fHeadersDeferred = false;
+                LogPrint("net", "resuming getheaders (%d) to peer=%d\n", pindexResume->nHeight, pto->id);
+                pto->PushMessage("getheaders", chainActive.GetLocator(pindexResume), uint256(0));
             }
         }
 
@@ -5625,20 +7405,24 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && fFetch && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        if (!pto->fDisconnect && !pto->fClient && fFetch && state.nBlocksInFlight < state.nBlocksInFlightLimit) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            FindNextBlocksToDownload(pto->GetId(), state.nBlocksInFlightLimit - state.nBlocksInFlight, vToDownload, staller);
             BOOST_FOREACH (CBlockIndex* pindex, vToDownload) {
                 vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), pindex);
-                LogPrintf("Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
+                LogPrint("net", "Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
                     pindex->nHeight, pto->id);
             }
             if (state.nBlocksInFlight == 0 && staller != -1) {
-                if (State(staller)->nStallingSince == 0) {
-                    State(staller)->nStallingSince = nNow;
-                    LogPrint("net", "Stall started peer=%d\n", staller);
+                CNodeState* stateStaller = State(staller);
+                if (stateStaller->nStallingSince == 0) {
+                    stateStaller->nStallingSince = nNow;
+                    // Multiplicative decrease: the window is stuck on this peer, so
+                    // give it less to hold up from now on
+                    stateStaller->nBlocksInFlightLimit = std::max(stateStaller->nBlocksInFlightLimit / 2, MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+                    LogPrint("net", "Stall started peer=%d, in-flight limit now %d\n", staller, stateStaller->nBlocksInFlightLimit);
                 }
             }
         }
@@ -5695,16 +7479,20 @@ bool CBlockUndo::WriteToDisk(CDiskBlockPos& pos, const uint256& hashBlock)
 
 bool CBlockUndo::ReadFromDisk(const CDiskBlockPos& pos, const uint256& hashBlock)
 {
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("CBlockUndo::ReadFromDisk : OpenBlockFile failed");
-
     // Read block
     uint256 hashChecksum;
     try {
-        filein >> *this;
-        filein >> hashChecksum;
+        CDiskBlockView view;
+        if (blockFileMapper.GetRecord(pos, "rev", sizeof(hashChecksum), view)) {
+            view.GetReader() >> *this >> hashChecksum;
+        } else {
+            // Open history file to read
+            CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+            if (filein.IsNull())
+                return error("CBlockUndo::ReadFromDisk : OpenBlockFile failed");
+            filein >> *this;
+            filein >> hashChecksum;
+        }
     } catch (std::exception& e) {
         return error("%s : Deserialize or I/O error - %s", __func__, e.what());
     }
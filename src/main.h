@@ -13,7 +13,9 @@
 #include "config/byron-config.h"
 #endif
 
+#include "addressindex.h"
 #include "amount.h"
+#include "blockstore.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "coins.h"
@@ -24,7 +26,9 @@
 #include "script/script.h"
 #include "script/sigcache.h"
 #include "script/standard.h"
+#include "spentindex.h"
 #include "sync.h"
+#include "timestampindex.h"
 #include "tinyformat.h"
 #include "txmempool.h"
 #include "uint256.h"
@@ -52,6 +56,7 @@ class CValidationState;
 
 struct CBlockTemplate;
 struct CNodeStateStats;
+struct CAssumeValidStats;
 
 /** Default for -blockmaxsize and -blockminsize, which control the range of sizes the mining code will create **/
 static const unsigned int DEFAULT_BLOCK_MAX_SIZE = 750000;
@@ -60,6 +65,10 @@ static const unsigned int DEFAULT_BLOCK_MIN_SIZE = 0;
 static const unsigned int DEFAULT_BLOCK_PRIORITY_SIZE = 50000;
 /** Default for accepting alerts from the P2P network. */
 static const bool DEFAULT_ALERTS = true;
+/** Defaults for the optional address, spent output and block timestamp indexes */
+static const bool DEFAULT_ADDRESSINDEX = false;
+static const bool DEFAULT_SPENTINDEX = false;
+static const bool DEFAULT_TIMESTAMPINDEX = false;
 /** The maximum size for transactions we're willing to relay/mine */
 static const unsigned int MAX_STANDARD_TX_SIZE = 100000;
 static const unsigned int MAX_ZEROCOIN_TX_SIZE = 150000;
@@ -73,20 +82,57 @@ static const unsigned int MAX_TX_SIGOPS_CURRENT = MAX_BLOCK_SIGOPS_CURRENT / 5;
 static const unsigned int MAX_TX_SIGOPS_LEGACY = MAX_BLOCK_SIGOPS_LEGACY / 5;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -limitancestorcount, max number of in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, max number of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -maxmempool, maximum megabytes of mempool memory usage */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/**
+ * Blocks below the tip that -prune always keeps on disk: a day's worth, well past the
+ * deepest reorganization allowed (MaxReorganizationDepth). Stake modifiers, masternode
+ * scores and collateral checks only need the block index and the UTXO set.
+ */
+static const unsigned int MIN_BLOCKS_TO_KEEP = 1440;
+/** The smallest -prune target, in bytes */
+static const uint64_t MIN_DISK_SPACE_FOR_BLOCK_FILES = 550 * 1024 * 1024;
 /** Coinbase transaction outputs can only be spent after this number of new blocks (network rule) */
 static const int COINBASE_MATURITY = 20;
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
-static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Maximum number of coins prefetch threads allowed */
+static const int MAX_PREFETCH_THREADS = 16;
+/** -prefetchthreads default (number of threads reading block inputs ahead of ConnectBlock, 0 = disabled) */
+static const int DEFAULT_PREFETCH_THREADS = 2;
+/** Number of blocks past the one being connected whose inputs are prefetched */
+static const int PREFETCH_BLOCKS_AHEAD = 2;
+/** -asyncflush default (write chainstate flushes to disk from a background thread) */
+static const bool DEFAULT_ASYNC_FLUSH = true;
+/** Number of blocks that can be requested at any given time from a single peer. Each peer starts at
+ *  the default and moves between the minimum and maximum depending on how quickly it delivers. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+static const int DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER = 8;
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 32;
+/** A peer that keeps its requests filled and delivers within this many seconds gets more in flight. */
+static const unsigned int BLOCK_DOWNLOAD_TARGET_LATENCY = 2;
+/** Maximum total size of blocks downloaded ahead of their parent and kept until it arrives. */
+static const unsigned int MAX_PENDING_BLOCKS_SIZE = 64 * 1000 * 1000;
+/** Blocks deeper than this below the tip are sent in full when asked for as a compact block. */
+static const int MAX_CMPCTBLOCK_DEPTH = 10;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
@@ -97,6 +143,12 @@ static const unsigned int MAX_HEADERS_RESULTS = 2000;
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
  *  harder). We'll probably want to make this a per-peer adaptive value at some point. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** How far beyond the active chain headers are accepted while syncing. A proof-of-stake header
+ *  costs nothing to make, so headers only run this far ahead of blocks that were fully checked. */
+static const int MAX_UNVERIFIED_HEADERS = 4 * MAX_HEADERS_RESULTS;
+/** How many headers whose block never arrived the block index may hold. The limit above only bounds
+ *  their height, not how many forks they make; past this only the best header chain is extended. */
+static const int MAX_HEADERS_WITHOUT_DATA = 2 * MAX_UNVERIFIED_HEADERS;
 /** Time to wait (in seconds) between writing blockchain state to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 3600;
 /** Maximum length of reject messages. */
@@ -133,13 +185,23 @@ extern CConditionVariable cvBlockChange;
 extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
+extern int nPrefetchThreads;
 extern bool fTxIndex;
+extern bool fAddressIndex;
+extern bool fSpentIndex;
+extern bool fTimestampIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
-extern unsigned int nCoinCacheSize;
+extern size_t nCoinCacheUsage;
 extern CFeeRate minRelayTxFee;
 extern bool fAlerts;
 extern bool fVerifyingBlocks;
+/** Whether blocks of the active chain may lack their data: it was pruned, or never downloaded because the chain state came from a UTXO snapshot */
+extern bool fHavePruned;
+/** True if we're running in -prune mode */
+extern bool fPruneMode;
+/** Number of bytes of block and undo files -prune aims to keep on disk */
+extern uint64_t nPruneTarget;
 
 extern bool fLargeWorkForkFound;
 extern bool fLargeWorkInvalidChainFound;
@@ -156,6 +218,8 @@ extern std::map<uint256, int64_t> mapZerocoinspends; //txid, time received
 
 /** Best header we've seen so far (used for getheaders queries' starting points). */
 extern CBlockIndex* pindexBestHeader;
+/** Block whose ancestors are connected without checking their scripts (-assumevalid), or 0 */
+extern uint256 hashAssumeValid;
 
 /** Minimum disk space required - used in CheckDiskSpace() */
 static const uint64_t nMinDiskSpace = 52428800;
@@ -174,9 +238,10 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals);
  * @param[in]   pfrom   The node which we are receiving the block from; it is added to mapBlockSource and may be penalised if the block is invalid.
  * @param[in]   pblock  The block we want to process.
  * @param[out]  dbp     If pblock is stored to disk (or already there), this will be set to its location.
+ * @param[in]   fAlreadyChecked  Whether the caller already ran CheckBlock and CheckBlockSignature on pblock.
  * @return True if state.IsValid()
  */
-bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp = NULL);
+bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp = NULL, bool fAlreadyChecked = false);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64_t nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
@@ -187,6 +252,15 @@ FILE* OpenUndoFile(const CDiskBlockPos& pos, bool fReadOnly = false);
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos& pos, const char* prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp = NULL);
+/** Write the UTXO set at the active tip to a snapshot file, see txoutsnapshot.h */
+bool DumpTxOutSnapshot(const boost::filesystem::path& path, CCoinsStats& stats, uint256& hashSnapshot, std::string& strError);
+/**
+ * Replace the chain state, which must be at the genesis block, with the one a snapshot
+ * holds, and continue syncing from the snapshot block. Its ancestors are treated as
+ * valid without their data. A non-zero hashExpected must match the snapshot's hash,
+ * which covers its metadata as well as its coins.
+ */
+bool LoadTxOutSnapshot(const boost::filesystem::path& path, const uint256& hashExpected, CCoinsStats& stats, uint256& hashSnapshot, std::string& strError);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
@@ -197,6 +271,8 @@ void UnloadBlockIndex();
 int ActiveProtocol();
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
+/** Process a gossip message that ProcessMessages handed to the message worker threads */
+void ProcessWorkerMessage(CNode* pfrom, CNetMessage& msg);
 /**
  * Send queued protocol messages to be sent to a give node.
  *
@@ -206,6 +282,8 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the coins prefetch thread */
+void ThreadCoinsPrefetch();
 
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
@@ -229,18 +307,29 @@ CBlockIndex* InsertBlockIndex(uint256 hash);
 bool AbortNode(const std::string& msg, const std::string& userMessage = "");
 /** Get statistics from node state */
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats& stats);
+/** Get how much script checking connecting blocks has skipped so far. Requires cs_main. */
+void GetAssumeValidStats(CAssumeValidStats& stats);
 /** Increase a node's misbehavior score. */
 void Misbehaving(NodeId nodeid, int howmuch);
 /** Flush all state, indexes and buffers to disk. */
 void FlushStateToDisk();
+/** Delete the block files -prune no longer needs, then flush */
+void PruneAndFlush();
+/** Number of bytes the block and undo files use */
+uint64_t CalculateCurrentUsage();
 
 
 /** (try to) add transaction to memory pool **/
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool ignoreFees = false);
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool ignoreFees = false, bool fOverrideMempoolLimit = false);
+
+/** Expire old transactions and trim the pool to the given size in bytes */
+void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age);
 
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool isDSTX = false);
 
 int GetInputAge(CTxIn& vin);
+/** Look up an unspent output in the chain state, which unlike its transaction stays available when blocks are pruned */
+bool GetUTXOCoin(const COutPoint& outpoint, Coin& coin);
 int GetInputAgeIX(uint256 nTXHash, CTxIn& vin);
 int GetIXConfirmations(uint256 nTXHash);
 
@@ -249,6 +338,15 @@ struct CNodeStateStats {
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    int nBlocksInFlightLimit;
+    int64_t nBlocksDownloaded;
+    int64_t nBlockLatency; //! Moving average of the time to deliver a requested block, in microseconds
+};
+
+struct CAssumeValidStats {
+    int64_t nBlocks;    //! Blocks connected without checking their scripts
+    int64_t nInputs;    //! Inputs of those blocks whose signatures were not checked
+    int64_t nTimeSaved; //! Estimate of the script checking that saved, in microseconds
 };
 
 struct CDiskTxPos : public CDiskBlockPos {
@@ -336,6 +434,17 @@ bool IsTransactionInChain(const uint256& txId, int& nHeightTx);
 bool IsBlockHashInChain(const uint256& hashBlock);
 bool ValidOutPoint(const COutPoint out, int nHeight);
 bool RecalculateBYRONSupply(int nHeightStart);
+/**
+ * Get the transaction totals of a connected block. Blocks connected before the
+ * totals were kept in the index have them rebuilt from their block and undo data.
+ */
+bool GetBlockStats(CBlockIndex* pindex, CBlockStats& stats);
+
+/** Queries of the optional indexes; fail if the index is not enabled */
+bool GetSpentIndex(const CSpentIndexKey& key, CSpentIndexValue& value);
+bool GetAddressIndex(unsigned int type, const uint160& addressHash, std::vector<std::pair<CAddressIndexKey, CAmount> >& addressIndex, int nStart = 0, int nEnd = 0);
+bool GetAddressUnspent(unsigned int type, const uint160& addressHash, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& unspentOutputs);
+bool GetTimestampIndex(unsigned int nHigh, unsigned int nLow, std::vector<uint256>& vHashes);
 
 /**
  * Check if transaction will be final in the next block to be created.
@@ -388,8 +497,8 @@ private:
 
 public:
     CScriptCheck() : ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn) : scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-                                                                                                                                ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
+    CScriptCheck(const CTxOut& outIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn) : scriptPubKey(outIn.scriptPubKey),
+                                                                                                                          ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
 
     bool operator()();
 
@@ -411,6 +520,8 @@ public:
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/** Get the serialized block at pindex without deserializing more than its header; false if it can't be mapped */
+bool ReadBlockViewFromDisk(CDiskBlockView& view, const CBlockIndex* pindex);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -599,6 +710,12 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache* pcoinsTip;
 
+/** Global variable that points to the prefetch buffer below pcoinsTip, or NULL when prefetching is disabled */
+extern CCoinsViewPrefetch* pcoinsPrefetch;
+
+/** Global variable that points to the background chainstate writer, or NULL when flushes are synchronous */
+extern CCoinsViewWriteBehind* pcoinsWriteBehind;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB* pblocktree;
 
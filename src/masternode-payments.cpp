@@ -7,13 +7,13 @@
 #include "masternode-payments.h"
 #include "addrman.h"
 #include "masternode-sync.h"
+#include "masternodedb.h"
 #include "masternodeman.h"
 #include "obfuscation.h"
 #include "spork.h"
 #include "sync.h"
 #include "util.h"
 #include "utilmoneystr.h"
-#include <boost/filesystem.hpp>
 
 /** Object for who's going to get paid on which blocks */
 CMasternodePayments masternodePayments;
@@ -22,161 +22,6 @@ CCriticalSection cs_vecPayments;
 CCriticalSection cs_mapMasternodeBlocks;
 CCriticalSection cs_mapMasternodePayeeVotes;
 
-//
-// CMasternodePaymentDB
-//
-
-CMasternodePaymentDB::CMasternodePaymentDB()
-{
-    pathDB = GetDataDir() / "mnpayments.dat";
-    strMagicMessage = "MasternodePayments";
-}
-
-bool CMasternodePaymentDB::Write(const CMasternodePayments& objToSave)
-{
-    int64_t nStart = GetTimeMillis();
-
-    // Serialize, checksum data up to that point, then append checksum
-    CDataStream ssObj(SER_DISK, CLIENT_VERSION);
-    ssObj << strMagicMessage;                   // Masternode cache file specific magic message
-    ssObj << FLATDATA(Params().MessageStart()); // Network specific magic number
-    ssObj << objToSave;
-    uint256 hash = Hash(ssObj.begin(), ssObj.end());
-    ssObj << hash;
-
-    // Open output file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathDB.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssObj;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
-    }
-    fileout.fclose();
-
-    LogPrint("masternode","Written info to mnpayments.dat  %dms\n", GetTimeMillis() - nStart);
-
-    return true;
-}
-
-CMasternodePaymentDB::ReadResult CMasternodePaymentDB::Read(CMasternodePayments& objToLoad, bool fDryRun)
-{
-    int64_t nStart = GetTimeMillis();
-    // Open input file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "rb");
-    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull()) {
-        error("%s : Failed to open file %s", __func__, pathDB.string());
-        return FileError;
-    }
-
-    // Use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathDB);
-    int dataSize = fileSize - sizeof(uint256);
-
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // Read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
-    }
-    filein.fclose();
-
-    CDataStream ssObj(vchData, SER_DISK, CLIENT_VERSION);
-
-    // Verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssObj.begin(), ssObj.end());
-    if (hashIn != hashTmp) {
-        error("%s : Checksum mismatch, data corrupted", __func__);
-        return IncorrectHash;
-    }
-
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
-    try {
-        // de-serialize file header (masternode cache file specific magic message) and ..
-        ssObj >> strMagicMessageTmp;
-
-        // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
-            error("%s : Invalid masternode payement cache magic message", __func__);
-            return IncorrectMagicMessage;
-        }
-
-        // de-serialize file header (network specific magic number) and ..
-        ssObj >> FLATDATA(pchMsgTmp);
-
-        // ... verify the network matches ours
-        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
-            error("%s : Invalid network magic number", __func__);
-            return IncorrectMagicNumber;
-        }
-
-        // de-serialize data into CMasternodePayments object
-        ssObj >> objToLoad;
-    } catch (std::exception& e) {
-        objToLoad.Clear();
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-
-        return IncorrectFormat;
-    }
-
-    LogPrint("masternode","Loaded info from mnpayments.dat  %dms\n", GetTimeMillis() - nStart);
-    LogPrint("masternode","  %s\n", objToLoad.ToString());
-
-    if (!fDryRun) {
-        LogPrint("masternode","Masternode payments manager - cleaning....\n");
-        objToLoad.CleanPaymentList();
-        LogPrint("masternode","Masternode payments manager - result:\n");
-        LogPrint("masternode","  %s\n", objToLoad.ToString());
-    }
-
-    return Ok;
-}
-
-void DumpMasternodePayments()
-{
-    int64_t nStart = GetTimeMillis();
-
-    CMasternodePaymentDB paymentdb;
-    CMasternodePayments tempPayments;
-
-    LogPrint("masternode","Verifying mnpayments.dat format...\n");
-    CMasternodePaymentDB::ReadResult readResult = paymentdb.Read(tempPayments, true);
-
-    // There was an error and it was not an error on file opening => do not proceed
-    if (readResult == CMasternodePaymentDB::FileError)
-        LogPrint("masternode","Missing budgets file - mnpayments.dat, will try to recreate\n");
-    else if (readResult != CMasternodePaymentDB::Ok) {
-        LogPrint("masternode","Error reading mnpayments.dat: ");
-        if (readResult == CMasternodePaymentDB::IncorrectFormat)
-            LogPrint("masternode","magic is ok but data has invalid format, will try to recreate\n");
-        else {
-            LogPrint("masternode","file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
-    }
-
-    LogPrint("masternode","Writting info to mnpayments.dat...\n");
-    paymentdb.Write(masternodePayments);
-
-    LogPrint("masternode","Budget dump finished  %dms\n", GetTimeMillis() - nStart);
-}
-
 bool IsBlockValueValid(const CBlock& block, CAmount nExpectedValue, CAmount nMinted)
 {
     CBlockIndex* pindexPrev = chainActive.Tip();
@@ -335,7 +180,12 @@ void CMasternodePayments::ProcessMessageMasternodePayments(CNode* pfrom, std::st
             nHeight = chainActive.Tip()->nHeight;
         }
 
-        if (masternodePayments.mapMasternodePayeeVotes.count(winner.GetHash())) {
+        bool fSeen;
+        {
+            LOCK(cs_mapMasternodePayeeVotes);
+            fSeen = masternodePayments.mapMasternodePayeeVotes.count(winner.GetHash()) > 0;
+        }
+        if (fSeen) {
             LogPrint("mnpayments", "mnw - Already seen - %s bestHeight %d\n", winner.GetHash().ToString().c_str(), nHeight);
             masternodeSync.AddedMasternodeWinner(winner.GetHash());
             return;
@@ -379,7 +229,7 @@ bool CMasternodePaymentWinner::Sign(CKey& keyMasternode, CPubKey& pubKeyMasterno
     std::string errorMessage;
     std::string strMasterNodeSignMessage;
 
-    std::string strMessage = vinMasternode.prevout.ToStringShort() + std::to_string(nBlockHeight) + payee.ToString();
+    std::string strMessage = GetStrMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         LogPrint("masternode","CMasternodePing::Sign() - Error: %s\n", errorMessage.c_str());
@@ -448,16 +298,82 @@ bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerI
             return false;
         }
 
-        mapMasternodePayeeVotes[winnerIn.GetHash()] = winnerIn;
+        AddVote(winnerIn);
+    }
+
+    return true;
+}
+
+void CMasternodePayments::AddVote(CMasternodePaymentWinner& winner)
+{
+    mapMasternodePayeeVotes[winner.GetHash()] = winner;
+
+    if (!mapMasternodeBlocks.count(winner.nBlockHeight)) {
+        CMasternodeBlockPayees blockPayees(winner.nBlockHeight);
+        mapMasternodeBlocks[winner.nBlockHeight] = blockPayees;
+    }
+
+    if (mapMasternodeBlocks[winner.nBlockHeight].AddPayee(winner.payee, 1) >= 2)
+        mapPayeeVotedHeights[winner.payee].insert(winner.nBlockHeight);
+}
+
+bool CMasternodePayments::LoadCache(CMasternodeDB& db)
+{
+    int64_t nStart = GetTimeMillis();
+
+    std::map<uint256, CMasternodePaymentWinner> mapVotes;
+    if (!db.ReadPaymentVotes(mapVotes))
+        return error("%s : Failed to read the masternode payment votes", __func__);
+
+    Clear();
+
+    // The block payees are tallied from the votes, as they were when the votes came in
+    LOCK2(cs_mapMasternodePayeeVotes, cs_mapMasternodeBlocks);
+    setCachedVotes.clear();
+    for (std::map<uint256, CMasternodePaymentWinner>::iterator it = mapVotes.begin(); it != mapVotes.end(); ++it) {
+        AddVote(it->second);
+        setCachedVotes.insert(it->first);
+    }
+
+    LogPrint("masternode", "Loaded masternode payment votes  %dms\n", GetTimeMillis() - nStart);
+    LogPrint("masternode", "  %s\n", ToString());
+    return true;
+}
+
+bool CMasternodePayments::FlushCache(CMasternodeDB& db)
+{
+    int64_t nStart = GetTimeMillis();
+    CLevelDBBatch batch;
+    int nWritten = 0;
+    int nErased = 0;
+
+    {
+        LOCK(cs_mapMasternodePayeeVotes);
 
-        if (!mapMasternodeBlocks.count(winnerIn.nBlockHeight)) {
-            CMasternodeBlockPayees blockPayees(winnerIn.nBlockHeight);
-            mapMasternodeBlocks[winnerIn.nBlockHeight] = blockPayees;
+        for (std::map<uint256, CMasternodePaymentWinner>::iterator it = mapMasternodePayeeVotes.begin(); it != mapMasternodePayeeVotes.end(); ++it) {
+            if (setCachedVotes.insert(it->first).second) {
+                batch.Write(make_pair(DB_PAYMENT_VOTE, it->first), it->second);
+                nWritten++;
+            }
+        }
+        std::set<uint256>::iterator itVote = setCachedVotes.begin();
+        while (itVote != setCachedVotes.end()) {
+            if (mapMasternodePayeeVotes.count(*itVote)) {
+                ++itVote;
+                continue;
+            }
+            batch.Erase(make_pair(DB_PAYMENT_VOTE, *itVote));
+            setCachedVotes.erase(itVote++);
+            nErased++;
         }
     }
 
-    mapMasternodeBlocks[winnerIn.nBlockHeight].AddPayee(winnerIn.payee, 1);
+    if (nWritten == 0 && nErased == 0)
+        return true;
+    if (!db.WriteBatch(batch))
+        return error("%s : Failed to write the masternode payment votes", __func__);
 
+    LogPrint("masternode", "Flushed masternode payment votes: %d written, %d erased  %dms\n", nWritten, nErased, GetTimeMillis() - nStart);
     return true;
 }
 
@@ -586,8 +502,9 @@ void CMasternodePayments::CleanPaymentList()
 
         if (nHeight - winner.nBlockHeight > nLimit) {
             LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing old Masternode payment - block %d\n", winner.nBlockHeight);
-            masternodeSync.mapSeenSyncMNW.erase((*it).first);
+            masternodeSync.EraseSeenMasternodeWinner((*it).first);
             mapMasternodePayeeVotes.erase(it++);
+            UnindexBlockPayees(winner.nBlockHeight);
             mapMasternodeBlocks.erase(winner.nBlockHeight);
         } else {
             ++it;
@@ -595,6 +512,48 @@ void CMasternodePayments::CleanPaymentList()
     }
 }
 
+void CMasternodePayments::IndexBlockPayees(const CMasternodeBlockPayees& blockPayees)
+{
+    BOOST_FOREACH (const CMasternodePayee& payee, blockPayees.vecPayments) {
+        if (payee.nVotes >= 2)
+            mapPayeeVotedHeights[payee.scriptPubKey].insert(blockPayees.nBlockHeight);
+    }
+}
+
+void CMasternodePayments::UnindexBlockPayees(int nBlockHeight)
+{
+    std::map<int, CMasternodeBlockPayees>::iterator mi = mapMasternodeBlocks.find(nBlockHeight);
+    if (mi == mapMasternodeBlocks.end())
+        return;
+
+    BOOST_FOREACH (const CMasternodePayee& payee, mi->second.vecPayments) {
+        std::map<CScript, std::set<int> >::iterator it = mapPayeeVotedHeights.find(payee.scriptPubKey);
+        if (it == mapPayeeVotedHeights.end())
+            continue;
+        it->second.erase(nBlockHeight);
+        if (it->second.empty())
+            mapPayeeVotedHeights.erase(it);
+    }
+}
+
+int CMasternodePayments::GetLastPaidHeight(const CScript& payee, int nHeight, int nDepth)
+{
+    LOCK(cs_mapMasternodeBlocks);
+
+    std::map<CScript, std::set<int> >::const_iterator it = mapPayeeVotedHeights.find(payee);
+    if (it == mapPayeeVotedHeights.end())
+        return 0;
+
+    std::set<int>::const_iterator itHeight = it->second.upper_bound(nHeight);
+    if (itHeight == it->second.begin())
+        return 0;
+    --itHeight;
+    if (*itHeight <= 0 || *itHeight <= nHeight - nDepth)
+        return 0;
+
+    return *itHeight;
+}
+
 bool CMasternodePaymentWinner::IsValid(CNode* pnode, std::string& strError)
 {
     CMasternode* pmn = mnodeman.Find(vinMasternode);
@@ -700,12 +659,17 @@ void CMasternodePaymentWinner::Relay()
     RelayInv(inv);
 }
 
+std::string CMasternodePaymentWinner::GetStrMessage() const
+{
+    return vinMasternode.prevout.ToStringShort() + std::to_string(nBlockHeight) + payee.ToString();
+}
+
 bool CMasternodePaymentWinner::SignatureValid()
 {
     CMasternode* pmn = mnodeman.Find(vinMasternode);
 
     if (pmn != NULL) {
-        std::string strMessage = vinMasternode.prevout.ToStringShort() + std::to_string(nBlockHeight) + payee.ToString();
+        std::string strMessage = GetStrMessage();
 
         std::string errorMessage = "";
         if (!obfuScationSigner.VerifyMessage(pmn->pubKeyMasternode, vchSig, strMessage, errorMessage)) {
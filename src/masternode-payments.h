@@ -16,6 +16,7 @@ extern CCriticalSection cs_vecPayments;
 extern CCriticalSection cs_mapMasternodeBlocks;
 extern CCriticalSection cs_mapMasternodePayeeVotes;
 
+class CMasternodeDB;
 class CMasternodePayments;
 class CMasternodePaymentWinner;
 class CMasternodeBlockPayees;
@@ -31,32 +32,6 @@ std::string GetRequiredPaymentsString(int nBlockHeight);
 bool IsBlockValueValid(const CBlock& block, CAmount nExpectedValue, CAmount nMinted);
 void FillBlockPayee(CMutableTransaction& txNew, CAmount nFees, bool fProofOfStake);
 
-void DumpMasternodePayments();
-
-/** Save Masternode Payment Data (mnpayments.dat)
- */
-class CMasternodePaymentDB
-{
-private:
-    boost::filesystem::path pathDB;
-    std::string strMagicMessage;
-
-public:
-    enum ReadResult {
-        Ok,
-        FileError,
-        HashReadError,
-        IncorrectHash,
-        IncorrectMagicMessage,
-        IncorrectMagicNumber,
-        IncorrectFormat
-    };
-
-    CMasternodePaymentDB();
-    bool Write(const CMasternodePayments& objToSave);
-    ReadResult Read(CMasternodePayments& objToLoad, bool fDryRun = false);
-};
-
 class CMasternodePayee
 {
 public:
@@ -103,19 +78,21 @@ public:
         vecPayments.clear();
     }
 
-    void AddPayee(CScript payeeIn, int nIncrement)
+    /** Returns the number of votes the payee has now */
+    int AddPayee(CScript payeeIn, int nIncrement)
     {
         LOCK(cs_vecPayments);
 
         BOOST_FOREACH (CMasternodePayee& payee, vecPayments) {
             if (payee.scriptPubKey == payeeIn) {
                 payee.nVotes += nIncrement;
-                return;
+                return payee.nVotes;
             }
         }
 
         CMasternodePayee c(payeeIn, nIncrement);
         vecPayments.push_back(c);
+        return nIncrement;
     }
 
     bool GetPayee(CScript& payee)
@@ -194,6 +171,7 @@ public:
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     bool IsValid(CNode* pnode, std::string& strError);
     bool SignatureValid();
+    std::string GetStrMessage() const;
     void Relay();
 
     void AddPayee(CScript payeeIn)
@@ -234,6 +212,15 @@ class CMasternodePayments
 private:
     int nSyncedFromPeer;
     int nLastBlockHeight;
+    // Heights each payee has at least two votes for in mapMasternodeBlocks, to find the last payment without walking back the chain
+    std::map<CScript, std::set<int> > mapPayeeVotedHeights;
+
+    // votes the cache database holds
+    std::set<uint256> setCachedVotes;
+
+    void IndexBlockPayees(const CMasternodeBlockPayees& blockPayees);
+    void UnindexBlockPayees(int nBlockHeight);
+    void AddVote(CMasternodePaymentWinner& winner);
 
 public:
     std::map<uint256, CMasternodePaymentWinner> mapMasternodePayeeVotes;
@@ -251,14 +238,22 @@ public:
         LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
         mapMasternodeBlocks.clear();
         mapMasternodePayeeVotes.clear();
+        mapPayeeVotedHeights.clear();
     }
 
     bool AddWinningMasternode(CMasternodePaymentWinner& winner);
+
+    /** Replace the votes with the ones the cache database holds */
+    bool LoadCache(CMasternodeDB& db);
+    /** Write the votes added or dropped since the last load or flush to the cache database */
+    bool FlushCache(CMasternodeDB& db);
     bool ProcessBlock(int nBlockHeight);
 
     void Sync(CNode* node, int nCountNeeded);
     void CleanPaymentList();
     int LastPayment(CMasternode& mn);
+    /** Highest height of the last nDepth blocks up to nHeight where payee has at least two votes, 0 if none */
+    int GetLastPaidHeight(const CScript& payee, int nHeight, int nDepth);
 
     bool GetBlockPayee(int nBlockHeight, CScript& payee);
     bool IsTransactionValid(const CTransaction& txNew, int nBlockHeight);
@@ -279,6 +274,11 @@ public:
     {
         READWRITE(mapMasternodePayeeVotes);
         READWRITE(mapMasternodeBlocks);
+        if (ser_action.ForRead()) {
+            mapPayeeVotedHeights.clear();
+            for (std::map<int, CMasternodeBlockPayees>::const_iterator it = mapMasternodeBlocks.begin(); it != mapMasternodeBlocks.end(); ++it)
+                IndexBlockPayees(it->second);
+        }
     }
 };
 
@@ -60,6 +60,7 @@ bool CMasternodeSync::IsBlockchainSynced()
 
 void CMasternodeSync::Reset()
 {
+    LOCK(cs);
     lastMasternodeList = 0;
     lastMasternodeWinner = 0;
     lastBudgetItem = 0;
@@ -83,7 +84,10 @@ void CMasternodeSync::Reset()
 
 void CMasternodeSync::AddedMasternodeList(uint256 hash)
 {
-    if (mnodeman.mapSeenMasternodeBroadcast.count(hash)) {
+    // Looked up before taking cs, which nothing else is locked under
+    bool fSeen = mnodeman.HasSeenBroadcast(hash);
+    LOCK(cs);
+    if (fSeen) {
         if (mapSeenSyncMNB[hash] < MASTERNODE_SYNC_THRESHOLD) {
             lastMasternodeList = GetTime();
             mapSeenSyncMNB[hash]++;
@@ -94,8 +98,19 @@ void CMasternodeSync::AddedMasternodeList(uint256 hash)
     }
 }
 
+// A peer's whole list arrived and matches ours, so there's no need to wait for stragglers
+void CMasternodeSync::ReceivedMasternodeList()
+{
+    LOCK(cs);
+    if (RequestedMasternodeAssets == MASTERNODE_SYNC_LIST) {
+        LogPrint("masternode", "CMasternodeSync::ReceivedMasternodeList - masternode list synced\n");
+        GetNextAsset();
+    }
+}
+
 void CMasternodeSync::AddedMasternodeWinner(uint256 hash)
 {
+    LOCK(cs);
     if (masternodePayments.mapMasternodePayeeVotes.count(hash)) {
         if (mapSeenSyncMNW[hash] < MASTERNODE_SYNC_THRESHOLD) {
             lastMasternodeWinner = GetTime();
@@ -107,8 +122,21 @@ void CMasternodeSync::AddedMasternodeWinner(uint256 hash)
     }
 }
 
+void CMasternodeSync::EraseSeenMasternodeList(const uint256& hash)
+{
+    LOCK(cs);
+    mapSeenSyncMNB.erase(hash);
+}
+
+void CMasternodeSync::EraseSeenMasternodeWinner(const uint256& hash)
+{
+    LOCK(cs);
+    mapSeenSyncMNW.erase(hash);
+}
+
 void CMasternodeSync::AddedBudgetItem(uint256 hash)
 {
+    LOCK(cs);
     lastBudgetItem = GetTime();
     mapSeenSyncBudget.insert(make_pair(hash, 1));
 }
@@ -125,6 +153,7 @@ bool CMasternodeSync::IsBudgetFinEmpty()
 
 void CMasternodeSync::GetNextAsset()
 {
+    LOCK(cs);
     switch (RequestedMasternodeAssets) {
         case (MASTERNODE_SYNC_INITIAL):
         case (MASTERNODE_SYNC_FAILED): // should never be used here actually, use Reset() instead
@@ -177,6 +206,7 @@ void CMasternodeSync::ProcessMessage(CNode* pfrom, std::string& strCommand, CDat
         int nCount;
         vRecv >> nItemID >> nCount;
 
+        LOCK(cs);
         if (RequestedMasternodeAssets >= MASTERNODE_SYNC_FINISHED) return;
 
         // This means we will receive no further communication
@@ -220,6 +250,16 @@ void CMasternodeSync::ClearFulfilledRequest()
     }
 }
 
+void CMasternodeSync::SyncFailed()
+{
+    LOCK(cs);
+    LogPrintf("CMasternodeSync::Process - ERROR - Sync has failed, will retry later\n");
+    RequestedMasternodeAssets = MASTERNODE_SYNC_FAILED;
+    RequestedMasternodeAttempt = 0;
+    lastFailure = GetTime();
+    nCountFailures++;
+}
+
 void CMasternodeSync::Process()
 {
     static int tick = 0;
@@ -259,7 +299,10 @@ void CMasternodeSync::Process()
             if (RequestedMasternodeAttempt <= 2) {
                 pnode->PushMessage("getsporks"); //get current network sporks
             } else if (RequestedMasternodeAttempt < 4) {
-                mnodeman.DsegUpdate(pnode);
+                if (pnode->nVersion >= MNLIST_DIFF_VERSION)
+                    mnodeman.RequestMasternodeList(pnode);
+                else
+                    mnodeman.DsegUpdate(pnode);
             } else if (RequestedMasternodeAttempt < 6) {
                 int nMnCount = mnodeman.CountEnabled();
                 pnode->PushMessage("mnget", nMnCount); //sync payees
@@ -300,11 +343,7 @@ void CMasternodeSync::Process()
                 if (lastMasternodeList == 0 &&
                     (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3 || GetTime() - nAssetSyncStarted > MASTERNODE_SYNC_TIMEOUT * 5)) {
                     if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
-                        LogPrintf("CMasternodeSync::Process - ERROR - Sync has failed, will retry later\n");
-                        RequestedMasternodeAssets = MASTERNODE_SYNC_FAILED;
-                        RequestedMasternodeAttempt = 0;
-                        lastFailure = GetTime();
-                        nCountFailures++;
+                        SyncFailed();
                     } else {
                         GetNextAsset();
                     }
@@ -313,7 +352,11 @@ void CMasternodeSync::Process()
 
                 if (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3) return;
 
-                mnodeman.DsegUpdate(pnode);
+                // Peers that can send the list in a few messages do, the others announce it entry by entry
+                if (pnode->nVersion >= MNLIST_DIFF_VERSION)
+                    mnodeman.RequestMasternodeList(pnode);
+                else
+                    mnodeman.DsegUpdate(pnode);
                 RequestedMasternodeAttempt++;
                 return;
             }
@@ -331,11 +374,7 @@ void CMasternodeSync::Process()
                 if (lastMasternodeWinner == 0 &&
                     (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3 || GetTime() - nAssetSyncStarted > MASTERNODE_SYNC_TIMEOUT * 5)) {
                     if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
-                        LogPrintf("CMasternodeSync::Process - ERROR - Sync has failed, will retry later\n");
-                        RequestedMasternodeAssets = MASTERNODE_SYNC_FAILED;
-                        RequestedMasternodeAttempt = 0;
-                        lastFailure = GetTime();
-                        nCountFailures++;
+                        SyncFailed();
                     } else {
                         GetNextAsset();
                     }
@@ -6,6 +6,8 @@
 #ifndef MASTERNODE_SYNC_H
 #define MASTERNODE_SYNC_H
 
+#include "sync.h"
+
 #define MASTERNODE_SYNC_INITIAL 0
 #define MASTERNODE_SYNC_SPORKS 1
 #define MASTERNODE_SYNC_LIST 2
@@ -28,6 +30,13 @@ extern CMasternodeSync masternodeSync;
 
 class CMasternodeSync
 {
+private:
+    // Guards the sync state against the message worker lanes. Nothing that blocks on another lock
+    // is called while it's held, so it can be taken under cs_main and the masternode locks.
+    CCriticalSection cs;
+
+    void SyncFailed();
+
 public:
     std::map<uint256, int> mapSeenSyncMNB;
     std::map<uint256, int> mapSeenSyncMNW;
@@ -60,7 +69,11 @@ public:
     CMasternodeSync();
 
     void AddedMasternodeList(uint256 hash);
+    void ReceivedMasternodeList();
     void AddedMasternodeWinner(uint256 hash);
+    /** Forget a broadcast or payment vote so it's counted again when it's next seen */
+    void EraseSeenMasternodeList(const uint256& hash);
+    void EraseSeenMasternodeWinner(const uint256& hash);
     void AddedBudgetItem(uint256 hash);
     void GetNextAsset();
     std::string GetSyncStatus();
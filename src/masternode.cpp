@@ -13,48 +13,26 @@
 
 // Keep track of the scanning errors I've seen
 map<uint256, int> mapSeenMasternodeScanningErrors;
-// Cache block hashes as we calculate them
-std::map<int64_t, uint256> mapCacheBlockHashes;
 
-// Get the last hash that matches the modulus given. Processed in reverse order
+// Get the hash of the block before nBlockHeight (or before the tip for 0, or the tip itself for negative heights).
+// Read from the active chain rather than cached by height, so a reorg never leaves a stale hash behind. The
+// message lanes call this without cs_main, so it starts from the atomically published tip and walks its ancestors.
 bool GetBlockHash(uint256& hash, int nBlockHeight)
 {
-    if (chainActive.Tip() == NULL) return false;
+    const CBlockIndex* pindexTip = chainActive.AtomicTip();
+    if (pindexTip == NULL || pindexTip->nHeight == 0 || pindexTip->nHeight + 1 < nBlockHeight) return false;
 
     if (nBlockHeight == 0)
-        nBlockHeight = chainActive.Tip()->nHeight;
+        nBlockHeight = pindexTip->nHeight;
 
-    if (mapCacheBlockHashes.count(nBlockHeight)) {
-        hash = mapCacheBlockHashes[nBlockHeight];
-        return true;
-    }
-
-    const CBlockIndex* BlockLastSolved = chainActive.Tip();
-    const CBlockIndex* BlockReading = chainActive.Tip();
-
-    if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0 || chainActive.Tip()->nHeight + 1 < nBlockHeight) return false;
-
-    int nBlocksAgo = 0;
-    if (nBlockHeight > 0) nBlocksAgo = (chainActive.Tip()->nHeight + 1) - nBlockHeight;
-    assert(nBlocksAgo >= 0);
+    int nHeight = nBlockHeight > 0 ? nBlockHeight - 1 : pindexTip->nHeight;
+    if (nHeight < 1) return false;
 
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if (n >= nBlocksAgo) {
-            hash = BlockReading->GetBlockHash();
-            mapCacheBlockHashes[nBlockHeight] = hash;
-            return true;
-        }
-        n++;
-
-        if (BlockReading->pprev == NULL) {
-            assert(BlockReading);
-            break;
-        }
-        BlockReading = BlockReading->pprev;
-    }
+    const CBlockIndex* pindex = pindexTip->GetAncestor(nHeight);
+    if (pindex == NULL) return false;
 
-    return false;
+    hash = pindex->GetBlockHash();
+    return true;
 }
 
 CMasternode::CMasternode()
@@ -148,8 +126,9 @@ bool CMasternode::UpdateFromNewBroadcast(CMasternodeBroadcast& mnb)
         int nDoS = 0;
         if (mnb.lastPing == CMasternodePing() || (mnb.lastPing != CMasternodePing() && mnb.lastPing.CheckAndUpdate(nDoS, false))) {
             lastPing = mnb.lastPing;
-            mnodeman.mapSeenMasternodePing.insert(make_pair(lastPing.GetHash(), lastPing));
+            mnodeman.AddSeenPing(lastPing);
         }
+        mnodeman.SetMasternodeDirty(vin.prevout);
         return true;
     }
     return false;
@@ -162,16 +141,22 @@ bool CMasternode::UpdateFromNewBroadcast(CMasternodeBroadcast& mnb)
 //
 uint256 CMasternode::CalculateScore(int mod, int64_t nBlockHeight)
 {
-    if (chainActive.Tip() == NULL) return 0;
+    if (chainActive.AtomicTip() == NULL) return 0;
 
     uint256 hash = 0;
-    uint256 aux = vin.prevout.hash + vin.prevout.n;
 
     if (!GetBlockHash(hash, nBlockHeight)) {
         LogPrint("masternode","CalculateScore ERROR - nHeight %d - Returned 0\n", nBlockHeight);
         return 0;
     }
 
+    return CalculateScore(hash);
+}
+
+uint256 CMasternode::CalculateScore(const uint256& hash) const
+{
+    uint256 aux = vin.prevout.hash + vin.prevout.n;
+
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     ss << hash;
     uint256 hash2 = ss.GetHash();
@@ -235,10 +220,12 @@ void CMasternode::Check(bool forceCheck)
 
 int64_t CMasternode::SecondsSincePayment()
 {
-    CScript pubkeyScript;
-    pubkeyScript = GetScriptForDestination(pubKeyCollateralAddress.GetID());
+    return SecondsSincePayment(mnodeman.CountEnabled() * 1.25);
+}
 
-    int64_t sec = (GetAdjustedTime() - GetLastPaid());
+int64_t CMasternode::SecondsSincePayment(int nBlockDepth)
+{
+    int64_t sec = (GetAdjustedTime() - GetLastPaid(nBlockDepth));
     int64_t month = 60 * 60 * 24 * 30;
     if (sec < month) return sec; //if it's less than 30 days, give seconds
 
@@ -253,7 +240,12 @@ int64_t CMasternode::SecondsSincePayment()
 
 int64_t CMasternode::GetLastPaid()
 {
-    CBlockIndex* pindexPrev = chainActive.Tip();
+    return GetLastPaid(mnodeman.CountEnabled() * 1.25);
+}
+
+int64_t CMasternode::GetLastPaid(int nBlockDepth)
+{
+    CBlockIndex* pindexPrev = chainActive.AtomicTip();
     if (pindexPrev == NULL) return false;
 
     CScript mnpayee;
@@ -267,36 +259,19 @@ int64_t CMasternode::GetLastPaid()
     // Use a deterministic offset to break a tie -- 2.5 minutes
     int64_t nOffset = hash.GetCompact(false) % 150;
 
-    if (chainActive.Tip() == NULL) return false;
-
-    const CBlockIndex* BlockReading = chainActive.Tip();
-
-    int nMnCount = mnodeman.CountEnabled() * 1.25;
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if (n >= nMnCount) {
-            return 0;
-        }
-        n++;
-
-        if (masternodePayments.mapMasternodeBlocks.count(BlockReading->nHeight)) {
-            /*
-                Search for this payee, with at least 2 votes. This will aid in consensus allowing the network
-                to converge on the same payees quickly, then keep the same schedule.
-            */
-            if (masternodePayments.mapMasternodeBlocks[BlockReading->nHeight].HasPayeeWithVotes(mnpayee, 2)) {
-                return BlockReading->nTime + nOffset;
-            }
-        }
+    /*
+        Search for this payee, with at least 2 votes. This will aid in consensus allowing the network
+        to converge on the same payees quickly, then keep the same schedule.
+    */
+    int nPaidHeight = masternodePayments.GetLastPaidHeight(mnpayee, pindexPrev->nHeight, nBlockDepth);
+    if (nPaidHeight == 0)
+        return 0;
 
-        if (BlockReading->pprev == NULL) {
-            assert(BlockReading);
-            break;
-        }
-        BlockReading = BlockReading->pprev;
-    }
+    const CBlockIndex* pindexPaid = pindexPrev->GetAncestor(nPaidHeight);
+    if (pindexPaid == NULL)
+        return 0;
 
-    return 0;
+    return pindexPaid->nTime + nOffset;
 }
 
 std::string CMasternode::GetStatus()
@@ -554,6 +529,7 @@ bool CMasternodeBroadcast::CheckAndUpdate(int& nDos)
         LogPrint("masternode","mnb - Got updated entry for %s\n", vin.prevout.hash.ToString());
 
         if (pmn->UpdateFromNewBroadcast((*this))) {
+            mnodeman.Reindex(*pmn);
             pmn->Check();
             if (pmn->IsEnabled()) Relay();
         }
@@ -595,8 +571,8 @@ bool CMasternodeBroadcast::CheckInputsAndAdd(int& nDoS)
         TRY_LOCK(cs_main, lockMain);
         if (!lockMain) {
             // Not mnb fault, let it to be checked again later
-            mnodeman.mapSeenMasternodeBroadcast.erase(GetHash());
-            masternodeSync.mapSeenSyncMNB.erase(GetHash());
+            mnodeman.EraseSeenBroadcast(GetHash());
+            masternodeSync.EraseSeenMasternodeList(GetHash());
             return false;
         }
 
@@ -612,22 +588,19 @@ bool CMasternodeBroadcast::CheckInputsAndAdd(int& nDoS)
     if (GetInputAge(vin) < MASTERNODE_MIN_CONFIRMATIONS) {
         LogPrint("masternode","mnb - Input must have at least %d confirmations\n", MASTERNODE_MIN_CONFIRMATIONS);
         // Maybe we miss few blocks, let this mnb to be checked again later
-        mnodeman.mapSeenMasternodeBroadcast.erase(GetHash());
-        masternodeSync.mapSeenSyncMNB.erase(GetHash());
+        mnodeman.EraseSeenBroadcast(GetHash());
+        masternodeSync.EraseSeenMasternodeList(GetHash());
         return false;
     }
 
     // Verify that sig time is legit in past
     // should be at least not earlier than block when 200000 BYRON tx got MASTERNODE_MIN_CONFIRMATIONS
-    uint256 hashBlock = 0;
-    CTransaction tx2;
-    GetTransaction(vin.prevout.hash, tx2, hashBlock, true);
-    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
-
-    if (mi != mapBlockIndex.end() && (*mi).second) {
-        CBlockIndex* pMNIndex = (*mi).second;                                                        // block for 200000 BYRON tx -> 1 confirmation
-        CBlockIndex* pConfIndex = chainActive[pMNIndex->nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1]; // block where tx got MASTERNODE_MIN_CONFIRMATIONS
-        if (pConfIndex->GetBlockTime() > sigTime) {
+    Coin coin;
+    const CBlockIndex* pindexTip = chainActive.AtomicTip();
+    if (GetUTXOCoin(vin.prevout, coin) && coin.nHeight > 0 && pindexTip != NULL && (int)coin.nHeight <= pindexTip->nHeight) {
+        // block where tx got MASTERNODE_MIN_CONFIRMATIONS
+        const CBlockIndex* pConfIndex = pindexTip->GetAncestor(std::min((int)coin.nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1, pindexTip->nHeight));
+        if (pConfIndex != NULL && pConfIndex->GetBlockTime() > sigTime) {
             LogPrint("masternode","mnb - Bad sigTime %d for Masternode %s (%i conf block is at %d)\n",
                 sigTime, vin.prevout.hash.ToString(), MASTERNODE_MIN_CONFIRMATIONS, pConfIndex->GetBlockTime());
             return false;
@@ -729,7 +702,7 @@ bool CMasternodePing::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     std::string strMasterNodeSignMessage;
 
     sigTime = GetAdjustedTime();
-    std::string strMessage = vin.ToString() + blockHash.ToString() + std::to_string(sigTime);
+    std::string strMessage = GetStrMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         LogPrint("masternode","CMasternodePing::Sign() - Error: %s\n", errorMessage);
@@ -744,9 +717,14 @@ bool CMasternodePing::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     return true;
 }
 
+std::string CMasternodePing::GetStrMessage() const
+{
+    return vin.ToString() + blockHash.ToString() + std::to_string(sigTime);
+}
+
 bool CMasternodePing::VerifySignature(CPubKey& pubKeyMasternode, int &nDos)
 {
-    std::string strMessage = vin.ToString() + blockHash.ToString() + std::to_string(sigTime);
+    std::string strMessage = GetStrMessage();
 	std::string errorMessage = "";
 
 	if(!obfuScationSigner.VerifyMessage(pubKeyMasternode, vchSig, strMessage, errorMessage)){
@@ -791,31 +769,27 @@ bool CMasternodePing::CheckAndUpdate(int& nDos, bool fRequireEnabled, bool fChec
         	if (!VerifySignature(pmn->pubKeyMasternode, nDos))
                 return false;
 
-            BlockMap::iterator mi = mapBlockIndex.find(blockHash);
-            if (mi != mapBlockIndex.end() && (*mi).second) {
-                if ((*mi).second->nHeight < chainActive.Height() - 24) {
-                    LogPrint("masternode","CMasternodePing::CheckAndUpdate - Masternode %s block hash %s is too old\n", vin.prevout.hash.ToString(), blockHash.ToString());
-                    // Do nothing here (no Masternode update, no mnping relay)
-                    // Let this node to be visible but fail to accept mnping
-
-                    return false;
-                }
-            } else {
-                if (fDebug) LogPrint("masternode","CMasternodePing::CheckAndUpdate - Masternode %s block hash %s is unknown\n", vin.prevout.hash.ToString(), blockHash.ToString());
+            // Look the block up among the tip's recent ancestors rather than in mapBlockIndex, which
+            // the block thread may be inserting into; anything deeper than that is too old anyway
+            const CBlockIndex* pindexTip = chainActive.AtomicTip();
+            const CBlockIndex* pindexPing = pindexTip;
+            while (pindexPing != NULL && pindexPing->GetBlockHash() != blockHash && pindexTip->nHeight - pindexPing->nHeight < 24)
+                pindexPing = pindexPing->pprev;
+            if (pindexPing == NULL || pindexPing->GetBlockHash() != blockHash) {
+                LogPrint("masternode","CMasternodePing::CheckAndUpdate - Masternode %s block hash %s is unknown or too old\n", vin.prevout.hash.ToString(), blockHash.ToString());
+                // Do nothing here (no Masternode update, no mnping relay)
+                // Let this node to be visible but fail to accept mnping
                 // maybe we stuck so we shouldn't ban this node, just fail to accept it
-                // TODO: or should we also request this block?
 
                 return false;
             }
 
             pmn->lastPing = *this;
+            mnodeman.SetMasternodeDirty(vin.prevout);
 
             //mnodeman.mapSeenMasternodeBroadcast.lastPing is probably outdated, so we'll update it
             CMasternodeBroadcast mnb(*pmn);
-            uint256 hash = mnb.GetHash();
-            if (mnodeman.mapSeenMasternodeBroadcast.count(hash)) {
-                mnodeman.mapSeenMasternodeBroadcast[hash].lastPing = *this;
-            }
+            mnodeman.UpdateSeenBroadcastPing(mnb.GetHash(), *this);
 
             pmn->Check(true);
             if (!pmn->IsEnabled()) return false;
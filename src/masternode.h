@@ -28,7 +28,6 @@ using namespace std;
 class CMasternode;
 class CMasternodeBroadcast;
 class CMasternodePing;
-extern map<int64_t, uint256> mapCacheBlockHashes;
 
 bool GetBlockHash(uint256& hash, int nBlockHeight);
 
@@ -63,6 +62,7 @@ public:
     bool CheckAndUpdate(int& nDos, bool fRequireEnabled = true, bool fCheckSigTimeOnly = false);
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     bool VerifySignature(CPubKey& pubKeyMasternode, int &nDos);
+    std::string GetStrMessage() const;
     void Relay();
 
     uint256 GetHash()
@@ -193,6 +193,8 @@ public:
     }
 
     uint256 CalculateScore(int mod = 1, int64_t nBlockHeight = 0);
+    /// Score against a known block hash, as GetBlockHash would return for the height
+    uint256 CalculateScore(const uint256& hashBlock) const;
 
     ADD_SERIALIZE_METHODS;
 
@@ -220,6 +222,7 @@ public:
     }
 
     int64_t SecondsSincePayment();
+    int64_t SecondsSincePayment(int nBlockDepth);
 
     bool UpdateFromNewBroadcast(CMasternodeBroadcast& mnb);
 
@@ -283,6 +286,8 @@ public:
     }
 
     int64_t GetLastPaid();
+    //! Time of the last payment within the last nBlockDepth blocks, 0 if none
+    int64_t GetLastPaid(int nBlockDepth);
     bool IsValidNetAddr();
 };
 
@@ -0,0 +1,88 @@
+// Copyright (c) 2019 The Byron developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "masternodedb.h"
+#include "masternodeman.h"
+#include "util.h"
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+
+CMasternodeDB* pMasternodeDB = NULL;
+
+CMasternodeDB::CMasternodeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "masternodes", nCacheSize, fMemory, fWipe) {}
+
+template <typename K, typename V>
+bool CMasternodeDB::ReadAll(char chType, std::map<K, V>& mapOut)
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << chType;
+    pcursor->Seek(ssKeySet.str());
+
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chKeyType;
+            ssKey >> chKeyType;
+            if (chKeyType != chType)
+                break;
+            K key;
+            ssKey >> key;
+
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> mapOut[key];
+            pcursor->Next();
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+
+    return true;
+}
+
+bool CMasternodeDB::ReadMasternodes(std::map<COutPoint, CMasternode>& mapMasternodes)
+{
+    return ReadAll(DB_MASTERNODE, mapMasternodes);
+}
+
+bool CMasternodeDB::ReadSeenBroadcasts(std::map<uint256, CMasternodeBroadcast>& mapBroadcasts)
+{
+    return ReadAll(DB_SEEN_BROADCAST, mapBroadcasts);
+}
+
+bool CMasternodeDB::ReadSeenPings(std::map<uint256, CMasternodePing>& mapPings)
+{
+    return ReadAll(DB_SEEN_PING, mapPings);
+}
+
+bool CMasternodeDB::ReadPaymentVotes(std::map<uint256, CMasternodePaymentWinner>& mapVotes)
+{
+    return ReadAll(DB_PAYMENT_VOTE, mapVotes);
+}
+
+void CMasternodeDB::Compact()
+{
+    int64_t nStart = GetTimeMillis();
+    CompactFull();
+    LogPrint("masternode", "Compacted masternode cache  %dms\n", GetTimeMillis() - nStart);
+}
+
+void FlushMasternodeCache()
+{
+    // Changes are collected under the managers' locks and written after; one flush at a time
+    // so an older batch can't land on top of a newer one
+    static CCriticalSection cs_flush;
+    LOCK(cs_flush);
+
+    if (pMasternodeDB == NULL)
+        return;
+
+    mnodeman.FlushCache(*pMasternodeDB);
+    masternodePayments.FlushCache(*pMasternodeDB);
+}
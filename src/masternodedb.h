@@ -0,0 +1,52 @@
+// Copyright (c) 2019 The Byron developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BYRON_MASTERNODEDB_H
+#define BYRON_MASTERNODEDB_H
+
+#include "leveldbwrapper.h"
+#include "masternode.h"
+#include "masternode-payments.h"
+
+#include <map>
+
+//! LevelDB cache of the masternode database
+static const size_t MASTERNODE_DB_CACHE = 1 << 22;
+
+// Key prefixes of the masternode cache database
+static const char DB_MASTERNODE = 'n';
+static const char DB_SEEN_BROADCAST = 'b';
+static const char DB_SEEN_PING = 'p';
+static const char DB_PAYMENT_VOTE = 'w';
+static const char DB_MASTERNODE_STATE = 's';
+
+/** Masternode list, seen gossip and payment votes, one entry per key, written as they change */
+class CMasternodeDB : public CLevelDBWrapper
+{
+public:
+    CMasternodeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+
+private:
+    CMasternodeDB(const CMasternodeDB&);
+    void operator=(const CMasternodeDB&);
+
+    template <typename K, typename V>
+    bool ReadAll(char chType, std::map<K, V>& mapOut);
+
+public:
+    bool ReadMasternodes(std::map<COutPoint, CMasternode>& mapMasternodes);
+    bool ReadSeenBroadcasts(std::map<uint256, CMasternodeBroadcast>& mapBroadcasts);
+    bool ReadSeenPings(std::map<uint256, CMasternodePing>& mapPings);
+    bool ReadPaymentVotes(std::map<uint256, CMasternodePaymentWinner>& mapVotes);
+
+    /** Drop the space taken by overwritten and erased entries */
+    void Compact();
+};
+
+extern CMasternodeDB* pMasternodeDB;
+
+/** Write what changed in the masternode list and payment votes since the last flush */
+void FlushMasternodeCache();
+
+#endif // BYRON_MASTERNODEDB_H
@@ -8,195 +8,159 @@
 #include "activemasternode.h"
 #include "addrman.h"
 #include "masternode.h"
+#include "masternodedb.h"
 #include "obfuscation.h"
 #include "spork.h"
+#include "random.h"
 #include "util.h"
-#include <boost/filesystem.hpp>
 
 #define MN_WINNER_MINIMUM_AGE 8000    // Age in seconds. This should be > MASTERNODE_REMOVAL_SECONDS to avoid misconfigured new nodes in the list.
 
 /** Masternode manager */
 CMasternodeMan mnodeman;
 
+// Paid longest ago first
 struct CompareLastPaid {
     bool operator()(const pair<int64_t, CTxIn>& t1,
         const pair<int64_t, CTxIn>& t2) const
     {
-        return t1.first < t2.first;
+        return t1.first > t2.first;
     }
 };
 
-struct CompareScoreTxIn {
-    bool operator()(const pair<int64_t, CTxIn>& t1,
-        const pair<int64_t, CTxIn>& t2) const
-    {
-        return t1.first < t2.first;
-    }
-};
-
-struct CompareScoreMN {
-    bool operator()(const pair<int64_t, CMasternode>& t1,
-        const pair<int64_t, CMasternode>& t2) const
+// Best score first; ties broken by outpoint so every node ranks them alike
+struct CompareScoreRank {
+    bool operator()(const pair<int64_t, CMasternode*>& t1,
+        const pair<int64_t, CMasternode*>& t2) const
     {
-        return t1.first < t2.first;
+        if (t1.first != t2.first)
+            return t1.first > t2.first;
+        return t1.second->vin.prevout < t2.second->vin.prevout;
     }
 };
 
-//
-// CMasternodeDB
-//
+CMasternodeIndexHasher::CMasternodeIndexHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())),
+                                                   k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
 
-CMasternodeDB::CMasternodeDB()
+size_t CMasternodeIndexHasher::operator()(const COutPoint& outpoint) const
 {
-    pathMN = GetDataDir() / "mncache.dat";
-    strMagicMessage = "MasternodeCache";
+    return CSipHasher(k0, k1).Write(outpoint.hash.begin(), outpoint.hash.size()).Write(outpoint.n).Finalize();
 }
 
-bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
+size_t CMasternodeIndexHasher::operator()(const CScript& script) const
 {
-    int64_t nStart = GetTimeMillis();
+    return CSipHasher(k0, k1).Write(script.data(), script.size()).Finalize();
+}
 
-    // Serialize, checksum data up to that point, then append checksum
-    CDataStream ssMasternodes(SER_DISK, CLIENT_VERSION);
-    ssMasternodes << strMagicMessage;                   // masternode cache file specific magic message
-    ssMasternodes << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssMasternodes << mnodemanToSave;
-    uint256 hash = Hash(ssMasternodes.begin(), ssMasternodes.end());
-    ssMasternodes << hash;
-
-    // Open output file, and associate with CAutoFile
-    FILE* file = fopen(pathMN.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathMN.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssMasternodes;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
-    }
-    // FileCommit(fileout);
-    fileout.fclose();
+size_t CMasternodeIndexHasher::operator()(const CPubKey& pubkey) const
+{
+    return CSipHasher(k0, k1).Write(pubkey.begin(), pubkey.size()).Finalize();
+}
 
-    LogPrint("masternode","Written info to mncache.dat  %dms\n", GetTimeMillis() - nStart);
-    LogPrint("masternode","  %s\n", mnodemanToSave.ToString());
+CMasternodeMan::CMasternodeMan()
+{
+    nDsqCount = 0;
+}
 
-    return true;
+void CMasternodeMan::IndexMasternode(std::list<CMasternode>::iterator it)
+{
+    CMasternodeIndexEntry& entry = mapMasternodesByOutpoint[it->vin.prevout];
+    entry.it = it;
+    entry.payee = GetScriptForDestination(it->pubKeyCollateralAddress.GetID());
+    entry.pubKeyMasternode = it->pubKeyMasternode;
+    mapMasternodesByPayee.insert(make_pair(entry.payee, it));
+    mapMasternodesByPubKey.insert(make_pair(entry.pubKeyMasternode, it));
 }
 
-CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bool fDryRun)
+void CMasternodeMan::UnindexMasternode(const COutPoint& outpoint)
 {
-    int64_t nStart = GetTimeMillis();
-    // Open input file, and associate with CAutoFile
-    FILE* file = fopen(pathMN.string().c_str(), "rb");
-    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull()) {
-        error("%s : Failed to open file %s", __func__, pathMN.string());
-        return FileError;
+    boost::unordered_map<COutPoint, CMasternodeIndexEntry, CMasternodeIndexHasher>::iterator mi = mapMasternodesByOutpoint.find(outpoint);
+    if (mi == mapMasternodesByOutpoint.end())
+        return;
+    const CMasternodeIndexEntry& entry = mi->second;
+
+    typedef boost::unordered_multimap<CScript, std::list<CMasternode>::iterator, CMasternodeIndexHasher>::iterator payee_iterator;
+    std::pair<payee_iterator, payee_iterator> rangePayee = mapMasternodesByPayee.equal_range(entry.payee);
+    for (payee_iterator it = rangePayee.first; it != rangePayee.second; ++it) {
+        if (it->second == entry.it) {
+            mapMasternodesByPayee.erase(it);
+            break;
+        }
     }
 
-    // Use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathMN);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // Read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
+    typedef boost::unordered_multimap<CPubKey, std::list<CMasternode>::iterator, CMasternodeIndexHasher>::iterator pubkey_iterator;
+    std::pair<pubkey_iterator, pubkey_iterator> rangePubKey = mapMasternodesByPubKey.equal_range(entry.pubKeyMasternode);
+    for (pubkey_iterator it = rangePubKey.first; it != rangePubKey.second; ++it) {
+        if (it->second == entry.it) {
+            mapMasternodesByPubKey.erase(it);
+            break;
+        }
     }
 
-    filein.fclose();
-
-    CDataStream ssMasternodes(vchData, SER_DISK, CLIENT_VERSION);
+    mapMasternodesByOutpoint.erase(mi);
+}
 
-    // Verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssMasternodes.begin(), ssMasternodes.end());
-    if (hashIn != hashTmp) {
-        error("%s : Checksum mismatch, data corrupted", __func__);
-        return IncorrectHash;
+void CMasternodeMan::EraseMasternode(std::list<CMasternode>::iterator it)
+{
+    UnindexMasternode(it->vin.prevout);
+    setDirtyMasternodes.insert(it->vin.prevout);
+
+    const CBlockIndex* pindexTip = chainActive.AtomicTip();
+    dequeRemovedMasternodes.push_back(make_pair(pindexTip ? pindexTip->nHeight : -1, it->vin));
+    if (dequeRemovedMasternodes.size() > MASTERNODES_REMOVED_LOG_SIZE)
+        dequeRemovedMasternodes.pop_front();
+
+    std::map<uint256, CMasternodeScores>::iterator mi;
+    for (mi = mapMasternodeScores.begin(); mi != mapMasternodeScores.end(); ++mi) {
+        CMasternodeScores& vScores = mi->second;
+        std::pair<int64_t, CMasternode*> entry(it->CalculateScore(mi->first).GetCompact(false), &*it);
+        CMasternodeScores::iterator si = lower_bound(vScores.begin(), vScores.end(), entry, CompareScoreRank());
+        if (si != vScores.end() && si->second == &*it)
+            vScores.erase(si);
     }
 
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
-    try {
-        // De-serialize file header (masternode cache file specific magic message) and ..
-        ssMasternodes >> strMagicMessageTmp;
+    listMasternodes.erase(it);
+}
 
-        // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
-            error("%s : Invalid masternode cache magic message", __func__);
-            return IncorrectMagicMessage;
-        }
+const CMasternodeMan::CMasternodeScores& CMasternodeMan::GetMasternodeScores(const uint256& hashBlock)
+{
+    AssertLockHeld(cs);
 
-        // De-serialize file header (network specific magic number) and ..
-        ssMasternodes >> FLATDATA(pchMsgTmp);
+    std::map<uint256, CMasternodeScores>::iterator mi = mapMasternodeScores.find(hashBlock);
+    if (mi != mapMasternodeScores.end())
+        return mi->second;
 
-        // ... verify the network matches ours
-        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
-            error("%s : Invalid network magic number", __func__);
-            return IncorrectMagicNumber;
-        }
-        // De-serialize data into CMasternodeMan object
-        ssMasternodes >> mnodemanToLoad;
-    } catch (std::exception& e) {
-        mnodemanToLoad.Clear();
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return IncorrectFormat;
+    if (listScoredBlocks.size() >= MASTERNODE_RANK_CACHE_BLOCKS) {
+        mapMasternodeScores.erase(listScoredBlocks.front());
+        listScoredBlocks.pop_front();
     }
+    listScoredBlocks.push_back(hashBlock);
 
-    LogPrint("masternode","Loaded info from mncache.dat  %dms\n", GetTimeMillis() - nStart);
-    LogPrint("masternode","  %s\n", mnodemanToLoad.ToString());
-
-    if (!fDryRun) {
-        LogPrint("masternode","Masternode manager - cleaning....\n");
-        mnodemanToLoad.CheckAndRemove(true);
-        LogPrint("masternode","Masternode manager - result:\n");
-        LogPrint("masternode","  %s\n", mnodemanToLoad.ToString());
-    }
+    CMasternodeScores& vScores = mapMasternodeScores[hashBlock];
+    vScores.reserve(listMasternodes.size());
+    BOOST_FOREACH (CMasternode& mn, listMasternodes)
+        vScores.push_back(make_pair(mn.CalculateScore(hashBlock).GetCompact(false), &mn));
+    sort(vScores.begin(), vScores.end(), CompareScoreRank());
 
-    return Ok;
+    return vScores;
 }
 
-void DumpMasternodes()
+void CMasternodeMan::ClearMasternodeScores()
 {
-    int64_t nStart = GetTimeMillis();
-
-    CMasternodeDB mndb;
-    CMasternodeMan tempMnodeman;
-
-    LogPrint("masternode","Verifying mncache.dat format...\n");
-    CMasternodeDB::ReadResult readResult = mndb.Read(tempMnodeman, true);
-    // There was an error and it was not an error on file opening => do not proceed
-    if (readResult == CMasternodeDB::FileError)
-        LogPrint("masternode","Missing masternode cache file - mncache.dat, will try to recreate\n");
-    else if (readResult != CMasternodeDB::Ok) {
-        LogPrint("masternode","Error reading mncache.dat: ");
-        if (readResult == CMasternodeDB::IncorrectFormat)
-            LogPrint("masternode","magic is ok but data has invalid format, will try to recreate\n");
-        else {
-            LogPrint("masternode","file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
-    }
-    LogPrint("masternode","Writting info to mncache.dat...\n");
-    mndb.Write(mnodeman);
-
-    LogPrint("masternode","Masternode dump finished  %dms\n", GetTimeMillis() - nStart);
+    mapMasternodeScores.clear();
+    listScoredBlocks.clear();
 }
 
-CMasternodeMan::CMasternodeMan()
+void CMasternodeMan::Reindex(const CMasternode& mn)
 {
-    nDsqCount = 0;
+    LOCK(cs);
+
+    boost::unordered_map<COutPoint, CMasternodeIndexEntry, CMasternodeIndexHasher>::iterator mi = mapMasternodesByOutpoint.find(mn.vin.prevout);
+    if (mi == mapMasternodesByOutpoint.end())
+        return;
+    std::list<CMasternode>::iterator it = mi->second.it;
+    UnindexMasternode(mn.vin.prevout);
+    IndexMasternode(it);
 }
 
 bool CMasternodeMan::Add(CMasternode& mn)
@@ -209,7 +173,16 @@ bool CMasternodeMan::Add(CMasternode& mn)
     CMasternode* pmn = Find(mn.vin);
     if (pmn == NULL) {
         LogPrint("masternode", "CMasternodeMan: Adding new Masternode %s - %i now\n", mn.vin.prevout.hash.ToString(), size() + 1);
-        vMasternodes.push_back(mn);
+        std::list<CMasternode>::iterator it = listMasternodes.insert(listMasternodes.end(), mn);
+        IndexMasternode(it);
+        setDirtyMasternodes.insert(mn.vin.prevout);
+
+        std::map<uint256, CMasternodeScores>::iterator mi;
+        for (mi = mapMasternodeScores.begin(); mi != mapMasternodeScores.end(); ++mi) {
+            CMasternodeScores& vScores = mi->second;
+            std::pair<int64_t, CMasternode*> entry(it->CalculateScore(mi->first).GetCompact(false), &*it);
+            vScores.insert(upper_bound(vScores.begin(), vScores.end(), entry, CompareScoreRank()), entry);
+        }
         return true;
     }
 
@@ -218,6 +191,7 @@ bool CMasternodeMan::Add(CMasternode& mn)
 
 void CMasternodeMan::AskForMN(CNode* pnode, CTxIn& vin)
 {
+    LOCK(cs);
     std::map<COutPoint, int64_t>::iterator i = mWeAskedForMasternodeListEntry.find(vin.prevout);
     if (i != mWeAskedForMasternodeListEntry.end()) {
         int64_t t = (*i).second;
@@ -235,7 +209,7 @@ void CMasternodeMan::Check()
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
     }
 }
@@ -247,8 +221,8 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
     LOCK(cs);
 
     // Remove inactive and outdated
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
+    std::list<CMasternode>::iterator it = listMasternodes.begin();
+    while (it != listMasternodes.end()) {
         if ((*it).activeState == CMasternode::MASTERNODE_REMOVE ||
             (*it).activeState == CMasternode::MASTERNODE_VIN_SPENT ||
             (forceExpiredRemoval && (*it).activeState == CMasternode::MASTERNODE_EXPIRED) ||
@@ -261,7 +235,8 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
             map<uint256, CMasternodeBroadcast>::iterator it3 = mapSeenMasternodeBroadcast.begin();
             while (it3 != mapSeenMasternodeBroadcast.end()) {
                 if ((*it3).second.vin == (*it).vin) {
-                    masternodeSync.mapSeenSyncMNB.erase((*it3).first);
+                    masternodeSync.EraseSeenMasternodeList((*it3).first);
+                    setDirtyBroadcasts.insert((*it3).first);
                     mapSeenMasternodeBroadcast.erase(it3++);
                 } else {
                     ++it3;
@@ -278,7 +253,8 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
                 }
             }
 
-            it = vMasternodes.erase(it);
+            std::list<CMasternode>::iterator itErase = it++;
+            EraseMasternode(itErase);
         } else {
             ++it;
         }
@@ -294,6 +270,36 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
         }
     }
 
+    // Check who's asked for a list snapshot or diff
+    it1 = mAskedUsForMasternodeListDiff.begin();
+    while (it1 != mAskedUsForMasternodeListDiff.end()) {
+        if ((*it1).second < GetTime()) {
+            mAskedUsForMasternodeListDiff.erase(it1++);
+        } else {
+            ++it1;
+        }
+    }
+
+    // Give up on lists that never came
+    map<NodeId, int64_t>::iterator itRequest = mapListDiffRequests.begin();
+    while (itRequest != mapListDiffRequests.end()) {
+        if ((*itRequest).second < GetTime() - MASTERNODES_LIST_DIFF_TIMEOUT) {
+            mapListDiffRequests.erase(itRequest++);
+        } else {
+            ++itRequest;
+        }
+    }
+
+    // Check who we asked for a list snapshot or diff
+    it1 = mWeAskedForMasternodeListDiff.begin();
+    while (it1 != mWeAskedForMasternodeListDiff.end()) {
+        if ((*it1).second < GetTime()) {
+            mWeAskedForMasternodeListDiff.erase(it1++);
+        } else {
+            ++it1;
+        }
+    }
+
     // Check who we asked for the Masternode list
     it1 = mWeAskedForMasternodeList.begin();
     while (it1 != mWeAskedForMasternodeList.end()) {
@@ -318,8 +324,9 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
     map<uint256, CMasternodeBroadcast>::iterator it3 = mapSeenMasternodeBroadcast.begin();
     while (it3 != mapSeenMasternodeBroadcast.end()) {
         if ((*it3).second.lastPing.sigTime < GetTime() - (MASTERNODE_REMOVAL_SECONDS * 2)) {
+            masternodeSync.EraseSeenMasternodeList((*it3).first);
+            setDirtyBroadcasts.insert((*it3).first);
             mapSeenMasternodeBroadcast.erase(it3++);
-            masternodeSync.mapSeenSyncMNB.erase((*it3).second.GetHash());
         } else {
             ++it3;
         }
@@ -329,6 +336,7 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
     map<uint256, CMasternodePing>::iterator it4 = mapSeenMasternodePing.begin();
     while (it4 != mapSeenMasternodePing.end()) {
         if ((*it4).second.sigTime < GetTime() - (MASTERNODE_REMOVAL_SECONDS * 2)) {
+            setDirtyPings.insert((*it4).first);
             mapSeenMasternodePing.erase(it4++);
         } else {
             ++it4;
@@ -339,15 +347,137 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
 void CMasternodeMan::Clear()
 {
     LOCK(cs);
-    vMasternodes.clear();
+    BOOST_FOREACH (const CMasternode& mn, listMasternodes)
+        setDirtyMasternodes.insert(mn.vin.prevout);
+    for (map<uint256, CMasternodeBroadcast>::iterator it = mapSeenMasternodeBroadcast.begin(); it != mapSeenMasternodeBroadcast.end(); ++it)
+        setDirtyBroadcasts.insert(it->first);
+    for (map<uint256, CMasternodePing>::iterator it = mapSeenMasternodePing.begin(); it != mapSeenMasternodePing.end(); ++it)
+        setDirtyPings.insert(it->first);
+    listMasternodes.clear();
+    mapMasternodesByOutpoint.clear();
+    mapMasternodesByPayee.clear();
+    mapMasternodesByPubKey.clear();
+    ClearMasternodeScores();
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
+    mAskedUsForMasternodeListDiff.clear();
+    mWeAskedForMasternodeListDiff.clear();
+    mapListDiffRequests.clear();
+    dequeRemovedMasternodes.clear();
     mapSeenMasternodeBroadcast.clear();
     mapSeenMasternodePing.clear();
     nDsqCount = 0;
 }
 
+bool CMasternodeMan::LoadCache(CMasternodeDB& db)
+{
+    int64_t nStart = GetTimeMillis();
+
+    std::map<COutPoint, CMasternode> mapMasternodes;
+    std::map<uint256, CMasternodeBroadcast> mapBroadcasts;
+    std::map<uint256, CMasternodePing> mapPings;
+    if (!db.ReadMasternodes(mapMasternodes) || !db.ReadSeenBroadcasts(mapBroadcasts) || !db.ReadSeenPings(mapPings))
+        return error("%s : Failed to read the masternode cache", __func__);
+
+    Clear();
+
+    LOCK(cs);
+    for (std::map<COutPoint, CMasternode>::iterator it = mapMasternodes.begin(); it != mapMasternodes.end(); ++it)
+        IndexMasternode(listMasternodes.insert(listMasternodes.end(), it->second));
+    mapSeenMasternodeBroadcast.swap(mapBroadcasts);
+    mapSeenMasternodePing.swap(mapPings);
+    // The database now holds exactly what is in memory
+    setDirtyMasternodes.clear();
+    setDirtyBroadcasts.clear();
+    setDirtyPings.clear();
+
+    db.Read(make_pair(DB_MASTERNODE_STATE, std::string("askedus")), mAskedUsForMasternodeList);
+    db.Read(make_pair(DB_MASTERNODE_STATE, std::string("weasked")), mWeAskedForMasternodeList);
+    db.Read(make_pair(DB_MASTERNODE_STATE, std::string("weaskedentry")), mWeAskedForMasternodeListEntry);
+    db.Read(make_pair(DB_MASTERNODE_STATE, std::string("weaskeddiff")), mWeAskedForMasternodeListDiff);
+    db.Read(make_pair(DB_MASTERNODE_STATE, std::string("dsqcount")), nDsqCount);
+    hashCachedState = GetStateHash();
+
+    LogPrint("masternode", "Loaded masternode cache  %dms\n", GetTimeMillis() - nStart);
+    LogPrint("masternode", "  %s\n", ToString());
+    return true;
+}
+
+bool CMasternodeMan::FlushCache(CMasternodeDB& db)
+{
+    int64_t nStart = GetTimeMillis();
+    CLevelDBBatch batch;
+    int nWritten = 0;
+    int nErased = 0;
+
+    {
+        LOCK(cs);
+
+        BOOST_FOREACH (const COutPoint& outpoint, setDirtyMasternodes) {
+            boost::unordered_map<COutPoint, CMasternodeIndexEntry, CMasternodeIndexHasher>::iterator mi = mapMasternodesByOutpoint.find(outpoint);
+            if (mi != mapMasternodesByOutpoint.end()) {
+                batch.Write(make_pair(DB_MASTERNODE, outpoint), *mi->second.it);
+                nWritten++;
+            } else {
+                batch.Erase(make_pair(DB_MASTERNODE, outpoint));
+                nErased++;
+            }
+        }
+        setDirtyMasternodes.clear();
+
+        BOOST_FOREACH (const uint256& hash, setDirtyBroadcasts) {
+            std::map<uint256, CMasternodeBroadcast>::iterator it = mapSeenMasternodeBroadcast.find(hash);
+            if (it != mapSeenMasternodeBroadcast.end()) {
+                batch.Write(make_pair(DB_SEEN_BROADCAST, hash), it->second);
+                nWritten++;
+            } else {
+                batch.Erase(make_pair(DB_SEEN_BROADCAST, hash));
+                nErased++;
+            }
+        }
+        setDirtyBroadcasts.clear();
+
+        BOOST_FOREACH (const uint256& hash, setDirtyPings) {
+            std::map<uint256, CMasternodePing>::iterator it = mapSeenMasternodePing.find(hash);
+            if (it != mapSeenMasternodePing.end()) {
+                batch.Write(make_pair(DB_SEEN_PING, hash), it->second);
+                nWritten++;
+            } else {
+                batch.Erase(make_pair(DB_SEEN_PING, hash));
+                nErased++;
+            }
+        }
+        setDirtyPings.clear();
+
+        uint256 hashState = GetStateHash();
+        if (hashState != hashCachedState) {
+            batch.Write(make_pair(DB_MASTERNODE_STATE, std::string("askedus")), mAskedUsForMasternodeList);
+            batch.Write(make_pair(DB_MASTERNODE_STATE, std::string("weasked")), mWeAskedForMasternodeList);
+            batch.Write(make_pair(DB_MASTERNODE_STATE, std::string("weaskedentry")), mWeAskedForMasternodeListEntry);
+            batch.Write(make_pair(DB_MASTERNODE_STATE, std::string("weaskeddiff")), mWeAskedForMasternodeListDiff);
+            batch.Write(make_pair(DB_MASTERNODE_STATE, std::string("dsqcount")), nDsqCount);
+            hashCachedState = hashState;
+            nWritten++;
+        }
+    }
+
+    if (nWritten == 0 && nErased == 0)
+        return true;
+    if (!db.WriteBatch(batch))
+        return error("%s : Failed to write the masternode cache", __func__);
+
+    LogPrint("masternode", "Flushed masternode cache: %d written, %d erased  %dms\n", nWritten, nErased, GetTimeMillis() - nStart);
+    return true;
+}
+
+uint256 CMasternodeMan::GetStateHash() const
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << mAskedUsForMasternodeList << mWeAskedForMasternodeList << mWeAskedForMasternodeListEntry << mWeAskedForMasternodeListDiff << nDsqCount;
+    return ss.GetHash();
+}
+
 int CMasternodeMan::stable_size ()
 {
     int nStable_size = 0;
@@ -355,7 +485,7 @@ int CMasternodeMan::stable_size ()
     int64_t nMasternode_Min_Age = MN_WINNER_MINIMUM_AGE;
     int64_t nMasternode_Age = 0;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         if (mn.protocolVersion < nMinProtocol) {
             continue; // Skip obsolete versions
         }
@@ -382,7 +512,7 @@ int CMasternodeMan::CountEnabled(int protocolVersion)
     int i = 0;
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         i++;
@@ -395,7 +525,7 @@ void CMasternodeMan::CountNetworks(int protocolVersion, int& ipv4, int& ipv6, in
 {
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         std::string strHost;
         int port;
@@ -440,27 +570,23 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
 CMasternode* CMasternodeMan::Find(const CScript& payee)
 {
     LOCK(cs);
-    CScript payee2;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        payee2 = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
-        if (payee2 == payee)
-            return &mn;
-    }
+    boost::unordered_multimap<CScript, std::list<CMasternode>::iterator, CMasternodeIndexHasher>::iterator mi = mapMasternodesByPayee.find(payee);
+    if (mi == mapMasternodesByPayee.end())
+        return NULL;
 
-    return NULL;
+    return &*mi->second;
 }
 
 CMasternode* CMasternodeMan::Find(const CTxIn& vin)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.vin.prevout == vin.prevout)
-            return &mn;
-    }
+    boost::unordered_map<COutPoint, CMasternodeIndexEntry, CMasternodeIndexHasher>::iterator mi = mapMasternodesByOutpoint.find(vin.prevout);
+    if (mi == mapMasternodesByOutpoint.end())
+        return NULL;
 
-    return NULL;
+    return &*mi->second.it;
 }
 
 
@@ -468,12 +594,23 @@ CMasternode* CMasternodeMan::Find(const CPubKey& pubKeyMasternode)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.pubKeyMasternode == pubKeyMasternode)
-            return &mn;
+    boost::unordered_multimap<CPubKey, std::list<CMasternode>::iterator, CMasternodeIndexHasher>::iterator mi = mapMasternodesByPubKey.find(pubKeyMasternode);
+    if (mi == mapMasternodesByPubKey.end())
+        return NULL;
+
+    return &*mi->second;
+}
+
+bool CMasternodeMan::HasMasternodeAt(const CNetAddr& addr)
+{
+    LOCK(cs);
+
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
+        if ((CNetAddr)mn.addr == addr)
+            return true;
     }
 
-    return NULL;
+    return false;
 }
 
 //
@@ -491,7 +628,9 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
     */
 
     int nMnCount = CountEnabled();
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    // How far back GetLastPaid looks for a payment
+    int nPaymentDepth = nMnCount * 1.25;
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         if (!mn.IsEnabled()) continue;
 
@@ -507,7 +646,7 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
         // Make sure it has as many confirmations as there are masternodes
         if (mn.GetMasternodeInputAge() < nMnCount) continue;
 
-        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(), mn.vin));
+        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(nPaymentDepth), mn.vin));
     }
 
     nCount = (int)vecMasternodeLastPaid.size();
@@ -515,18 +654,18 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
     // When the network is in the process of upgrading, don't penalize nodes that recently restarted
     if (fFilterSigTime && nCount < nMnCount / 3) return GetNextMasternodeInQueueForPayment(nBlockHeight, false, nCount);
 
-    // Sort them high to low
-    sort(vecMasternodeLastPaid.rbegin(), vecMasternodeLastPaid.rend(), CompareLastPaid());
-
     // Look at 1/10 of the oldest nodes (by last payment), calculate their scores and pay the best one
     //  -- This doesn't look at who is being paid in the +8-10 blocks, allowing for double payments very rarely
     //  -- 1/100 payments should be a double payment on mainnet - (1/(3000/10))*2
     //  -- (chance per block * chances before IsScheduled will fire)
-    int nTenthNetwork = CountEnabled() / 10;
-    int nCountTenth = 0;
+    // Only that tenth needs sorting, high to low
+    int nTenthNetwork = nMnCount / 10;
+    size_t nCountTenth = std::min(vecMasternodeLastPaid.size(), (size_t)std::max(nTenthNetwork, 1));
+    partial_sort(vecMasternodeLastPaid.begin(), vecMasternodeLastPaid.begin() + nCountTenth, vecMasternodeLastPaid.end(), CompareLastPaid());
+
     uint256 nHigh = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeLastPaid) {
-        CMasternode* pmn = Find(s.second);
+    for (size_t i = 0; i < nCountTenth; i++) {
+        CMasternode* pmn = Find(vecMasternodeLastPaid[i].second);
         if (!pmn) break;
 
         uint256 n = pmn->CalculateScore(1, nBlockHeight - 100);
@@ -534,8 +673,6 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
             nHigh = n;
             pBestMasternode = pmn;
         }
-        nCountTenth++;
-        if (nCountTenth >= nTenthNetwork) break;
     }
 
     return pBestMasternode;
@@ -555,7 +692,7 @@ CMasternode* CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn>& vecToExclude
     LogPrint("masternode", "CMasternodeMan::FindRandomNotInVec - rand %d\n", rand);
     bool found;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         found = false;
         BOOST_FOREACH (CTxIn& usedVin, vecToExclude) {
@@ -575,31 +712,24 @@ CMasternode* CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn>& vecToExclude
 
 CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
 {
-    int64_t score = 0;
-    CMasternode* winner = NULL;
+    uint256 hash = 0;
+    if (!GetBlockHash(hash, nBlockHeight)) return NULL;
+
+    LOCK(cs);
 
-    // Scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    // Scores are kept best first, so the winner is the first one that qualifies
+    BOOST_FOREACH (const PAIRTYPE(int64_t, CMasternode*) & s, GetMasternodeScores(hash)) {
+        CMasternode& mn = *s.second;
         mn.Check();
         if (mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
-
-        // Calculate the score for each Masternode
-        uint256 n = mn.CalculateScore(mod, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        // Determine the winner
-        if (n2 > score) {
-            score = n2;
-            winner = &mn;
-        }
+        return &mn;
     }
 
-    return winner;
+    return NULL;
 }
 
 int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
     int64_t nMasternode_Min_Age = MN_WINNER_MINIMUM_AGE;
     int64_t nMasternode_Age = 0;
 
@@ -607,14 +737,20 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
     uint256 hash = 0;
     if (!GetBlockHash(hash, nBlockHeight)) return -1;
 
-    // Scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    LOCK(cs);
+
+    if (!mapMasternodesByOutpoint.count(vin.prevout)) return -1;
+
+    bool fCheckAge = IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT);
+    int rank = 0;
+    BOOST_FOREACH (const PAIRTYPE(int64_t, CMasternode*) & s, GetMasternodeScores(hash)) {
+        CMasternode& mn = *s.second;
         if (mn.protocolVersion < minProtocol) {
             LogPrint("masternode","Skipping Masternode with obsolete version %d\n", mn.protocolVersion);
             continue;                                                       // Skip obsolete versions
         }
 
-        if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
+        if (fCheckAge) {
             nMasternode_Age = GetAdjustedTime() - mn.sigTime;
             if ((nMasternode_Age) < nMasternode_Min_Age) {
                 if (fDebug) LogPrint("masternode","Skipping just activated Masternode. Age: %ld\n", nMasternode_Age);
@@ -627,18 +763,8 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
             if (!mn.IsEnabled()) continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
-
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
         rank++;
-        if (s.second.prevout == vin.prevout) {
+        if (mn.vin.prevout == vin.prevout) {
             return rank;
         }
     }
@@ -648,36 +774,35 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
 
 std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
 {
-    std::vector<pair<int64_t, CMasternode> > vecMasternodeScores;
+    std::vector<CMasternode*> vDisabled;
     std::vector<pair<int, CMasternode> > vecMasternodeRanks;
 
     // Make sure we know about this block
     uint256 hash = 0;
     if (!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
 
-    // Scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    LOCK(cs);
+
+    // Enabled masternodes by score, then the disabled ones
+    int rank = 0;
+    BOOST_FOREACH (const PAIRTYPE(int64_t, CMasternode*) & s, GetMasternodeScores(hash)) {
+        CMasternode& mn = *s.second;
         mn.Check();
 
         if (mn.protocolVersion < minProtocol) continue;
 
         if (!mn.IsEnabled()) {
-            vecMasternodeScores.push_back(make_pair(9999, mn));
+            vDisabled.push_back(&mn);
             continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn));
+        rank++;
+        vecMasternodeRanks.push_back(make_pair(rank, mn));
     }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreMN());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CMasternode) & s, vecMasternodeScores) {
+    BOOST_FOREACH (CMasternode* pmn, vDisabled) {
         rank++;
-        vecMasternodeRanks.push_back(make_pair(rank, s.second));
+        vecMasternodeRanks.push_back(make_pair(rank, *pmn));
     }
 
     return vecMasternodeRanks;
@@ -685,35 +810,100 @@ std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t
 
 CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    uint256 hash = 0;
+    if (!GetBlockHash(hash, nBlockHeight)) return NULL;
+
+    LOCK(cs);
 
-    // Scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    int rank = 0;
+    BOOST_FOREACH (const PAIRTYPE(int64_t, CMasternode*) & s, GetMasternodeScores(hash)) {
+        CMasternode& mn = *s.second;
         if (mn.protocolVersion < minProtocol) continue;
         if (fOnlyActive) {
             mn.Check();
             if (!mn.IsEnabled()) continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
-
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
         rank++;
         if (rank == nRank) {
-            return Find(s.second);
+            return &mn;
         }
     }
 
     return NULL;
 }
 
+bool CMasternodeMan::HasSeenBroadcast(const uint256& hash)
+{
+    LOCK(cs);
+    return mapSeenMasternodeBroadcast.count(hash) > 0;
+}
+
+bool CMasternodeMan::GetSeenBroadcast(const uint256& hash, CMasternodeBroadcast& mnb)
+{
+    LOCK(cs);
+    map<uint256, CMasternodeBroadcast>::iterator it = mapSeenMasternodeBroadcast.find(hash);
+    if (it == mapSeenMasternodeBroadcast.end())
+        return false;
+    mnb = it->second;
+    return true;
+}
+
+void CMasternodeMan::EraseSeenBroadcast(const uint256& hash)
+{
+    LOCK(cs);
+    if (mapSeenMasternodeBroadcast.erase(hash))
+        setDirtyBroadcasts.insert(hash);
+}
+
+void CMasternodeMan::UpdateSeenBroadcastPing(const uint256& hash, const CMasternodePing& mnp)
+{
+    LOCK(cs);
+    map<uint256, CMasternodeBroadcast>::iterator it = mapSeenMasternodeBroadcast.find(hash);
+    if (it != mapSeenMasternodeBroadcast.end()) {
+        it->second.lastPing = mnp;
+        setDirtyBroadcasts.insert(hash);
+    }
+}
+
+bool CMasternodeMan::HasSeenPing(const uint256& hash)
+{
+    LOCK(cs);
+    return mapSeenMasternodePing.count(hash) > 0;
+}
+
+bool CMasternodeMan::GetSeenPing(const uint256& hash, CMasternodePing& mnp)
+{
+    LOCK(cs);
+    map<uint256, CMasternodePing>::iterator it = mapSeenMasternodePing.find(hash);
+    if (it == mapSeenMasternodePing.end())
+        return false;
+    mnp = it->second;
+    return true;
+}
+
+void CMasternodeMan::AddSeenPing(CMasternodePing& mnp)
+{
+    LOCK(cs);
+    uint256 hash = mnp.GetHash();
+    if (mapSeenMasternodePing.insert(make_pair(hash, mnp)).second)
+        setDirtyPings.insert(hash);
+}
+
+void CMasternodeMan::AddSeenBroadcast(CMasternodeBroadcast& mnb)
+{
+    LOCK(cs);
+    uint256 hash = mnb.GetHash();
+    if (mapSeenMasternodeBroadcast.insert(make_pair(hash, mnb)).second)
+        setDirtyBroadcasts.insert(hash);
+}
+
+void CMasternodeMan::SetMasternodeDirty(const COutPoint& outpoint)
+{
+    LOCK(cs);
+    setDirtyMasternodes.insert(outpoint);
+}
+
 void CMasternodeMan::ProcessMasternodeConnections()
 {
     // We don't care about this for regtest
@@ -730,78 +920,306 @@ void CMasternodeMan::ProcessMasternodeConnections()
     }
 }
 
-void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
+void CMasternodeMan::ProcessBroadcast(CNode* pfrom, CMasternodeBroadcast& mnb)
 {
-    if (fLiteMode) return; // Disable all Obfuscation/Masternode related functionality
-    if (!masternodeSync.IsBlockchainSynced()) return;
+    uint256 hash = mnb.GetHash();
+    bool fSeen;
+    {
+        LOCK(cs);
+        fSeen = !mapSeenMasternodeBroadcast.insert(make_pair(hash, mnb)).second;
+        if (!fSeen)
+            setDirtyBroadcasts.insert(hash);
+    }
+    if (fSeen) {
+        masternodeSync.AddedMasternodeList(hash);
+        return;
+    }
 
-    LOCK(cs_process_message);
+    int nDoS = 0;
+    if (!mnb.CheckAndUpdate(nDoS)) {
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
 
-    if (strCommand == "mnb") { // Masternode Broadcast
-        CMasternodeBroadcast mnb;
-        vRecv >> mnb;
+        return;
+    }
 
-        if (mapSeenMasternodeBroadcast.count(mnb.GetHash())) { // Seen
-            masternodeSync.AddedMasternodeList(mnb.GetHash());
-            return;
+    // Make sure the vout that was signed is related to the transaction that spawned the Masternode
+    //  - this is expensive, so it's only done once per Masternode
+    if (!obfuScationSigner.IsVinAssociatedWithPubkey(mnb.vin, mnb.pubKeyCollateralAddress)) {
+        LogPrintf("CMasternodeMan::ProcessMessage() : mnb - Got mismatched pubkey and vin\n");
+        Misbehaving(pfrom->GetId(), 33);
+        return;
+    }
+
+    // Make sure it's still unspent
+    //  - this is checked later by .check() in many places and by ThreadCheckObfuScationPool()
+    if (mnb.CheckInputsAndAdd(nDoS)) {
+        // Use this as a peer
+        addrman.Add(CAddress(mnb.addr), pfrom->addr, 2 * 60 * 60);
+        masternodeSync.AddedMasternodeList(mnb.GetHash());
+    } else {
+        LogPrint("masternode","mnb - Rejected Masternode entry %s\n", mnb.vin.prevout.hash.ToString());
+
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
+    }
+}
+
+void CMasternodeMan::ProcessPing(CNode* pfrom, CMasternodePing& mnp)
+{
+    LogPrint("masternode", "mnp - Masternode ping, vin: %s\n", mnp.vin.prevout.hash.ToString());
+
+    {
+        LOCK(cs);
+        uint256 hash = mnp.GetHash();
+        if (!mapSeenMasternodePing.insert(make_pair(hash, mnp)).second) return; //seen
+        setDirtyPings.insert(hash);
+    }
+
+    int nDoS = 0;
+    if (mnp.CheckAndUpdate(nDoS)) return;
+
+    if (nDoS > 0) {
+        // If anything significant failed, mark that node
+        Misbehaving(pfrom->GetId(), nDoS);
+    } else {
+        // If nothing significant failed, search existing Masternode list
+        CMasternode* pmn = Find(mnp.vin);
+        // If it's known, don't ask for the mnb, just return
+        if (pmn != NULL) return;
+    }
+
+    // Something significant is broken or mn is unknown,
+    // we might have to ask for a masternode entry once
+    AskForMN(pfrom, mnp.vin);
+}
+
+uint256 CMasternodeMan::GetListHash()
+{
+    LOCK(cs);
+
+    std::map<COutPoint, uint256> mapAnnouncements;
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
+        if (mn.addr.IsRFC1918() || !mn.IsEnabled()) continue;
+        mapAnnouncements[mn.vin.prevout] = CMasternodeBroadcast(mn).GetHash();
+    }
+
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    std::map<COutPoint, uint256>::const_iterator it;
+    for (it = mapAnnouncements.begin(); it != mapAnnouncements.end(); ++it)
+        ss << it->first << it->second;
+    return ss.GetHash();
+}
+
+void CMasternodeMan::RequestMasternodeList(CNode* pnode)
+{
+    std::set<uint256> setPingBlocks;
+    {
+        LOCK(cs);
+        if (mapListDiffRequests.count(pnode->GetId())) return;
+
+        if (Params().NetworkID() == CBaseChainParams::MAIN) {
+            if (!(pnode->addr.IsRFC1918() || pnode->addr.IsLocal())) {
+                std::map<CNetAddr, int64_t>::iterator it = mWeAskedForMasternodeListDiff.find(pnode->addr);
+                if (it != mWeAskedForMasternodeListDiff.end()) {
+                    if (GetTime() < (*it).second) {
+                        LogPrint("masternode", "getmnlist - we already asked peer %i for the list; skipping...\n", pnode->GetId());
+                        return;
+                    }
+                }
+            }
         }
-        mapSeenMasternodeBroadcast.insert(make_pair(mnb.GetHash(), mnb));
 
-        int nDoS = 0;
-        if (!mnb.CheckAndUpdate(nDoS)) {
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
+        BOOST_FOREACH (CMasternode& mn, listMasternodes)
+            setPingBlocks.insert(mn.lastPing.blockHash);
+    }
 
-            return;
+    // Changes since the newest ping we know of; none at all gets us the whole list
+    int nFromHeight = 0;
+    {
+        LOCK(cs_main);
+        BOOST_FOREACH (const uint256& hash, setPingBlocks) {
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
+            if (mi != mapBlockIndex.end() && chainActive.Contains(mi->second))
+                nFromHeight = std::max(nFromHeight, mi->second->nHeight);
         }
+    }
 
-        // Make sure the vout that was signed is related to the transaction that spawned the Masternode
-        //  - this is expensive, so it's only done once per Masternode
-        if (!obfuScationSigner.IsVinAssociatedWithPubkey(mnb.vin, mnb.pubKeyCollateralAddress)) {
-            LogPrintf("CMasternodeMan::ProcessMessage() : mnb - Got mismatched pubkey and vin\n");
-            Misbehaving(pfrom->GetId(), 33);
-            return;
+    uint256 hashList = GetListHash();
+    LogPrint("masternode", "getmnlist - asking peer %i for the list since height %d\n", pnode->GetId(), nFromHeight);
+    pnode->PushMessage("getmnlist", nFromHeight, hashList);
+
+    // The peer takes a height past its tip for a whole-list request too, and won't answer
+    // another one as long as it would a dseg
+    bool fSnapshot = nFromHeight <= 0 || nFromHeight > pnode->nStartingHeight;
+    int64_t askAgain = GetTime() + (fSnapshot ? MASTERNODES_DSEG_SECONDS : MASTERNODE_MIN_MNP_SECONDS);
+
+    LOCK(cs);
+    mWeAskedForMasternodeListDiff[pnode->addr] = askAgain;
+    mapListDiffRequests[pnode->GetId()] = GetTime();
+}
+
+bool CMasternodeMan::IsListDiffRequested(NodeId nodeid)
+{
+    LOCK(cs);
+    return mapListDiffRequests.count(nodeid) > 0;
+}
+
+void CMasternodeMan::SendListDiff(CNode* pfrom, int nFromHeight, const uint256& hashList)
+{
+    // The tip is read once and the peer's height resolved through it, since the chain may
+    // have moved on since the request was checked; a height it no longer has gets the whole list
+    const CBlockIndex* pindexTip = chainActive.AtomicTip();
+    const CBlockIndex* pindexFrom = NULL;
+    if (pindexTip != NULL && nFromHeight > 0)
+        pindexFrom = pindexTip->GetAncestor(nFromHeight);
+    if (pindexFrom == NULL)
+        nFromHeight = 0;
+
+    LOCK(cs);
+
+    CMasternodeListDiff diffBase;
+    diffBase.nHeight = pindexTip == NULL ? 0 : pindexTip->nHeight;
+    diffBase.nFromHeight = nFromHeight;
+    diffBase.hashList = GetListHash();
+
+    // A peer that holds the same announcements only needs fresher pings
+    bool fSameList = hashList == diffBase.hashList;
+    int64_t nTimeFrom = 0;
+    if (pindexFrom != NULL)
+        nTimeFrom = pindexFrom->GetBlockTime() - MASTERNODES_LIST_DIFF_MARGIN_SECONDS;
+
+    std::vector<CMasternodeListDiff> vParts(1, diffBase);
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
+        if (mn.addr.IsRFC1918() || !mn.IsEnabled()) continue;
+
+        if (vParts.back().size() >= MASTERNODES_LIST_DIFF_ENTRIES)
+            vParts.push_back(diffBase);
+
+        if (!fSameList && mn.sigTime >= nTimeFrom)
+            vParts.back().vBroadcasts.push_back(CMasternodeBroadcast(mn));
+        else if (mn.lastPing.sigTime >= nTimeFrom)
+            vParts.back().vPings.push_back(mn.lastPing);
+    }
+
+    if (nFromHeight > 0) {
+        BOOST_FOREACH (const PAIRTYPE(int, CTxIn) & removed, dequeRemovedMasternodes) {
+            if (removed.first >= nFromHeight)
+                vParts.back().vRemoved.push_back(removed.second);
         }
+    }
 
-        // Make sure it's still unspent
-        //  - this is checked later by .check() in many places and by ThreadCheckObfuScationPool()
-        if (mnb.CheckInputsAndAdd(nDoS)) {
-            // Use this as a peer
-            addrman.Add(CAddress(mnb.addr), pfrom->addr, 2 * 60 * 60);
-            masternodeSync.AddedMasternodeList(mnb.GetHash());
-        } else {
-            LogPrint("masternode","mnb - Rejected Masternode entry %s\n", mnb.vin.prevout.hash.ToString());
+    int nBroadcasts = 0, nPings = 0;
+    for (unsigned int i = 0; i < vParts.size(); i++) {
+        vParts[i].nPart = i;
+        vParts[i].nParts = vParts.size();
+        nBroadcasts += vParts[i].vBroadcasts.size();
+        nPings += vParts[i].vPings.size();
+        pfrom->PushMessage("mnlistdiff", vParts[i]);
+    }
+
+    LogPrint("masternode", "getmnlist - Sent %d broadcasts, %d pings and %d removals since height %d in %d parts to peer %i\n",
+        nBroadcasts, nPings, (int)vParts.back().vRemoved.size(), nFromHeight, (int)vParts.size(), pfrom->GetId());
+}
 
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
+void CMasternodeMan::ProcessListDiff(CNode* pfrom, CMasternodeListDiff& diff)
+{
+    {
+        LOCK(cs);
+        if (!mapListDiffRequests.count(pfrom->GetId())) {
+            LogPrint("masternode", "mnlistdiff - unrequested list from peer %i\n", pfrom->GetId());
+            return;
         }
     }
 
-    else if (strCommand == "mnp") { //Masternode Ping
-        CMasternodePing mnp;
-        vRecv >> mnp;
+    if (diff.nParts <= 0 || diff.nPart < 0 || diff.nPart >= diff.nParts || diff.size() > MASTERNODES_LIST_DIFF_ENTRIES ||
+        diff.vRemoved.size() > MASTERNODES_REMOVED_LOG_SIZE) {
+        LogPrintf("CMasternodeMan::ProcessMessage() : mnlistdiff - malformed part from peer %i\n", pfrom->GetId());
+        Misbehaving(pfrom->GetId(), 20);
+        return;
+    }
 
-        LogPrint("masternode", "mnp - Masternode ping, vin: %s\n", mnp.vin.prevout.hash.ToString());
+    // Each entry is checked exactly as if it had been relayed on its own
+    BOOST_FOREACH (CMasternodeBroadcast& mnb, diff.vBroadcasts)
+        ProcessBroadcast(pfrom, mnb);
+    BOOST_FOREACH (CMasternodePing& mnp, diff.vPings)
+        ProcessPing(pfrom, mnp);
 
-        if (mapSeenMasternodePing.count(mnp.GetHash())) return; //seen
-        mapSeenMasternodePing.insert(make_pair(mnp.GetHash(), mnp));
+    // Removals only make us check those masternodes against our own view
+    BOOST_FOREACH (const CTxIn& vin, diff.vRemoved) {
+        CMasternode* pmn = Find(vin);
+        if (pmn != NULL) pmn->Check(true);
+    }
 
-        int nDoS = 0;
-        if (mnp.CheckAndUpdate(nDoS)) return;
+    if (diff.nPart < diff.nParts - 1) return;
 
-        if (nDoS > 0) {
-            // If anything significant failed, mark that node
-            Misbehaving(pfrom->GetId(), nDoS);
-        } else {
-            // If nothing significant failed, search existing Masternode list
-            CMasternode* pmn = Find(mnp.vin);
-            // If it's known, don't ask for the mnb, just return
-            if (pmn != NULL) return;
+    {
+        LOCK(cs);
+        mapListDiffRequests.erase(pfrom->GetId());
+    }
+
+    // Matching lists need nothing more; otherwise fetch what we're missing the old way,
+    // which only downloads the announcements we haven't seen
+    if (GetListHash() == diff.hashList) {
+        LogPrint("masternode", "mnlistdiff - list of peer %i as of height %d matches ours\n", pfrom->GetId(), diff.nHeight);
+        masternodeSync.ReceivedMasternodeList();
+    } else {
+        LogPrint("masternode", "mnlistdiff - list of peer %i as of height %d differs from ours, asking for its inventory\n", pfrom->GetId(), diff.nHeight);
+        DsegUpdate(pfrom);
+    }
+}
+
+void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
+{
+    if (fLiteMode) return; // Disable all Obfuscation/Masternode related functionality
+    if (!masternodeSync.IsBlockchainSynced()) return;
+
+    LOCK(cs_process_message);
+
+    if (strCommand == "mnb") { // Masternode Broadcast
+        CMasternodeBroadcast mnb;
+        vRecv >> mnb;
+        ProcessBroadcast(pfrom, mnb);
+    }
+
+    else if (strCommand == "mnp") { //Masternode Ping
+        CMasternodePing mnp;
+        vRecv >> mnp;
+        ProcessPing(pfrom, mnp);
+
+    } else if (strCommand == "getmnlist") { // Masternode list snapshot, or what changed since a height
+        int nFromHeight;
+        uint256 hashList;
+        vRecv >> nFromHeight >> hashList;
+
+        // A whole list costs as much to send as a dseg and is limited the same way; diffs are cheap
+        const CBlockIndex* pindexTip = chainActive.AtomicTip();
+        bool fSnapshot = nFromHeight <= 0 || pindexTip == NULL || nFromHeight > pindexTip->nHeight;
+        bool isLocal = (pfrom->addr.IsRFC1918() || pfrom->addr.IsLocal());
+        if (!isLocal && Params().NetworkID() == CBaseChainParams::MAIN) {
+            bool fAskedAlready = false;
+            {
+                LOCK(cs);
+                std::map<CNetAddr, int64_t>::iterator i = mAskedUsForMasternodeListDiff.find(pfrom->addr);
+                if (i != mAskedUsForMasternodeListDiff.end() && GetTime() < (*i).second)
+                    fAskedAlready = true;
+                else
+                    mAskedUsForMasternodeListDiff[pfrom->addr] = GetTime() + (fSnapshot ? MASTERNODES_DSEG_SECONDS : MASTERNODE_MIN_MNP_SECONDS);
+            }
+            if (fAskedAlready) {
+                LogPrintf("CMasternodeMan::ProcessMessage() : getmnlist - peer already asked me for the list\n");
+                if (fSnapshot)
+                    Misbehaving(pfrom->GetId(), 34);
+                return;
+            }
         }
 
-        // Something significant is broken or mn is unknown,
-        // we might have to ask for a masternode entry once
-        AskForMN(pfrom, mnp.vin);
+        SendListDiff(pfrom, fSnapshot ? 0 : nFromHeight, hashList);
+
+    } else if (strCommand == "mnlistdiff") { // Part of a list we asked for
+        CMasternodeListDiff diff;
+        vRecv >> diff;
+        ProcessListDiff(pfrom, diff);
 
     } else if (strCommand == "dseg") { //Get Masternode list or specific entry
 
@@ -813,24 +1231,29 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             bool isLocal = (pfrom->addr.IsRFC1918() || pfrom->addr.IsLocal());
 
             if (!isLocal && Params().NetworkID() == CBaseChainParams::MAIN) {
-                std::map<CNetAddr, int64_t>::iterator i = mAskedUsForMasternodeList.find(pfrom->addr);
-                if (i != mAskedUsForMasternodeList.end()) {
-                    int64_t t = (*i).second;
-                    if (GetTime() < t) {
-                        LogPrintf("CMasternodeMan::ProcessMessage() : dseg - peer already asked me for the list\n");
-                        Misbehaving(pfrom->GetId(), 34);
-                        return;
+                bool fAskedAlready = false;
+                {
+                    LOCK(cs);
+                    std::map<CNetAddr, int64_t>::iterator i = mAskedUsForMasternodeList.find(pfrom->addr);
+                    if (i != mAskedUsForMasternodeList.end() && GetTime() < (*i).second) {
+                        fAskedAlready = true;
+                    } else {
+                        int64_t askAgain = GetTime() + MASTERNODES_DSEG_SECONDS;
+                        mAskedUsForMasternodeList[pfrom->addr] = askAgain;
                     }
                 }
-                int64_t askAgain = GetTime() + MASTERNODES_DSEG_SECONDS;
-                mAskedUsForMasternodeList[pfrom->addr] = askAgain;
+                if (fAskedAlready) {
+                    LogPrintf("CMasternodeMan::ProcessMessage() : dseg - peer already asked me for the list\n");
+                    Misbehaving(pfrom->GetId(), 34);
+                    return;
+                }
             }
         } // else, asking for a specific node which is ok
 
-
+        LOCK(cs);
         int nInvCount = 0;
 
-        BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+        BOOST_FOREACH (CMasternode& mn, listMasternodes) {
             if (mn.addr.IsRFC1918()) continue; // Local network
 
             if (mn.IsEnabled()) {
@@ -841,7 +1264,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                     pfrom->PushInventory(CInv(MSG_MASTERNODE_ANNOUNCE, hash));
                     nInvCount++;
 
-                    if (!mapSeenMasternodeBroadcast.count(hash)) mapSeenMasternodeBroadcast.insert(make_pair(hash, mnb));
+                    if (mapSeenMasternodeBroadcast.insert(make_pair(hash, mnb)).second) setDirtyBroadcasts.insert(hash);
 
                     if (vin == mn.vin) {
                         LogPrint("masternode", "dseg - Sent 1 Masternode entry to peer %i\n", pfrom->GetId());
@@ -949,6 +1372,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                     LogPrint("masternode", "dsee - Got updated entry for %s\n", vin.prevout.hash.ToString());
                     if (pmn->protocolVersion < GETHEADERS_VERSION) {
                         pmn->pubKeyMasternode = pubkey2;
+                        Reindex(*pmn);
                         pmn->sigTime = sigTime;
                         pmn->sig = vchSig;
                         pmn->protocolVersion = protocolVersion;
@@ -957,6 +1381,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                         pmn->lastPing = CMasternodePing(vin);
                     }
                     pmn->nLastDsee = sigTime;
+                    SetMasternodeDirty(vin.prevout);
                     pmn->Check();
                     if (pmn->IsEnabled()) {
                         TRY_LOCK(cs_vNodes, lockNodes);
@@ -1013,14 +1438,12 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
             // Verify that sig time is legit in past
             // should be at least not earlier than block when 200000 BYRON tx got MASTERNODE_MIN_CONFIRMATIONS
-            uint256 hashBlock = 0;
-            CTransaction tx2;
-            GetTransaction(vin.prevout.hash, tx2, hashBlock, true);
-            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
-            if (mi != mapBlockIndex.end() && (*mi).second) {
-                CBlockIndex* pMNIndex = (*mi).second;                                                        // block for 200000 BYRON tx -> 1 confirmation
-                CBlockIndex* pConfIndex = chainActive[pMNIndex->nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1]; // block where tx got MASTERNODE_MIN_CONFIRMATIONS
-                if (pConfIndex->GetBlockTime() > sigTime) {
+            Coin coin;
+            const CBlockIndex* pindexTip = chainActive.AtomicTip();
+            if (GetUTXOCoin(vin.prevout, coin) && coin.nHeight > 0 && pindexTip != NULL && (int)coin.nHeight <= pindexTip->nHeight) {
+                // block where tx got MASTERNODE_MIN_CONFIRMATIONS
+                const CBlockIndex* pConfIndex = pindexTip->GetAncestor(std::min((int)coin.nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1, pindexTip->nHeight));
+                if (pConfIndex != NULL && pConfIndex->GetBlockTime() > sigTime) {
                     LogPrint("masternode","mnb - Bad sigTime %d for Masternode %s (%i conf block is at %d)\n",
                         sigTime, vin.prevout.hash.ToString(), MASTERNODE_MIN_CONFIRMATIONS, pConfIndex->GetBlockTime());
                     return;
@@ -1113,6 +1536,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                 // Fake ping for v11 masternodes, ignore for v12
                 if (pmn->protocolVersion < GETHEADERS_VERSION) pmn->lastPing = CMasternodePing(vin);
                 pmn->nLastDseep = sigTime;
+                SetMasternodeDirty(vin.prevout);
                 pmn->Check();
                 if (pmn->IsEnabled()) {
                     TRY_LOCK(cs_vNodes, lockNodes);
@@ -1136,22 +1560,18 @@ void CMasternodeMan::Remove(CTxIn vin)
 {
     LOCK(cs);
 
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
-        if ((*it).vin == vin) {
-            LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).vin.prevout.hash.ToString(), size() - 1);
-            vMasternodes.erase(it);
-            break;
-        }
-        ++it;
+    boost::unordered_map<COutPoint, CMasternodeIndexEntry, CMasternodeIndexHasher>::iterator mi = mapMasternodesByOutpoint.find(vin.prevout);
+    if (mi != mapMasternodesByOutpoint.end() && mi->second.it->vin == vin) {
+        LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", vin.prevout.hash.ToString(), size() - 1);
+        EraseMasternode(mi->second.it);
     }
 }
 
 void CMasternodeMan::UpdateMasternodeList(CMasternodeBroadcast mnb)
 {
-	mapSeenMasternodePing.insert(make_pair(mnb.lastPing.GetHash(), mnb.lastPing));
-	mapSeenMasternodeBroadcast.insert(make_pair(mnb.GetHash(), mnb));
-	masternodeSync.AddedMasternodeList(mnb.GetHash());
+    AddSeenPing(mnb.lastPing);
+    AddSeenBroadcast(mnb);
+    masternodeSync.AddedMasternodeList(mnb.GetHash());
 
     LogPrint("masternode","CMasternodeMan::UpdateMasternodeList() -- masternode=%s\n", mnb.vin.prevout.ToString());
 
@@ -1160,7 +1580,8 @@ void CMasternodeMan::UpdateMasternodeList(CMasternodeBroadcast mnb)
         CMasternode mn(mnb);
         Add(mn);
     } else {
-    	pmn->UpdateFromNewBroadcast(mnb);
+    	if (pmn->UpdateFromNewBroadcast(mnb))
+            Reindex(*pmn);
     }
 }
 
@@ -1168,7 +1589,7 @@ std::string CMasternodeMan::ToString() const
 {
     std::ostringstream info;
 
-    info << "Masternodes: " << (int)vMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size() << ", nDsqCount: " << (int)nDsqCount;
+    info << "Masternodes: " << (int)listMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size() << ", nDsqCount: " << (int)nDsqCount;
 
     return info.str();
 }
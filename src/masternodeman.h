@@ -15,38 +15,95 @@
 #include "sync.h"
 #include "util.h"
 
-#define MASTERNODES_DUMP_SECONDS (15 * 60)
+#include <deque>
+#include <list>
+#include <set>
+
+#include <boost/unordered_map.hpp>
+
+// How often changes to the list are written to the masternode cache database
+#define MASTERNODES_FLUSH_SECONDS 60
+// How often the masternode cache database is compacted
+#define MASTERNODES_COMPACT_SECONDS (24 * 60 * 60)
 #define MASTERNODES_DSEG_SECONDS (3 * 60 * 60)
+// Number of blocks whose masternode scores are kept for ranking
+#define MASTERNODE_RANK_CACHE_BLOCKS 32
+// Broadcasts and pings sent per mnlistdiff message
+#define MASTERNODES_LIST_DIFF_ENTRIES 1000
+// Slack allowed between a diff's starting block and the broadcasts and pings it must include
+#define MASTERNODES_LIST_DIFF_MARGIN_SECONDS (2 * MASTERNODE_PING_SECONDS)
+// How long we wait for the parts of a list we asked a peer for
+#define MASTERNODES_LIST_DIFF_TIMEOUT (5 * 60)
+// Removed masternodes remembered for the diffs we send
+#define MASTERNODES_REMOVED_LOG_SIZE 10000
 
 using namespace std;
 
+class CMasternodeDB;
 class CMasternodeMan;
 
 extern CMasternodeMan mnodeman;
-void DumpMasternodes();
 
-/** Access to the MN database (mncache.dat)
- */
-class CMasternodeDB
+/** Salted SipHash of the keys masternodes are indexed by, so peers can't pick keys that collide */
+class CMasternodeIndexHasher
 {
 private:
-    boost::filesystem::path pathMN;
-    std::string strMagicMessage;
+    uint64_t k0, k1;
 
 public:
-    enum ReadResult {
-        Ok,
-        FileError,
-        HashReadError,
-        IncorrectHash,
-        IncorrectMagicMessage,
-        IncorrectMagicNumber,
-        IncorrectFormat
-    };
+    CMasternodeIndexHasher();
+
+    size_t operator()(const COutPoint& outpoint) const;
+    size_t operator()(const CScript& script) const;
+    size_t operator()(const CPubKey& pubkey) const;
+};
+
+/**
+ * One part of a masternode list sent in answer to getmnlist: the whole list, or only
+ * what changed since a block height. Each part commits to the hash of the sender's
+ * whole list (CMasternodeMan::GetListHash), which the receiver checks its own list
+ * against once the last part is in.
+ */
+class CMasternodeListDiff
+{
+public:
+    int nHeight;     // the sender's chain height the list is as of
+    int nFromHeight; // 0 for the whole list
+    uint256 hashList;
+    int nPart;
+    int nParts;
+    // masternodes announced since nFromHeight, or all of them
+    std::vector<CMasternodeBroadcast> vBroadcasts;
+    // newer pings of masternodes whose announcement is older
+    std::vector<CMasternodePing> vPings;
+    // masternodes the sender dropped since nFromHeight; only hints, never trusted
+    std::vector<CTxIn> vRemoved;
+
+    CMasternodeListDiff()
+    {
+        nHeight = 0;
+        nFromHeight = 0;
+        hashList = 0;
+        nPart = 0;
+        nParts = 0;
+    }
+
+    size_t size() const { return vBroadcasts.size() + vPings.size(); }
+
+    ADD_SERIALIZE_METHODS;
 
-    CMasternodeDB();
-    bool Write(const CMasternodeMan& mnodemanToSave);
-    ReadResult Read(CMasternodeMan& mnodemanToLoad, bool fDryRun = false);
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(nHeight);
+        READWRITE(nFromHeight);
+        READWRITE(hashList);
+        READWRITE(nPart);
+        READWRITE(nParts);
+        READWRITE(vBroadcasts);
+        READWRITE(vPings);
+        READWRITE(vRemoved);
+    }
 };
 
 class CMasternodeMan
@@ -58,19 +115,63 @@ private:
     // critical section to protect the inner data structures specifically on messaging
     mutable CCriticalSection cs_process_message;
 
-    // map to hold all MNs
-    std::vector<CMasternode> vMasternodes;
+    // list to hold all MNs, in the order they were added
+    std::list<CMasternode> listMasternodes;
+
+    struct CMasternodeIndexEntry {
+        std::list<CMasternode>::iterator it;
+        // the keys the entry is filed under in the other indexes
+        CScript payee;
+        CPubKey pubKeyMasternode;
+    };
+
+    // indexes into listMasternodes; several masternodes may share a payee or a key
+    boost::unordered_map<COutPoint, CMasternodeIndexEntry, CMasternodeIndexHasher> mapMasternodesByOutpoint;
+    boost::unordered_multimap<CScript, std::list<CMasternode>::iterator, CMasternodeIndexHasher> mapMasternodesByPayee;
+    boost::unordered_multimap<CPubKey, std::list<CMasternode>::iterator, CMasternodeIndexHasher> mapMasternodesByPubKey;
+    // every masternode's score against one block, best first
+    typedef std::vector<std::pair<int64_t, CMasternode*> > CMasternodeScores;
+    // scores of the blocks ranked most recently, keyed by block hash so a reorg can't mix them up;
+    // kept up to date as masternodes come and go, oldest block dropped first
+    std::map<uint256, CMasternodeScores> mapMasternodeScores;
+    std::list<uint256> listScoredBlocks;
     // who's asked for the Masternode list and the last time
     std::map<CNetAddr, int64_t> mAskedUsForMasternodeList;
     // who we asked for the Masternode list and the last time
     std::map<CNetAddr, int64_t> mWeAskedForMasternodeList;
     // which Masternodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
+    // who's asked for a list snapshot or diff and when they may ask again
+    std::map<CNetAddr, int64_t> mAskedUsForMasternodeListDiff;
+    // who we asked for a list snapshot or diff and when we may ask again
+    std::map<CNetAddr, int64_t> mWeAskedForMasternodeListDiff;
+    // peers we're waiting for mnlistdiff parts from, and when we asked
+    std::map<NodeId, int64_t> mapListDiffRequests;
+    // masternodes dropped from the list, oldest first, with the height they went at
+    std::deque<std::pair<int, CTxIn> > dequeRemovedMasternodes;
+    // masternodes, seen broadcasts and seen pings added, changed or removed since the cache
+    // database was last loaded or flushed, and a hash of the request times and dsq count it holds
+    std::set<COutPoint> setDirtyMasternodes;
+    std::set<uint256> setDirtyBroadcasts;
+    std::set<uint256> setDirtyPings;
+    uint256 hashCachedState;
+
+    void IndexMasternode(std::list<CMasternode>::iterator it);
+    void UnindexMasternode(const COutPoint& outpoint);
+    void EraseMasternode(std::list<CMasternode>::iterator it);
+    const CMasternodeScores& GetMasternodeScores(const uint256& hashBlock);
+    void ClearMasternodeScores();
+    uint256 GetStateHash() const;
+
+    void ProcessBroadcast(CNode* pfrom, CMasternodeBroadcast& mnb);
+    void ProcessPing(CNode* pfrom, CMasternodePing& mnp);
+    void ProcessListDiff(CNode* pfrom, CMasternodeListDiff& diff);
+    void SendListDiff(CNode* pfrom, int nFromHeight, const uint256& hashList);
 
 public:
-    // Keep track of all broadcasts I've seen
+    // Keep track of all broadcasts I've seen; guarded by cs, use the accessors below from outside
     map<uint256, CMasternodeBroadcast> mapSeenMasternodeBroadcast;
-    // Keep track of all pings I've seen
+    // Keep track of all pings I've seen; guarded by cs, use the accessors below from outside
     map<uint256, CMasternodePing> mapSeenMasternodePing;
 
     // keep track of dsq count to prevent masternodes from gaming obfuscation queue
@@ -82,7 +183,22 @@ public:
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
     {
         LOCK(cs);
+        // Stored as a vector, which the indexes are rebuilt from
+        std::vector<CMasternode> vMasternodes;
+        if (!ser_action.ForRead())
+            vMasternodes.assign(listMasternodes.begin(), listMasternodes.end());
         READWRITE(vMasternodes);
+        if (ser_action.ForRead()) {
+            listMasternodes.clear();
+            mapMasternodesByOutpoint.clear();
+            mapMasternodesByPayee.clear();
+            mapMasternodesByPubKey.clear();
+            ClearMasternodeScores();
+            BOOST_FOREACH (const CMasternode& mn, vMasternodes) {
+                if (!mapMasternodesByOutpoint.count(mn.vin.prevout))
+                    IndexMasternode(listMasternodes.insert(listMasternodes.end(), mn));
+            }
+        }
         READWRITE(mAskedUsForMasternodeList);
         READWRITE(mWeAskedForMasternodeList);
         READWRITE(mWeAskedForMasternodeListEntry);
@@ -110,17 +226,49 @@ public:
     /// Clear Masternode vector
     void Clear();
 
+    /// Replace the list and seen gossip with what the cache database holds
+    bool LoadCache(CMasternodeDB& db);
+
+    /// Write the entries that changed since the last load or flush to the cache database
+    bool FlushCache(CMasternodeDB& db);
+
     int CountEnabled(int protocolVersion = -1);
 
     void CountNetworks(int protocolVersion, int& ipv4, int& ipv6, int& onion);
 
     void DsegUpdate(CNode* pnode);
 
+    /// Ask a peer for the changes to our list, or for its whole list if we have none
+    void RequestMasternodeList(CNode* pnode);
+
+    bool HasSeenBroadcast(const uint256& hash);
+    bool GetSeenBroadcast(const uint256& hash, CMasternodeBroadcast& mnb);
+    void EraseSeenBroadcast(const uint256& hash);
+    /// Make mnp the last ping of the seen broadcast with this hash, if there is one
+    void UpdateSeenBroadcastPing(const uint256& hash, const CMasternodePing& mnp);
+    bool HasSeenPing(const uint256& hash);
+    bool GetSeenPing(const uint256& hash, CMasternodePing& mnp);
+    void AddSeenPing(CMasternodePing& mnp);
+    void AddSeenBroadcast(CMasternodeBroadcast& mnb);
+    /// Have the next FlushCache write this masternode, for changes made through Find
+    void SetMasternodeDirty(const COutPoint& outpoint);
+    /// Whether we're waiting for mnlistdiff parts from this peer
+    bool IsListDiffRequested(NodeId nodeid);
+
+    /// Hash of the announcements of the masternodes we'd send in a list, ordered by outpoint
+    uint256 GetListHash();
+
     /// Find an entry
     CMasternode* Find(const CScript& payee);
     CMasternode* Find(const CTxIn& vin);
     CMasternode* Find(const CPubKey& pubKeyMasternode);
 
+    /// File mn again under its payee and key, after a new broadcast may have changed them
+    void Reindex(const CMasternode& mn);
+
+    /// Whether a masternode in the list runs on this IP, whatever the port
+    bool HasMasternodeAt(const CNetAddr& addr);
+
     /// Find an entry in the masternode list that is next to be paid
     CMasternode* GetNextMasternodeInQueueForPayment(int nBlockHeight, bool fFilterSigTime, int& nCount);
 
@@ -133,7 +281,8 @@ public:
     std::vector<CMasternode> GetFullMasternodeVector()
     {
         Check();
-        return vMasternodes;
+        LOCK(cs);
+        return std::vector<CMasternode>(listMasternodes.begin(), listMasternodes.end());
     }
 
     std::vector<pair<int, CMasternode> > GetMasternodeRanks(int64_t nBlockHeight, int minProtocol = 0);
@@ -145,7 +294,7 @@ public:
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
     /// Return the number of (unique) Masternodes
-    int size() { return vMasternodes.size(); }
+    int size() { return listMasternodes.size(); }
 
     /// Return the number of Masternodes older than (default) 8000 seconds
     int stable_size ();
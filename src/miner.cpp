@@ -29,7 +29,6 @@
 #include "invalid.h"
 
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
 
 using namespace std;
 
@@ -38,54 +37,193 @@ using namespace std;
 // BYRONMiner
 //
 
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+int64_t nLastCoinStakeSearchInterval = 0;
+
 //
-// Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
+// Once some of a transaction's ancestors are in the block being built, the
+// ancestor totals cached in its mempool entry overstate what it still needs.
+// CTxMemPoolModifiedEntry keeps the corrected totals for such transactions,
+// in a second multi_index ordered like the mempool's ancestor_score index, so
+// CreateNewBlock can always pick the best remaining package without sorting
+// the pool.
 //
-class COrphan
-{
-public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
+struct CTxMemPoolModifiedEntry {
+    CTxMemPoolModifiedEntry(CTxMemPool::txiter entry)
+    {
+        iter = entry;
+        nSizeWithAncestors = entry->GetSizeWithAncestors();
+        nModFeesWithAncestors = entry->GetModFeesWithAncestors();
+    }
 
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+};
+
+// Comparator for CTxMemPool::txiter objects.
+struct CompareCTxMemPoolIter {
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
     {
+        return &(*a) < &(*b);
     }
 };
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
-int64_t nLastCoinStakeSearchInterval = 0;
+struct modifiedentry_iter {
+    typedef CTxMemPool::txiter result_type;
+    result_type operator()(const CTxMemPoolModifiedEntry& entry) const
+    {
+        return entry.iter;
+    }
+};
 
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
-{
-    bool byFee;
+// Same ordering as CompareTxMemPoolEntryByAncestorFee, on the modified totals.
+struct CompareModifiedEntry {
+    bool operator()(const CTxMemPoolModifiedEntry& a, const CTxMemPoolModifiedEntry& b) const
+    {
+        double f1 = (double)a.nModFeesWithAncestors * b.nSizeWithAncestors;
+        double f2 = (double)b.nModFeesWithAncestors * a.nSizeWithAncestors;
+        if (f1 == f2)
+            return CTxMemPool::CompareIteratorByHash()(a.iter, b.iter);
+        return f1 > f2;
+    }
+};
 
-public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) {}
+typedef boost::multi_index_container<
+    CTxMemPoolModifiedEntry,
+    boost::multi_index::indexed_by<
+        boost::multi_index::ordered_unique<
+            modifiedentry_iter,
+            CompareCTxMemPoolIter>,
+        // sorted by modified ancestor fee rate
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
+            CompareModifiedEntry> > >
+    indexed_modified_transaction_set;
+
+typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
+typedef indexed_modified_transaction_set::index<ancestor_score>::type::iterator modtxscoreiter;
+
+struct update_for_parent_inclusion {
+    update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
+
+    void operator()(CTxMemPoolModifiedEntry& e)
+    {
+        e.nModFeesWithAncestors -= iter->GetModifiedFee();
+        e.nSizeWithAncestors -= iter->GetTxSize();
+    }
+
+    CTxMemPool::txiter iter;
+};
 
-    bool operator()(const TxPriority& a, const TxPriority& b)
+// A package sorted this way always lists parents before their children.
+struct CompareTxIterByAncestorCount {
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
     {
-        if (byFee) {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
-        } else {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
-        }
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
+    }
+};
+
+// We want to sort transactions by priority for the free area of the block:
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
+struct TxCoinAgePriorityCompare {
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b) const
+    {
+        if (a.first == b.first)
+            return CompareTxMemPoolEntryByScore()(*(b.second), *(a.second)); // Reverse order to make sort less than
+        return a.first < b.first;
     }
 };
 
+/** Add the descendants of newly added transactions to mapModifiedTx, with the added ancestors taken out of their totals */
+static void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set& mapModifiedTx)
+{
+    BOOST_FOREACH (const CTxMemPool::txiter it, alreadyAdded) {
+        CTxMemPool::setEntries descendants;
+        mempool.CalculateDescendants(it, descendants);
+        BOOST_FOREACH (CTxMemPool::txiter desc, descendants) {
+            if (alreadyAdded.count(desc))
+                continue;
+            modtxiter mit = mapModifiedTx.find(desc);
+            if (mit == mapModifiedTx.end()) {
+                CTxMemPoolModifiedEntry modEntry(desc);
+                modEntry.nSizeWithAncestors -= it->GetTxSize();
+                modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
+                mapModifiedTx.insert(modEntry);
+            } else {
+                mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
+            }
+        }
+    }
+}
+
+/**
+ * Check a package, sorted parents first, against the block's coins view and
+ * sigop budget. If every transaction passes, the package is appended to the
+ * template and its coins are applied to view; otherwise nothing changes.
+ */
+static bool AddPackageToBlock(const std::vector<CTxMemPool::txiter>& package, CBlockTemplate* pblocktemplate, CCoinsViewCache& view, int nHeight, uint64_t& nBlockSize, uint64_t& nBlockTx, unsigned int& nBlockSigOps, CAmount& nFees, CTxMemPool::setEntries& inBlock)
+{
+    CCoinsViewCache viewPackage(&view);
+    std::vector<CAmount> vTxFees;
+    std::vector<unsigned int> vTxSigOps;
+    unsigned int nPackageSigOps = 0;
+    BOOST_FOREACH (CTxMemPool::txiter it, package) {
+        const CTransaction& tx = it->GetTx();
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+            return false;
+
+        if (!viewPackage.HaveInputs(tx))
+            return false;
+
+        // Check for invalid/fraudulent inputs. They shouldn't make it through mempool, but check anyways.
+        BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+            if (invalid_out::ContainsOutPoint(txin.prevout)) {
+                LogPrintf("%s : found invalid input %s in tx %s", __func__, txin.prevout.ToString(), tx.GetHash().ToString());
+                return false;
+            }
+        }
+
+        // Legacy limits on sigOps:
+        unsigned int nTxSigOps = GetLegacySigOpCount(tx) + GetP2SHSigOpCount(tx, viewPackage);
+        nPackageSigOps += nTxSigOps;
+        if (nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS_CURRENT)
+            return false;
+
+        // Note that flags: we don't want to set mempool/IsStandard()
+        // policy here, but we still have to ensure that the block we
+        // create only contains transactions that are valid in new blocks.
+        CValidationState state;
+        if (!CheckInputs(tx, state, viewPackage, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+            return false;
+
+        vTxFees.push_back(viewPackage.GetValueIn(tx) - tx.GetValueOut());
+        vTxSigOps.push_back(nTxSigOps);
+
+        CTxUndo txundo;
+        UpdateCoins(tx, state, viewPackage, txundo, nHeight);
+    }
+
+    // Writing into another cache can't fail; kept out of the assert so it still runs with NDEBUG
+    bool fFlushed = viewPackage.Flush();
+    assert(fFlushed);
+    for (unsigned int i = 0; i < package.size(); i++) {
+        pblocktemplate->block.vtx.push_back(package[i]->GetTx());
+        pblocktemplate->vTxFees.push_back(vTxFees[i]);
+        pblocktemplate->vTxSigOps.push_back(vTxSigOps[i]);
+        nBlockSize += package[i]->GetTxSize();
+        ++nBlockTx;
+        nBlockSigOps += vTxSigOps[i];
+        nFees += vTxFees[i];
+        inBlock.insert(package[i]);
+    }
+    return true;
+}
+
 void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
 {
     pblock->nTime = std::max(pindexPrev->GetMedianTimePast() + 1, GetAdjustedTime());
@@ -176,188 +314,185 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
         CBlockIndex* pindexPrev = chainActive.Tip();
         const int nHeight = pindexPrev->nHeight + 1;
         CCoinsViewCache view(pcoinsTip);
-
-        // Priority order to process transactions.
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
         bool fPrintPriority = GetBoolArg("-printpriority", false);
 
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi) {
-            const CTransaction& tx = mi->second.GetTx();
-
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight)){
-                continue;
+        uint64_t nBlockSize = 1000;
+        uint64_t nBlockTx = 0;
+        unsigned int nBlockSigOps = 100;
+        CTxMemPool::setEntries inBlock;
+
+        // Fill the high-priority area first. Priorities are cached in the
+        // mempool entries, so this only has to order them; it is skipped
+        // entirely with -blockprioritysize=0.
+        if (nBlockPrioritySize > 0) {
+            std::vector<TxCoinAgePriority> vecPriority;
+            TxCoinAgePriorityCompare pricomparer;
+            std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
+            vecPriority.reserve(mempool.mapTx.size());
+            for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi) {
+                double dPriority = mi->GetPriority(nHeight);
+                CAmount dummy;
+                mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+                vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
             }
+            std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-
-            for (const CTxIn& txin : tx.vin) {               
-                // Read prev transaction.
-                if (!view.HaveCoins(txin.prevout.hash)) {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash)) {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
+            while (!vecPriority.empty()) {
+                // Take highest priority transaction off the priority queue:
+                CTxMemPool::txiter iter = vecPriority.front().second;
+                double actualPriority = vecPriority.front().first;
+                std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+                vecPriority.pop_back();
 
-                    // Has to wait for dependencies.
-                    if (!porphan) {
-                        // Use list for automatic deletion.
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
+                if (inBlock.count(iter))
+                    continue;
+
+                // Wait for all in-mempool parents to be included first.
+                bool fWaiting = false;
+                BOOST_FOREACH (CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter)) {
+                    if (!inBlock.count(parent)) {
+                        fWaiting = true;
+                        break;
                     }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
+                }
+                if (fWaiting) {
+                    waitPriMap.insert(std::make_pair(iter, actualPriority));
                     continue;
                 }
 
-                // Check for invalid/fraudulent inputs. They shouldn't make it through mempool, but check anyways.
-                if (invalid_out::ContainsOutPoint(txin.prevout)) {
-                    LogPrintf("%s : found invalid input %s in tx %s", __func__, txin.prevout.ToString(), tx.GetHash().ToString());
-                    fMissingInputs = true;
+                // Move on to fee ordering once past the priority size or we run
+                // out of high-priority transactions.
+                if (nBlockSize + iter->GetTxSize() >= nBlockPrioritySize || !AllowFree(actualPriority))
                     break;
-                }
-
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
 
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
+                if (nBlockSize + iter->GetTxSize() >= nBlockMaxSize)
+                    continue;
 
-                int nConf = nHeight - coins->nHeight;
+                std::vector<CTxMemPool::txiter> package(1, iter);
+                if (!AddPackageToBlock(package, pblocktemplate.get(), view, nHeight, nBlockSize, nBlockTx, nBlockSigOps, nFees, inBlock))
+                    continue;
 
-                dPriority = double_safe_addition(dPriority, ((double)nValueIn * nConf));
+                if (fPrintPriority) {
+                    LogPrintf("priority %.1f fee %s txid %s\n",
+                        actualPriority, CFeeRate(iter->GetModifiedFee(), iter->GetTxSize()).ToString(), iter->GetTx().GetHash().ToString());
+                }
 
+                // Children that were waiting on this transaction can be considered now.
+                BOOST_FOREACH (CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter)) {
+                    std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator wpiter = waitPriMap.find(child);
+                    if (wpiter != waitPriMap.end()) {
+                        vecPriority.push_back(TxCoinAgePriority(wpiter->second, child));
+                        std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+                        waitPriMap.erase(wpiter);
+                    }
+                }
             }
-
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize.
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
-
-            CFeeRate feeRate(nTotalIn - tx.GetValueOut(), nTxSize);
-
-            if (porphan) {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
-            } else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
         }
 
-        // Collect transactions into block.
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        vector<CBigNum> vBlockSerials;
-        vector<CBigNum> vTxSerials;
-        while (!vecPriority.empty()) {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nMaxBlockSigOps = MAX_BLOCK_SIGOPS_CURRENT;
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority))) {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        // Then add packages by the fee rate of each transaction together with
+        // its unconfirmed ancestors. The mempool keeps these sorted, so this
+        // only walks as far as the block gets.
+        //
+        // mapModifiedTx holds packages whose ancestors are partly in the block
+        // already, with totals corrected for that.
+        indexed_modified_transaction_set mapModifiedTx;
+        // Keep track of entries that failed inclusion, to avoid duplicate work
+        CTxMemPool::setEntries failedTx;
+        UpdatePackagesForAdded(inBlock, mapModifiedTx);
+
+        CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
+        CTxMemPool::txiter iter;
+        while (mi != mempool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty()) {
+            // First try to find a new transaction in mapTx to evaluate.
+            if (mi != mempool.mapTx.get<ancestor_score>().end()) {
+                CTxMemPool::txiter it = mempool.mapTx.project<0>(mi);
+                if (mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it)) {
+                    ++mi;
+                    continue;
+                }
             }
 
-            if (!view.HaveInputs(tx))
-                continue;
+            // Now that mi is not stale, determine which transaction to evaluate:
+            // the next entry from mapTx, or the best from mapModifiedTx?
+            bool fUsingModified = false;
+            modtxscoreiter modit = mapModifiedTx.get<ancestor_score>().begin();
+            if (mi == mempool.mapTx.get<ancestor_score>().end()) {
+                // We're out of entries in mapTx; use the entry from mapModifiedTx
+                iter = modit->iter;
+                fUsingModified = true;
+            } else {
+                // Try to compare the mapTx entry to the mapModifiedTx entry
+                iter = mempool.mapTx.project<0>(mi);
+                if (modit != mapModifiedTx.get<ancestor_score>().end() &&
+                    CompareModifiedEntry()(*modit, CTxMemPoolModifiedEntry(iter))) {
+                    // The best entry in mapModifiedTx has higher score
+                    // than the one from mapTx.
+                    // Switch which transaction (package) to consider
+                    iter = modit->iter;
+                    fUsingModified = true;
+                } else {
+                    // Either no entry in mapModifiedTx, or it's worse than mapTx.
+                    // Increment mi for the next loop iteration.
+                    ++mi;
+                }
+            }
 
-            CAmount nTxFees = view.GetValueIn(tx) - tx.GetValueOut();
+            // We skip mapTx entries that are inBlock, and mapModifiedTx shouldn't
+            // contain anything that is inBlock.
+            assert(!inBlock.count(iter));
 
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
-                continue;
+            uint64_t packageSize = iter->GetSizeWithAncestors();
+            CAmount packageFees = iter->GetModFeesWithAncestors();
+            if (fUsingModified) {
+                packageSize = modit->nSizeWithAncestors;
+                packageFees = modit->nModFeesWithAncestors;
+            }
 
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
+            // Skip free transactions if we're past the minimum block size;
+            // everything after this pays less.
+            if (packageFees < ::minRelayTxFee.GetFee(packageSize) && nBlockSize >= nBlockMinSize)
+                break;
 
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+            CTxMemPool::setEntries ancestors;
+            uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+            std::string dummy;
+            mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+            std::vector<CTxMemPool::txiter> package;
+            BOOST_FOREACH (CTxMemPool::txiter ancestor, ancestors) {
+                if (!inBlock.count(ancestor))
+                    package.push_back(ancestor);
+            }
+            package.push_back(iter);
+            std::sort(package.begin(), package.end(), CompareTxIterByAncestorCount());
+
+            if (nBlockSize + packageSize >= nBlockMaxSize ||
+                !AddPackageToBlock(package, pblocktemplate.get(), view, nHeight, nBlockSize, nBlockTx, nBlockSigOps, nFees, inBlock)) {
+                if (fUsingModified) {
+                    // Since we always look at the best entry in mapModifiedTx,
+                    // we must erase failed entries so that we can consider the
+                    // next best entry on the next loop iteration
+                    mapModifiedTx.get<ancestor_score>().erase(modit);
+                    failedTx.insert(iter);
+                }
+                // Stop looking once the block is as good as full.
+                if (nBlockSize > nBlockMaxSize - 1000)
+                    break;
                 continue;
-
-            CTxUndo txundo;
-            UpdateCoins(tx, state, view, txundo, nHeight);
-
-            // Added.
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            for (const CBigNum& bnSerial : vTxSerials)
-                vBlockSerials.emplace_back(bnSerial);
-
-            if (fPrintPriority) {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
             }
 
-            // Add transactions that depend on this one to the priority queue.
-            if (mapDependers.count(hash)) {
-                BOOST_FOREACH (COrphan* porphan, mapDependers[hash]) {
-                    if (!porphan->setDependsOn.empty()) {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty()) {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
+            CTxMemPool::setEntries added;
+            BOOST_FOREACH (CTxMemPool::txiter it, package) {
+                if (fPrintPriority) {
+                    LogPrintf("fee %s txid %s\n",
+                        CFeeRate(it->GetModifiedFee(), it->GetTxSize()).ToString(), it->GetTx().GetHash().ToString());
                 }
+                // Erase from the modified set, if present
+                mapModifiedTx.erase(it);
+                added.insert(it);
             }
+
+            // Update transactions that depend on each of these
+            UpdatePackagesForAdded(added, mapModifiedTx);
         }
 
         if (!fProofOfStake) {
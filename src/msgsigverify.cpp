@@ -0,0 +1,179 @@
+// Copyright (c) 2019 The Byron developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "msgsigverify.h"
+
+#include "hash.h"
+#include "main.h"
+
+#include <string.h>
+
+#include <boost/thread.hpp>
+
+CMessageSigVerifier messageSigVerifier;
+
+uint256 GetSignedMessageHash(const std::string& strMessage)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << strMessageMagic;
+    ss << strMessage;
+    return ss.GetHash();
+}
+
+CMessageSigVerifier::CMessageSigVerifier(size_t nMaxResultsIn) : nMaxResults(nMaxResultsIn)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+uint256 CMessageSigVerifier::GetKey(const uint256& hash, const std::vector<unsigned char>& vchSig)
+{
+    return Hash(hash.begin(), hash.end(), vchSig.begin(), vchSig.end());
+}
+
+void CMessageSigVerifier::SetThreads(int nThreads)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    stats.nThreads = nThreads;
+}
+
+bool CMessageSigVerifier::IsRunning()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return stats.nThreads > 0;
+}
+
+void CMessageSigVerifier::Queue(const std::string& strMessage, const std::vector<unsigned char>& vchSig)
+{
+    uint256 hash = GetSignedMessageHash(strMessage);
+    uint256 key = GetKey(hash, vchSig);
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (stats.nThreads == 0)
+            return;
+        if (mapEntries.count(key)) {
+            stats.nDuplicates++;
+            return;
+        }
+        if (queueJobs.size() >= MAX_SIGVERIFY_QUEUE) {
+            stats.nDropped++;
+            return;
+        }
+
+        CSigEntry& entry = mapEntries[key];
+        entry.state = SIG_QUEUED;
+        entry.fRecovered = false;
+
+        CSigJob job;
+        job.key = key;
+        job.hash = hash;
+        job.vchSig = vchSig;
+        queueJobs.push_back(job);
+
+        stats.nQueued++;
+        stats.nMaxQueueDepth = std::max(stats.nMaxQueueDepth, queueJobs.size());
+    }
+    condJobs.notify_one();
+}
+
+void CMessageSigVerifier::Finish(const uint256& key, bool fRecovered, const CPubKey& pubkey)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        CSigEntry& entry = mapEntries[key];
+        entry.state = SIG_DONE;
+        entry.fRecovered = fRecovered;
+        entry.pubkey = pubkey;
+
+        listDone.push_back(key);
+        while (listDone.size() > nMaxResults) {
+            mapEntries.erase(listDone.front());
+            listDone.pop_front();
+        }
+    }
+    condDone.notify_all();
+}
+
+bool CMessageSigVerifier::RecoverPubKey(const uint256& hash, const std::vector<unsigned char>& vchSig, CPubKey& pubkey)
+{
+    uint256 key = GetKey(hash, vchSig);
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        std::map<uint256, CSigEntry>::iterator it = mapEntries.find(key);
+        if (it != mapEntries.end() && it->second.state == SIG_RUNNING) {
+            // Another thread is recovering it already; waiting is cheaper than doing it twice
+            boost::this_thread::disable_interruption di;
+            stats.nWaits++;
+            while ((it = mapEntries.find(key)) != mapEntries.end() && it->second.state == SIG_RUNNING)
+                condDone.wait(lock);
+        }
+
+        if (it != mapEntries.end() && it->second.state == SIG_DONE) {
+            stats.nResultHits++;
+            pubkey = it->second.pubkey;
+            return it->second.fRecovered;
+        }
+
+        // Not queued, or still waiting for a thread: don't wait behind the queue
+        CSigEntry& entry = mapEntries[key];
+        entry.state = SIG_RUNNING;
+        entry.fRecovered = false;
+        stats.nVerifiedInline++;
+    }
+
+    CPubKey pubkeyRecovered;
+    bool fRecovered = pubkeyRecovered.RecoverCompact(hash, vchSig);
+    Finish(key, fRecovered, pubkeyRecovered);
+
+    pubkey = pubkeyRecovered;
+    return fRecovered;
+}
+
+bool CMessageSigVerifier::ProcessOne()
+{
+    CSigJob job;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (queueJobs.empty())
+            return false;
+        job = queueJobs.front();
+        queueJobs.pop_front();
+
+        // Its handler may have got to it first
+        std::map<uint256, CSigEntry>::iterator it = mapEntries.find(job.key);
+        if (it == mapEntries.end() || it->second.state != SIG_QUEUED)
+            return true;
+        it->second.state = SIG_RUNNING;
+        stats.nVerifiedByWorkers++;
+    }
+
+    CPubKey pubkey;
+    bool fRecovered = pubkey.RecoverCompact(job.hash, job.vchSig);
+    Finish(job.key, fRecovered, pubkey);
+    return true;
+}
+
+void CMessageSigVerifier::ThreadSigVerifier()
+{
+    while (true) {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (queueJobs.empty())
+                condJobs.wait(lock);
+        }
+        ProcessOne();
+    }
+}
+
+CMessageSigVerifierStats CMessageSigVerifier::GetStats()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    CMessageSigVerifierStats ret = stats;
+    ret.nQueueDepth = queueJobs.size();
+    return ret;
+}
+
+void ThreadMessageSigVerifier()
+{
+    messageSigVerifier.ThreadSigVerifier();
+}
@@ -0,0 +1,121 @@
+// Copyright (c) 2019 The Byron developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BYRON_MSGSIGVERIFY_H
+#define BYRON_MSGSIGVERIFY_H
+
+#include "pubkey.h"
+#include "uint256.h"
+
+#include <deque>
+#include <list>
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+/** -sigverifythreads default: threads recovering the signers of queued gossip */
+static const int DEFAULT_SIGVERIFY_THREADS = 2;
+/** Maximum number of signature verification threads */
+static const int MAX_SIGVERIFY_THREADS = 16;
+/** Signatures waiting for a verification thread; past this, handlers recover them inline */
+static const size_t MAX_SIGVERIFY_QUEUE = 10000;
+/** Recovered signers kept for handlers still to come and for duplicates */
+static const size_t MAX_SIGVERIFY_RESULTS = 20000;
+
+/** Counters reported by getnetworkinfo */
+struct CMessageSigVerifierStats {
+    int nThreads;
+    size_t nQueueDepth;
+    size_t nMaxQueueDepth;
+    uint64_t nQueued;
+    uint64_t nDuplicates;
+    uint64_t nDropped;
+    uint64_t nVerifiedByWorkers;
+    uint64_t nVerifiedInline;
+    uint64_t nResultHits;
+    uint64_t nWaits;
+};
+
+/**
+ * Recovers the keys that signed masternode, spork and SwiftX messages.
+ *
+ * Gossip handed to the message worker threads is queued here first, so the
+ * compact-signature key recovery runs on a pool of its own while the message
+ * waits for its lane. The handlers still run in order; when one verifies a
+ * signature it takes the result, waits for a recovery that is under way, or
+ * recovers the key itself if no thread got to it yet. Signatures are keyed by
+ * message hash and signature, so duplicates from several peers are recovered
+ * once.
+ */
+class CMessageSigVerifier
+{
+private:
+    enum SigState {
+        SIG_QUEUED,
+        SIG_RUNNING,
+        SIG_DONE
+    };
+
+    struct CSigEntry {
+        SigState state;
+        bool fRecovered;
+        CPubKey pubkey;
+    };
+
+    struct CSigJob {
+        uint256 key;
+        uint256 hash;
+        std::vector<unsigned char> vchSig;
+    };
+
+    boost::mutex mutex;
+    boost::condition_variable condJobs;
+    boost::condition_variable condDone;
+
+    std::map<uint256, CSigEntry> mapEntries;
+    std::deque<CSigJob> queueJobs;
+    // finished entries, oldest first, so the results don't grow without bound
+    std::list<uint256> listDone;
+    size_t nMaxResults;
+
+    CMessageSigVerifierStats stats;
+
+    static uint256 GetKey(const uint256& hash, const std::vector<unsigned char>& vchSig);
+    void Finish(const uint256& key, bool fRecovered, const CPubKey& pubkey);
+
+public:
+    CMessageSigVerifier(size_t nMaxResultsIn = MAX_SIGVERIFY_RESULTS);
+
+    /** Number of verification threads about to run ThreadSigVerifier; 0 recovers everything inline */
+    void SetThreads(int nThreads);
+    bool IsRunning();
+
+    /** Queue recovery of the key that signed strMessage, unless it's known or queued already */
+    void Queue(const std::string& strMessage, const std::vector<unsigned char>& vchSig);
+
+    /** Key that signed the message hash, from a queued recovery if there is one */
+    bool RecoverPubKey(const uint256& hash, const std::vector<unsigned char>& vchSig, CPubKey& pubkey);
+
+    /** Recover queued signatures until interrupted */
+    void ThreadSigVerifier();
+
+    /** Work a single queued signature on the calling thread; false if there was none */
+    bool ProcessOne();
+
+    CMessageSigVerifierStats GetStats();
+};
+
+extern CMessageSigVerifier messageSigVerifier;
+
+/** Body of the -sigverifythreads threads */
+void ThreadMessageSigVerifier();
+
+/** Hash a signed message the way CObfuScationSigner signs it */
+uint256 GetSignedMessageHash(const std::string& strMessage);
+
+#endif // BYRON_MSGSIGVERIFY_H
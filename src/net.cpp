@@ -16,6 +16,7 @@
 #include "chainparams.h"
 #include "clientversion.h"
 #include "miner.h"
+#include "msgsigverify.h"
 #include "obfuscation.h"
 #include "primitives/transaction.h"
 #include "scheduler.h"
@@ -28,6 +29,14 @@
 #include <fcntl.h>
 #endif
 
+#ifdef USE_POLL
+#include <poll.h>
+#endif
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -41,6 +50,15 @@
 // Dump addresses to peers.dat every 15 minutes (900s)
 #define DUMP_ADDRESSES_INTERVAL 900
 
+// Longest time the socket handler waits for socket events (frequency to poll pnode->vSend)
+#define SOCKET_EVENTS_TIMEOUT_MS 50
+
+// Maximum number of events collected by one epoll_wait call
+#define MAX_EPOLL_EVENTS 1024
+
+// Maximum number of queued messages handed to one sendmsg call
+#define MAX_SEND_BUFFERS 64
+
 #if !defined(HAVE_MSG_NOSIGNAL) && !defined(MSG_NOSIGNAL)
 #define MSG_NOSIGNAL 0
 #endif
@@ -85,12 +103,14 @@ uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
 CAddrMan addrman;
 int nMaxConnections = 125;
+SocketEventsMode socketEventsMode = SOCKETEVENTS_SELECT;
+int nMessageWorkerThreads = 0;
 bool fAddressesInitialized = false;
 std::string strSubVersion;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSerializedNetMsgRef> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -108,8 +128,22 @@ NodeId nLastNodeId = 0;
 CCriticalSection cs_nLastNodeId;
 
 static CSemaphore* semOutbound = NULL;
+#ifdef USE_EPOLL
+static int hEpoll = -1;
+#endif
 boost::condition_variable messageHandlerCondition;
 
+// Nodes with queued worker messages, serviced round-robin by the message worker threads
+static std::deque<CNode*> vWorkerNodes;
+static boost::mutex mutexWorkerNodes;
+static boost::condition_variable condWorkerNodes;
+
+// Commands beyond this many distinct ones are lumped together, so peers sending
+// made-up commands can't grow the map without bound
+static const size_t MAX_LATENCY_COMMANDS = 64;
+static std::map<std::string, CMessageLatencyStats> mapMessageLatency;
+static CCriticalSection cs_mapMessageLatency;
+
 // Signals for message handling
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
@@ -391,6 +425,103 @@ CNode* FindNode(const CService& addr)
     return NULL;
 }
 
+bool ParseSocketEventsMode(const std::string& strMode, SocketEventsMode& modeOut)
+{
+    if (strMode == "select") {
+        modeOut = SOCKETEVENTS_SELECT;
+        return true;
+    }
+#ifdef USE_POLL
+    if (strMode == "poll") {
+        modeOut = SOCKETEVENTS_POLL;
+        return true;
+    }
+#endif
+#ifdef USE_EPOLL
+    if (strMode == "epoll") {
+        modeOut = SOCKETEVENTS_EPOLL;
+        return true;
+    }
+#endif
+    return false;
+}
+
+static const char* GetSocketEventsModeName(SocketEventsMode mode)
+{
+    switch (mode) {
+    case SOCKETEVENTS_SELECT:
+        return "select";
+    case SOCKETEVENTS_POLL:
+        return "poll";
+    case SOCKETEVENTS_EPOLL:
+        return "epoll";
+    }
+    return "unknown";
+}
+
+std::string GetSocketEventsModes()
+{
+    std::string strModes = "select";
+#ifdef USE_POLL
+    strModes += ", poll";
+#endif
+#ifdef USE_EPOLL
+    strModes += ", epoll";
+#endif
+    return strModes;
+}
+
+/** Create the epoll instance and register the listening sockets with it */
+static void InitSocketEvents()
+{
+#ifdef USE_EPOLL
+    if (socketEventsMode != SOCKETEVENTS_EPOLL || hEpoll != -1)
+        return;
+
+    hEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (hEpoll == -1) {
+        LogPrintf("epoll_create1 failed: %s, falling back to poll\n", NetworkErrorString(WSAGetLastError()));
+        socketEventsMode = SOCKETEVENTS_POLL;
+        return;
+    }
+
+    BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+        // Listening sockets stay level-triggered: only one connection is accepted per
+        // iteration, so pending connections have to be reported again.
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = hListenSocket.socket;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0)
+            LogPrintf("epoll_ctl failed to add listening socket: %s\n", NetworkErrorString(WSAGetLastError()));
+    }
+#endif
+}
+
+/** Start watching a new peer socket; a no-op unless the epoll backend is in use */
+static bool RegisterNodeSocket(SOCKET hSocket)
+{
+#ifdef USE_EPOLL
+    if (socketEventsMode == SOCKETEVENTS_EPOLL) {
+        struct epoll_event event = {};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.fd = hSocket;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hSocket, &event) != 0) {
+            LogPrintf("epoll_ctl failed to add peer socket: %s\n", NetworkErrorString(WSAGetLastError()));
+            return false;
+        }
+    }
+#endif
+    return true;
+}
+
+static void UnregisterNodeSocket(SOCKET hSocket)
+{
+#ifdef USE_EPOLL
+    if (socketEventsMode == SOCKETEVENTS_EPOLL)
+        epoll_ctl(hEpoll, EPOLL_CTL_DEL, hSocket, NULL);
+#endif
+}
+
 CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool obfuScationMaster)
 {
     if (pszDest == NULL) {
@@ -419,11 +550,15 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool obfuScationMa
     bool proxyConnectionFailed = false;
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed)) {
-        if (!IsSelectableSocket(hSocket)) {
+        if (socketEventsMode == SOCKETEVENTS_SELECT && !IsSelectableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
         }
+        if (!RegisterNodeSocket(hSocket)) {
+            CloseSocket(hSocket);
+            return NULL;
+        }
 
         addrman.Attempt(addrConnect);
 
@@ -454,6 +589,7 @@ void CNode::CloseSocketDisconnect()
     fDisconnect = true;
     if (hSocket != INVALID_SOCKET) {
         LogPrint("net", "disconnecting peer=%d\n", id);
+        UnregisterNodeSocket(hSocket);
         CloseSocket(hSocket);
     }
 
@@ -490,6 +626,9 @@ void CNode::PushVersion()
         LogPrint("net", "send version message: version %d, blocks=%d, us=%s, peer=%d\n", PROTOCOL_VERSION, nBestHeight, addrMe.ToString(), id);
     PushMessage("version", PROTOCOL_VERSION, nLocalServices, nTime, addrYou, addrMe,
         nLocalHostNonce, strSubVersion, nBestHeight, true);
+    // Sent ahead of our verack, so that the peer knows to sync headers-first
+    // from us before it starts asking for blocks
+    PushMessage("sendheaders");
 }
 
 
@@ -801,25 +940,64 @@ int CNetMessage::readData(const char* pch, unsigned int nBytes)
     return nCopy;
 }
 
+/**
+ * Hand as many queued buffers to the socket as one system call takes, starting at
+ * nSendOffset into the first. Buffers are gathered with sendmsg() where available,
+ * so a queue of shared messages goes out without being copied together first.
+ */
+static int SendQueuedBuffers(CNode* pnode, std::deque<CSerializedNetMsgRef>::iterator it, size_t& nRequested)
+{
+#ifdef WIN32
+    const CSerializeData& data = **it;
+    nRequested = data.size() - pnode->nSendOffset;
+    return send(pnode->hSocket, &data[pnode->nSendOffset], nRequested, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+    struct iovec iov[MAX_SEND_BUFFERS];
+    int nBuffers = 0;
+    nRequested = 0;
+    for (; it != pnode->vSendMsg.end() && nBuffers < MAX_SEND_BUFFERS; it++, nBuffers++) {
+        const CSerializeData& data = **it;
+        size_t nOffset = nBuffers == 0 ? pnode->nSendOffset : 0;
+        iov[nBuffers].iov_base = (void*)&data[nOffset];
+        iov[nBuffers].iov_len = data.size() - nOffset;
+        nRequested += iov[nBuffers].iov_len;
+    }
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = nBuffers;
+    return sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+}
+
 void SocketSendData(CNode* pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSerializedNetMsgRef>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData& data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        assert((*it)->size() > pnode->nSendOffset);
+        size_t nRequested;
+        int nBytes = SendQueuedBuffers(pnode, it, nRequested);
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            // Step over the buffers that went out completely
+            size_t nLeft = nBytes;
+            while (nLeft > 0) {
+                size_t nRemaining = (*it)->size() - pnode->nSendOffset;
+                if (nLeft < nRemaining) {
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                nLeft -= nRemaining;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= (*it)->size();
                 it++;
-            } else {
-                // Could not send full message; stop sending more
+            }
+            if ((size_t)nBytes < nRequested) {
+                // Could not send everything; stop sending more and wait until
+                // the socket reports it is writable again
+                pnode->fCanSendData = false;
                 break;
             }
         } else {
@@ -832,6 +1010,7 @@ void SocketSendData(CNode* pnode)
                 }
             }
             // Couldn't send anything at all
+            pnode->fCanSendData = false;
             break;
         }
     }
@@ -844,6 +1023,202 @@ void SocketSendData(CNode* pnode)
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
+/**
+ * Decide whether the socket handler should write to and/or read from a node:
+ * * If there is data to send, wait for the socket to become writable. As this only
+ *   happens when optimistic write failed, we choose to first drain the
+ *   write buffer in this case before receiving more. This avoids
+ *   needlessly queueing received data, if the remote peer is not themselves
+ *   receiving data. This means properly utilizing TCP flow control signalling.
+ * * Otherwise, if there is no (complete) message in the receive buffer,
+ *   or there is space left in the buffer, wait for data to receive.
+ * * (if neither of the above applies, there is certainly one message
+ *   in the receiver buffer ready to be processed).
+ * Together, that means that at least one of the following is always possible,
+ * so we don't deadlock:
+ * * We send some data.
+ * * We wait for data to be received (and disconnect after timeout).
+ * * We process a message in the buffer (message handler thread).
+ */
+static void GetNodeSocketInterest(CNode* pnode, bool& fWantSend, bool& fWantRecv)
+{
+    fWantSend = false;
+    fWantRecv = false;
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend && !pnode->vSendMsg.empty()) {
+            fWantSend = true;
+            return;
+        }
+    }
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                            pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+            fWantRecv = true;
+    }
+}
+
+static void SocketEventsSelect(const vector<CNode*>& vNodesCopy, set<SOCKET>& setRecv, set<SOCKET>& setSend, set<SOCKET>& setError)
+{
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = SOCKET_EVENTS_TIMEOUT_MS * 1000;
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket.socket, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hListenSocket.socket);
+        have_fds = true;
+    }
+
+    BOOST_FOREACH (CNode* pnode, vNodesCopy) {
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        FD_SET(pnode->hSocket, &fdsetError);
+        hSocketMax = max(hSocketMax, pnode->hSocket);
+        have_fds = true;
+
+        bool fWantSend, fWantRecv;
+        GetNodeSocketInterest(pnode, fWantSend, fWantRecv);
+        if (fWantSend)
+            FD_SET(pnode->hSocket, &fdsetSend);
+        if (fWantRecv)
+            FD_SET(pnode->hSocket, &fdsetRecv);
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+        &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    boost::this_thread::interruption_point();
+
+    if (nSelect == SOCKET_ERROR) {
+        if (have_fds) {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        MilliSleep(SOCKET_EVENTS_TIMEOUT_MS);
+    }
+
+    BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket)
+        if (FD_ISSET(hListenSocket.socket, &fdsetRecv))
+            setRecv.insert(hListenSocket.socket);
+
+    BOOST_FOREACH (CNode* pnode, vNodesCopy) {
+        SOCKET hSocket = pnode->hSocket;
+        if (hSocket == INVALID_SOCKET)
+            continue;
+        if (FD_ISSET(hSocket, &fdsetRecv))
+            setRecv.insert(hSocket);
+        if (FD_ISSET(hSocket, &fdsetSend))
+            setSend.insert(hSocket);
+        if (FD_ISSET(hSocket, &fdsetError))
+            setError.insert(hSocket);
+    }
+}
+
+#ifdef USE_POLL
+static void SocketEventsPoll(const vector<CNode*>& vNodesCopy, set<SOCKET>& setRecv, set<SOCKET>& setSend, set<SOCKET>& setError)
+{
+    vector<struct pollfd> vPollFds;
+    vPollFds.reserve(vhListenSocket.size() + vNodesCopy.size());
+
+    BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+        struct pollfd pollfd = {};
+        pollfd.fd = hListenSocket.socket;
+        pollfd.events = POLLIN;
+        vPollFds.push_back(pollfd);
+    }
+
+    BOOST_FOREACH (CNode* pnode, vNodesCopy) {
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        bool fWantSend, fWantRecv;
+        GetNodeSocketInterest(pnode, fWantSend, fWantRecv);
+        // Unlike select(), poll() always reports hangups; leave idle sockets out so a
+        // peer whose receive buffer is full can't make us spin.
+        if (!fWantSend && !fWantRecv)
+            continue;
+        struct pollfd pollfd = {};
+        pollfd.fd = pnode->hSocket;
+        pollfd.events = (fWantSend ? POLLOUT : 0) | (fWantRecv ? POLLIN : 0);
+        vPollFds.push_back(pollfd);
+    }
+
+    int nRet = poll(vPollFds.data(), vPollFds.size(), SOCKET_EVENTS_TIMEOUT_MS);
+    boost::this_thread::interruption_point();
+
+    if (nRet == SOCKET_ERROR) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEINTR)
+            LogPrintf("socket poll error %s\n", NetworkErrorString(nErr));
+        MilliSleep(SOCKET_EVENTS_TIMEOUT_MS);
+        return;
+    }
+
+    BOOST_FOREACH (const struct pollfd& pollfd, vPollFds) {
+        if (pollfd.revents & POLLIN)
+            setRecv.insert(pollfd.fd);
+        if (pollfd.revents & POLLOUT)
+            setSend.insert(pollfd.fd);
+        if (pollfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+            setError.insert(pollfd.fd);
+    }
+}
+#endif
+
+#ifdef USE_EPOLL
+/** Whether readiness remembered from earlier edge-triggered events can be acted on right away */
+static bool HasPendingSocketWork(const vector<CNode*>& vNodesCopy)
+{
+    BOOST_FOREACH (CNode* pnode, vNodesCopy) {
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        bool fWantSend, fWantRecv;
+        GetNodeSocketInterest(pnode, fWantSend, fWantRecv);
+        if ((fWantSend && pnode->fCanSendData) || (fWantRecv && pnode->fHasRecvData))
+            return true;
+    }
+    return false;
+}
+
+static void SocketEventsEpoll(bool fOnlyPoll, set<SOCKET>& setRecv, set<SOCKET>& setSend, set<SOCKET>& setError)
+{
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int nEvents = epoll_wait(hEpoll, events, MAX_EPOLL_EVENTS, fOnlyPoll ? 0 : SOCKET_EVENTS_TIMEOUT_MS);
+    boost::this_thread::interruption_point();
+
+    if (nEvents == SOCKET_ERROR) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEINTR)
+            LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(nErr));
+        MilliSleep(SOCKET_EVENTS_TIMEOUT_MS);
+        return;
+    }
+
+    for (int i = 0; i < nEvents; i++) {
+        SOCKET hSocket = events[i].data.fd;
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP))
+            setRecv.insert(hSocket);
+        if (events[i].events & EPOLLOUT)
+            setSend.insert(hSocket);
+        if (events[i].events & (EPOLLERR | EPOLLHUP))
+            setError.insert(hSocket);
+    }
+}
+#endif
+
 static list<CNode*> vNodesDisconnected;
 
 void ThreadSocketHandler()
@@ -913,88 +1288,34 @@ void ThreadSocketHandler()
         }
 
         //
-        // Find which sockets have data to receive
+        // Wait for sockets to become ready
         //
-        struct timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
-
+        vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH (CNode* pnode, vNodes) {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
+            vNodesCopy = vNodes;
+            BOOST_FOREACH (CNode* pnode, vNodesCopy)
+                pnode->AddRef();
         }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-            &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
-
-        if (nSelect == SOCKET_ERROR) {
-            if (have_fds) {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec / 1000);
-        }
+        set<SOCKET> setRecv, setSend, setError;
+#ifdef USE_EPOLL
+        if (socketEventsMode == SOCKETEVENTS_EPOLL)
+            SocketEventsEpoll(HasPendingSocketWork(vNodesCopy), setRecv, setSend, setError);
+        else
+#endif
+#ifdef USE_POLL
+        if (socketEventsMode == SOCKETEVENTS_POLL)
+            SocketEventsPoll(vNodesCopy, setRecv, setSend, setError);
+        else
+#endif
+            SocketEventsSelect(vNodesCopy, setRecv, setSend, setError);
 
         //
         // Accept new connections
         //
         BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv)) {
+            if (hListenSocket.socket != INVALID_SOCKET && setRecv.count(hListenSocket.socket)) {
                 struct sockaddr_storage sockaddr;
                 socklen_t len = sizeof(sockaddr);
                 SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
@@ -1017,7 +1338,7 @@ void ThreadSocketHandler()
                     int nErr = WSAGetLastError();
                     if (nErr != WSAEWOULDBLOCK)
                         LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                } else if (!IsSelectableSocket(hSocket)) {
+                } else if (socketEventsMode == SOCKETEVENTS_SELECT && !IsSelectableSocket(hSocket)) {
                     LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
                     CloseSocket(hSocket);
                 } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
@@ -1026,6 +1347,8 @@ void ThreadSocketHandler()
                 } else if (CNode::IsBanned(addr) && !whitelisted) {
                     LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
                     CloseSocket(hSocket);
+                } else if (!RegisterNodeSocket(hSocket)) {
+                    CloseSocket(hSocket);
                 } else {
                     CNode* pnode = new CNode(hSocket, addr, "", true);
                     pnode->AddRef();
@@ -1042,22 +1365,32 @@ void ThreadSocketHandler()
         //
         // Service each socket
         //
-        vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH (CNode* pnode, vNodesCopy)
-                pnode->AddRef();
-        }
         BOOST_FOREACH (CNode* pnode, vNodesCopy) {
             boost::this_thread::interruption_point();
 
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            bool fReceive = setRecv.count(pnode->hSocket) || setError.count(pnode->hSocket);
+            bool fSend = setSend.count(pnode->hSocket);
+            if (socketEventsMode == SOCKETEVENTS_EPOLL) {
+                // Edge-triggered events only report changes, so remember readiness
+                // until recv() drains the socket or send() fills its buffer.
+                if (fReceive)
+                    pnode->fHasRecvData = true;
+                if (fSend) {
+                    LOCK(pnode->cs_vSend);
+                    pnode->fCanSendData = true;
+                }
+                bool fWantSend, fWantRecv;
+                GetNodeSocketInterest(pnode, fWantSend, fWantRecv);
+                fReceive = fWantRecv && pnode->fHasRecvData;
+                fSend = fWantSend && pnode->fCanSendData;
+            }
+
             //
             // Receive
             //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError)) {
+            if (fReceive) {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv) {
                     {
@@ -1065,6 +1398,9 @@ void ThreadSocketHandler()
                         char pchBuf[0x10000];
                         int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
                         if (nBytes > 0) {
+                            // A short read means the socket is drained; more data raises a new edge
+                            if (nBytes < (int)sizeof(pchBuf))
+                                pnode->fHasRecvData = false;
                             if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
                                 pnode->CloseSocketDisconnect();
                             pnode->nLastRecv = GetTime();
@@ -1078,7 +1414,9 @@ void ThreadSocketHandler()
                         } else if (nBytes < 0) {
                             // error
                             int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
+                            if (nErr == WSAEWOULDBLOCK) {
+                                pnode->fHasRecvData = false;
+                            } else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
                                 if (!pnode->fDisconnect)
                                     LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
                                 pnode->CloseSocketDisconnect();
@@ -1093,7 +1431,7 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend)) {
+            if (fSend) {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
                     SocketSendData(pnode);
@@ -1568,6 +1906,107 @@ void ThreadMessageHandler()
     }
 }
 
+void CNode::QueueWorkerMessage(const CNetMessage& msg)
+{
+    {
+        LOCK(cs_vWorkerMsg);
+        vWorkerMsg.push_back(msg);
+        nWorkerMsgSize += msg.vRecv.size() + CMessageHeader::HEADER_SIZE;
+        if (fWorkerScheduled)
+            return;
+        fWorkerScheduled = true;
+    }
+
+    // The queued reference keeps the node alive until a worker is done with it
+    AddRef();
+    {
+        boost::unique_lock<boost::mutex> lock(mutexWorkerNodes);
+        vWorkerNodes.push_back(this);
+    }
+    condWorkerNodes.notify_one();
+}
+
+void ThreadMessageWorker()
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    while (true) {
+        CNode* pnode;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexWorkerNodes);
+            while (vWorkerNodes.empty())
+                condWorkerNodes.wait(lock);
+            pnode = vWorkerNodes.front();
+            vWorkerNodes.pop_front();
+        }
+
+        // Handle a single message per turn so one busy peer can't starve the others.
+        // Only this thread touches the front of the queue until the node is requeued,
+        // and deque::push_back leaves references to existing elements valid.
+        if (!pnode->fDisconnect) {
+            CNetMessage* pmsg;
+            {
+                LOCK(pnode->cs_vWorkerMsg);
+                pmsg = &pnode->vWorkerMsg.front();
+            }
+            g_signals.ProcessWorkerMessage(pnode, *pmsg);
+        }
+        boost::this_thread::interruption_point();
+
+        bool fMore;
+        {
+            LOCK(pnode->cs_vWorkerMsg);
+            if (pnode->fDisconnect) {
+                pnode->vWorkerMsg.clear();
+                pnode->nWorkerMsgSize = 0;
+            } else {
+                pnode->nWorkerMsgSize -= pnode->vWorkerMsg.front().vRecv.size() + CMessageHeader::HEADER_SIZE;
+                pnode->vWorkerMsg.pop_front();
+            }
+            fMore = !pnode->vWorkerMsg.empty();
+            pnode->fWorkerScheduled = fMore;
+        }
+
+        if (fMore) {
+            boost::unique_lock<boost::mutex> lock(mutexWorkerNodes);
+            vWorkerNodes.push_back(pnode);
+        } else {
+            pnode->Release();
+        }
+    }
+}
+
+void CMessageLatencyStats::Add(int64_t nLatency, int64_t nProcessTime)
+{
+    nCount++;
+    nTotalLatency += nLatency;
+    nMaxLatency = std::max(nMaxLatency, nLatency);
+    nTotalProcessTime += nProcessTime;
+
+    int nBucket = 0;
+    for (int64_t nLimit = 10; nBucket < BUCKETS - 1 && nLatency > nLimit; nLimit *= 10)
+        nBucket++;
+    vBuckets[nBucket]++;
+}
+
+void RecordMessageLatency(const std::string& strCommand, int64_t nLatency, int64_t nProcessTime)
+{
+    LOCK(cs_mapMessageLatency);
+    std::map<std::string, CMessageLatencyStats>::iterator it = mapMessageLatency.find(strCommand);
+    if (it == mapMessageLatency.end()) {
+        if (mapMessageLatency.size() >= MAX_LATENCY_COMMANDS)
+            it = mapMessageLatency.insert(std::make_pair(std::string("*other*"), CMessageLatencyStats())).first;
+        else
+            it = mapMessageLatency.insert(std::make_pair(strCommand, CMessageLatencyStats())).first;
+    }
+    it->second.Add(nLatency, nProcessTime);
+}
+
+std::map<std::string, CMessageLatencyStats> GetMessageLatencyStats()
+{
+    LOCK(cs_mapMessageLatency);
+    return mapMessageLatency;
+}
+
 // ppcoin: stake minter thread
 void static ThreadStakeMinter()
 {
@@ -1605,7 +2044,7 @@ bool BindListenPort(const CService& addrBind, string& strError, bool fWhiteliste
         LogPrintf("%s\n", strError);
         return false;
     }
-    if (!IsSelectableSocket(hListenSocket)) {
+    if (socketEventsMode == SOCKETEVENTS_SELECT && !IsSelectableSocket(hListenSocket)) {
         strError = "Error: Couldn't create a listenable socket for incoming connections";
         LogPrintf("%s\n", strError);
         return false;
@@ -1769,6 +2208,8 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     MapPort(GetBoolArg("-upnp", DEFAULT_UPNP));
 
     // Send and receive from sockets, accept connections
+    InitSocketEvents();
+    LogPrintf("Using %s for socket events\n", GetSocketEventsModeName(socketEventsMode));
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
     // Initiate outbound connections from -addnode
@@ -1778,8 +2219,19 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
+    nMessageWorkerThreads = std::max(0, std::min((int)GetArg("-msgthreads", DEFAULT_MSG_THREADS), MAX_MSG_THREADS));
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
 
+    // Process gossip messages that don't need cs_main
+    for (int i = 0; i < nMessageWorkerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msgworker", &ThreadMessageWorker));
+
+    // Recover the signers of gossip waiting for the message workers
+    int nSigVerifyThreads = nMessageWorkerThreads > 0 ? std::max(0, std::min((int)GetArg("-sigverifythreads", DEFAULT_SIGVERIFY_THREADS), MAX_SIGVERIFY_THREADS)) : 0;
+    messageSigVerifier.SetThreads(nSigVerifyThreads);
+    for (int i = 0; i < nSigVerifyThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "sigverify", &ThreadMessageSigVerifier));
+
     // Dump network addresses
     scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL);
 
@@ -1819,6 +2271,12 @@ public:
             if (hListenSocket.socket != INVALID_SOCKET)
                 if (!CloseSocket(hListenSocket.socket))
                     LogPrintf("CloseSocket(hListenSocket) failed with error %s\n", NetworkErrorString(WSAGetLastError()));
+#ifdef USE_EPOLL
+        if (hEpoll != -1) {
+            close(hEpoll);
+            hEpoll = -1;
+        }
+#endif
 
         // clean up some globals (to help leak detection)
         BOOST_FOREACH (CNode* pnode, vNodes)
@@ -1867,8 +2325,9 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Save original serialized message so newer versions are preserved, as a
+        // complete message every peer asking for it can share
+        mapRelay.insert(std::make_pair(inv, MakeNetMsg(inv.GetCommand(), ss)));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
@@ -2086,12 +2545,21 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     fSuccessfullyConnected = false;
     fDisconnect = false;
     nRefCount = 0;
+    nWorkerMsgSize = 0;
+    fWorkerScheduled = false;
     nSendSize = 0;
     nSendOffset = 0;
+    // Assume the socket is ready until a recv/send says otherwise, so that edge
+    // events raised before this node was visible to the socket handler aren't lost.
+    fCanSendData = true;
+    fHasRecvData = true;
     hashContinue = 0;
     nStartingHeight = -1;
     fGetAddr = false;
     fRelayTxes = false;
+    fSupportsCompactBlocks = false;
+    fPreferHighBandwidthCompact = false;
+    fPreferHeaders = false;
     setInventoryKnown.max_size(SendBufferSize() / 1000);
     pfilter = new CBloomFilter();
     nPingNonceSent = 0;
@@ -2160,8 +2628,7 @@ void CNode::AskFor(const CInv& inv)
 void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend)
 {
     ENTER_CRITICAL_SECTION(cs_vSend);
-    assert(ssSend.size() == 0);
-    ssSend << CMessageHeader(pszCommand, 0);
+    BeginNetMsg(ssSend, pszCommand);
     LogPrint("net", "sending: %s ", SanitizeString(pszCommand));
 }
 
@@ -2192,28 +2659,60 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
         return;
     }
 
-    // Set the size
-    unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+    LogPrint("net", "(%d bytes) peer=%d\n", ssSend.size() - CMessageHeader::HEADER_SIZE, id);
 
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-    unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+    CSerializedNetMsgRef msg = EndNetMsg(ssSend);
+    vSendMsg.push_back(msg);
+    nSendSize += msg->size();
+
+    // If write queue empty, attempt "optimistic write"
+    if (vSendMsg.size() == 1)
+        SocketSendData(this);
+
+    LEAVE_CRITICAL_SECTION(cs_vSend);
+}
+
+void CNode::PushSerializedMessage(const CSerializedNetMsgRef& msg)
+{
+    // Dropped like any other message; -fuzzmessagestest can't apply, the buffer is shared
+    if (mapArgs.count("-dropmessagestest") && GetRand(GetArg("-dropmessagestest", 2)) == 0) {
+        LogPrint("net", "dropmessages DROPPING SEND MESSAGE\n");
+        return;
+    }
 
-    LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
+    LOCK(cs_vSend);
+    LogPrint("net", "sending shared message (%d bytes) peer=%d\n", msg->size() - CMessageHeader::HEADER_SIZE, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    vSendMsg.push_back(msg);
+    nSendSize += msg->size();
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (vSendMsg.size() == 1)
         SocketSendData(this);
+}
 
-    LEAVE_CRITICAL_SECTION(cs_vSend);
+void BeginNetMsg(CDataStream& ss, const char* pszCommand)
+{
+    assert(ss.size() == 0);
+    ss << CMessageHeader(pszCommand, 0);
+}
+
+CSerializedNetMsgRef EndNetMsg(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+
+    CSerializeData* pdata = new CSerializeData();
+    ss.GetAndClear(*pdata);
+    return CSerializedNetMsgRef(pdata);
 }
 
 //
@@ -21,7 +21,9 @@
 #include "uint256.h"
 #include "utilstrencodings.h"
 
+#include <atomic>
 #include <deque>
+#include <memory>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -35,6 +37,7 @@
 class CAddrMan;
 class CBlockIndex;
 class CScheduler;
+class CNetMessage;
 class CNode;
 
 namespace boost
@@ -65,9 +68,48 @@ static const bool DEFAULT_UPNP = false;
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 
+/** -msgthreads default: threads processing gossip messages off the main message handler */
+static const int DEFAULT_MSG_THREADS = 2;
+/** Maximum number of message worker threads */
+static const int MAX_MSG_THREADS = 16;
+
+/** How ThreadSocketHandler waits for socket readiness */
+enum SocketEventsMode {
+    SOCKETEVENTS_SELECT, // select() over fd_sets rebuilt every iteration, limited to FD_SETSIZE
+    SOCKETEVENTS_POLL,   // poll() over a pollfd array rebuilt every iteration
+    SOCKETEVENTS_EPOLL,  // edge-triggered epoll with persistent registrations
+};
+/** -socketevents default */
+#if defined(USE_EPOLL)
+static const char* const DEFAULT_SOCKETEVENTS = "epoll";
+#elif defined(USE_POLL)
+static const char* const DEFAULT_SOCKETEVENTS = "poll";
+#else
+static const char* const DEFAULT_SOCKETEVENTS = "select";
+#endif
+
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
 
+/**
+ * A complete serialized P2P message, header included. It is never modified once built,
+ * so a single copy can sit in the send queues of any number of peers.
+ */
+typedef std::shared_ptr<const CSerializeData> CSerializedNetMsgRef;
+
+void BeginNetMsg(CDataStream& ss, const char* pszCommand);
+CSerializedNetMsgRef EndNetMsg(CDataStream& ss);
+
+/** Serialize a message once, for queueing to many peers with CNode::PushSerializedMessage */
+template <typename T1>
+CSerializedNetMsgRef MakeNetMsg(const char* pszCommand, const T1& a1)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    BeginNetMsg(ss, pszCommand);
+    ss << a1;
+    return EndNetMsg(ss);
+}
+
 void AddOneShot(std::string strDest);
 bool RecvLine(SOCKET hSocket, std::string& strLine);
 void AddressCurrentlyConnected(const CService& addr);
@@ -83,6 +125,8 @@ bool BindListenPort(const CService& bindAddr, std::string& strError, bool fWhite
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
 void SocketSendData(CNode* pnode);
+bool ParseSocketEventsMode(const std::string& strMode, SocketEventsMode& modeOut);
+std::string GetSocketEventsModes();
 
 typedef int NodeId;
 
@@ -91,6 +135,7 @@ struct CNodeSignals {
     boost::signals2::signal<int()> GetHeight;
     boost::signals2::signal<bool(CNode*)> ProcessMessages;
     boost::signals2::signal<bool(CNode*, bool)> SendMessages;
+    boost::signals2::signal<void(CNode*, CNetMessage&)> ProcessWorkerMessage;
     boost::signals2::signal<void(NodeId, const CNode*)> InitializeNode;
     boost::signals2::signal<void(NodeId)> FinalizeNode;
 };
@@ -131,10 +176,12 @@ extern uint64_t nLocalServices;
 extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
 extern int nMaxConnections;
+extern SocketEventsMode socketEventsMode;
+extern int nMessageWorkerThreads;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSerializedNetMsgRef> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -179,6 +226,32 @@ public:
 };
 
 
+/** Handling latency of one message command, from receipt until its handler returned */
+class CMessageLatencyStats
+{
+public:
+    // Histogram buckets are powers of ten: <=10us, <=100us, ..., <=1s, >1s
+    static const int BUCKETS = 7;
+
+    uint64_t nCount;
+    int64_t nTotalLatency; // in microseconds, includes time spent queued
+    int64_t nMaxLatency;
+    int64_t nTotalProcessTime; // in microseconds, spent inside the handler itself
+    uint64_t vBuckets[BUCKETS];
+
+    CMessageLatencyStats() : nCount(0), nTotalLatency(0), nMaxLatency(0), nTotalProcessTime(0)
+    {
+        for (int i = 0; i < BUCKETS; i++)
+            vBuckets[i] = 0;
+    }
+
+    void Add(int64_t nLatency, int64_t nProcessTime);
+};
+
+void RecordMessageLatency(const std::string& strCommand, int64_t nLatency, int64_t nProcessTime);
+std::map<std::string, CMessageLatencyStats> GetMessageLatencyStats();
+
+
 class CNetMessage
 {
 public:
@@ -293,12 +366,23 @@ public:
     size_t nSendSize;   // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSerializedNetMsgRef> vSendMsg;
     CCriticalSection cs_vSend;
+    // Edge-triggered readiness, only used with SOCKETEVENTS_EPOLL. fCanSendData is only
+    // changed while holding cs_vSend; fHasRecvData is private to the socket handler thread.
+    std::atomic<bool> fCanSendData;
+    bool fHasRecvData;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    // Messages handed to the worker pool. They are processed in order, by one
+    // worker at a time; fWorkerScheduled is set while the node is queued for or
+    // held by a worker.
+    std::deque<CNetMessage> vWorkerMsg;
+    size_t nWorkerMsgSize;
+    bool fWorkerScheduled;
+    CCriticalSection cs_vWorkerMsg;
     uint64_t nRecvBytes;
     int nRecvVersion;
 
@@ -336,7 +420,7 @@ public:
     CSemaphoreGrant grantOutbound;
     CCriticalSection cs_filter;
     CBloomFilter* pfilter;
-    int nRefCount;
+    std::atomic<int> nRefCount;
     NodeId id;
 
 protected:
@@ -347,6 +431,7 @@ protected:
     static bool setBannedIsDirty;
 
     std::vector<std::string> vecRequestsFulfilled; //keep track of what client has asked for
+    CCriticalSection cs_vecRequestsFulfilled;
 
     // Whitelisted ranges. Any node connecting from these is automatically
     // whitelisted (as well as those connecting to whitelisted binds).
@@ -373,6 +458,13 @@ public:
     std::multimap<int64_t, CInv> mapAskFor;
     std::vector<uint256> vBlockRequested;
 
+    // compact block relay, negotiated with sendcmpct
+    bool fSupportsCompactBlocks;
+    // Whether the peer wants new blocks pushed as cmpctblock without an inv first
+    bool fPreferHighBandwidthCompact;
+    // Whether the peer announces new blocks with headers, and so answers getheaders with headers
+    bool fPreferHeaders;
+
     // Ping time measurement:
     // The pong reply we're expecting, or 0 if no pong expected.
     uint64_t nPingNonceSent;
@@ -408,6 +500,15 @@ public:
         return nRefCount;
     }
 
+    // Hand a received message to the message worker threads
+    void QueueWorkerMessage(const CNetMessage& msg);
+
+    size_t GetWorkerQueueSize()
+    {
+        LOCK(cs_vWorkerMsg);
+        return nWorkerMsgSize;
+    }
+
     // requires LOCK(cs_vRecvMsg)
     unsigned int GetTotalRecvSize()
     {
@@ -490,6 +591,9 @@ public:
 
     void PushVersion();
 
+    // Queue a message that was serialized once for several peers
+    void PushSerializedMessage(const CSerializedNetMsgRef& msg);
+
 
     void PushMessage(const char* pszCommand)
     {
@@ -660,6 +764,7 @@ public:
 
     bool HasFulfilledRequest(std::string strRequest)
     {
+        LOCK(cs_vecRequestsFulfilled);
         BOOST_FOREACH (std::string& type, vecRequestsFulfilled) {
             if (type == strRequest) return true;
         }
@@ -668,6 +773,7 @@ public:
 
     void ClearFulfilledRequest(std::string strRequest)
     {
+        LOCK(cs_vecRequestsFulfilled);
         std::vector<std::string>::iterator it = vecRequestsFulfilled.begin();
         while (it != vecRequestsFulfilled.end()) {
             if ((*it) == strRequest) {
@@ -680,6 +786,7 @@ public:
 
     void FulfilledRequest(std::string strRequest)
     {
+        LOCK(cs_vecRequestsFulfilled);
         if (HasFulfilledRequest(strRequest)) return;
         vecRequestsFulfilled.push_back(strRequest);
     }
@@ -7,7 +7,9 @@
 #include "coincontrol.h"
 #include "init.h"
 #include "main.h"
+#include "masternodedb.h"
 #include "masternodeman.h"
+#include "msgsigverify.h"
 #include "script/sign.h"
 #include "swifttx.h"
 #include "ui_interface.h"
@@ -144,6 +146,7 @@ void CObfuscationPool::ProcessMessageObfuscation(CNode* pfrom, std::string& strC
             }
             mnodeman.nDsqCount++;
             pmn->nLastDsq = mnodeman.nDsqCount;
+            mnodeman.SetMasternodeDirty(pmn->vin.prevout);
             pmn->allowFreeTx = true;
 
             LogPrint("obfuscation", "dsq - new Obfuscation queue object - %s\n", addr.ToString());
@@ -2099,14 +2102,11 @@ bool CObfuScationSigner::IsVinAssociatedWithPubkey(CTxIn& vin, CPubKey& pubkey)
     CScript payee2;
     payee2 = GetScriptForDestination(pubkey.GetID());
 
-    CTransaction txVin;
-    uint256 hash;
-    if (GetTransaction(vin.prevout.hash, txVin, hash, true)) {
-        BOOST_FOREACH (CTxOut out, txVin.vout) {
-            if (out.nValue == 200000 * COIN) {
-                if (out.scriptPubKey == payee2) return true;
-            }
-        }
+    // The collateral is unspent, so the chain state has it even when its block was pruned
+    Coin coin;
+    if (GetUTXOCoin(vin.prevout, coin)) {
+        if (coin.out.nValue == 200000 * COIN && coin.out.scriptPubKey == payee2)
+            return true;
     }
 
     return false;
@@ -2156,12 +2156,9 @@ bool CObfuScationSigner::SignMessage(std::string strMessage, std::string& errorM
 
 bool CObfuScationSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage)
 {
-    CHashWriter ss(SER_GETHASH, 0);
-    ss << strMessageMagic;
-    ss << strMessage;
-
+    // Gossip queued for the message workers usually has its signer recovered already
     CPubKey pubkey2;
-    if (!pubkey2.RecoverCompact(ss.GetHash(), vchSig)) {
+    if (!messageSigVerifier.RecoverPubKey(GetSignedMessageHash(strMessage), vchSig, pubkey2)) {
         errorMessage = _("Error recovering public key.");
         return false;
     }
@@ -2301,6 +2298,12 @@ void ThreadCheckObfuScationPool()
                 CleanTransactionLocksList();
             }
 
+            if (c % MASTERNODES_FLUSH_SECONDS == 0)
+                FlushMasternodeCache();
+
+            if (c % MASTERNODES_COMPACT_SECONDS == 0 && pMasternodeDB != NULL)
+                pMasternodeDB->Compact();
+
             obfuScationPool.CheckTimeout();
             obfuScationPool.CheckForCompleteQueue();
 
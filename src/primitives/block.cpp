@@ -13,6 +13,8 @@
 #include "utilstrencodings.h"
 #include "util.h"
 
+#include <boost/thread.hpp>
+
 uint256 CBlockHeader::GetHash() const
 {
     if(nVersion < 4)
@@ -21,6 +23,34 @@ uint256 CBlockHeader::GetHash() const
     return Hash(BEGIN(nVersion), END(nAccumulatorCheckpoint));
 }
 
+/** Minimum number of headers per thread in GetBlockHeaderHashes */
+static const size_t HEADER_HASH_BATCH_MIN = 128;
+
+static void HashBlockHeaderRange(const std::vector<CBlockHeader>* pvHeaders, std::vector<uint256>* pvHashes, size_t nBegin, size_t nEnd)
+{
+    for (size_t i = nBegin; i < nEnd; i++)
+        (*pvHashes)[i] = (*pvHeaders)[i].GetHash();
+}
+
+void GetBlockHeaderHashes(const std::vector<CBlockHeader>& vHeaders, std::vector<uint256>& vHashes)
+{
+    vHashes.resize(vHeaders.size());
+    size_t nThreads = std::max(1U, boost::thread::hardware_concurrency());
+    nThreads = std::min(nThreads, std::max<size_t>(1, vHeaders.size() / HEADER_HASH_BATCH_MIN));
+    size_t nPerThread = (vHeaders.size() + nThreads - 1) / std::max<size_t>(1, nThreads);
+
+    // The calling thread takes the first slice itself.
+    boost::thread_group threads;
+    for (size_t nThread = 1; nThread < nThreads; nThread++) {
+        size_t nBegin = nThread * nPerThread;
+        size_t nEnd = std::min(vHeaders.size(), nBegin + nPerThread);
+        if (nBegin < nEnd)
+            threads.create_thread(boost::bind(&HashBlockHeaderRange, &vHeaders, &vHashes, nBegin, nEnd));
+    }
+    HashBlockHeaderRange(&vHeaders, &vHashes, 0, std::min(vHeaders.size(), nPerThread));
+    threads.join_all();
+}
+
 uint256 CBlock::BuildMerkleTree(bool* fMutated) const
 {
     /* WARNING! If you're reading this because you're learning about crypto
@@ -66,15 +96,19 @@ uint256 CBlock::BuildMerkleTree(bool* fMutated) const
     bool mutated = false;
     for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
     {
-        for (int i = 0; i < nSize; i += 2)
-        {
-            int i2 = std::min(i+1, nSize-1);
-            if (i2 == i + 1 && i2 + 1 == nSize && vMerkleTree[j+i] == vMerkleTree[j+i2]) {
-                // Two identical hashes at the end of the list at a particular level.
-                mutated = true;
-            }
-            vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                       BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
+        if (nSize % 2 == 0 && vMerkleTree[j+nSize-2] == vMerkleTree[j+nSize-1]) {
+            // Two identical hashes at the end of the list at a particular level.
+            mutated = true;
+        }
+        // The hashes of a level are contiguous, so every full pair is a 64-byte
+        // input and the whole level can be hashed in one batch.
+        size_t nNext = vMerkleTree.size();
+        vMerkleTree.resize(nNext + (nSize + 1) / 2);
+        SHA256D64(vMerkleTree[nNext].begin(), vMerkleTree[j].begin(), nSize / 2);
+        if (nSize % 2) {
+            // An odd last entry is paired with itself.
+            const uint256& last = vMerkleTree[j+nSize-1];
+            vMerkleTree.back() = Hash(BEGIN(last), END(last), BEGIN(last), END(last));
         }
         j += nSize;
     }
@@ -82,6 +82,13 @@ public:
     }
 };
 
+/**
+ * Compute the hashes of a batch of headers; vHashes[i] is always equal to
+ * vHeaders[i].GetHash(). Large batches are split over all cores, which makes
+ * bulk hashing of pre-switch (Quark) headers scale with the machine.
+ */
+void GetBlockHeaderHashes(const std::vector<CBlockHeader>& vHeaders, std::vector<uint256>& vHashes);
+
 
 class CBlock : public CBlockHeader
 {
@@ -169,7 +169,10 @@ enum {
     MSG_MASTERNODE_QUORUM,
     MSG_MASTERNODE_ANNOUNCE,
     MSG_MASTERNODE_PING,
-    MSG_DSTX
+    MSG_DSTX,
+    // Like MSG_FILTERED_BLOCK, MSG_CMPCT_BLOCK is only asked for in a getdata and
+    // never announced in an inv.
+    MSG_CMPCT_BLOCK
 };
 
 #endif // BITCOIN_PROTOCOL_H
@@ -11,6 +11,7 @@
 #include "clientversion.h"
 #include "main.h"
 #include "rpc/server.h"
+#include "script/sigcache.h"
 #include "sync.h"
 #include "txdb.h"
 #include "util.h"
@@ -179,16 +180,22 @@ UniValue mempoolToJSON(bool fVerbose = false)
     if (fVerbose) {
         LOCK(mempool.cs);
         UniValue o(UniValue::VOBJ);
-        BOOST_FOREACH (const PAIRTYPE(uint256, CTxMemPoolEntry) & entry, mempool.mapTx) {
-            const uint256& hash = entry.first;
-            const CTxMemPoolEntry& e = entry.second;
+        BOOST_FOREACH (const CTxMemPoolEntry& e, mempool.mapTx) {
+            const uint256& hash = e.GetTx().GetHash();
             UniValue info(UniValue::VOBJ);
             info.push_back(Pair("size", (int)e.GetTxSize()));
             info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
+            info.push_back(Pair("modifiedfee", ValueFromAmount(e.GetModifiedFee())));
             info.push_back(Pair("time", e.GetTime()));
             info.push_back(Pair("height", (int)e.GetHeight()));
             info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
             info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
+            info.push_back(Pair("descendantcount", e.GetCountWithDescendants()));
+            info.push_back(Pair("descendantsize", e.GetSizeWithDescendants()));
+            info.push_back(Pair("descendantfees", e.GetModFeesWithDescendants()));
+            info.push_back(Pair("ancestorcount", e.GetCountWithAncestors()));
+            info.push_back(Pair("ancestorsize", e.GetSizeWithAncestors()));
+            info.push_back(Pair("ancestorfees", e.GetModFeesWithAncestors()));
             const CTransaction& tx = e.GetTx();
             set<string> setDepends;
             BOOST_FOREACH (const CTxIn& txin, tx.vin) {
@@ -238,10 +245,17 @@ UniValue getrawmempool(const UniValue& params, bool fHelp)
             "  \"transactionid\" : {       (json object)\n"
             "    \"size\" : n,             (numeric) transaction size in bytes\n"
             "    \"fee\" : n,              (numeric) transaction fee in byron\n"
+            "    \"modifiedfee\" : n,      (numeric) transaction fee with fee deltas used for mining priority\n"
             "    \"time\" : n,             (numeric) local time transaction entered pool in seconds since 1 Jan 1970 GMT\n"
             "    \"height\" : n,           (numeric) block height when transaction entered pool\n"
             "    \"startingpriority\" : n, (numeric) priority when transaction entered pool\n"
             "    \"currentpriority\" : n,  (numeric) transaction priority now\n"
+            "    \"descendantcount\" : n,  (numeric) number of in-mempool descendant transactions (including this one)\n"
+            "    \"descendantsize\" : n,   (numeric) size of in-mempool descendants (including this one)\n"
+            "    \"descendantfees\" : n,   (numeric) modified fees (see above) of in-mempool descendants (including this one)\n"
+            "    \"ancestorcount\" : n,    (numeric) number of in-mempool ancestor transactions (including this one)\n"
+            "    \"ancestorsize\" : n,     (numeric) size of in-mempool ancestors (including this one)\n"
+            "    \"ancestorfees\" : n,     (numeric) modified fees (see above) of in-mempool ancestors (including this one)\n"
             "    \"depends\" : [           (array) unconfirmed transactions used as inputs for this transaction\n"
             "        \"transactionid\",    (string) parent transaction id\n"
             "       ... ]\n"
@@ -286,6 +300,42 @@ UniValue getblockhash(const UniValue& params, bool fHelp)
     return pblockindex->GetBlockHash().GetHex();
 }
 
+UniValue getblockhashes(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 2)
+        throw runtime_error(
+            "getblockhashes high low\n"
+            "\nReturns array of hashes of blocks within the timestamp range provided (requires -timestampindex).\n"
+
+            "\nArguments:\n"
+            "1. high         (numeric, required) The newer block timestamp\n"
+            "2. low          (numeric, required) The older block timestamp\n"
+
+            "\nResult:\n"
+            "[\n"
+            "  \"hash\"         (string) The block hash\n"
+            "  ,...\n"
+            "]\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getblockhashes", "1231614698 1231024505") + HelpExampleRpc("getblockhashes", "1231614698, 1231024505"));
+
+    unsigned int high = params[0].get_int();
+    unsigned int low = params[1].get_int();
+    if (high < low)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "High is expected to be at or after low");
+
+    std::vector<uint256> blockHashes;
+    if (!GetTimestampIndex(high, low, blockHashes))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for block hashes");
+
+    UniValue result(UniValue::VARR);
+    for (const uint256& hash : blockHashes)
+        result.push_back(hash.GetHex());
+
+    return result;
+}
+
 UniValue getblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -342,6 +392,9 @@ UniValue getblock(const UniValue& params, bool fHelp)
     CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
 
+    if (!(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
+
     if (!ReadBlockFromDisk(block, pblockindex))
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
 
@@ -447,6 +500,103 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
     return ret;
 }
 
+static UniValue TxOutSnapshotStatsToJSON(const CCoinsStats& stats, const uint256& hashSnapshot, const boost::filesystem::path& path)
+{
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("path", path.string()));
+    ret.push_back(Pair("height", (int64_t)stats.nHeight));
+    ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
+    ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
+    ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
+    ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
+    ret.push_back(Pair("hash_snapshot", hashSnapshot.GetHex()));
+    ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
+    return ret;
+}
+
+UniValue dumptxoutset(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset \"path\"\n"
+            "\nWrites the unspent transaction output set at the current tip to a file, which\n"
+            "a new node can start from with loadtxoutset instead of downloading the history.\n"
+            "Note this call may take some time.\n"
+
+            "\nArguments:\n"
+            "1. \"path\"    (string, required) The file to write, relative to the data directory unless absolute\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"path\": \"path\",          (string) The absolute path of the file written\n"
+            "  \"height\":n,              (numeric) The height of the block the snapshot is the state after\n"
+            "  \"bestblock\": \"hex\",      (string) The hash of that block\n"
+            "  \"transactions\": n,       (numeric) The number of transactions\n"
+            "  \"txouts\": n,             (numeric) The number of outputs\n"
+            "  \"hash_serialized\": \"hash\", (string) The hash of the set, as gettxoutsetinfo reports it\n"
+            "  \"hash_snapshot\": \"hash\", (string) The hash of the set and the block data stored with it, for loadtxoutset\n"
+            "  \"total_amount\": x.xxx    (numeric) The total amount\n"
+            "}\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("dumptxoutset", "\"utxo.dat\"") + HelpExampleRpc("dumptxoutset", "\"utxo.dat\""));
+
+    boost::filesystem::path path = boost::filesystem::absolute(params[0].get_str(), GetDataDir());
+    if (boost::filesystem::exists(path))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, path.string() + " already exists");
+
+    CCoinsStats stats;
+    uint256 hashSnapshot;
+    std::string strError;
+    if (!DumpTxOutSnapshot(path, stats, hashSnapshot, strError))
+        throw JSONRPCError(RPC_MISC_ERROR, strError);
+    return TxOutSnapshotStatsToJSON(stats, hashSnapshot, path);
+}
+
+UniValue loadtxoutset(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "loadtxoutset \"path\" ( \"expectedhash\" )\n"
+            "\nStarts the chain state from a snapshot dumptxoutset wrote, instead of from the\n"
+            "genesis block. Only works on a node that hasn't connected any blocks yet, once its\n"
+            "headers include the snapshot block. Blocks below the snapshot block are never\n"
+            "downloaded, so their transactions aren't available and the chain can't be\n"
+            "reorganized below it.\n"
+            "Note this call may take some time.\n"
+
+            "\nArguments:\n"
+            "1. \"path\"          (string, required) The snapshot file, relative to the data directory unless absolute\n"
+            "2. \"expectedhash\"  (string, optional) The hash_snapshot the snapshot must have, from dumptxoutset on a trusted node\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"path\": \"path\",          (string) The absolute path of the file loaded\n"
+            "  \"height\":n,              (numeric) The height of the block the snapshot is the state after\n"
+            "  \"bestblock\": \"hex\",      (string) The hash of that block\n"
+            "  \"transactions\": n,       (numeric) The number of transactions\n"
+            "  \"txouts\": n,             (numeric) The number of outputs\n"
+            "  \"hash_serialized\": \"hash\", (string) The hash of the set\n"
+            "  \"hash_snapshot\": \"hash\", (string) The hash of the set and the block data stored with it\n"
+            "  \"total_amount\": x.xxx    (numeric) The total amount\n"
+            "}\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("loadtxoutset", "\"utxo.dat\"") + HelpExampleRpc("loadtxoutset", "\"utxo.dat\""));
+
+    boost::filesystem::path path = boost::filesystem::absolute(params[0].get_str(), GetDataDir());
+    uint256 hashExpected = 0;
+    if (params.size() > 1)
+        hashExpected = ParseHashV(params[1], "expectedhash");
+
+    CCoinsStats stats;
+    uint256 hashSnapshot;
+    std::string strError;
+    if (!LoadTxOutSnapshot(path, hashExpected, stats, hashSnapshot, strError))
+        throw JSONRPCError(RPC_MISC_ERROR, strError);
+    return TxOutSnapshotStatsToJSON(stats, hashSnapshot, path);
+}
+
 UniValue gettxout(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -474,7 +624,6 @@ UniValue gettxout(const UniValue& params, bool fHelp)
             "        ,...\n"
             "     ]\n"
             "  },\n"
-            "  \"version\" : n,            (numeric) The version\n"
             "  \"coinbase\" : true|false   (boolean) Coinbase or not\n"
             "}\n"
 
@@ -497,33 +646,33 @@ UniValue gettxout(const UniValue& params, bool fHelp)
     if (params.size() > 2)
         fMempool = params[2].get_bool();
 
-    CCoins coins;
+    if (n < 0)
+        return NullUniValue;
+    COutPoint out(hash, n);
+
+    Coin coin;
     if (fMempool) {
         LOCK(mempool.cs);
         CCoinsViewMemPool view(pcoinsTip, mempool);
-        if (!view.GetCoins(hash, coins))
+        if (!view.GetCoin(out, coin) || mempool.isSpent(out)) // TODO: filtering spent coins should be done by the CCoinsViewMemPool
             return NullUniValue;
-        mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
     } else {
-        if (!pcoinsTip->GetCoins(hash, coins))
+        if (!pcoinsTip->GetCoin(out, coin))
             return NullUniValue;
     }
-    if (n < 0 || (unsigned int)n >= coins.vout.size() || coins.vout[n].IsNull())
-        return NullUniValue;
 
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     CBlockIndex* pindex = it->second;
     ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
-    if ((unsigned int)coins.nHeight == MEMPOOL_HEIGHT)
+    if (coin.nHeight == MEMPOOL_HEIGHT)
         ret.push_back(Pair("confirmations", 0));
     else
-        ret.push_back(Pair("confirmations", pindex->nHeight - coins.nHeight + 1));
-    ret.push_back(Pair("value", ValueFromAmount(coins.vout[n].nValue)));
+        ret.push_back(Pair("confirmations", pindex->nHeight - (int)coin.nHeight + 1));
+    ret.push_back(Pair("value", ValueFromAmount(coin.out.nValue)));
     UniValue o(UniValue::VOBJ);
-    ScriptPubKeyToJSON(coins.vout[n].scriptPubKey, o, true);
+    ScriptPubKeyToJSON(coin.out.scriptPubKey, o, true);
     ret.push_back(Pair("scriptPubKey", o));
-    ret.push_back(Pair("version", coins.nVersion));
-    ret.push_back(Pair("coinbase", coins.fCoinBase));
+    ret.push_back(Pair("coinbase", coin.fCoinBase));
 
     return ret;
 }
@@ -582,6 +731,16 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
             "  \"difficulty\": xxxxxx,     (numeric) the current difficulty\n"
             "  \"verificationprogress\": xxxx, (numeric) estimate of verification progress [0..1]\n"
             "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"size_on_disk\": xxxxxx,   (numeric) the bytes the block and undo files take\n"
+            "  \"pruned\": xx,             (boolean) whether old block files are deleted (-prune)\n"
+            "  \"prune_target_size\": xxxxxx, (numeric) the bytes -prune keeps block and undo files to (only in prune mode)\n"
+            "  \"pruneheight\": xxxxxx,    (numeric) the lowest block height whose data is stored (only when blocks are missing)\n"
+            "  \"assumevalid\": {          (object) script verification skipped for blocks assumed valid\n"
+            "     \"hash\": \"xxxx\",        (string) the block whose ancestors are assumed valid, 0 if none\n"
+            "     \"skippedblocks\": xx,     (numeric) blocks connected without checking their scripts since startup\n"
+            "     \"skippedinputs\": xx,     (numeric) inputs of those blocks whose signatures were not checked\n"
+            "     \"timesaved\": x.xxx       (numeric) estimate of the script checking time saved, in seconds\n"
+            "  },\n"
             "  \"softforks\": [            (array) status of softforks in progress\n"
             "     {\n"
             "        \"id\": \"xxxx\",        (string) name of softfork\n"
@@ -610,6 +769,24 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("difficulty", (double)GetDifficulty()));
     obj.push_back(Pair("verificationprogress", Checkpoints::GuessVerificationProgress(chainActive.Tip())));
     obj.push_back(Pair("chainwork", chainActive.Tip()->nChainWork.GetHex()));
+    obj.push_back(Pair("size_on_disk", CalculateCurrentUsage()));
+    obj.push_back(Pair("pruned", fPruneMode));
+    if (fPruneMode)
+        obj.push_back(Pair("prune_target_size", nPruneTarget));
+    if (fHavePruned) {
+        CBlockIndex* block = chainActive.Tip();
+        while (block && block->pprev && (block->pprev->nStatus & BLOCK_HAVE_DATA))
+            block = block->pprev;
+        obj.push_back(Pair("pruneheight", block->nHeight));
+    }
+    CAssumeValidStats assumeValidStats;
+    GetAssumeValidStats(assumeValidStats);
+    UniValue assumevalid(UniValue::VOBJ);
+    assumevalid.push_back(Pair("hash", hashAssumeValid.GetHex()));
+    assumevalid.push_back(Pair("skippedblocks", assumeValidStats.nBlocks));
+    assumevalid.push_back(Pair("skippedinputs", assumeValidStats.nInputs));
+    assumevalid.push_back(Pair("timesaved", assumeValidStats.nTimeSaved * 0.000001));
+    obj.push_back(Pair("assumevalid", assumevalid));
     CBlockIndex* tip = chainActive.Tip();
     UniValue softforks(UniValue::VARR);
     softforks.push_back(SoftForkDesc("bip65", 5, tip));
@@ -742,50 +919,31 @@ UniValue getfeeinfo(const UniValue& params, bool fHelp)
             "\nExamples:\n" +
             HelpExampleCli("getfeeinfo", "5") + HelpExampleRpc("getfeeinfo", "5"));
 
-    LOCK(cs_main);
-
     int nBlocks = params[0].get_int();
-    int nBestHeight = chainActive.Height();
-    int nStartHeight = nBestHeight - nBlocks;
-    if (nBlocks < 0 || nStartHeight <= 0)
-        throw JSONRPCError(RPC_INVALID_PARAMETER, "invalid start height");
+    std::vector<CBlockIndex*> vBlocks;
+    {
+        LOCK(cs_main);
+        int nBestHeight = chainActive.Height();
+        int nStartHeight = nBestHeight - nBlocks;
+        if (nBlocks < 0 || nStartHeight <= 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "invalid start height");
+
+        vBlocks.reserve(nBlocks + 1);
+        for (int i = nStartHeight; i <= nBestHeight; i++)
+            vBlocks.push_back(chainActive[i]);
+    }
 
     CAmount nFees = 0;
     int64_t nBytes = 0;
     int64_t nTotal = 0;
-    for (int i = nStartHeight; i <= nBestHeight; i++) {
-        CBlockIndex* pindex = chainActive[i];
-        CBlock block;
-        if (!ReadBlockFromDisk(block, pindex))
+    for (CBlockIndex* pindex : vBlocks) {
+        CBlockStats stats;
+        if (!GetBlockStats(pindex, stats))
             throw JSONRPCError(RPC_DATABASE_ERROR, "failed to read block from disk");
 
-        CAmount nValueIn = 0;
-        CAmount nValueOut = 0;
-        for (const CTransaction& tx : block.vtx) {
-            if (tx.IsCoinBase() || tx.IsCoinStake())
-                continue;
-
-            for (unsigned int j = 0; j < tx.vin.size(); j++) {
-                COutPoint prevout = tx.vin[j].prevout;
-                CTransaction txPrev;
-                uint256 hashBlock;
-                if(!GetTransaction(prevout.hash, txPrev, hashBlock, true))
-                    throw JSONRPCError(RPC_DATABASE_ERROR, "failed to read tx from disk");
-                nValueIn += txPrev.vout[prevout.n].nValue;
-            }
-
-            for (unsigned int j = 0; j < tx.vout.size(); j++) {
-                nValueOut += tx.vout[j].nValue;
-            }
-
-            nFees += nValueIn - nValueOut;
-            nBytes += tx.GetSerializeSize(SER_NETWORK, CLIENT_VERSION);
-            nTotal++;
-        }
-
-        pindex = chainActive.Next(pindex);
-        if (!pindex)
-            break;
+        nFees += stats.nFees;
+        nBytes += stats.nFeeTxBytes;
+        nTotal += stats.nFeeTxs;
     }
 
     UniValue ret(UniValue::VOBJ);
@@ -804,7 +962,15 @@ UniValue mempoolInfoToJSON()
     UniValue ret(UniValue::VOBJ);
     ret.push_back(Pair("size", (int64_t) mempool.size()));
     ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
-    //ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    size_t maxmempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    ret.push_back(Pair("maxmempool", (int64_t) maxmempool));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFee(maxmempool).GetFeePerK())));
+
+    uint64_t nSigCacheHits, nSigCacheMisses;
+    GetSignatureCacheStats(nSigCacheHits, nSigCacheMisses);
+    ret.push_back(Pair("sigcachehits", nSigCacheHits));
+    ret.push_back(Pair("sigcachemisses", nSigCacheMisses));
 
     return ret;
 }
@@ -820,6 +986,11 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
             "{\n"
             "  \"size\": xxxxx                (numeric) Current tx count\n"
             "  \"bytes\": xxxxx               (numeric) Sum of all tx sizes\n"
+            "  \"usage\": xxxxx               (numeric) Total memory usage for the mempool\n"
+            "  \"maxmempool\": xxxxx          (numeric) Maximum memory usage for the mempool\n"
+            "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee for tx to be accepted\n"
+            "  \"sigcachehits\": xxxxx        (numeric) Signature checks answered from the signature cache\n"
+            "  \"sigcachemisses\": xxxxx      (numeric) Signature checks that had to be verified\n"
             "}\n"
 
             "\nExamples:\n" +
@@ -50,6 +50,13 @@ static const CRPCConvertParam vRPCConvertParams[] =
         {"getbalance", 1},
         {"getbalance", 2},
         {"getblockhash", 0},
+        {"getblockhashes", 0},
+        {"getblockhashes", 1},
+        {"getspentinfo", 0},
+        {"getaddressbalance", 0},
+        {"getaddressdeltas", 0},
+        {"getaddresstxids", 0},
+        {"getaddressutxos", 0},
         {"move", 2},
         {"move", 3},
         {"sendfrom", 2},
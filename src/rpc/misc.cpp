@@ -546,6 +546,304 @@ UniValue setmocktime(const UniValue& params, bool fHelp)
     return NullUniValue;
 }
 
+static bool GetAddressFromIndex(unsigned int type, const uint160& hash, std::string& address)
+{
+    if (type == ADDRESS_INDEX_SCRIPTHASH)
+        address = CBitcoinAddress(CScriptID(hash)).ToString();
+    else if (type == ADDRESS_INDEX_PUBKEYHASH)
+        address = CBitcoinAddress(CKeyID(hash)).ToString();
+    else
+        return false;
+    return true;
+}
+
+/** Parse either a single address string or an {"addresses": [...]} object */
+static void GetAddressesFromParams(const UniValue& params, std::vector<std::pair<uint160, unsigned int> >& addresses)
+{
+    std::vector<std::string> vAddressStrings;
+    if (params[0].isStr()) {
+        vAddressStrings.push_back(params[0].get_str());
+    } else if (params[0].isObject()) {
+        UniValue addressValues = find_value(params[0].get_obj(), "addresses");
+        if (!addressValues.isArray())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Addresses is expected to be an array");
+        for (unsigned int i = 0; i < addressValues.size(); i++)
+            vAddressStrings.push_back(addressValues[i].get_str());
+    } else {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
+    }
+
+    for (const std::string& strAddress : vAddressStrings) {
+        CBitcoinAddress address(strAddress);
+        uint160 hashBytes;
+        unsigned int type = 0;
+        if (!address.GetIndexKey(hashBytes, type))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
+        addresses.push_back(std::make_pair(hashBytes, type));
+    }
+}
+
+/** Read the optional "start" and "end" heights of an address query */
+static void GetHeightRangeFromParams(const UniValue& params, int& nStart, int& nEnd)
+{
+    nStart = 0;
+    nEnd = 0;
+    if (!params[0].isObject())
+        return;
+
+    UniValue startValue = find_value(params[0].get_obj(), "start");
+    UniValue endValue = find_value(params[0].get_obj(), "end");
+    if (startValue.isNum() && endValue.isNum()) {
+        nStart = startValue.get_int();
+        nEnd = endValue.get_int();
+        if (nStart <= 0 || nEnd <= 0 || nEnd < nStart)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Start and end are expected to be positive with end at or after start");
+    }
+}
+
+UniValue getaddressutxos(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressutxos {\"addresses\": [\"address\",...]}\n"
+            "\nReturns all unspent outputs for the addresses (requires -addressindex).\n"
+
+            "\nArguments:\n"
+            "1. \"address\" or {\"addresses\": [\"address\",...]}  (string or object, required) The address(es)\n"
+
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"address\": \"address\",  (string) The address\n"
+            "    \"txid\": \"hash\",        (string) The output txid\n"
+            "    \"outputIndex\": n,      (numeric) The output index\n"
+            "    \"script\": \"hex\",       (string) The script hex encoded\n"
+            "    \"satoshis\": n,         (numeric) The number of satoshis of the output\n"
+            "    \"height\": n            (numeric) The block height\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getaddressutxos", "'{\"addresses\": [\"DMJRSsuU9zfyrvxVaAEFQqK4MxZg6vgeS6\"]}'") +
+            HelpExampleRpc("getaddressutxos", "{\"addresses\": [\"DMJRSsuU9zfyrvxVaAEFQqK4MxZg6vgeS6\"]}"));
+
+    std::vector<std::pair<uint160, unsigned int> > addresses;
+    GetAddressesFromParams(params, addresses);
+
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > unspentOutputs;
+    for (const std::pair<uint160, unsigned int>& address : addresses) {
+        if (!GetAddressUnspent(address.second, address.first, unspentOutputs))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    }
+
+    UniValue result(UniValue::VARR);
+    for (const std::pair<CAddressUnspentKey, CAddressUnspentValue>& it : unspentOutputs) {
+        std::string strAddress;
+        if (!GetAddressFromIndex(it.first.type, it.first.hashBytes, strAddress))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
+
+        UniValue output(UniValue::VOBJ);
+        output.push_back(Pair("address", strAddress));
+        output.push_back(Pair("txid", it.first.txhash.GetHex()));
+        output.push_back(Pair("outputIndex", (int)it.first.index));
+        output.push_back(Pair("script", HexStr(it.second.script.begin(), it.second.script.end())));
+        output.push_back(Pair("satoshis", it.second.satoshis));
+        output.push_back(Pair("height", it.second.blockHeight));
+        result.push_back(output);
+    }
+
+    return result;
+}
+
+UniValue getaddressdeltas(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressdeltas {\"addresses\": [\"address\",...], \"start\": n, \"end\": n}\n"
+            "\nReturns all changes for the addresses (requires -addressindex).\n"
+
+            "\nArguments:\n"
+            "1. \"address\" or {\"addresses\": [\"address\",...], \"start\": n, \"end\": n}  (string or object, required)\n"
+            "   The address(es), optionally with the block height range to look at\n"
+
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"satoshis\": n,        (numeric) The difference of satoshis\n"
+            "    \"txid\": \"hash\",       (string) The related txid\n"
+            "    \"index\": n,           (numeric) The related input or output index\n"
+            "    \"blockindex\": n,      (numeric) The position of the transaction in the block\n"
+            "    \"height\": n,          (numeric) The block height\n"
+            "    \"address\": \"address\"  (string) The address\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getaddressdeltas", "'{\"addresses\": [\"DMJRSsuU9zfyrvxVaAEFQqK4MxZg6vgeS6\"]}'") +
+            HelpExampleRpc("getaddressdeltas", "{\"addresses\": [\"DMJRSsuU9zfyrvxVaAEFQqK4MxZg6vgeS6\"]}"));
+
+    int nStart, nEnd;
+    GetHeightRangeFromParams(params, nStart, nEnd);
+    std::vector<std::pair<uint160, unsigned int> > addresses;
+    GetAddressesFromParams(params, addresses);
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    for (const std::pair<uint160, unsigned int>& address : addresses) {
+        if (!GetAddressIndex(address.second, address.first, addressIndex, nStart, nEnd))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    }
+
+    UniValue result(UniValue::VARR);
+    for (const std::pair<CAddressIndexKey, CAmount>& it : addressIndex) {
+        std::string strAddress;
+        if (!GetAddressFromIndex(it.first.type, it.first.hashBytes, strAddress))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
+
+        UniValue delta(UniValue::VOBJ);
+        delta.push_back(Pair("satoshis", it.second));
+        delta.push_back(Pair("txid", it.first.txhash.GetHex()));
+        delta.push_back(Pair("index", (int)it.first.index));
+        delta.push_back(Pair("blockindex", (int)it.first.txindex));
+        delta.push_back(Pair("height", it.first.blockHeight));
+        delta.push_back(Pair("address", strAddress));
+        result.push_back(delta);
+    }
+
+    return result;
+}
+
+UniValue getaddressbalance(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance {\"addresses\": [\"address\",...]}\n"
+            "\nReturns the balance for the addresses (requires -addressindex).\n"
+
+            "\nArguments:\n"
+            "1. \"address\" or {\"addresses\": [\"address\",...]}  (string or object, required) The address(es)\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"balance\": n,   (numeric) The current balance in satoshis\n"
+            "  \"received\": n   (numeric) The total number of satoshis received (including change)\n"
+            "}\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getaddressbalance", "'{\"addresses\": [\"DMJRSsuU9zfyrvxVaAEFQqK4MxZg6vgeS6\"]}'") +
+            HelpExampleRpc("getaddressbalance", "{\"addresses\": [\"DMJRSsuU9zfyrvxVaAEFQqK4MxZg6vgeS6\"]}"));
+
+    std::vector<std::pair<uint160, unsigned int> > addresses;
+    GetAddressesFromParams(params, addresses);
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    for (const std::pair<uint160, unsigned int>& address : addresses) {
+        if (!GetAddressIndex(address.second, address.first, addressIndex))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    }
+
+    CAmount nBalance = 0;
+    CAmount nReceived = 0;
+    for (const std::pair<CAddressIndexKey, CAmount>& it : addressIndex) {
+        if (it.second > 0)
+            nReceived += it.second;
+        nBalance += it.second;
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("balance", nBalance));
+    result.push_back(Pair("received", nReceived));
+
+    return result;
+}
+
+UniValue getaddresstxids(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddresstxids {\"addresses\": [\"address\",...], \"start\": n, \"end\": n}\n"
+            "\nReturns the txids for the addresses (requires -addressindex).\n"
+
+            "\nArguments:\n"
+            "1. \"address\" or {\"addresses\": [\"address\",...], \"start\": n, \"end\": n}  (string or object, required)\n"
+            "   The address(es), optionally with the block height range to look at\n"
+
+            "\nResult:\n"
+            "[\n"
+            "  \"transactionid\"  (string) The transaction id\n"
+            "  ,...\n"
+            "]\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getaddresstxids", "'{\"addresses\": [\"DMJRSsuU9zfyrvxVaAEFQqK4MxZg6vgeS6\"]}'") +
+            HelpExampleRpc("getaddresstxids", "{\"addresses\": [\"DMJRSsuU9zfyrvxVaAEFQqK4MxZg6vgeS6\"]}"));
+
+    int nStart, nEnd;
+    GetHeightRangeFromParams(params, nStart, nEnd);
+    std::vector<std::pair<uint160, unsigned int> > addresses;
+    GetAddressesFromParams(params, addresses);
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    for (const std::pair<uint160, unsigned int>& address : addresses) {
+        if (!GetAddressIndex(address.second, address.first, addressIndex, nStart, nEnd))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    }
+
+    // Order by height across all addresses, listing each transaction once
+    std::set<std::pair<int, std::string> > txids;
+    for (const std::pair<CAddressIndexKey, CAmount>& it : addressIndex)
+        txids.insert(std::make_pair(it.first.blockHeight, it.first.txhash.GetHex()));
+
+    UniValue result(UniValue::VARR);
+    std::set<std::string> seen;
+    for (const std::pair<int, std::string>& it : txids) {
+        if (seen.insert(it.second).second)
+            result.push_back(it.second);
+    }
+
+    return result;
+}
+
+UniValue getspentinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1 || !params[0].isObject())
+        throw runtime_error(
+            "getspentinfo {\"txid\": \"hash\", \"index\": n}\n"
+            "\nReturns the txid and index where an output is spent (requires -spentindex).\n"
+
+            "\nArguments:\n"
+            "1. {\"txid\": \"hash\", \"index\": n}  (object, required) The output\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"txid\": \"hash\",  (string) The spending transaction id\n"
+            "  \"index\": n,      (numeric) The spending input index\n"
+            "  \"height\": n      (numeric) The height of the block with the spending transaction\n"
+            "}\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getspentinfo", "'{\"txid\": \"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", \"index\": 0}'") +
+            HelpExampleRpc("getspentinfo", "{\"txid\": \"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", \"index\": 0}"));
+
+    UniValue txidValue = find_value(params[0].get_obj(), "txid");
+    UniValue indexValue = find_value(params[0].get_obj(), "index");
+    if (!txidValue.isStr() || !indexValue.isNum())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid txid or index");
+
+    CSpentIndexKey key(ParseHashV(txidValue, "txid"), indexValue.get_int());
+    CSpentIndexValue value;
+    if (!GetSpentIndex(key, value))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to get spent info");
+
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("txid", value.txid.GetHex()));
+    obj.push_back(Pair("index", (int)value.inputIndex));
+    obj.push_back(Pair("height", value.blockHeight));
+
+    return obj;
+}
+
 #ifdef ENABLE_WALLET
 UniValue getstakingstatus(const UniValue& params, bool fHelp)
 {
@@ -563,6 +861,17 @@ UniValue getstakingstatus(const UniValue& params, bool fHelp)
             "  \"enoughcoins\": true|false,        (boolean) if available coins are greater than reserve balance\n"
             "  \"mnsync\": true|false,             (boolean) if masternode data is synced\n"
             "  \"staking status\": true|false,     (boolean) if the wallet is staking or not\n"
+            "  \"kernelsearch\": {                (object) stake kernel search statistics\n"
+            "    \"threads\": n,                   (numeric) threads used for hashing kernels\n"
+            "    \"searches\": n,                  (numeric) number of searches since startup\n"
+            "    \"kernelsfound\": n,              (numeric) searches that found a kernel\n"
+            "    \"hashes\": n,                    (numeric) kernel hashes computed since startup\n"
+            "    \"lastkernels\": n,               (numeric) stakable outputs in the last search\n"
+            "    \"lasthashes\": n,                (numeric) kernel hashes computed in the last search\n"
+            "    \"lastsearchtime\": ttt,          (numeric) time of the last search in seconds since epoch\n"
+            "    \"lastsearchms\": x.xxx,          (numeric) duration of the last search in milliseconds\n"
+            "    \"hashespersec\": n               (numeric) hash rate of the last search\n"
+            "  }\n"
             "}\n"
 
             "\nExamples:\n" +
@@ -591,6 +900,20 @@ UniValue getstakingstatus(const UniValue& params, bool fHelp)
         nStaking = true;
     obj.push_back(Pair("staking status", nStaking));
 
+    CStakeSearchStats stats;
+    GetStakeSearchStats(stats);
+    UniValue search(UniValue::VOBJ);
+    search.push_back(Pair("threads", nStakeSearchThreads));
+    search.push_back(Pair("searches", stats.nSearches));
+    search.push_back(Pair("kernelsfound", stats.nKernelsFound));
+    search.push_back(Pair("hashes", stats.nHashes));
+    search.push_back(Pair("lastkernels", (uint64_t)stats.nLastKernels));
+    search.push_back(Pair("lasthashes", stats.nLastHashes));
+    search.push_back(Pair("lastsearchtime", stats.nLastSearchTime));
+    search.push_back(Pair("lastsearchms", stats.nLastSearchMicros * 0.001));
+    search.push_back(Pair("hashespersec", stats.nLastSearchMicros > 0 ? (uint64_t)(stats.nLastHashes * 1000000 / stats.nLastSearchMicros) : 0));
+    obj.push_back(Pair("kernelsearch", search));
+
     return obj;
 }
 #endif // ENABLE_WALLET
@@ -9,6 +9,7 @@
 
 #include "clientversion.h"
 #include "main.h"
+#include "msgsigverify.h"
 #include "net.h"
 #include "netbase.h"
 #include "protocol.h"
@@ -109,7 +110,10 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"inflightlimit\": n,        (numeric) How many blocks we currently allow in flight from this peer\n"
+            "    \"blocksdownloaded\": n,     (numeric) The number of requested blocks this peer has delivered\n"
+            "    \"blocklatency\": n,         (numeric) Average time in seconds this peer took to deliver a requested block\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -158,6 +162,9 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            obj.push_back(Pair("inflightlimit", statestats.nBlocksInFlightLimit));
+            obj.push_back(Pair("blocksdownloaded", statestats.nBlocksDownloaded));
+            obj.push_back(Pair("blocklatency", statestats.nBlockLatency / 1e6));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
 
@@ -388,6 +395,29 @@ static UniValue GetNetworksInfo()
     return networks;
 }
 
+static UniValue GetMessageLatencyInfo()
+{
+    static const char* const pszBuckets[CMessageLatencyStats::BUCKETS] = {"10us", "100us", "1ms", "10ms", "100ms", "1s", "slower"};
+
+    UniValue latency(UniValue::VOBJ);
+    std::map<std::string, CMessageLatencyStats> mapStats = GetMessageLatencyStats();
+    for (std::map<std::string, CMessageLatencyStats>::const_iterator it = mapStats.begin(); it != mapStats.end(); ++it) {
+        const CMessageLatencyStats& stats = it->second;
+        UniValue histogram(UniValue::VOBJ);
+        for (int i = 0; i < CMessageLatencyStats::BUCKETS; i++)
+            histogram.push_back(Pair(pszBuckets[i], (uint64_t)stats.vBuckets[i]));
+
+        UniValue rec(UniValue::VOBJ);
+        rec.push_back(Pair("count", (uint64_t)stats.nCount));
+        rec.push_back(Pair("avglatency", stats.nTotalLatency / (int64_t)stats.nCount));
+        rec.push_back(Pair("maxlatency", stats.nMaxLatency));
+        rec.push_back(Pair("avgprocesstime", stats.nTotalProcessTime / (int64_t)stats.nCount));
+        rec.push_back(Pair("histogram", histogram));
+        latency.push_back(Pair(SanitizeString(it->first), rec));
+    }
+    return latency;
+}
+
 UniValue getnetworkinfo(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -420,7 +450,32 @@ UniValue getnetworkinfo(const UniValue& params, bool fHelp)
             "    \"score\": xxx                         (numeric) relative score\n"
             "  }\n"
             "  ,...\n"
-            "  ]\n"
+            "  ],\n"
+            "  \"messagethreads\": xxx,                 (numeric) threads processing gossip apart from the main message handler\n"
+            "  \"sigverify\": {                         (json object) signature recovery for gossip waiting for the message threads\n"
+            "    \"threads\": xxx,                      (numeric) signature verification threads\n"
+            "    \"queuedepth\": xxx,                   (numeric) signatures waiting for a thread\n"
+            "    \"maxqueuedepth\": xxx,                (numeric) most signatures that have waited at once\n"
+            "    \"queued\": xxx,                       (numeric) signatures queued\n"
+            "    \"duplicates\": xxx,                   (numeric) signatures not queued as they were known or queued already\n"
+            "    \"dropped\": xxx,                      (numeric) signatures not queued as the queue was full\n"
+            "    \"threadverified\": xxx,               (numeric) signatures recovered by the verification threads\n"
+            "    \"inlineverified\": xxx,               (numeric) signatures recovered by the thread checking them\n"
+            "    \"resulthits\": xxx,                   (numeric) checks served by an earlier recovery\n"
+            "    \"waits\": xxx                         (numeric) checks that waited for a recovery under way\n"
+            "  },\n"
+            "  \"messagelatency\": {                    (json object) handling latency per received message command\n"
+            "    \"command\": {\n"
+            "      \"count\": xxx,                      (numeric) messages handled\n"
+            "      \"avglatency\": xxx,                 (numeric) average time from receipt until handled, in microseconds\n"
+            "      \"maxlatency\": xxx,                 (numeric) maximum time from receipt until handled, in microseconds\n"
+            "      \"avgprocesstime\": xxx,             (numeric) average time spent in the handler, in microseconds\n"
+            "      \"histogram\": {                     (json object) number of messages per latency bucket\n"
+            "        \"10us\": xxx, \"100us\": xxx, \"1ms\": xxx, \"10ms\": xxx, \"100ms\": xxx, \"1s\": xxx, \"slower\": xxx\n"
+            "      }\n"
+            "    }\n"
+            "    ,...\n"
+            "  }\n"
             "}\n"
 
             "\nExamples:\n" +
@@ -449,6 +504,21 @@ UniValue getnetworkinfo(const UniValue& params, bool fHelp)
         }
     }
     obj.push_back(Pair("localaddresses", localAddresses));
+    obj.push_back(Pair("messagethreads", nMessageWorkerThreads));
+    CMessageSigVerifierStats sigStats = messageSigVerifier.GetStats();
+    UniValue sigverify(UniValue::VOBJ);
+    sigverify.push_back(Pair("threads", sigStats.nThreads));
+    sigverify.push_back(Pair("queuedepth", (uint64_t)sigStats.nQueueDepth));
+    sigverify.push_back(Pair("maxqueuedepth", (uint64_t)sigStats.nMaxQueueDepth));
+    sigverify.push_back(Pair("queued", sigStats.nQueued));
+    sigverify.push_back(Pair("duplicates", sigStats.nDuplicates));
+    sigverify.push_back(Pair("dropped", sigStats.nDropped));
+    sigverify.push_back(Pair("threadverified", sigStats.nVerifiedByWorkers));
+    sigverify.push_back(Pair("inlineverified", sigStats.nVerifiedInline));
+    sigverify.push_back(Pair("resulthits", sigStats.nResultHits));
+    sigverify.push_back(Pair("waits", sigStats.nWaits));
+    obj.push_back(Pair("sigverify", sigverify));
+    obj.push_back(Pair("messagelatency", GetMessageLatencyInfo()));
     return obj;
 }
 
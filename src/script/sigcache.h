@@ -8,8 +8,16 @@
 
 #include "script/interpreter.h"
 
+#include <stdint.h>
 #include <vector>
 
+// DoS prevention: limit cache size to 32MB (over 1000000 entries on 64-bit
+// systems). Due to how we count cache size, actual memory usage is slightly
+// more (~32.25 MB)
+static const int64_t DEFAULT_MAX_SIG_CACHE_SIZE = 32;
+// Maximum sig cache size allowed
+static const int64_t MAX_MAX_SIG_CACHE_SIZE = 16384;
+
 class CPubKey;
 
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
@@ -23,4 +31,10 @@ public:
     bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 };
 
+/** Size the signature cache from -maxsigcachemb; call before any script verification */
+void InitSignatureCache();
+
+/** Lookups answered from and missed by the signature cache since startup */
+void GetSignatureCacheStats(uint64_t& nHits, uint64_t& nMisses);
+
 #endif // BITCOIN_SCRIPT_SIGCACHE_H
@@ -119,6 +119,21 @@ enum {
 #define WRITEDATA(s, obj) s.write((char*)&(obj), sizeof(obj))
 #define READDATA(s, obj) s.read((char*)&(obj), sizeof(obj))
 
+/** Big endian integers, for database keys that have to sort numerically */
+template <typename Stream>
+inline void ser_writedata32be(Stream& s, uint32_t obj)
+{
+    unsigned char buf[4] = {(unsigned char)(obj >> 24), (unsigned char)(obj >> 16), (unsigned char)(obj >> 8), (unsigned char)obj};
+    s.write((char*)buf, sizeof(buf));
+}
+template <typename Stream>
+inline uint32_t ser_readdata32be(Stream& s)
+{
+    unsigned char buf[4];
+    s.read((char*)buf, sizeof(buf));
+    return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | (uint32_t)buf[3];
+}
+
 inline unsigned int GetSerializeSize(char a, int, int = 0)
 {
     return sizeof(a);
@@ -432,6 +447,7 @@ I ReadVarInt(Stream& is)
 
 #define FLATDATA(obj) REF(CFlatData((char*)&(obj), (char*)&(obj) + sizeof(obj)))
 #define VARINT(obj) REF(WrapVarInt(REF(obj)))
+#define COMPACTSIZE(obj) REF(CCompactSize(REF(obj)))
 #define LIMITED_STRING(obj, n) REF(LimitedString<n>(REF(obj)))
 
 /** 
@@ -501,6 +517,32 @@ public:
     }
 };
 
+class CCompactSize
+{
+protected:
+    uint64_t& n;
+
+public:
+    CCompactSize(uint64_t& nIn) : n(nIn) {}
+
+    unsigned int GetSerializeSize(int, int) const
+    {
+        return GetSizeOfCompactSize(n);
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int, int) const
+    {
+        WriteCompactSize<Stream>(s, n);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int, int)
+    {
+        n = ReadCompactSize<Stream>(s);
+    }
+};
+
 template <size_t Limit>
 class LimitedString
 {
@@ -13,31 +13,46 @@ bool CBYRONStake::SetInput(CTransaction txPrev, unsigned int n)
 {
     this->txFrom = txPrev;
     this->nPosition = n;
+    this->prevoutFrom = COutPoint(txPrev.GetHash(), n);
+    this->outFrom = txPrev.vout[n];
+    return true;
+}
+
+bool CBYRONStake::SetInput(const COutPoint& prevout, const Coin& coin)
+{
+    this->nPosition = prevout.n;
+    this->prevoutFrom = prevout;
+    this->outFrom = coin.out;
+    // The coin records the height it was created at, so the block is known without the transaction
+    if ((int)coin.nHeight <= chainActive.Height())
+        this->pindexFrom = chainActive[coin.nHeight];
     return true;
 }
 
 bool CBYRONStake::GetTxFrom(CTransaction& tx)
 {
+    if (txFrom.IsNull())
+        return false;
     tx = txFrom;
     return true;
 }
 
 bool CBYRONStake::CreateTxIn(CWallet* pwallet, CTxIn& txIn, uint256 hashTxOut)
 {
-    txIn = CTxIn(txFrom.GetHash(), nPosition);
+    txIn = CTxIn(prevoutFrom.hash, nPosition);
     return true;
 }
 
 CAmount CBYRONStake::GetValue()
 {
-    return txFrom.vout[nPosition].nValue;
+    return outFrom.nValue;
 }
 
 bool CBYRONStake::CreateTxOuts(CWallet* pwallet, vector<CTxOut>& vout, CAmount nTotal)
 {
     vector<valtype> vSolutions;
     txnouttype whichType;
-    CScript scriptPubKeyKernel = txFrom.vout[nPosition].scriptPubKey;
+    CScript scriptPubKeyKernel = outFrom.scriptPubKey;
     if (!Solver(scriptPubKeyKernel, whichType, vSolutions)) {
         LogPrintf("CreateCoinStake : failed to parse kernel\n");
         return false;
@@ -86,13 +101,16 @@ CDataStream CBYRONStake::GetUniqueness()
 {
     // The unique identifier for a BYRON stake is the outpoint
     CDataStream ss(SER_NETWORK, 0);
-    ss << nPosition << txFrom.GetHash();
+    ss << nPosition << prevoutFrom.hash;
     return ss;
 }
 
 // The block that the UTXO was added to the chain
 CBlockIndex* CBYRONStake::GetIndexFrom()
 {
+    if (txFrom.IsNull())
+        return pindexFrom;
+
     uint256 hashBlock = 0;
     CTransaction tx;
     if (GetTransaction(txFrom.GetHash(), tx, hashBlock, true)) {
@@ -31,6 +31,9 @@ class CBYRONStake : public CStakeInput
 private:
     CTransaction txFrom;
     unsigned int nPosition;
+    //! Set instead of txFrom when the input comes from the UTXO set alone
+    COutPoint prevoutFrom;
+    CTxOut outFrom;
 public:
     CBYRONStake()
     {
@@ -38,6 +41,8 @@ public:
     }
 
     bool SetInput(CTransaction txPrev, unsigned int n);
+    //! For a coin whose transaction isn't available, e.g. one loaded from a UTXO snapshot
+    bool SetInput(const COutPoint& prevout, const Coin& coin);
 
     CBlockIndex* GetIndexFrom() override;
     bool GetTxFrom(CTransaction& tx) override;
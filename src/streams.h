@@ -408,6 +408,66 @@ public:
     }
 };
 
+/** Read-only stream over memory owned by someone else, such as a mapped file.
+ *
+ * Nothing is copied except into the objects being deserialized; the memory
+ * must outlive the reader.
+ */
+class CMemoryReader
+{
+private:
+    const char* pbegin;
+    const char* pcur;
+    const char* pend;
+    int nType;
+    int nVersion;
+
+public:
+    CMemoryReader(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn) : pbegin(pbeginIn),
+                                                                                          pcur(pbeginIn),
+                                                                                          pend(pendIn),
+                                                                                          nType(nTypeIn),
+                                                                                          nVersion(nVersionIn)
+    {
+        assert(pbegin <= pend);
+    }
+
+    //
+    // Stream subset
+    //
+    int GetType() { return nType; }
+    int GetVersion() { return nVersion; }
+    size_t size() const { return pend - pcur; }
+    bool empty() const { return pcur == pend; }
+    //! Number of bytes read so far
+    size_t GetPos() const { return pcur - pbegin; }
+
+    CMemoryReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CMemoryReader::read : end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    CMemoryReader& ignore(size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CMemoryReader::ignore : end of data");
+        pcur += nSize;
+        return (*this);
+    }
+
+    template <typename T>
+    CMemoryReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 /** Non-refcounted RAII wrapper around a FILE* that implements a ring buffer to
  *  deserialize from. It guarantees the ability to rewind a given number of bytes.
  *
@@ -0,0 +1,195 @@
+// Copyright (c) 2026 The Byron developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUPPORT_POOL_H
+#define BITCOIN_SUPPORT_POOL_H
+
+#include <assert.h>
+#include <cstddef>
+#include <new>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Memory resource handing out small blocks from large chunks.
+ *
+ * Node based containers allocate one block of the same few sizes per
+ * element. Serving those from chunks avoids the per-allocation malloc
+ * header and the allocator calls themselves; freed blocks are kept on a
+ * free list per size and reused. Requests that are too large or need more
+ * alignment than ALIGN_BYTES go to operator new.
+ *
+ * Not thread safe; chunks are only returned to the system by Release() or
+ * on destruction.
+ */
+template <size_t MAX_BLOCK_SIZE_BYTES, size_t ALIGN_BYTES>
+class CPoolResource
+{
+private:
+    static const size_t NUM_LISTS = MAX_BLOCK_SIZE_BYTES / ALIGN_BYTES + 1;
+
+    struct ListNode {
+        ListNode* pNext;
+    };
+
+    //! Free blocks, indexed by size in units of ALIGN_BYTES
+    ListNode* vFreeLists[NUM_LISTS];
+    std::vector<void*> vChunks;
+    size_t nChunkSizeBytes;
+    char* pAvailableBegin;
+    char* pAvailableEnd;
+    //! Blocks handed out and not yet returned, including oversized ones
+    size_t nInUse;
+
+    static size_t RoundToAlign(size_t nBytes)
+    {
+        return (nBytes + ALIGN_BYTES - 1) / ALIGN_BYTES * ALIGN_BYTES;
+    }
+
+    static bool IsPooled(size_t nBytes, size_t nAlignment)
+    {
+        return nBytes <= MAX_BLOCK_SIZE_BYTES && nAlignment <= ALIGN_BYTES;
+    }
+
+    void PushFree(void* p, size_t nList)
+    {
+        ListNode* pNode = static_cast<ListNode*>(p);
+        pNode->pNext = vFreeLists[nList];
+        vFreeLists[nList] = pNode;
+    }
+
+    void AllocateChunk()
+    {
+        // Keep what is left of the current chunk around as a free block
+        size_t nRemaining = pAvailableEnd - pAvailableBegin;
+        if (nRemaining >= ALIGN_BYTES)
+            PushFree(pAvailableBegin, nRemaining / ALIGN_BYTES);
+
+        void* pChunk = ::operator new(nChunkSizeBytes);
+        vChunks.push_back(pChunk);
+        pAvailableBegin = static_cast<char*>(pChunk);
+        pAvailableEnd = pAvailableBegin + nChunkSizeBytes;
+    }
+
+public:
+    explicit CPoolResource(size_t nChunkSizeBytesIn = 256 * 1024) : nChunkSizeBytes(RoundToAlign(nChunkSizeBytesIn)), pAvailableBegin(NULL), pAvailableEnd(NULL), nInUse(0)
+    {
+        static_assert(ALIGN_BYTES >= sizeof(ListNode) && (ALIGN_BYTES & (ALIGN_BYTES - 1)) == 0, "ALIGN_BYTES must be a power of two that fits a pointer");
+        assert(nChunkSizeBytes >= MAX_BLOCK_SIZE_BYTES);
+        for (size_t i = 0; i < NUM_LISTS; i++)
+            vFreeLists[i] = NULL;
+    }
+
+    ~CPoolResource()
+    {
+        Release();
+    }
+
+    void* Allocate(size_t nBytes, size_t nAlignment)
+    {
+        nInUse++;
+        if (!IsPooled(nBytes, nAlignment))
+            return ::operator new(nBytes);
+
+        size_t nRounded = RoundToAlign(nBytes);
+        size_t nList = nRounded / ALIGN_BYTES;
+        if (vFreeLists[nList] != NULL) {
+            ListNode* pNode = vFreeLists[nList];
+            vFreeLists[nList] = pNode->pNext;
+            return pNode;
+        }
+        if ((size_t)(pAvailableEnd - pAvailableBegin) < nRounded)
+            AllocateChunk();
+        void* p = pAvailableBegin;
+        pAvailableBegin += nRounded;
+        return p;
+    }
+
+    void Deallocate(void* p, size_t nBytes, size_t nAlignment)
+    {
+        assert(nInUse > 0);
+        nInUse--;
+        if (!IsPooled(nBytes, nAlignment)) {
+            ::operator delete(p);
+            return;
+        }
+        PushFree(p, RoundToAlign(nBytes) / ALIGN_BYTES);
+    }
+
+    /** Give all chunks back to the system; only allowed when no block is in use */
+    void Release()
+    {
+        assert(nInUse == 0);
+        for (size_t i = 0; i < vChunks.size(); i++)
+            ::operator delete(vChunks[i]);
+        std::vector<void*>().swap(vChunks);
+        for (size_t i = 0; i < NUM_LISTS; i++)
+            vFreeLists[i] = NULL;
+        pAvailableBegin = pAvailableEnd = NULL;
+    }
+
+    bool IsUnused() const
+    {
+        return nInUse == 0;
+    }
+
+    /** Bytes held in chunks, whether handed out or free */
+    size_t ChunkBytes() const
+    {
+        return vChunks.size() * nChunkSizeBytes;
+    }
+};
+
+/** Standard allocator drawing from a CPoolResource, for use with node based containers */
+template <typename T, size_t MAX_BLOCK_SIZE_BYTES, size_t ALIGN_BYTES>
+class CPoolAllocator
+{
+public:
+    typedef CPoolResource<MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES> ResourceType;
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind {
+        typedef CPoolAllocator<U, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES> other;
+    };
+
+    explicit CPoolAllocator(ResourceType* pResourceIn) : pResource(pResourceIn) {}
+
+    template <typename U>
+    CPoolAllocator(const CPoolAllocator<U, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& other) : pResource(other.Resource())
+    {
+    }
+
+    T* allocate(size_t n)
+    {
+        return static_cast<T*>(pResource->Allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        pResource->Deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    ResourceType* Resource() const
+    {
+        return pResource;
+    }
+
+private:
+    ResourceType* pResource;
+};
+
+template <typename T, typename U, size_t MAX_BLOCK_SIZE_BYTES, size_t ALIGN_BYTES>
+bool operator==(const CPoolAllocator<T, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& a, const CPoolAllocator<U, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& b)
+{
+    return a.Resource() == b.Resource();
+}
+
+template <typename T, typename U, size_t MAX_BLOCK_SIZE_BYTES, size_t ALIGN_BYTES>
+bool operator!=(const CPoolAllocator<T, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& a, const CPoolAllocator<U, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& b)
+{
+    return !(a == b);
+}
+
+#endif // BITCOIN_SUPPORT_POOL_H
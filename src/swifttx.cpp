@@ -475,10 +475,15 @@ uint256 CConsensusVote::GetHash() const
 }
 
 
+std::string CConsensusVote::GetStrMessage() const
+{
+    return txHash.ToString().c_str() + std::to_string(nBlockHeight);
+}
+
 bool CConsensusVote::SignatureValid()
 {
     std::string errorMessage;
-    std::string strMessage = txHash.ToString().c_str() + std::to_string(nBlockHeight);
+    std::string strMessage = GetStrMessage();
 
     CMasternode* pmn = mnodeman.Find(vinMasternode);
 
@@ -501,7 +506,7 @@ bool CConsensusVote::Sign()
 
     CKey key2;
     CPubKey pubkey2;
-    std::string strMessage = txHash.ToString().c_str() + std::to_string(nBlockHeight);
+    std::string strMessage = GetStrMessage();
 
     if (!obfuScationSigner.SetKey(strMasterNodePrivKey, errorMessage, key2, pubkey2)) {
         LogPrintf("CConsensusVote::Sign() - ERROR: Invalid masternodeprivkey: '%s'\n", errorMessage.c_str());
@@ -0,0 +1,143 @@
+// Copyright (c) 2026 The Byron developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addressindex.h"
+#include "base58.h"
+#include "clientversion.h"
+#include "key.h"
+#include "script/standard.h"
+#include "spentindex.h"
+#include "streams.h"
+#include "timestampindex.h"
+#include "txdb.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(addressindex_tests)
+
+BOOST_AUTO_TEST_CASE(addressindex_script_keys)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    CKeyID keyID = pubkey.GetID();
+
+    unsigned int type;
+    uint160 hashBytes;
+
+    BOOST_CHECK(GetAddressIndexKey(GetScriptForDestination(keyID), type, hashBytes));
+    BOOST_CHECK_EQUAL(type, (unsigned int)ADDRESS_INDEX_PUBKEYHASH);
+    BOOST_CHECK(hashBytes == keyID);
+
+    // Pay to pubkey is filed under the same address as pay to pubkey hash
+    CScript p2pk = CScript() << ToByteVector(pubkey) << OP_CHECKSIG;
+    BOOST_CHECK(GetAddressIndexKey(p2pk, type, hashBytes));
+    BOOST_CHECK_EQUAL(type, (unsigned int)ADDRESS_INDEX_PUBKEYHASH);
+    BOOST_CHECK(hashBytes == keyID);
+
+    CScriptID scriptID(p2pk);
+    BOOST_CHECK(GetAddressIndexKey(GetScriptForDestination(scriptID), type, hashBytes));
+    BOOST_CHECK_EQUAL(type, (unsigned int)ADDRESS_INDEX_SCRIPTHASH);
+    BOOST_CHECK(hashBytes == scriptID);
+
+    BOOST_CHECK(!GetAddressIndexKey(CScript() << OP_RETURN, type, hashBytes));
+
+    BOOST_CHECK(CBitcoinAddress(keyID).GetIndexKey(hashBytes, type));
+    BOOST_CHECK_EQUAL(type, (unsigned int)ADDRESS_INDEX_PUBKEYHASH);
+    BOOST_CHECK(hashBytes == keyID);
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_key_ordering)
+{
+    uint160 hashBytes = uint160(ParseHex("0102030405060708090a0b0c0d0e0f1011121314"));
+
+    // Big endian heights keep the serialized keys in chain order
+    CAddressIndexKey low(ADDRESS_INDEX_PUBKEYHASH, hashBytes, 255, 2, uint256(1), 0, false);
+    CAddressIndexKey high(ADDRESS_INDEX_PUBKEYHASH, hashBytes, 256, 1, uint256(1), 0, false);
+    CDataStream ssLow(SER_DISK, CLIENT_VERSION), ssHigh(SER_DISK, CLIENT_VERSION);
+    ssLow << low;
+    ssHigh << high;
+    BOOST_CHECK_EQUAL(ssLow.size(), low.GetSerializeSize(SER_DISK, CLIENT_VERSION));
+    BOOST_CHECK(ssLow.str() < ssHigh.str());
+
+    CAddressIndexKey check;
+    ssHigh >> check;
+    BOOST_CHECK_EQUAL(check.blockHeight, 256);
+    BOOST_CHECK_EQUAL(check.txindex, 1U);
+    BOOST_CHECK(check.hashBytes == hashBytes);
+
+    CDataStream ssTime1(SER_DISK, CLIENT_VERSION), ssTime2(SER_DISK, CLIENT_VERSION);
+    ssTime1 << CTimestampIndexKey(0x01ff, uint256(2));
+    ssTime2 << CTimestampIndexKey(0x0200, uint256(1));
+    BOOST_CHECK(ssTime1.str() < ssTime2.str());
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_db)
+{
+    CBlockTreeDB db(1 << 20, true, true);
+    uint160 hashA = uint160(ParseHex("0102030405060708090a0b0c0d0e0f1011121314"));
+    uint160 hashB = uint160(ParseHex("1102030405060708090a0b0c0d0e0f1011121314"));
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vIndex;
+    vIndex.push_back(std::make_pair(CAddressIndexKey(ADDRESS_INDEX_PUBKEYHASH, hashA, 10, 1, uint256(1), 0, false), 50));
+    vIndex.push_back(std::make_pair(CAddressIndexKey(ADDRESS_INDEX_PUBKEYHASH, hashA, 20, 1, uint256(2), 0, true), -50));
+    vIndex.push_back(std::make_pair(CAddressIndexKey(ADDRESS_INDEX_PUBKEYHASH, hashB, 15, 1, uint256(3), 0, false), 7));
+    BOOST_CHECK(db.WriteAddressIndex(vIndex));
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vRead;
+    BOOST_CHECK(db.ReadAddressIndex(ADDRESS_INDEX_PUBKEYHASH, hashA, vRead));
+    BOOST_CHECK_EQUAL(vRead.size(), 2U);
+    BOOST_CHECK_EQUAL(vRead[0].second + vRead[1].second, 0);
+
+    vRead.clear();
+    BOOST_CHECK(db.ReadAddressIndex(ADDRESS_INDEX_PUBKEYHASH, hashA, vRead, 15, 30));
+    BOOST_CHECK_EQUAL(vRead.size(), 1U);
+    BOOST_CHECK_EQUAL(vRead[0].first.blockHeight, 20);
+
+    // Disconnecting the spend drops its history entry
+    vIndex.resize(2);
+    vIndex.erase(vIndex.begin());
+    BOOST_CHECK(db.EraseAddressIndex(vIndex));
+    vRead.clear();
+    BOOST_CHECK(db.ReadAddressIndex(ADDRESS_INDEX_PUBKEYHASH, hashA, vRead));
+    BOOST_CHECK_EQUAL(vRead.size(), 1U);
+
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+    CAddressUnspentKey unspentKey(ADDRESS_INDEX_SCRIPTHASH, hashB, uint256(3), 1);
+    vUnspent.push_back(std::make_pair(unspentKey, CAddressUnspentValue(7, CScript() << OP_TRUE, 15)));
+    BOOST_CHECK(db.UpdateAddressUnspentIndex(vUnspent));
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspentRead;
+    BOOST_CHECK(db.ReadAddressUnspentIndex(ADDRESS_INDEX_SCRIPTHASH, hashB, vUnspentRead));
+    BOOST_CHECK_EQUAL(vUnspentRead.size(), 1U);
+    BOOST_CHECK_EQUAL(vUnspentRead[0].second.satoshis, 7);
+
+    // A null value removes the output once spent
+    vUnspent[0].second.SetNull();
+    BOOST_CHECK(db.UpdateAddressUnspentIndex(vUnspent));
+    vUnspentRead.clear();
+    BOOST_CHECK(db.ReadAddressUnspentIndex(ADDRESS_INDEX_SCRIPTHASH, hashB, vUnspentRead));
+    BOOST_CHECK(vUnspentRead.empty());
+
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > vSpent;
+    CSpentIndexKey spentKey(uint256(1), 0);
+    vSpent.push_back(std::make_pair(spentKey, CSpentIndexValue(uint256(2), 0, 20, 50, ADDRESS_INDEX_PUBKEYHASH, hashA)));
+    BOOST_CHECK(db.UpdateSpentIndex(vSpent));
+    CSpentIndexValue spentValue;
+    BOOST_CHECK(db.ReadSpentIndex(spentKey, spentValue));
+    BOOST_CHECK(spentValue.txid == uint256(2));
+    BOOST_CHECK_EQUAL(spentValue.blockHeight, 20);
+    vSpent[0].second.SetNull();
+    BOOST_CHECK(db.UpdateSpentIndex(vSpent));
+    BOOST_CHECK(!db.ReadSpentIndex(spentKey, spentValue));
+
+    BOOST_CHECK(db.WriteTimestampIndex(CTimestampIndexKey(1000, uint256(10))));
+    BOOST_CHECK(db.WriteTimestampIndex(CTimestampIndexKey(2000, uint256(20))));
+    BOOST_CHECK(db.WriteTimestampIndex(CTimestampIndexKey(3000, uint256(30))));
+    std::vector<uint256> vHashes;
+    BOOST_CHECK(db.ReadTimestampIndex(2500, 1000, vHashes));
+    BOOST_CHECK_EQUAL(vHashes.size(), 2U);
+    BOOST_CHECK(vHashes[0] == uint256(10) && vHashes[1] == uint256(20));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,155 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2019 The Byron developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "version.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+static CBlock BuildBlockTestCase(bool fProofOfStake)
+{
+    CBlock block;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig.resize(10);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 42;
+
+    block.vtx.resize(4);
+    block.vtx[0] = tx;
+    block.nVersion = 42;
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+
+    // A coinstake spends a real output and marks itself with an empty first output
+    CMutableTransaction txStake;
+    txStake.vin.resize(1);
+    txStake.vin[0].prevout.hash = GetRandHash();
+    txStake.vin[0].prevout.n = 0;
+    txStake.vout.resize(2);
+    txStake.vout[0].SetEmpty();
+    txStake.vout[1].nValue = 43;
+
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].prevout.n = 0;
+    block.vtx[1] = fProofOfStake ? CTransaction(txStake) : CTransaction(tx);
+    tx.vin.resize(10);
+    for (size_t i = 0; i < tx.vin.size(); i++) {
+        tx.vin[i].prevout.hash = GetRandHash();
+        tx.vin[i].prevout.n = 0;
+    }
+    block.vtx[2] = tx;
+    tx.vin[0].prevout.hash = GetRandHash();
+    block.vtx[3] = tx;
+    if (fProofOfStake)
+        block.vchBlockSig.assign(70, 0x30);
+
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(SimpleRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase(false));
+
+    pool.addUnchecked(block.vtx[2].GetHash(), CTxMemPoolEntry(block.vtx[2], 0, 0, 0.0, 1));
+
+    // Do a simple ShortTxIDs RT
+    {
+        CBlockHeaderAndShortTxIDs shortIDs(block);
+
+        CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+        stream << shortIDs;
+
+        CBlockHeaderAndShortTxIDs shortIDs2;
+        stream >> shortIDs2;
+
+        PartiallyDownloadedBlock partialBlock(&pool);
+        BOOST_CHECK(partialBlock.InitData(shortIDs2) == READ_STATUS_OK);
+        BOOST_CHECK_EQUAL(partialBlock.GetPrefilledCount(), 1U);
+        BOOST_CHECK_EQUAL(partialBlock.GetMempoolCount(), 1U);
+        BOOST_CHECK(partialBlock.IsTxAvailable(0));
+        BOOST_CHECK(!partialBlock.IsTxAvailable(1));
+        BOOST_CHECK(partialBlock.IsTxAvailable(2));
+        BOOST_CHECK(!partialBlock.IsTxAvailable(3));
+
+        // Missing transactions in the wrong order fail the merkle check
+        PartiallyDownloadedBlock partialBlockCopy = partialBlock;
+        CBlock block2;
+        std::vector<CTransaction> vtx_missing;
+        vtx_missing.push_back(block.vtx[3]);
+        vtx_missing.push_back(block.vtx[1]);
+        BOOST_CHECK(partialBlockCopy.FillBlock(block2, vtx_missing) == READ_STATUS_FAILED);
+
+        // Too few is invalid
+        partialBlockCopy = partialBlock;
+        vtx_missing.resize(1);
+        BOOST_CHECK(partialBlockCopy.FillBlock(block2, vtx_missing) == READ_STATUS_INVALID);
+
+        vtx_missing[0] = block.vtx[1];
+        vtx_missing.push_back(block.vtx[3]);
+        BOOST_CHECK(partialBlock.FillBlock(block2, vtx_missing) == READ_STATUS_OK);
+        BOOST_CHECK(block.GetHash() == block2.GetHash());
+        BOOST_CHECK(block.hashMerkleRoot == block2.BuildMerkleTree());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(ProofOfStakeTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase(true));
+    BOOST_CHECK(block.IsProofOfStake());
+
+    pool.addUnchecked(block.vtx[2].GetHash(), CTxMemPoolEntry(block.vtx[2], 0, 0, 0.0, 1));
+    pool.addUnchecked(block.vtx[3].GetHash(), CTxMemPoolEntry(block.vtx[3], 0, 0, 0.0, 1));
+
+    CBlockHeaderAndShortTxIDs shortIDs(block);
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << shortIDs;
+    CBlockHeaderAndShortTxIDs shortIDs2;
+    stream >> shortIDs2;
+
+    // Coinbase and coinstake are sent in full, so the block rebuilds without a round trip
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(shortIDs2) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(partialBlock.GetPrefilledCount(), 2U);
+    BOOST_CHECK_EQUAL(partialBlock.GetMempoolCount(), 2U);
+    for (size_t i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK(partialBlock.IsTxAvailable(i));
+
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, std::vector<CTransaction>()) == READ_STATUS_OK);
+    BOOST_CHECK(block.GetHash() == block2.GetHash());
+    BOOST_CHECK(block.vchBlockSig == block2.vchBlockSig);
+    BOOST_CHECK(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION) == ::GetSerializeSize(block2, SER_NETWORK, PROTOCOL_VERSION));
+}
+
+BOOST_AUTO_TEST_CASE(TransactionsRequestSerializationTest)
+{
+    BlockTransactionsRequest req1;
+    req1.blockhash = GetRandHash();
+    req1.indexes.resize(4);
+    req1.indexes[0] = 0;
+    req1.indexes[1] = 1;
+    req1.indexes[2] = 3;
+    req1.indexes[3] = 4;
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << req1;
+
+    BlockTransactionsRequest req2;
+    stream >> req2;
+
+    BOOST_CHECK(req1.blockhash == req2.blockhash);
+    BOOST_CHECK(req1.indexes == req2.indexes);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
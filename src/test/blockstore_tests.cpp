@@ -0,0 +1,66 @@
+// Copyright (c) 2019 The Byron developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockstore.h"
+#include "chainparams.h"
+#include "main.h"
+#include "streams.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockstore_tests)
+
+BOOST_AUTO_TEST_CASE(memory_reader)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << uint32_t(42) << std::string("byron");
+
+    CMemoryReader reader(&ss[0], &ss[0] + ss.size(), SER_DISK, CLIENT_VERSION);
+    uint32_t n = 0;
+    std::string str;
+    reader >> n;
+    BOOST_CHECK_EQUAL(n, 42U);
+    BOOST_CHECK_EQUAL(reader.GetPos(), 4U);
+    reader >> str;
+    BOOST_CHECK_EQUAL(str, "byron");
+    BOOST_CHECK(reader.empty());
+    BOOST_CHECK_THROW(reader >> n, std::ios_base::failure);
+    BOOST_CHECK_THROW(reader.ignore(1), std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(genesis_block_view)
+{
+    CBlockIndex* pindex;
+    {
+        LOCK(cs_main);
+        pindex = chainActive.Genesis();
+    }
+    BOOST_REQUIRE(pindex != NULL);
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << Params().GenesisBlock();
+
+    // The view is the block as it was written to disk
+    CDiskBlockView view;
+    BOOST_REQUIRE(ReadBlockViewFromDisk(view, pindex));
+    BOOST_CHECK_EQUAL(view.size(), ss.size());
+    BOOST_CHECK(memcmp(view.begin(), &ss[0], ss.size()) == 0);
+
+    CBlock block;
+    BOOST_CHECK(ReadBlockFromDisk(block, pindex));
+    BOOST_CHECK(block.GetHash() == Params().GenesisBlock().GetHash());
+
+    // A view keeps its file mapped after the mapper lets go of it
+    CBlockFileMapper mapper(1);
+    CDiskBlockView view2;
+    BOOST_REQUIRE(mapper.GetRecord(pindex->GetBlockPos(), "blk", 0, view2));
+    mapper.Forget(pindex->GetBlockPos().nFile);
+    BOOST_CHECK(memcmp(view2.begin(), &ss[0], ss.size()) == 0);
+
+    // Records reaching past the end of the file are left to the fread path
+    BOOST_CHECK(!mapper.GetRecord(pindex->GetBlockPos(), "blk", 1 << 30, view2));
+    BOOST_CHECK(!mapper.GetRecord(CDiskBlockPos(pindex->GetBlockPos().nFile + 1000, 8), "blk", 0, view2));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
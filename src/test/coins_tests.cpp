@@ -3,8 +3,14 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "coins.h"
+#include "clientversion.h"
 #include "random.h"
+#include "script/script.h"
+#include "streams.h"
+#include "txoutsnapshot.h"
 #include "uint256.h"
+#include "undo.h"
+#include "version.h"
 
 #include <vector>
 #include <map>
@@ -16,40 +22,37 @@ namespace
 class CCoinsViewTest : public CCoinsView
 {
     uint256 hashBestBlock_;
-    std::map<uint256, CCoins> map_;
+    std::map<COutPoint, Coin> map_;
 
 public:
-    bool GetCoins(const uint256& txid, CCoins& coins) const
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const
     {
-        std::map<uint256, CCoins>::const_iterator it = map_.find(txid);
+        std::map<COutPoint, Coin>::const_iterator it = map_.find(outpoint);
         if (it == map_.end()) {
             return false;
         }
-        coins = it->second;
-        if (coins.IsPruned() && insecure_rand() % 2 == 0) {
+        coin = it->second;
+        if (coin.IsSpent() && insecure_rand() % 2 == 0) {
             // Randomly return false in case of an empty entry.
             return false;
         }
         return true;
     }
 
-    bool HaveCoins(const uint256& txid) const
-    {
-        CCoins coins;
-        return GetCoins(txid, coins);
-    }
-
     uint256 GetBestBlock() const { return hashBestBlock_; }
 
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
     {
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
-            map_[it->first] = it->second.coins;
-            if (it->second.coins.IsPruned() && insecure_rand() % 3 == 0) {
-                // Randomly delete empty entries on write.
-                map_.erase(it->first);
+            if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+                // Same optimization used in CCoinsViewDB is to only write dirty entries.
+                map_[it->first] = it->second.coin;
+                if (it->second.coin.IsSpent() && insecure_rand() % 3 == 0) {
+                    // Randomly delete empty entries on write.
+                    map_.erase(it->first);
+                }
             }
-            mapCoins.erase(it++);
+            it = mapCoins.erase(it);
         }
         mapCoins.clear();
         hashBestBlock_ = hashBlock;
@@ -58,6 +61,28 @@ public:
 
     bool GetStats(CCoinsStats& stats) const { return false; }
 };
+
+class CCoinsViewCursorTest : public CCoinsViewCursor
+{
+    const std::vector<std::pair<COutPoint, Coin> >& vCoins;
+    size_t nPos;
+
+public:
+    CCoinsViewCursorTest(const std::vector<std::pair<COutPoint, Coin> >& vCoinsIn, const uint256& hashBlockIn) : CCoinsViewCursor(hashBlockIn), vCoins(vCoinsIn), nPos(0) {}
+
+    bool GetKey(COutPoint& key) const { key = vCoins[nPos].first; return true; }
+    bool GetValue(Coin& coin) const { coin = vCoins[nPos].second; return true; }
+    unsigned int GetSize() const { return 0; }
+    bool Valid() const { return nPos < vCoins.size(); }
+    void Next() { nPos++; }
+};
+
+// Coins sorted the way the coins database keys them
+bool CompareOutPointKeys(const std::pair<COutPoint, Coin>& a, const std::pair<COutPoint, Coin>& b)
+{
+    int nCmp = memcmp(a.first.hash.begin(), b.first.hash.begin(), a.first.hash.size());
+    return nCmp < 0 || (nCmp == 0 && a.first.n < b.first.n);
+}
 }
 
 BOOST_AUTO_TEST_SUITE(coins_tests)
@@ -67,8 +92,8 @@ static const unsigned int NUM_SIMULATION_ITERATIONS = 40000;
 // This is a large randomized insert/remove simulation test on a variable-size
 // stack of caches on top of CCoinsViewTest.
 //
-// It will randomly create/update/delete CCoins entries to a tip of caches, with
-// txids picked from a limited list of random 256-bit hashes. Occasionally, a
+// It will randomly create/update/delete Coin entries to a tip of caches, with
+// outpoints picked from a limited list of random 256-bit hashes. Occasionally, a
 // new tip is added to the stack of caches, or the tip is flushed and removed.
 //
 // During the process, booleans are kept to make sure that the randomized
@@ -85,7 +110,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool missed_an_entry = false;
 
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
@@ -102,37 +127,41 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     for (unsigned int i = 0; i < NUM_SIMULATION_ITERATIONS; i++) {
         // Do a random modification.
         {
-            uint256 txid = txids[insecure_rand() % txids.size()]; // txid we're going to modify in this iteration.
-            CCoins& coins = result[txid];
-            CCoinsModifier entry = stack.back()->ModifyCoins(txid);
-            BOOST_CHECK(coins == *entry);
-            if (insecure_rand() % 5 == 0 || coins.IsPruned()) {
-                if (coins.IsPruned()) {
-                    added_an_entry = true;
-                } else {
+            COutPoint outpoint(txids[insecure_rand() % txids.size()], insecure_rand() % 2); // outpoint we're going to modify in this iteration.
+            Coin& coin = result[outpoint];
+            const Coin& entry = stack.back()->AccessCoin(outpoint);
+            BOOST_CHECK(coin == entry);
+            if (insecure_rand() % 5 == 0 || coin.IsSpent()) {
+                bool fOverwrite = !coin.IsSpent();
+                if (fOverwrite) {
                     updated_an_entry = true;
+                } else {
+                    added_an_entry = true;
                 }
-                coins.nVersion = insecure_rand();
-                coins.vout.resize(1);
-                coins.vout[0].nValue = insecure_rand();
-                *entry = coins;
+                Coin newcoin;
+                newcoin.out.nValue = insecure_rand();
+                newcoin.nHeight = 1;
+                coin = newcoin;
+                stack.back()->AddCoin(outpoint, std::move(newcoin), fOverwrite || insecure_rand() % 2);
             } else {
-                coins.Clear();
-                entry->Clear();
+                coin.Clear();
+                stack.back()->SpendCoin(outpoint);
                 removed_an_entry = true;
             }
         }
 
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                    found_an_entry = true;
-                } else {
-                    BOOST_CHECK(it->second.IsPruned());
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                bool have = stack.back()->HaveCoin(it->first);
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(have == !coin.IsSpent());
+                BOOST_CHECK(coin == it->second);
+                if (coin.IsSpent()) {
                     missed_an_entry = true;
+                } else {
+                    BOOST_CHECK(stack.back()->HaveCoinInCache(it->first));
+                    found_an_entry = true;
                 }
             }
         }
@@ -175,4 +204,230 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(missed_an_entry);
 }
 
+// Prefetched entries must be served at most once, and never after the
+// backing view has been written to.
+BOOST_AUTO_TEST_CASE(coins_prefetch_test)
+{
+    CCoinsViewTest base;
+    CCoinsViewPrefetch prefetch(&base, 2);
+    COutPoint out1(GetRandHash(), 0);
+    COutPoint out2(GetRandHash(), 1);
+    COutPoint out3(GetRandHash(), 0);
+
+    {
+        CCoinsViewCache cache(&base);
+        const COutPoint outpoints[] = {out1, out2, out3};
+        for (unsigned int i = 0; i < 3; i++) {
+            CTxOut txout;
+            txout.nValue = 1;
+            cache.AddCoin(outpoints[i], Coin(txout, 1, false, false), false);
+        }
+        BOOST_CHECK(cache.Flush());
+    }
+
+    BOOST_CHECK(!prefetch.Prefetch(COutPoint(GetRandHash(), 0)));
+    BOOST_CHECK(prefetch.Prefetch(out1));
+    BOOST_CHECK(!prefetch.Prefetch(out1));
+    BOOST_CHECK(prefetch.Prefetch(out2));
+    // The buffer is full.
+    BOOST_CHECK(!prefetch.Prefetch(out3));
+
+    size_t nEntries;
+    uint64_t nHits, nMisses;
+    Coin coin;
+    BOOST_CHECK(prefetch.GetCoin(out1, coin));
+    BOOST_CHECK_EQUAL(coin.out.nValue, 1);
+    prefetch.GetPrefetchStats(nEntries, nHits, nMisses);
+    BOOST_CHECK_EQUAL(nEntries, 1U);
+    BOOST_CHECK_EQUAL(nHits, 1U);
+    BOOST_CHECK(prefetch.GetCoin(out1, coin));
+    prefetch.GetPrefetchStats(nEntries, nHits, nMisses);
+    BOOST_CHECK_EQUAL(nMisses, 1U);
+
+    // Spend out2 through the prefetch view; the buffered copy must go away.
+    {
+        CCoinsViewCache cache(&prefetch);
+        BOOST_CHECK(cache.SpendCoin(out2));
+        BOOST_CHECK(cache.Flush());
+    }
+    prefetch.GetPrefetchStats(nEntries, nHits, nMisses);
+    BOOST_CHECK_EQUAL(nEntries, 0U);
+    BOOST_CHECK(!prefetch.Prefetch(out2));
+}
+
+// Flushes handed to the write-behind view must be visible to readers right
+// away, and reach the base view once Sync() returns.
+BOOST_AUTO_TEST_CASE(coins_write_behind_test)
+{
+    CCoinsViewTest base;
+    CCoinsViewWriteBehind writer(&base);
+    COutPoint out1(GetRandHash(), 0);
+    COutPoint out2(GetRandHash(), 1);
+    uint256 hashBlock1 = GetRandHash();
+    uint256 hashBlock2 = GetRandHash();
+
+    {
+        CCoinsViewCache cache(&writer);
+        CTxOut txout;
+        txout.nValue = 5;
+        cache.AddCoin(out1, Coin(txout, 1, false, false), false);
+        cache.AddCoin(out2, Coin(txout, 1, false, false), false);
+        cache.SetBestBlock(hashBlock1);
+        BOOST_CHECK(cache.Flush());
+    }
+
+    Coin coin;
+    BOOST_CHECK(writer.GetCoin(out1, coin));
+    BOOST_CHECK_EQUAL(coin.out.nValue, 5);
+    BOOST_CHECK(writer.GetBestBlock() == hashBlock1);
+
+    {
+        CCoinsViewCache cache(&writer);
+        BOOST_CHECK(cache.SpendCoin(out1));
+        cache.SetBestBlock(hashBlock2);
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(!writer.GetCoin(out1, coin));
+    BOOST_CHECK(writer.HaveCoin(out2));
+    BOOST_CHECK(writer.GetBestBlock() == hashBlock2);
+
+    BOOST_CHECK(writer.Sync());
+    size_t nPending, nLastEntries;
+    int64_t nLastMicros;
+    writer.GetWriteStats(nPending, nLastEntries, nLastMicros);
+    BOOST_CHECK_EQUAL(nPending, 0U);
+    BOOST_CHECK(!base.GetCoin(out1, coin) || coin.IsSpent());
+    BOOST_CHECK(base.GetCoin(out2, coin));
+    BOOST_CHECK_EQUAL(coin.out.nValue, 5);
+    BOOST_CHECK(base.GetBestBlock() == hashBlock2);
+}
+
+// Spending one output of a transaction must leave its siblings alone, and a
+// flush must hand the pooled memory back.
+BOOST_AUTO_TEST_CASE(coins_per_output_test)
+{
+    CCoinsViewTest base;
+    CCoinsViewCache cache(&base);
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(500);
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        tx.vout[i].nValue = i + 1;
+        tx.vout[i].scriptPubKey = CScript() << OP_TRUE;
+    }
+    // Provably unspendable outputs never enter the view.
+    tx.vout[499].scriptPubKey = CScript() << OP_RETURN;
+    CTransaction txFinal(tx);
+    AddCoins(cache, txFinal, 100);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 499U);
+    BOOST_CHECK(cache.DynamicMemoryUsage() > 0);
+    BOOST_CHECK(!cache.HaveCoin(COutPoint(txFinal.GetHash(), 499)));
+
+    Coin spent;
+    BOOST_CHECK(cache.SpendCoin(COutPoint(txFinal.GetHash(), 7), &spent));
+    BOOST_CHECK_EQUAL(spent.out.nValue, 8);
+    BOOST_CHECK_EQUAL(spent.nHeight, 100U);
+    BOOST_CHECK(!cache.SpendCoin(COutPoint(txFinal.GetHash(), 7)));
+    BOOST_CHECK(cache.HaveCoin(COutPoint(txFinal.GetHash(), 8)));
+    BOOST_CHECK_EQUAL(AccessByTxid(cache, txFinal.GetHash()).out.nValue, 1);
+
+    // Only the bucket array of an empty map is left, as in a cache that never held anything.
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0U);
+    CCoinsViewCache cacheEmpty(&base);
+    BOOST_CHECK_EQUAL(cache.DynamicMemoryUsage(), cacheEmpty.DynamicMemoryUsage());
+    const Coin& coin = cache.AccessCoin(COutPoint(txFinal.GetHash(), 8));
+    BOOST_CHECK_EQUAL(coin.out.nValue, 9);
+    BOOST_CHECK(cache.AccessCoin(COutPoint(txFinal.GetHash(), 7)).IsSpent());
+}
+
+// The undo record layout must stay readable by and from the old CTxInUndo format.
+BOOST_AUTO_TEST_CASE(coins_undo_serialization_test)
+{
+    CTxOut txout;
+    txout.nValue = 5000;
+    txout.scriptPubKey = CScript() << OP_TRUE;
+
+    CTxUndo txundo;
+    txundo.vprevout.push_back(Coin(txout, 1234, false, true));
+    txundo.vprevout.push_back(Coin(txout, 0, false, false));
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << txundo;
+    BOOST_CHECK_EQUAL(ss.size(), txundo.GetSerializeSize(SER_DISK, CLIENT_VERSION));
+
+    CTxUndo txundo2;
+    ss >> txundo2;
+    BOOST_CHECK(txundo2.vprevout.size() == 2);
+    BOOST_CHECK(txundo2.vprevout[0] == txundo.vprevout[0]);
+    BOOST_CHECK(txundo2.vprevout[0].IsCoinStake());
+    BOOST_CHECK_EQUAL(txundo2.vprevout[1].nHeight, 0U);
+    BOOST_CHECK(txundo2.vprevout[1].out == txout);
+}
+
+// A snapshot reads back the coins it was written from, hashing them the same way
+BOOST_AUTO_TEST_CASE(coins_snapshot_test)
+{
+    std::vector<std::pair<COutPoint, Coin> > vCoins;
+    for (int i = 0; i < 5; i++) {
+        uint256 hash = GetRandHash();
+        for (unsigned int n = 0; n < 4; n++) {
+            if (n > 0 && insecure_rand() % 2)
+                continue;
+            CTxOut txout;
+            txout.nValue = insecure_rand() % 1000000;
+            txout.scriptPubKey = CScript() << OP_TRUE;
+            vCoins.push_back(std::make_pair(COutPoint(hash, n), Coin(txout, 100 - i, i == 0, i == 1)));
+        }
+    }
+    std::sort(vCoins.begin(), vCoins.end(), CompareOutPointKeys);
+
+    CTxOutSnapshotMetadata metadata;
+    metadata.hashBlock = GetRandHash();
+    metadata.nHeight = 100;
+    metadata.vTxCount.assign(101, 1);
+
+    CAutoFile file(tmpfile(), SER_DISK, CLIENT_VERSION);
+    CCoinsViewCursorTest cursor(vCoins, metadata.hashBlock);
+    CCoinsStats stats;
+    BOOST_CHECK(WriteTxOutSnapshot(file, metadata, cursor, stats));
+    BOOST_CHECK_EQUAL(stats.nTransactions, 5U);
+    BOOST_CHECK_EQUAL(stats.nTransactionOutputs, vCoins.size());
+
+    rewind(file.Get());
+    CTxOutSnapshotReader reader(file);
+    BOOST_CHECK(reader.metadata.hashBlock == metadata.hashBlock);
+    BOOST_CHECK(reader.metadata.vTxCount == metadata.vTxCount);
+    COutPoint outpoint;
+    Coin coin;
+    size_t nRead = 0;
+    while (reader.Next(outpoint, coin)) {
+        BOOST_CHECK(outpoint == vCoins[nRead].first);
+        BOOST_CHECK(coin == vCoins[nRead].second);
+        nRead++;
+    }
+    BOOST_CHECK_EQUAL(nRead, vCoins.size());
+    CCoinsStats statsRead;
+    std::string strError;
+    BOOST_CHECK(reader.Finish(statsRead, strError));
+    BOOST_CHECK(statsRead.hashSerialized == stats.hashSerialized);
+    BOOST_CHECK_EQUAL(statsRead.nTotalAmount, stats.nTotalAmount);
+    BOOST_CHECK(reader.metadata.GetSnapshotHash(statsRead.hashSerialized) == metadata.GetSnapshotHash(stats.hashSerialized));
+
+    // The metadata is committed to as well as the coins
+    CTxOutSnapshotMetadata metadataForged = metadata;
+    metadataForged.nMoneySupply += COIN;
+    BOOST_CHECK(metadataForged.GetSnapshotHash(stats.hashSerialized) != metadata.GetSnapshotHash(stats.hashSerialized));
+
+    // The same outputs in another order would let a coin appear twice
+    std::swap(vCoins.front(), vCoins.back());
+    CAutoFile fileUnsorted(tmpfile(), SER_DISK, CLIENT_VERSION);
+    CCoinsViewCursorTest cursorUnsorted(vCoins, metadata.hashBlock);
+    BOOST_CHECK(WriteTxOutSnapshot(fileUnsorted, metadata, cursorUnsorted, stats));
+    rewind(fileUnsorted.Get());
+    CTxOutSnapshotReader readerUnsorted(fileUnsorted);
+    BOOST_CHECK_THROW(while (readerUnsorted.Next(outpoint, coin)) {}, std::ios_base::failure);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
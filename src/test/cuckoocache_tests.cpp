@@ -0,0 +1,138 @@
+// Copyright (c) 2016 Jeremy Rubin
+// Copyright (c) 2026 The Byron developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "cuckoocache.h"
+#include "key.h"
+#include "keystore.h"
+#include "primitives/transaction.h"
+#include "random.h"
+#include "script/sigcache.h"
+#include "script/sign.h"
+#include "script/standard.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+/** Hash picking 32 bits of a uint256 for each of the eight slots */
+struct UintHasher {
+    template <uint8_t hash_select>
+    uint32_t operator()(const uint256& key) const
+    {
+        uint32_t u;
+        std::memcpy(&u, key.begin() + 4 * hash_select, 4);
+        return u;
+    }
+};
+
+typedef CuckooCache::cache<uint256, UintHasher> cache_type;
+
+/** Fraction of vInserted still found in the cache */
+double HitRate(cache_type& cc, const std::vector<uint256>& vInserted)
+{
+    size_t nHits = 0;
+    for (const uint256& h : vInserted)
+        if (cc.contains(h, false))
+            ++nHits;
+    return (double)nHits / vInserted.size();
+}
+}
+
+BOOST_AUTO_TEST_SUITE(cuckoocache_tests)
+
+BOOST_AUTO_TEST_CASE(cuckoocache_insert_contains_erase)
+{
+    cache_type cc;
+    cc.setup(1 << 12);
+
+    std::vector<uint256> vHashes;
+    for (int i = 0; i < 1000; i++) {
+        vHashes.push_back(GetRandHash());
+        cc.insert(vHashes.back());
+    }
+    BOOST_CHECK_EQUAL(HitRate(cc, vHashes), 1.0);
+    BOOST_CHECK(!cc.contains(GetRandHash(), false));
+
+    // Erasing only marks the slot as reusable, the entry stays visible until overwritten
+    BOOST_CHECK(cc.contains(vHashes[0], true));
+    cc.insert(vHashes[0]);
+    BOOST_CHECK(cc.contains(vHashes[0], false));
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_hit_rate_ok)
+{
+    // A table filled to half its capacity should keep nearly everything
+    cache_type cc;
+    uint32_t nSize = cc.setup_bytes(1 << 20);
+    std::vector<uint256> vHashes;
+    for (uint32_t i = 0; i < nSize / 2; i++) {
+        vHashes.push_back(GetRandHash());
+        cc.insert(vHashes.back());
+    }
+    BOOST_CHECK(HitRate(cc, vHashes) >= 0.98);
+
+    // Overfilling evicts old entries but keeps the most recent ones
+    std::vector<uint256> vRecent;
+    for (uint32_t i = 0; i < nSize * 2; i++) {
+        uint256 h = GetRandHash();
+        cc.insert(h);
+        if (i >= nSize * 2 - nSize / 4)
+            vRecent.push_back(h);
+    }
+    BOOST_CHECK(HitRate(cc, vRecent) >= 0.95);
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_warm_block_validation)
+{
+    CBasicKeyStore keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+    CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+
+    // A batch of signed transactions standing in for a block's worth of inputs
+    std::vector<CTransaction> vTx;
+    for (int i = 0; i < 200; i++) {
+        CMutableTransaction txFrom;
+        txFrom.vout.resize(1);
+        txFrom.vout[0].scriptPubKey = scriptPubKey;
+        txFrom.vout[0].nValue = i + 1;
+
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(CTransaction(txFrom).GetHash(), 0);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = i;
+        BOOST_CHECK(SignSignature(keystore, scriptPubKey, tx, 0));
+        vTx.push_back(tx);
+    }
+
+    uint64_t nHitsStart, nMissesStart, nHits, nMisses;
+    GetSignatureCacheStats(nHitsStart, nMissesStart);
+
+    // Mempool acceptance fills the cache
+    for (const CTransaction& tx : vTx)
+        BOOST_CHECK(VerifyScript(tx.vin[0].scriptSig, scriptPubKey, SCRIPT_VERIFY_P2SH, CachingTransactionSignatureChecker(&tx, 0, true)));
+    GetSignatureCacheStats(nHits, nMisses);
+    BOOST_CHECK_EQUAL(nMisses - nMissesStart, vTx.size());
+
+    int64_t nTimeCold = GetTimeMicros();
+    for (const CTransaction& tx : vTx)
+        BOOST_CHECK(VerifyScript(tx.vin[0].scriptSig, scriptPubKey, SCRIPT_VERIFY_P2SH, TransactionSignatureChecker(&tx, 0)));
+    nTimeCold = GetTimeMicros() - nTimeCold;
+
+    // Block validation is answered from the warm cache
+    int64_t nTimeWarm = GetTimeMicros();
+    for (const CTransaction& tx : vTx)
+        BOOST_CHECK(VerifyScript(tx.vin[0].scriptSig, scriptPubKey, SCRIPT_VERIFY_P2SH, CachingTransactionSignatureChecker(&tx, 0, false)));
+    nTimeWarm = GetTimeMicros() - nTimeWarm;
+    GetSignatureCacheStats(nHits, nMisses);
+    BOOST_CHECK_EQUAL(nHits - nHitsStart, vTx.size());
+    BOOST_TEST_MESSAGE(strprintf("sigcache: %u inputs verified in %dus uncached, %dus from a warm cache", vTx.size(), nTimeCold, nTimeWarm));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,6 +3,9 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "hash.h"
+#include "chainparams.h"
+#include "primitives/block.h"
+#include "random.h"
 #include "utilstrencodings.h"
 
 #include <vector>
@@ -46,4 +49,54 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    // Reference vectors from the SipHash paper, key 00 01 .. 0f
+    CSipHasher hasher(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x726fdb47dd0e0e31ull);
+    static const unsigned char t0[1] = {0};
+    hasher.Write(t0, 1);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x74f839c593dc67fdull);
+    static const unsigned char t1[7] = {1, 2, 3, 4, 5, 6, 7};
+    hasher.Write(t1, 7);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x93f5f5799a932462ull);
+    BOOST_CHECK_EQUAL(CSipHasher(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL).Write(0x0706050403020100ULL).Finalize(), 0x93f5f5799a932462ull);
+
+    // The uint256 shortcut agrees with hashing the same 32 bytes
+    for (int i = 0; i < 16; i++) {
+        uint64_t k0 = GetRand(std::numeric_limits<uint64_t>::max());
+        uint64_t k1 = GetRand(std::numeric_limits<uint64_t>::max());
+        uint256 x = GetRandHash();
+        CSipHasher sip(k0, k1);
+        sip.Write(x.begin(), 32);
+        BOOST_CHECK_EQUAL(SipHashUint256(k0, k1, x), sip.Finalize());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(header_hash_batch)
+{
+    // The mainnet genesis block is a Quark hashed header.
+    std::vector<CBlockHeader> vHeaders(1, Params(CBaseChainParams::MAIN).GenesisBlock().GetBlockHeader());
+    std::vector<uint256> vHashes;
+    GetBlockHeaderHashes(vHeaders, vHashes);
+    BOOST_CHECK_EQUAL(vHashes.size(), 1U);
+    BOOST_CHECK(vHashes[0] == uint256("0x00000b710c7c656f9a126394c67a7c50e8b570fc993c61de7fbaaf1ef850c2ba"));
+
+    // Large enough to be split over threads, mixing Quark and SHA256 headers.
+    vHeaders.resize(1000);
+    for (unsigned int i = 0; i < vHeaders.size(); i++) {
+        vHeaders[i].nVersion = i % 3 == 0 ? 5 : 1;
+        vHeaders[i].hashPrevBlock = GetRandHash();
+        vHeaders[i].nNonce = i;
+    }
+    GetBlockHeaderHashes(vHeaders, vHashes);
+    BOOST_CHECK_EQUAL(vHashes.size(), vHeaders.size());
+    for (unsigned int i = 0; i < vHeaders.size(); i++)
+        BOOST_CHECK(vHashes[i] == vHeaders[i].GetHash());
+
+    vHeaders.clear();
+    GetBlockHeaderHashes(vHeaders, vHashes);
+    BOOST_CHECK(vHashes.empty());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
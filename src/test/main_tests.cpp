@@ -5,7 +5,10 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "primitives/transaction.h"
+#include "clientversion.h"
 #include "main.h"
+#include "random.h"
+#include "streams.h"
 
 #include <boost/test/unit_test.hpp>
 
@@ -29,4 +32,67 @@ BOOST_AUTO_TEST_CASE(subsidy_limit_test)
     BOOST_CHECK(nSum == 1200000000000000ULL);
 }
 
+BOOST_AUTO_TEST_CASE(blockindex_stats_serialization)
+{
+    CBlockIndex index;
+    index.nHeight = 1000;
+    index.nStatus = BLOCK_VALID_SCRIPTS | BLOCK_HAVE_DATA;
+    index.nMoneySupply = 5000 * COIN;
+    index.stats.nValueIn = 120 * COIN;
+    index.stats.nValueOut = 119 * COIN;
+    index.stats.nFees = COIN;
+    index.stats.nFeeTxs = 3;
+    index.stats.nFeeTxBytes = 678;
+
+    // Entries written without the flag keep the old layout and load without totals
+    CDataStream ssOld(SER_DISK, CLIENT_VERSION);
+    ssOld << CDiskBlockIndex(&index);
+    CDiskBlockIndex diskOld;
+    ssOld >> diskOld;
+    BOOST_CHECK(ssOld.empty());
+    BOOST_CHECK_EQUAL(diskOld.nMoneySupply, index.nMoneySupply);
+    BOOST_CHECK_EQUAL(diskOld.stats.nFeeTxs, 0U);
+
+    index.nStatus |= BLOCK_HAVE_STATS;
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << CDiskBlockIndex(&index);
+    BOOST_CHECK(ss.size() > ssOld.size());
+    CDiskBlockIndex disk;
+    ss >> disk;
+    BOOST_CHECK(ss.empty());
+    BOOST_CHECK_EQUAL(disk.stats.nValueIn, index.stats.nValueIn);
+    BOOST_CHECK_EQUAL(disk.stats.nValueOut, index.stats.nValueOut);
+    BOOST_CHECK_EQUAL(disk.stats.nFees, index.stats.nFees);
+    BOOST_CHECK_EQUAL(disk.stats.nFeeTxs, index.stats.nFeeTxs);
+    BOOST_CHECK_EQUAL(disk.stats.nFeeTxBytes, index.stats.nFeeTxBytes);
+}
+
+BOOST_AUTO_TEST_CASE(blockindex_stake_checksum_serialization)
+{
+    CBlockIndex index;
+    index.nHeight = 1000;
+    index.nStatus = BLOCK_VALID_SCRIPTS | BLOCK_HAVE_DATA;
+    index.SetProofOfStake();
+    index.hashProofOfStake = GetRandHash();
+    index.nStakeModifierChecksum = 0x12345678;
+
+    // A provisional checksum, or a proof-of-stake hash from before a restart, isn't stored
+    CDataStream ssOld(SER_DISK, CLIENT_VERSION);
+    ssOld << CDiskBlockIndex(&index);
+    CDiskBlockIndex diskOld;
+    ssOld >> diskOld;
+    BOOST_CHECK(ssOld.empty());
+    BOOST_CHECK(diskOld.hashProofOfStake == 0);
+    BOOST_CHECK_EQUAL(diskOld.nStakeModifierChecksum, 0U);
+
+    index.nStatus |= BLOCK_HAVE_STAKE_HASH | BLOCK_HAVE_STAKE_CHECKSUM;
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << CDiskBlockIndex(&index);
+    CDiskBlockIndex disk;
+    ss >> disk;
+    BOOST_CHECK(ss.empty());
+    BOOST_CHECK(disk.hashProofOfStake == index.hashProofOfStake);
+    BOOST_CHECK_EQUAL(disk.nStakeModifierChecksum, index.nStakeModifierChecksum);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,337 @@
+// Copyright (c) 2019 The Byron developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "masternode-payments.h"
+#include "masternode.h"
+#include "masternodedb.h"
+#include "masternodeman.h"
+#include "random.h"
+#include "streams.h"
+#include "utiltime.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(masternode_tests)
+
+static CPubKey RandomPubKey()
+{
+    std::vector<unsigned char> vch(33);
+    vch[0] = 0x02;
+    GetRandBytes(&vch[1], 32);
+    return CPubKey(vch);
+}
+
+/** An enabled masternode with an old enough collateral and sigTime to be eligible for payment */
+static CMasternode SyntheticMasternode(int64_t nNow)
+{
+    CMasternode mn;
+    mn.vin = CTxIn(GetRandHash(), 0);
+    mn.pubKeyCollateralAddress = RandomPubKey();
+    mn.pubKeyMasternode = RandomPubKey();
+    mn.sigTime = nNow - 60 * 24 * 60 * 60;
+    mn.lastPing.vin = mn.vin;
+    mn.lastPing.sigTime = nNow;
+    mn.unitTest = true;
+    mn.cacheInputAge = 1000000;
+    mn.cacheInputAgeBlock = 0;
+    return mn;
+}
+
+BOOST_AUTO_TEST_CASE(masternode_registry_indexes)
+{
+    int64_t nNow = GetAdjustedTime();
+    CMasternodeMan man;
+    std::vector<CMasternode> vmn;
+    for (int i = 0; i < 3; i++) {
+        vmn.push_back(SyntheticMasternode(nNow));
+        BOOST_CHECK(man.Add(vmn.back()));
+    }
+    BOOST_CHECK(!man.Add(vmn[0]));
+    BOOST_CHECK_EQUAL(man.size(), 3);
+
+    for (int i = 0; i < 3; i++) {
+        CScript payee = GetScriptForDestination(vmn[i].pubKeyCollateralAddress.GetID());
+        BOOST_CHECK(man.Find(vmn[i].vin) == man.Find(payee));
+        BOOST_CHECK(man.Find(vmn[i].vin) == man.Find(vmn[i].pubKeyMasternode));
+        BOOST_CHECK(man.Find(vmn[i].vin)->vin == vmn[i].vin);
+    }
+
+    // A new masternode key is found once the entry is reindexed
+    CMasternode* pmn = man.Find(vmn[1].vin);
+    CPubKey pubKeyOld = pmn->pubKeyMasternode;
+    pmn->pubKeyMasternode = RandomPubKey();
+    man.Reindex(*pmn);
+    BOOST_CHECK(man.Find(pubKeyOld) == NULL);
+    BOOST_CHECK(man.Find(pmn->pubKeyMasternode) == pmn);
+
+    // Indexes are rebuilt when the list is read back
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << man;
+    CMasternodeMan man2;
+    ss >> man2;
+    BOOST_CHECK_EQUAL(man2.size(), 3);
+    BOOST_CHECK(man2.Find(pmn->pubKeyMasternode) != NULL);
+    BOOST_CHECK(man2.Find(pmn->pubKeyMasternode)->vin == vmn[1].vin);
+
+    man.Remove(vmn[0].vin);
+    BOOST_CHECK_EQUAL(man.size(), 2);
+    BOOST_CHECK(man.Find(vmn[0].vin) == NULL);
+    BOOST_CHECK(man.Find(vmn[0].pubKeyMasternode) == NULL);
+    BOOST_CHECK(man.Find(GetScriptForDestination(vmn[0].pubKeyCollateralAddress.GetID())) == NULL);
+    BOOST_CHECK(man.Find(vmn[2].vin) != NULL);
+}
+
+BOOST_AUTO_TEST_CASE(masternode_last_paid_index)
+{
+    CScript payeeA = GetScriptForDestination(RandomPubKey().GetID());
+    CScript payeeB = GetScriptForDestination(RandomPubKey().GetID());
+
+    // Payments only count with two votes or more
+    CMasternodePayments payments;
+    int nHeights[] = {5, 8, 12, 15};
+    int nVotesA[] = {2, 1, 3, 0};
+    for (int i = 0; i < 4; i++) {
+        CMasternodeBlockPayees blockPayees(nHeights[i]);
+        if (nVotesA[i] > 0)
+            blockPayees.AddPayee(payeeA, nVotesA[i]);
+        blockPayees.AddPayee(payeeB, 1);
+        payments.mapMasternodeBlocks[nHeights[i]] = blockPayees;
+    }
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << payments;
+    CMasternodePayments payments2;
+    ss >> payments2;
+
+    BOOST_CHECK_EQUAL(payments2.GetLastPaidHeight(payeeA, 10, 100), 5);
+    BOOST_CHECK_EQUAL(payments2.GetLastPaidHeight(payeeA, 12, 100), 12);
+    BOOST_CHECK_EQUAL(payments2.GetLastPaidHeight(payeeA, 20, 100), 12);
+    BOOST_CHECK_EQUAL(payments2.GetLastPaidHeight(payeeA, 11, 7), 5);
+    BOOST_CHECK_EQUAL(payments2.GetLastPaidHeight(payeeA, 11, 6), 0);
+    BOOST_CHECK_EQUAL(payments2.GetLastPaidHeight(payeeA, 4, 100), 0);
+    BOOST_CHECK_EQUAL(payments2.GetLastPaidHeight(payeeB, 20, 100), 0);
+}
+
+struct CompareExpectedRank {
+    bool operator()(const std::pair<int64_t, CTxIn>& t1, const std::pair<int64_t, CTxIn>& t2) const
+    {
+        if (t1.first != t2.first)
+            return t1.first > t2.first;
+        return t1.second.prevout < t2.second.prevout;
+    }
+};
+
+/** Check the cached ranks against scores computed from scratch */
+static void CheckRanks(CMasternodeMan& man, const std::vector<CTxIn>& vvin, int nBlockHeight)
+{
+    uint256 hash;
+    BOOST_REQUIRE(GetBlockHash(hash, nBlockHeight));
+
+    std::vector<std::pair<int64_t, CTxIn> > vScores;
+    BOOST_FOREACH (const CTxIn& vin, vvin)
+        vScores.push_back(std::make_pair(man.Find(vin)->CalculateScore(1, nBlockHeight).GetCompact(false), vin));
+    std::sort(vScores.begin(), vScores.end(), CompareExpectedRank());
+
+    for (unsigned int i = 0; i < vScores.size(); i++) {
+        BOOST_CHECK_EQUAL(man.GetMasternodeRank(vScores[i].second, nBlockHeight), (int)i + 1);
+        BOOST_CHECK(man.GetMasternodeByRank(i + 1, nBlockHeight)->vin == vScores[i].second);
+    }
+    BOOST_CHECK(man.GetCurrentMasterNode(1, nBlockHeight)->vin == vScores[0].second);
+    BOOST_CHECK(man.GetMasternodeByRank(vScores.size() + 1, nBlockHeight) == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(masternode_rank_cache)
+{
+    // A made-up chain to score against, linked like a real one so ancestors can be found
+    std::vector<uint256> vHashes(10);
+    std::vector<CBlockIndex> vBlocks(10);
+    for (int i = 0; i < 10; i++) {
+        vHashes[i] = GetRandHash();
+        vBlocks[i].nHeight = i;
+        vBlocks[i].phashBlock = &vHashes[i];
+        vBlocks[i].pprev = i > 0 ? &vBlocks[i - 1] : NULL;
+        vBlocks[i].BuildSkip();
+    }
+    CBlockIndex* pindexOldTip = chainActive.Tip();
+    chainActive.SetTip(&vBlocks.back());
+
+    int64_t nNow = GetAdjustedTime();
+    CMasternodeMan man;
+    std::vector<CTxIn> vvin;
+    for (int i = 0; i < 1000; i++) {
+        CMasternode mn = SyntheticMasternode(nNow);
+        vvin.push_back(mn.vin);
+        man.Add(mn);
+    }
+
+    int64_t nTimeCold = GetTimeMicros();
+    man.GetMasternodeRank(vvin[0], 5);
+    nTimeCold = GetTimeMicros() - nTimeCold;
+    int64_t nTimeWarm = GetTimeMicros();
+    for (int i = 0; i < 100; i++)
+        man.GetMasternodeRank(vvin[i], 5);
+    nTimeWarm = GetTimeMicros() - nTimeWarm;
+    BOOST_TEST_MESSAGE(strprintf("masternodes: 1000, first rank in %dus, 100 cached ranks in %dus", nTimeCold, nTimeWarm));
+
+    CheckRanks(man, vvin, 5);
+    CheckRanks(man, vvin, 6);
+
+    // Scores already cached follow masternodes being added and removed
+    CMasternode mn = SyntheticMasternode(nNow);
+    vvin.push_back(mn.vin);
+    man.Add(mn);
+    man.Remove(vvin[3]);
+    vvin.erase(vvin.begin() + 3);
+    CheckRanks(man, vvin, 5);
+    CheckRanks(man, vvin, 6);
+
+    // A different block at the same height gets its own scores
+    vHashes[4] = GetRandHash();
+    CheckRanks(man, vvin, 5);
+
+    chainActive.SetTip(pindexOldTip);
+}
+
+BOOST_AUTO_TEST_CASE(masternode_list_hash)
+{
+    int64_t nNow = GetAdjustedTime();
+    std::vector<CMasternode> vmn;
+    for (int i = 0; i < 5; i++)
+        vmn.push_back(SyntheticMasternode(nNow));
+
+    // The same announcements hash the same whatever order they were added in
+    CMasternodeMan man, man2;
+    for (int i = 0; i < 5; i++) {
+        man.Add(vmn[i]);
+        man2.Add(vmn[4 - i]);
+    }
+    BOOST_CHECK(man.GetListHash() == man2.GetListHash());
+
+    // Newer pings leave it alone, a new announcement changes it
+    man2.Find(vmn[0].vin)->lastPing.sigTime++;
+    BOOST_CHECK(man.GetListHash() == man2.GetListHash());
+    man2.Find(vmn[0].vin)->sigTime++;
+    BOOST_CHECK(man.GetListHash() != man2.GetListHash());
+
+    CMasternodeListDiff diff;
+    diff.nHeight = 100;
+    diff.nFromHeight = 90;
+    diff.hashList = man.GetListHash();
+    diff.nParts = 1;
+    diff.vBroadcasts.push_back(CMasternodeBroadcast(vmn[0]));
+    diff.vPings.push_back(vmn[1].lastPing);
+    diff.vRemoved.push_back(vmn[2].vin);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << diff;
+    CMasternodeListDiff diff2;
+    ss >> diff2;
+    BOOST_CHECK_EQUAL(diff2.nFromHeight, 90);
+    BOOST_CHECK(diff2.hashList == diff.hashList);
+    BOOST_CHECK_EQUAL(diff2.size(), 2U);
+    BOOST_CHECK(diff2.vBroadcasts[0].GetHash() == CMasternodeBroadcast(vmn[0]).GetHash());
+    BOOST_CHECK(diff2.vPings[0].GetHash() == vmn[1].lastPing.GetHash());
+    BOOST_CHECK(diff2.vRemoved[0] == vmn[2].vin);
+}
+
+BOOST_AUTO_TEST_CASE(masternode_cache_db)
+{
+    CMasternodeDB db(1 << 20, true);
+    int64_t nNow = GetAdjustedTime();
+    CMasternodeMan man;
+    std::vector<CMasternode> vmn;
+    for (int i = 0; i < 3; i++) {
+        vmn.push_back(SyntheticMasternode(nNow));
+        man.Add(vmn.back());
+    }
+    CMasternodeBroadcast mnb(vmn[0]);
+    man.AddSeenBroadcast(mnb);
+    man.AddSeenPing(vmn[1].lastPing);
+    BOOST_CHECK(man.FlushCache(db));
+
+    CMasternodeMan man2;
+    BOOST_CHECK(man2.LoadCache(db));
+    BOOST_CHECK_EQUAL(man2.size(), 3);
+    BOOST_CHECK(man2.GetListHash() == man.GetListHash());
+    BOOST_CHECK(man2.Find(vmn[2].pubKeyMasternode) != NULL);
+    BOOST_CHECK_EQUAL(man2.mapSeenMasternodeBroadcast.size(), 1U);
+    BOOST_CHECK_EQUAL(man2.mapSeenMasternodePing.size(), 1U);
+
+    // The next flush picks up a new ping and the entries that went, and leaves alone
+    // the masternodes that were not marked as changed
+    man.Find(vmn[1].vin)->lastPing.sigTime++;
+    man.SetMasternodeDirty(vmn[1].vin.prevout);
+    man.Find(vmn[2].vin)->lastPing.sigTime++;
+    man.Remove(vmn[0].vin);
+    man.EraseSeenBroadcast(mnb.GetHash());
+    BOOST_CHECK(man.FlushCache(db));
+
+    std::map<COutPoint, CMasternode> mapMasternodes;
+    BOOST_CHECK(db.ReadMasternodes(mapMasternodes));
+    BOOST_CHECK_EQUAL(mapMasternodes.size(), 2U);
+    BOOST_CHECK(!mapMasternodes.count(vmn[0].vin.prevout));
+    BOOST_CHECK_EQUAL(mapMasternodes[vmn[1].vin.prevout].lastPing.sigTime, nNow + 1);
+    BOOST_CHECK_EQUAL(mapMasternodes[vmn[2].vin.prevout].lastPing.sigTime, nNow);
+    std::map<uint256, CMasternodeBroadcast> mapBroadcasts;
+    BOOST_CHECK(db.ReadSeenBroadcasts(mapBroadcasts));
+    BOOST_CHECK(mapBroadcasts.empty());
+
+    // Block payees are tallied again from the stored votes
+    CScript payee = GetScriptForDestination(vmn[2].pubKeyCollateralAddress.GetID());
+    CMasternodePayments payments;
+    std::vector<uint256> vVotes;
+    for (int i = 0; i < 2; i++) {
+        CMasternodePaymentWinner winner(vmn[i].vin);
+        winner.nBlockHeight = 100;
+        winner.AddPayee(payee);
+        payments.mapMasternodePayeeVotes[winner.GetHash()] = winner;
+        vVotes.push_back(winner.GetHash());
+    }
+    BOOST_CHECK(payments.FlushCache(db));
+
+    CMasternodePayments payments2;
+    BOOST_CHECK(payments2.LoadCache(db));
+    BOOST_CHECK_EQUAL(payments2.mapMasternodePayeeVotes.size(), 2U);
+    CScript payeeFound;
+    BOOST_CHECK(payments2.GetBlockPayee(100, payeeFound));
+    BOOST_CHECK(payeeFound == payee);
+    BOOST_CHECK_EQUAL(payments2.GetLastPaidHeight(payee, 100, 10), 100);
+
+    payments.mapMasternodePayeeVotes.erase(vVotes[0]);
+    BOOST_CHECK(payments.FlushCache(db));
+    std::map<uint256, CMasternodePaymentWinner> mapVotes;
+    BOOST_CHECK(db.ReadPaymentVotes(mapVotes));
+    BOOST_CHECK_EQUAL(mapVotes.size(), 1U);
+    BOOST_CHECK(mapVotes.count(vVotes[1]));
+}
+
+BOOST_AUTO_TEST_CASE(masternode_payment_queue_benchmark)
+{
+    int64_t nNow = GetAdjustedTime();
+    int nSizes[] = {5000, 20000};
+    for (int i = 0; i < 2; i++) {
+        CMasternodeMan man;
+        std::vector<CTxIn> vvin;
+        for (int j = 0; j < nSizes[i]; j++) {
+            CMasternode mn = SyntheticMasternode(nNow);
+            vvin.push_back(mn.vin);
+            man.Add(mn);
+        }
+
+        int64_t nTimeFind = GetTimeMicros();
+        BOOST_FOREACH (const CTxIn& vin, vvin)
+            BOOST_CHECK(man.Find(vin) != NULL);
+        nTimeFind = GetTimeMicros() - nTimeFind;
+
+        int nCount = 0;
+        int64_t nTimeQueue = GetTimeMicros();
+        man.GetNextMasternodeInQueueForPayment(100, true, nCount);
+        nTimeQueue = GetTimeMicros() - nTimeQueue;
+        BOOST_CHECK_EQUAL(nCount, nSizes[i]);
+
+        BOOST_TEST_MESSAGE(strprintf("masternodes: %d, all found by outpoint in %dus, payment queue in %dus", nSizes[i], nTimeFind, nTimeQueue));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "main.h"
+#include "random.h"
 #include "txmempool.h"
 #include "util.h"
 
@@ -99,4 +100,111 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+// Build a transaction spending the given outputs with one output of nValue.
+static CMutableTransaction MakeSpend(const std::vector<COutPoint>& vPrevouts, CAmount nValue)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(vPrevouts.size());
+    for (unsigned int i = 0; i < vPrevouts.size(); i++) {
+        tx.vin[i].prevout = vPrevouts[i];
+        tx.vin[i].scriptSig = CScript() << OP_11;
+    }
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = nValue;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(MempoolAncestorDescendantTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    pool.setSanityCheck(false);
+
+    // A chain parent -> child -> grandchild
+    CMutableTransaction txParent = MakeSpend(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), 10 * COIN);
+    CMutableTransaction txChild = MakeSpend(std::vector<COutPoint>(1, COutPoint(txParent.GetHash(), 0)), 9 * COIN);
+    CMutableTransaction txGrandChild = MakeSpend(std::vector<COutPoint>(1, COutPoint(txChild.GetHash(), 0)), 8 * COIN);
+
+    CTxMemPoolEntry parentEntry(txParent, 1000, 0, 0.0, 1);
+    CTxMemPoolEntry childEntry(txChild, 2000, 0, 0.0, 1);
+    CTxMemPoolEntry grandChildEntry(txGrandChild, 30000, 0, 0.0, 1);
+    pool.addUnchecked(txParent.GetHash(), parentEntry);
+    pool.addUnchecked(txChild.GetHash(), childEntry);
+    pool.addUnchecked(txGrandChild.GetHash(), grandChildEntry);
+
+    CTxMemPool::txiter parentIt = pool.mapTx.find(txParent.GetHash());
+    CTxMemPool::txiter childIt = pool.mapTx.find(txChild.GetHash());
+    CTxMemPool::txiter grandChildIt = pool.mapTx.find(txGrandChild.GetHash());
+    uint64_t nTotalSize = parentIt->GetTxSize() + childIt->GetTxSize() + grandChildIt->GetTxSize();
+
+    BOOST_CHECK_EQUAL(parentIt->GetCountWithDescendants(), 3U);
+    BOOST_CHECK_EQUAL(parentIt->GetSizeWithDescendants(), nTotalSize);
+    BOOST_CHECK_EQUAL(parentIt->GetModFeesWithDescendants(), 33000);
+    BOOST_CHECK_EQUAL(grandChildIt->GetCountWithAncestors(), 3U);
+    BOOST_CHECK_EQUAL(grandChildIt->GetSizeWithAncestors(), nTotalSize);
+    BOOST_CHECK_EQUAL(grandChildIt->GetModFeesWithAncestors(), 33000);
+
+    // The grandchild pays for the whole chain, so by ancestor fee rate it
+    // comes first, while by its own fee rate the parent comes last.
+    BOOST_CHECK(pool.mapTx.get<ancestor_score>().begin()->GetTx().GetHash() == txGrandChild.GetHash());
+    BOOST_CHECK(pool.mapTx.get<mining_score>().rbegin()->GetTx().GetHash() == txParent.GetHash());
+
+    // Prioritising the child moves the totals of the whole chain.
+    pool.PrioritiseTransaction(txChild.GetHash(), txChild.GetHash().ToString(), 0, 5000);
+    BOOST_CHECK_EQUAL(parentIt->GetModFeesWithDescendants(), 38000);
+    BOOST_CHECK_EQUAL(grandChildIt->GetModFeesWithAncestors(), 38000);
+    BOOST_CHECK_EQUAL(childIt->GetModifiedFee(), 7000);
+
+    // Confirming the parent leaves the rest of the chain with fixed-up ancestor state.
+    std::vector<CTransaction> vtx(1, txParent);
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(vtx, 2, conflicts);
+    BOOST_CHECK_EQUAL(pool.size(), 2U);
+    BOOST_CHECK_EQUAL(childIt->GetCountWithAncestors(), 1U);
+    BOOST_CHECK_EQUAL(grandChildIt->GetCountWithAncestors(), 2U);
+    BOOST_CHECK_EQUAL(grandChildIt->GetModFeesWithAncestors(), 37000);
+    BOOST_CHECK_EQUAL(childIt->GetCountWithDescendants(), 2U);
+
+    // Removing the child recursively takes the grandchild with it.
+    std::list<CTransaction> removed;
+    pool.remove(txChild, removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 2U);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+    // The child's fee delta outlives its eviction until the prioritisation is cleared.
+    pool.ClearPrioritisation(txChild.GetHash());
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+
+    CMutableTransaction txLow = MakeSpend(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), 10 * COIN);
+    CMutableTransaction txHigh = MakeSpend(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), 10 * COIN);
+    CMutableTransaction txLowChild = MakeSpend(std::vector<COutPoint>(1, COutPoint(txLow.GetHash(), 0)), 9 * COIN);
+
+    pool.addUnchecked(txLow.GetHash(), CTxMemPoolEntry(txLow, 100, 0, 0.0, 1));
+    pool.addUnchecked(txHigh.GetHash(), CTxMemPoolEntry(txHigh, 50000, 0, 0.0, 1));
+    size_t nUsageTwo = pool.DynamicMemoryUsage();
+    pool.addUnchecked(txLowChild.GetHash(), CTxMemPoolEntry(txLowChild, 100, 0, 0.0, 1));
+
+    // Nothing to do while under the limit.
+    pool.TrimToSize(pool.DynamicMemoryUsage());
+    BOOST_CHECK_EQUAL(pool.size(), 3U);
+    BOOST_CHECK(pool.GetMinFee(1).GetFeePerK() == 0);
+
+    // Trimming evicts the cheapest package as a whole and raises the minimum fee.
+    std::vector<COutPoint> vNoSpendsRemaining;
+    pool.TrimToSize(nUsageTwo - 1, &vNoSpendsRemaining);
+    BOOST_CHECK_EQUAL(pool.size(), 1U);
+    BOOST_CHECK(pool.exists(txHigh.GetHash()));
+    BOOST_CHECK_EQUAL(vNoSpendsRemaining.size(), 1U);
+    BOOST_CHECK(vNoSpendsRemaining[0] == txLow.vin[0].prevout);
+    BOOST_CHECK(pool.GetMinFee(1).GetFeePerK() > 1000);
+
+    // Entries older than the expiry time go, with their descendants.
+    BOOST_CHECK_EQUAL(pool.Expire(1), 1);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
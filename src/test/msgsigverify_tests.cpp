@@ -0,0 +1,78 @@
+// Copyright (c) 2019 The Byron developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "key.h"
+#include "msgsigverify.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(msgsigverify_tests)
+
+static std::vector<unsigned char> SignMessage(const CKey& key, const std::string& strMessage)
+{
+    std::vector<unsigned char> vchSig;
+    BOOST_REQUIRE(key.SignCompact(GetSignedMessageHash(strMessage), vchSig));
+    return vchSig;
+}
+
+BOOST_AUTO_TEST_CASE(msgsigverify_queue)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    std::string strMessage = "mnw 1234";
+    std::vector<unsigned char> vchSig = SignMessage(key, strMessage);
+    uint256 hash = GetSignedMessageHash(strMessage);
+
+    // Without threads nothing is queued, but checks still recover the key
+    CMessageSigVerifier verifier(2);
+    verifier.Queue(strMessage, vchSig);
+    BOOST_CHECK(!verifier.ProcessOne());
+    CPubKey pubkey;
+    BOOST_CHECK(verifier.RecoverPubKey(hash, vchSig, pubkey));
+    BOOST_CHECK(pubkey == key.GetPubKey());
+    BOOST_CHECK_EQUAL(verifier.GetStats().nVerifiedInline, 1U);
+
+    // A duplicate is recovered once, and its checks are served from the result
+    verifier.SetThreads(1);
+    std::string strMessage2 = "mnw 1235";
+    std::vector<unsigned char> vchSig2 = SignMessage(key, strMessage2);
+    verifier.Queue(strMessage2, vchSig2);
+    verifier.Queue(strMessage2, vchSig2);
+    BOOST_CHECK_EQUAL(verifier.GetStats().nQueueDepth, 1U);
+    BOOST_CHECK(verifier.ProcessOne());
+    BOOST_CHECK(!verifier.ProcessOne());
+    CPubKey pubkey2;
+    BOOST_CHECK(verifier.RecoverPubKey(GetSignedMessageHash(strMessage2), vchSig2, pubkey2));
+    BOOST_CHECK(pubkey2 == key.GetPubKey());
+
+    CMessageSigVerifierStats stats = verifier.GetStats();
+    BOOST_CHECK_EQUAL(stats.nQueued, 1U);
+    BOOST_CHECK_EQUAL(stats.nDuplicates, 1U);
+    BOOST_CHECK_EQUAL(stats.nVerifiedByWorkers, 1U);
+    BOOST_CHECK_EQUAL(stats.nResultHits, 1U);
+
+    // A check that gets to a queued signature first recovers it itself
+    std::string strMessage3 = "mnw 1236";
+    std::vector<unsigned char> vchSig3 = SignMessage(key, strMessage3);
+    verifier.Queue(strMessage3, vchSig3);
+    CPubKey pubkey3;
+    BOOST_CHECK(verifier.RecoverPubKey(GetSignedMessageHash(strMessage3), vchSig3, pubkey3));
+    BOOST_CHECK(pubkey3 == key.GetPubKey());
+    BOOST_CHECK(verifier.ProcessOne());
+    BOOST_CHECK_EQUAL(verifier.GetStats().nVerifiedByWorkers, 1U);
+    BOOST_CHECK_EQUAL(verifier.GetStats().nVerifiedInline, 2U);
+
+    // Results are capped, oldest first
+    BOOST_CHECK(verifier.RecoverPubKey(hash, vchSig, pubkey));
+    BOOST_CHECK_EQUAL(verifier.GetStats().nVerifiedInline, 3U);
+
+    // A signature that doesn't parse recovers nothing
+    std::vector<unsigned char> vchBad(vchSig);
+    vchBad.pop_back();
+    CPubKey pubkeyBad;
+    BOOST_CHECK(!verifier.RecoverPubKey(hash, vchBad, pubkeyBad));
+    BOOST_CHECK(!verifier.RecoverPubKey(hash, vchBad, pubkeyBad));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
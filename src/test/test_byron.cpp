@@ -6,8 +6,10 @@
 
 #define BOOST_TEST_MODULE Byron Test Suite
 
+#include "crypto/sha256.h"
 #include "main.h"
 #include "random.h"
+#include "script/sigcache.h"
 #include "txdb.h"
 #include "ui_interface.h"
 #include "util.h"
@@ -33,8 +35,10 @@ struct TestingSetup {
     ECCVerifyHandle globalVerifyHandle;
 
     TestingSetup() {
+        SHA256AutoDetect();
         ECC_Start();
         SetupEnvironment();
+        InitSignatureCache();
         fPrintToDebugLog = false; // don't want to write to debug.log file
         fCheckBlockIndex = true;
         SelectParams(CBaseChainParams::UNITTEST);
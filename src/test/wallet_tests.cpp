@@ -305,4 +305,70 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+BOOST_AUTO_TEST_CASE(stake_kernel_search)
+{
+    uint256 bnTarget = ~uint256(0) >> 6;
+    std::vector<CStakeKernel> vKernels;
+    std::vector<CDataStream> vUniqueIDs;
+    for (unsigned int i = 0; i < 1024; i++) {
+        CDataStream ss(SER_NETWORK, 0);
+        ss << i << GetRandHash();
+        vUniqueIDs.push_back(ss);
+        // A value of 100 gives a weight of one, so the weighted target is bnTarget
+        vKernels.push_back(CStakeKernel(0x1234567890abcdefULL + i, 1500000000 + i, ss, 100, bnTarget));
+    }
+
+    // The precomputed prefix hashes the same input as CheckStake()
+    unsigned int nTimeStart = 1500100000;
+    for (unsigned int i = 0; i < 16; i++) {
+        unsigned int nTimeTx = nTimeStart + i;
+        uint256 hashExpected, hash;
+        bool fExpected = CheckStake(vUniqueIDs[i], 100, 0x1234567890abcdefULL + i, bnTarget, 1500000000 + i, nTimeTx, hashExpected);
+        BOOST_CHECK_EQUAL(vKernels[i].CheckHash(nTimeTx, hash), fExpected);
+        BOOST_CHECK(hash == hashExpected);
+    }
+
+    // Latest timestamp first, then lowest kernel index
+    size_t nExpectedKernel = 0;
+    unsigned int nExpectedTime = 0;
+    for (unsigned int nStep = 0; nStep < STAKE_HASH_DRIFT && !nExpectedTime; nStep++) {
+        for (size_t i = 0; i < vKernels.size(); i++) {
+            uint256 hash;
+            if (vKernels[i].CheckHash(nTimeStart + STAKE_HASH_DRIFT - nStep, hash)) {
+                nExpectedKernel = i;
+                nExpectedTime = nTimeStart + STAKE_HASH_DRIFT - nStep;
+                break;
+            }
+        }
+    }
+    BOOST_REQUIRE(nExpectedTime != 0);
+
+    for (int nThreads = 1; nThreads <= 4; nThreads++) {
+        nStakeSearchThreads = nThreads;
+        size_t nKernel = 0;
+        unsigned int nTimeTx = 0;
+        uint256 hashProofOfStake;
+        BOOST_CHECK(SearchStakeKernels(vKernels, nTimeStart, nKernel, nTimeTx, hashProofOfStake));
+        BOOST_CHECK_EQUAL(nKernel, nExpectedKernel);
+        BOOST_CHECK_EQUAL(nTimeTx, nExpectedTime);
+        BOOST_CHECK(hashProofOfStake == vKernels[nKernel].GetHash(nTimeTx));
+    }
+
+    // Nothing can hit a zero target; every kernel is tried at every timestamp
+    std::vector<CStakeKernel> vMissKernels(1, CStakeKernel(1, 1500000000, vUniqueIDs[0], 100, 0));
+    CStakeSearchStats statsBefore, statsAfter;
+    GetStakeSearchStats(statsBefore);
+    size_t nKernel = 0;
+    unsigned int nTimeTx = nTimeStart;
+    uint256 hashProofOfStake;
+    BOOST_CHECK(!SearchStakeKernels(vMissKernels, nTimeStart, nKernel, nTimeTx, hashProofOfStake));
+    BOOST_CHECK_EQUAL(nTimeTx, nTimeStart);
+    GetStakeSearchStats(statsAfter);
+    BOOST_CHECK_EQUAL(statsAfter.nSearches, statsBefore.nSearches + 1);
+    BOOST_CHECK_EQUAL(statsAfter.nLastHashes, STAKE_HASH_DRIFT);
+    BOOST_CHECK_EQUAL(statsAfter.nKernelsFound, statsBefore.nKernelsFound);
+
+    nStakeSearchThreads = DEFAULT_STAKE_SEARCH_THREADS;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,78 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2026 The Byron developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TIMESTAMPINDEX_H
+#define BITCOIN_TIMESTAMPINDEX_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+/**
+ * Block by timestamp, key of the 's' records (the value is empty). The
+ * timestamp is big endian so a range of times iterates in order.
+ */
+struct CTimestampIndexKey {
+    unsigned int timestamp;
+    uint256 blockHash;
+
+    CTimestampIndexKey(unsigned int time, uint256 hash)
+    {
+        timestamp = time;
+        blockHash = hash;
+    }
+
+    CTimestampIndexKey()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        timestamp = 0;
+        blockHash = 0;
+    }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 36;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ser_writedata32be(s, timestamp);
+        blockHash.Serialize(s, nType, nVersion);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        timestamp = ser_readdata32be(s);
+        blockHash.Unserialize(s, nType, nVersion);
+    }
+};
+
+/** Prefix of CTimestampIndexKey to seek to the first block at or after a time */
+struct CTimestampIndexIteratorKey {
+    unsigned int timestamp;
+
+    CTimestampIndexIteratorKey(unsigned int time)
+    {
+        timestamp = time;
+    }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 4;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ser_writedata32be(s, timestamp);
+    }
+};
+
+#endif // BITCOIN_TIMESTAMPINDEX_H
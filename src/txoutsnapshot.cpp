@@ -0,0 +1,134 @@
+// Copyright (c) 2019 The Byron developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txoutsnapshot.h"
+
+#include "main.h"
+#include "util.h"
+
+#include <boost/thread.hpp>
+
+/*
+ * File layout: the metadata, then one group per transaction as written by
+ * CTxOutSetWriter, then a zero txid, then the number of transactions and
+ * outputs and the hash of the groups.
+ */
+
+bool WriteTxOutSnapshot(CAutoFile& file, const CTxOutSnapshotMetadata& metadata, CCoinsViewCursor& cursor, CCoinsStats& stats)
+{
+    file << metadata;
+
+    CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+    hasher << metadata.hashBlock;
+    CTxOutSetWriter<CAutoFile> writerFile(file);
+    CTxOutSetWriter<CHashWriter> writerHash(hasher);
+    while (cursor.Valid()) {
+        boost::this_thread::interruption_point();
+        COutPoint outpoint;
+        Coin coin;
+        if (!cursor.GetKey(outpoint) || !cursor.GetValue(coin))
+            return error("%s : unable to read coin", __func__);
+        writerFile.Add(outpoint, coin);
+        writerHash.Add(outpoint, coin);
+        stats.nTotalAmount += coin.out.nValue;
+        stats.nSerializedSize += cursor.GetSize();
+        cursor.Next();
+    }
+    writerFile.Finish();
+    writerHash.Finish();
+
+    stats.hashBlock = metadata.hashBlock;
+    stats.nHeight = metadata.nHeight;
+    stats.nTransactions = writerHash.nTransactions;
+    stats.nTransactionOutputs = writerHash.nTransactionOutputs;
+    stats.hashSerialized = hasher.GetHash();
+
+    file << uint256(0);
+    file << stats.nTransactions << stats.nTransactionOutputs << stats.hashSerialized;
+    return true;
+}
+
+CTxOutSnapshotReader::CTxOutSnapshotReader(CAutoFile& fileIn) : file(fileIn),
+                                                                hasher(SER_GETHASH, PROTOCOL_VERSION),
+                                                                writer(hasher),
+                                                                nCode(0),
+                                                                nLastOut(0),
+                                                                fInTx(false),
+                                                                fEnd(false),
+                                                                nTotalAmount(0)
+{
+    file >> metadata;
+    hasher << metadata.hashBlock;
+}
+
+bool CTxOutSnapshotReader::Next(COutPoint& outpoint, Coin& coin)
+{
+    while (!fEnd) {
+        if (!fInTx) {
+            uint256 hashPrev = hashTx;
+            file >> hashTx;
+            if (hashTx == 0) {
+                fEnd = true;
+                break;
+            }
+            // Coins come in database key order, so each one appears only once
+            if (writer.nTransactions > 0 && memcmp(hashPrev.begin(), hashTx.begin(), hashTx.size()) >= 0)
+                throw std::ios_base::failure("transactions out of order");
+            file >> VARINT(nCode);
+            if ((int)(nCode >> 2) > metadata.nHeight)
+                throw std::ios_base::failure("coin from after the snapshot block");
+            fInTx = true;
+            nLastOut = 0;
+        }
+
+        unsigned int nOut = 0;
+        file >> VARINT(nOut);
+        if (nOut == 0) {
+            fInTx = false;
+            continue;
+        }
+        if (nOut <= nLastOut)
+            throw std::ios_base::failure("outputs out of order");
+        nLastOut = nOut;
+
+        CTxOut out;
+        file >> out;
+        if (!MoneyRange(out.nValue))
+            throw std::ios_base::failure("coin value out of range");
+        outpoint = COutPoint(hashTx, nOut - 1);
+        coin = Coin(out, nCode >> 2, nCode & 2, nCode & 1);
+        writer.Add(outpoint, coin);
+        nTotalAmount += out.nValue;
+        return true;
+    }
+    return false;
+}
+
+bool CTxOutSnapshotReader::Finish(CCoinsStats& stats, std::string& strError)
+{
+    assert(fEnd);
+    writer.Finish();
+
+    uint64_t nTransactions, nTransactionOutputs;
+    uint256 hashSerialized;
+    file >> nTransactions >> nTransactionOutputs >> hashSerialized;
+
+    stats.hashBlock = metadata.hashBlock;
+    stats.nHeight = metadata.nHeight;
+    stats.nTransactions = writer.nTransactions;
+    stats.nTransactionOutputs = writer.nTransactionOutputs;
+    stats.hashSerialized = hasher.GetHash();
+    stats.nTotalAmount = nTotalAmount;
+
+    if (nTransactions != stats.nTransactions || nTransactionOutputs != stats.nTransactionOutputs) {
+        strError = strprintf("snapshot holds %u transactions and %u outputs, its trailer says %u and %u",
+            stats.nTransactions, stats.nTransactionOutputs, nTransactions, nTransactionOutputs);
+        return false;
+    }
+    if (hashSerialized != stats.hashSerialized) {
+        strError = strprintf("snapshot hashes to %s, its trailer says %s", stats.hashSerialized.GetHex(), hashSerialized.GetHex());
+        return false;
+    }
+    return true;
+}
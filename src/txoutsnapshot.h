@@ -0,0 +1,122 @@
+// Copyright (c) 2019 The Byron developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BYRON_TXOUTSNAPSHOT_H
+#define BYRON_TXOUTSNAPSHOT_H
+
+#include "amount.h"
+#include "coins.h"
+#include "hash.h"
+#include "serialize.h"
+#include "streams.h"
+#include "tinyformat.h"
+#include "uint256.h"
+
+#include <string.h>
+#include <string>
+#include <vector>
+
+/** Version of the file format written by dumptxoutset */
+static const int TXOUT_SNAPSHOT_VERSION = 1;
+
+/**
+ * Header of a UTXO snapshot: the block the coins are the state after, and what
+ * the block index needs about that block and its ancestors that only their
+ * bodies would tell otherwise.
+ */
+class CTxOutSnapshotMetadata
+{
+public:
+    int nVersion;
+    unsigned char pchMessageStart[4];
+    uint256 hashBlock;
+    int nHeight;
+    CAmount nMoneySupply;
+    CAmount nMint;
+    uint64_t nStakeModifier;
+    unsigned int nStakeModifierChecksum;
+    //! Number of transactions in each block from the genesis block up to hashBlock
+    std::vector<unsigned int> vTxCount;
+
+    CTxOutSnapshotMetadata() { SetNull(); }
+
+    void SetNull()
+    {
+        nVersion = TXOUT_SNAPSHOT_VERSION;
+        memset(pchMessageStart, 0, sizeof(pchMessageStart));
+        hashBlock = 0;
+        nHeight = 0;
+        nMoneySupply = 0;
+        nMint = 0;
+        nStakeModifier = 0;
+        nStakeModifierChecksum = 0;
+        vTxCount.clear();
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersionIn)
+    {
+        READWRITE(FLATDATA(pchMessageStart));
+        READWRITE(nVersion);
+        if (nVersion != TXOUT_SNAPSHOT_VERSION)
+            throw std::ios_base::failure(strprintf("unsupported snapshot version %d", nVersion));
+        READWRITE(hashBlock);
+        READWRITE(nHeight);
+        READWRITE(nMoneySupply);
+        READWRITE(nMint);
+        READWRITE(nStakeModifier);
+        READWRITE(nStakeModifierChecksum);
+        READWRITE(vTxCount);
+    }
+
+    /**
+     * The hash a snapshot is checked against when loaded: this metadata followed by
+     * hashSerialized, the hash of the coins. The block index takes the supply, mint
+     * and stake modifier checksum from here, so they have to be committed to as well.
+     */
+    uint256 GetSnapshotHash(const uint256& hashSerialized) const
+    {
+        CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+        ss << *this << hashSerialized;
+        return ss.GetHash();
+    }
+};
+
+/**
+ * Write metadata and then the coins cursor walks over to file. The coins are
+ * stored the way GetStats hashes them, so stats.hashSerialized is the same
+ * hash gettxoutsetinfo reports for the snapshot block.
+ */
+bool WriteTxOutSnapshot(CAutoFile& file, const CTxOutSnapshotMetadata& metadata, CCoinsViewCursor& cursor, CCoinsStats& stats);
+
+/** Reads back a snapshot WriteTxOutSnapshot wrote, recomputing its hash on the way */
+class CTxOutSnapshotReader
+{
+private:
+    CAutoFile& file;
+    CHashWriter hasher;
+    CTxOutSetWriter<CHashWriter> writer;
+    uint256 hashTx;
+    unsigned int nCode;
+    unsigned int nLastOut;
+    bool fInTx;
+    bool fEnd;
+    CAmount nTotalAmount;
+
+public:
+    CTxOutSnapshotMetadata metadata;
+
+    //! Reads the metadata; throws std::ios_base::failure if the file isn't a snapshot
+    CTxOutSnapshotReader(CAutoFile& fileIn);
+
+    //! Read the next coin. Returns false after the last one; throws on a malformed file.
+    bool Next(COutPoint& outpoint, Coin& coin);
+
+    //! Once Next returned false, check the trailer against what was read and fill in stats
+    bool Finish(CCoinsStats& stats, std::string& strError);
+};
+
+#endif // BYRON_TXOUTSNAPSHOT_H
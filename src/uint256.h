@@ -295,6 +295,13 @@ public:
         return pn[0] | (uint64_t)pn[1] << 32;
     }
 
+    /** The pos'th 64-bit word, counting from the least significant one */
+    uint64_t GetUint64(int pos) const
+    {
+        assert(pos >= 0 && 2 * pos + 1 < WIDTH);
+        return pn[2 * pos] | (uint64_t)pn[2 * pos + 1] << 32;
+    }
+
     unsigned int GetSerializeSize(int nType, int nVersion) const
     {
         return sizeof(pn);
@@ -12,7 +12,7 @@
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 70935;
+static const int PROTOCOL_VERSION = 70936;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -39,5 +39,8 @@ static const int MEMPOOL_GD_VERSION = 60002;
 //! "filter*" commands are disabled without NODE_BLOOM after and including this version
 static const int NO_BLOOM_VERSION = 70005;
 
+//! "getmnlist" and "mnlistdiff" masternode list snapshots start with this version
+static const int MNLIST_DIFF_VERSION = 70936;
+
 
 #endif // BITCOIN_VERSION_H
@@ -434,7 +434,11 @@ void CWallet::SyncMetaData(pair<TxSpends::iterator, TxSpends::iterator> range)
  * Outpoint is spent if any non-conflicted transaction
  * spends it:
  */
-bool CWallet::IsSpent(const uint256& hash, unsigned int n) const
+/**
+ * Outpoint is spent if any non-conflicted transaction spends it, or with nMinDepth > 0
+ * only if the spending transaction is at least that deep in the main chain.
+ */
+bool CWallet::IsSpent(const uint256& hash, unsigned int n, int nMinDepth) const
 {
     const COutPoint outpoint(hash, n);
     pair<TxSpends::const_iterator, TxSpends::const_iterator> range;
@@ -443,7 +447,7 @@ bool CWallet::IsSpent(const uint256& hash, unsigned int n) const
     for (TxSpends::const_iterator it = range.first; it != range.second; ++it) {
         const uint256& wtxid = it->second;
         std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(wtxid);
-        if (mit != mapWallet.end() && mit->second.GetDepthInMainChain() >= 0)
+        if (mit != mapWallet.end() && mit->second.GetDepthInMainChain() >= nMinDepth)
             return true; // Spent
     }
 
@@ -659,6 +663,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         wtx.BindWallet(this);
         wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
         AddToSpends(hash);
+        AddToStakeCandidates(wtx);
     } else {
         LOCK(cs_wallet);
         // Inserts only if not already there, returns tx inserted or tx found
@@ -673,6 +678,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
             wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
             wtx.nTimeSmart = ComputeTimeSmart(wtx);
             AddToSpends(hash);
+            AddToStakeCandidates(wtx);
         }
 
         bool fUpdated = false;
@@ -2017,37 +2023,98 @@ bool less_then_denom(const COutput& out1, const COutput& out2)
     return (!found1 && found2);
 }
 
-bool CWallet::SelectStakeCoins(std::list<std::unique_ptr<CStakeInput> >& listInputs, CAmount nTargetAmount)
+void CWallet::AddToStakeCandidates(const CWalletTx& wtx)
 {
-    LOCK(cs_main);
-    //Add BYRON
-    vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, NULL, false, STAKABLE_COINS);
+    AssertLockHeld(cs_wallet);
+    const uint256& hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        const CTxOut& txout = wtx.vout[i];
+        if (txout.nValue <= 0 || (IsMine(txout) & ISMINE_SPENDABLE) == ISMINE_NO)
+            continue;
+
+        // CBYRONStake::CreateTxOuts() only supports pay to pubkey and pay to pubkey hash kernels
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        if (!Solver(txout.scriptPubKey, whichType, vSolutions) || (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH))
+            continue;
+
+        mapStakeCandidates.insert(make_pair(COutPoint(hash, i), CStakeCandidate()));
+    }
+}
+
+bool CWallet::SelectStakeKernels(std::vector<CStakeKernel>& vKernels, std::vector<COutPoint>& vKernelOutpoints, unsigned int nBits, unsigned int nTimeStart, CAmount nTargetAmount)
+{
+    LOCK2(cs_main, cs_wallet);
+    vKernels.clear();
+    vKernelOutpoints.clear();
+    if (!GetBoolArg("-byronstake", true))
+        return true;
+
+    uint256 bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+
     CAmount nAmountSelected = 0;
-    if (GetBoolArg("-byronstake", true)) {
-        for (const COutput &out : vCoins) {
-            //make sure not to outrun target amount
-            if (nAmountSelected + out.tx->vout[out.i].nValue > nTargetAmount)
-                continue;
+    std::map<COutPoint, CStakeCandidate>::iterator it = mapStakeCandidates.begin();
+    while (it != mapStakeCandidates.end()) {
+        const COutPoint& prevout = it->first;
+        CStakeCandidate& candidate = it->second;
+        std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(prevout.hash);
+
+        // Forget outputs that left the wallet or whose spend is buried deep enough
+        if (mi == mapWallet.end() || IsSpent(prevout.hash, prevout.n, Params().COINBASE_MATURITY())) {
+            mapStakeCandidates.erase(it++);
+            continue;
+        }
+        ++it;
 
-            // Get tx time
-            int64_t nTxTime = out.tx->GetTxTime();
+        const CWalletTx* pcoin = &mi->second;
+        const CAmount nValue = pcoin->vout[prevout.n].nValue;
+        if (IsSpent(prevout.hash, prevout.n) || IsLockedCoin(prevout.hash, prevout.n))
+            continue;
 
-            // Check for min age
-            if (GetAdjustedTime() - nTxTime < nStakeMinAge)
-                continue;
+        //make sure not to outrun target amount
+        if (nAmountSelected + nValue > nTargetAmount)
+            continue;
 
-            // Check that it is matured
-            if (out.nDepth < (out.tx->IsCoinStake() ? Params().COINBASE_MATURITY() : 10))
-                continue;
+        // Check for min age
+        if (GetAdjustedTime() - pcoin->GetTxTime() < nStakeMinAge)
+            continue;
 
-            // Add to our stake set
-            nAmountSelected += out.tx->vout[out.i].nValue;
+        // Check that it is matured
+        if (!CheckFinalTx(*pcoin) || !pcoin->IsTrusted() || pcoin->GetBlocksToMaturity() > 0)
+            continue;
+        if (pcoin->GetDepthInMainChain(false) < (pcoin->IsCoinStake() ? Params().COINBASE_MATURITY() : 10))
+            continue;
+
+        // The block that the output was added to the chain
+        BlockMap::const_iterator mbi = mapBlockIndex.find(pcoin->hashBlock);
+        if (mbi == mapBlockIndex.end() || !chainActive.Contains(mbi->second) || mbi->second->nHeight < 1)
+            continue;
+        const CBlockIndex* pindexFrom = mbi->second;
+        if (pindexFrom->nTime + nStakeMinAge > nTimeStart)
+            continue;
 
-            std::unique_ptr<CBYRONStake> input(new CBYRONStake());
-            input->SetInput((CTransaction) *out.tx, out.i);
-            listInputs.emplace_back(std::move(input));
+        // The modifier is read from the block a selection interval after pindexFrom; it only changes
+        // if the chain is reorganized past that block
+        if (candidate.pindexFrom != pindexFrom || !candidate.pindexModifier || !chainActive.Contains(candidate.pindexModifier)) {
+            int nStakeModifierHeight = 0;
+            int64_t nStakeModifierTime = 0;
+            uint64_t nStakeModifier = 0;
+            const CBlockIndex* pindexModifier = NULL;
+            if (!GetKernelStakeModifier(pindexFrom->GetBlockHash(), nStakeModifier, nStakeModifierHeight, nStakeModifierTime, false, &pindexModifier))
+                continue;
+            candidate.pindexFrom = pindexFrom;
+            candidate.pindexModifier = pindexModifier;
+            candidate.nStakeModifier = nStakeModifier;
         }
+
+        // The unique identifier for a BYRON stake is the outpoint, see CBYRONStake::GetUniqueness()
+        CDataStream ssUniqueID(SER_NETWORK, 0);
+        ssUniqueID << prevout.n << prevout.hash;
+
+        nAmountSelected += nValue;
+        vKernels.push_back(CStakeKernel(candidate.nStakeModifier, pindexFrom->nTime, ssUniqueID, nValue, bnTargetPerCoinDay));
+        vKernelOutpoints.push_back(prevout);
     }
 
     return true;
@@ -2795,102 +2862,92 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (nBalance > 0 && nBalance <= nReserveBalance)
         return false;
 
-    // Get the list of stakable inputs
-    std::list<std::unique_ptr<CStakeInput> > listInputs;
-    if (!SelectStakeCoins(listInputs, nBalance - nReserveBalance))
+    // Build the kernels of all stakable outputs
+    unsigned int nTimeStart = GetAdjustedTime();
+    std::vector<CStakeKernel> vKernels;
+    std::vector<COutPoint> vKernelOutpoints;
+    if (!SelectStakeKernels(vKernels, vKernelOutpoints, nBits, nTimeStart, nBalance - nReserveBalance))
         return false;
 
-    if (listInputs.empty())
+    if (vKernels.empty())
         return false;
 
-    if (GetAdjustedTime() - chainActive.Tip()->GetBlockTime() < 60)
+    if (GetAdjustedTime() - chainActive.Tip()->GetBlockTime() < 60) {
         MilliSleep(10000);
+        nTimeStart = GetAdjustedTime();
+    }
 
-    CAmount nCredit;
-    CScript scriptPubKeyKernel;
-    bool fKernelFound = false;
-    for (std::unique_ptr<CStakeInput>& stakeInput : listInputs) {
-        nCredit = 0;
-        // Make sure the wallet is unlocked and shutdown hasn't been requested
-        if (IsLocked() || ShutdownRequested())
-            return false;
-
-        // Make sure that enough time has elapsed between
-        CBlockIndex* pindex = stakeInput->GetIndexFrom();
-        if (!pindex || pindex->nHeight < 1) {
-            LogPrintf("*** no pindexfrom\n");
-            continue;
-        }
-
-        // Read block header
-        CBlockHeader block = pindex->GetBlockHeader();
-        uint256 hashProofOfStake = 0;
-        nTxNewTime = GetAdjustedTime();
-
-        // Iterates each utxo inside of CheckStakeKernelHash()
-        if (Stake(stakeInput.get(), nBits, block.GetBlockTime(), nTxNewTime, hashProofOfStake)) {
-            LOCK(cs_main);
-            // Double check that this will pass time requirements
-            if (nTxNewTime <= chainActive.Tip()->GetMedianTimePast()) {
-                LogPrintf("CreateCoinStake() : kernel found, but it is too far in the past \n");
-                continue;
-            }
-
-            // Found a kernel
-            LogPrintf("CreateCoinStake : kernel found\n");
-            nCredit += stakeInput->GetValue();
-
-            // Calculate reward
-            CAmount nReward;
-            nReward = GetBlockValue(chainActive.Height() + 1);
-            nCredit += nReward;
-
-            // Create the output transaction(s)
-            vector<CTxOut> vout;
-            if (!stakeInput->CreateTxOuts(this, vout, nCredit)) {
-                LogPrintf("%s : failed to get scriptPubKey\n", __func__);
-                continue;
-            }
-            txNew.vout.insert(txNew.vout.end(), vout.begin(), vout.end());
-
-            CAmount nMinFee = 0;
-
-            // Set output amount
-            if (txNew.vout.size() == 3) {
-                txNew.vout[1].nValue = ((nCredit - nMinFee) / 2 / CENT) * CENT;
-                txNew.vout[2].nValue = nCredit - nMinFee - txNew.vout[1].nValue;
-            } else
-                txNew.vout[1].nValue = nCredit - nMinFee;
+    // Make sure the wallet is unlocked and shutdown hasn't been requested
+    if (IsLocked() || ShutdownRequested())
+        return false;
 
-            // Limit size
-            unsigned int nBytes = ::GetSerializeSize(txNew, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBytes >= DEFAULT_BLOCK_MAX_SIZE / 5)
-                return error("CreateCoinStake : exceeded coinstake size limit");
+    // Hash all kernels across the whole timestamp drift
+    size_t nKernel = 0;
+    uint256 hashProofOfStake = 0;
+    bool fKernelFound = SearchStakeKernels(vKernels, nTimeStart, nKernel, nTxNewTime, hashProofOfStake);
 
-            // Masternode payment
-            FillBlockPayee(txNew, nMinFee, true);
+    mapHashedBlocks.clear();
+    mapHashedBlocks[chainActive.Tip()->nHeight] = GetTime(); // Store a time stamp of when we last hashed on this block
 
-            uint256 hashTxOut = txNew.GetHash();
-            CTxIn in;
-            if (!stakeInput->CreateTxIn(this, in, hashTxOut)) {
-                LogPrintf("%s : failed to create TxIn\n", __func__);
-                txNew.vin.clear();
-                txNew.vout.clear();
-                continue;
-            }
-            txNew.vin.emplace_back(in);
-
-            fKernelFound = true;
-            break;
-        }
+    if (!fKernelFound || IsLocked() || ShutdownRequested())
+        return false;
 
-        if (fKernelFound)
-            break; // if kernel is found stop searching
+    LOCK2(cs_main, cs_wallet);
+    // Double check that this will pass time requirements
+    if (nTxNewTime <= chainActive.Tip()->GetMedianTimePast()) {
+        LogPrintf("CreateCoinStake() : kernel found, but it is too far in the past \n");
+        return false;
     }
 
-    if (!fKernelFound)
+    const COutPoint& prevout = vKernelOutpoints[nKernel];
+    const CWalletTx* pcoin = GetWalletTx(prevout.hash);
+    if (!pcoin)
         return false;
 
+    std::unique_ptr<CBYRONStake> stakeInput(new CBYRONStake());
+    stakeInput->SetInput((CTransaction) *pcoin, prevout.n);
+
+    // Found a kernel
+    LogPrintf("CreateCoinStake : kernel found\n");
+    CAmount nCredit = stakeInput->GetValue();
+
+    // Calculate reward
+    CAmount nReward;
+    nReward = GetBlockValue(chainActive.Height() + 1);
+    nCredit += nReward;
+
+    // Create the output transaction(s)
+    vector<CTxOut> vout;
+    if (!stakeInput->CreateTxOuts(this, vout, nCredit))
+        return error("%s : failed to get scriptPubKey", __func__);
+    txNew.vout.insert(txNew.vout.end(), vout.begin(), vout.end());
+
+    CAmount nMinFee = 0;
+
+    // Set output amount
+    if (txNew.vout.size() == 3) {
+        txNew.vout[1].nValue = ((nCredit - nMinFee) / 2 / CENT) * CENT;
+        txNew.vout[2].nValue = nCredit - nMinFee - txNew.vout[1].nValue;
+    } else
+        txNew.vout[1].nValue = nCredit - nMinFee;
+
+    // Limit size
+    unsigned int nBytes = ::GetSerializeSize(txNew, SER_NETWORK, PROTOCOL_VERSION);
+    if (nBytes >= DEFAULT_BLOCK_MAX_SIZE / 5)
+        return error("CreateCoinStake : exceeded coinstake size limit");
+
+    // Masternode payment
+    FillBlockPayee(txNew, nMinFee, true);
+
+    uint256 hashTxOut = txNew.GetHash();
+    CTxIn in;
+    if (!stakeInput->CreateTxIn(this, in, hashTxOut)) {
+        txNew.vin.clear();
+        txNew.vout.clear();
+        return error("%s : failed to create TxIn", __func__);
+    }
+    txNew.vin.emplace_back(in);
+
     // Sign for BYRON
     int nIn = 0;
 
@@ -163,9 +163,26 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /** Kernel data cached for a wallet output that may be staked */
+    struct CStakeCandidate {
+        const CBlockIndex* pindexFrom;
+        const CBlockIndex* pindexModifier;
+        uint64_t nStakeModifier;
+
+        CStakeCandidate() : pindexFrom(NULL), pindexModifier(NULL), nStakeModifier(0) {}
+    };
+
+    /**
+     * Outputs that may be used as stake kernels, kept up to date as transactions
+     * are added to the wallet so the minter never rescans mapWallet. Maturity,
+     * spent and lock state are checked when the kernels are built.
+     */
+    std::map<COutPoint, CStakeCandidate> mapStakeCandidates;
+    void AddToStakeCandidates(const CWalletTx& wtx);
+
 public:
     bool MintableCoins();
-    bool SelectStakeCoins(std::list<std::unique_ptr<CStakeInput> >& listInputs, CAmount nTargetAmount);
+    bool SelectStakeKernels(std::vector<CStakeKernel>& vKernels, std::vector<COutPoint>& vKernelOutpoints, unsigned int nBits, unsigned int nTimeStart, CAmount nTargetAmount);
     bool SelectCoinsDark(CAmount nValueMin, CAmount nValueMax, std::vector<CTxIn>& setCoinsRet, CAmount& nValueRet, int nObfuscationRoundsMin, int nObfuscationRoundsMax) const;
     bool SelectCoinsByDenominations(int nDenom, CAmount nValueMin, CAmount nValueMax, std::vector<CTxIn>& vCoinsRet, std::vector<COutput>& vCoinsRet2, CAmount& nValueRet, int nObfuscationRoundsMin, int nObfuscationRoundsMax);
     bool SelectCoinsDarkDenominated(CAmount nTargetValue, std::vector<CTxIn>& setCoinsRet, CAmount& nValueRet) const;
@@ -315,7 +332,7 @@ public:
     // Extract txin information and keys from output
     bool GetVinAndKeysFromOutput(COutput out, CTxIn& txinRet, CPubKey& pubKeyRet, CKey& keyRet);
 
-    bool IsSpent(const uint256& hash, unsigned int n) const;
+    bool IsSpent(const uint256& hash, unsigned int n, int nMinDepth = 0) const;
 
     bool IsLockedCoin(uint256 hash, unsigned int n) const;
     void LockCoin(COutPoint& output);